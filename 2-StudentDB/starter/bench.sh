@@ -0,0 +1,140 @@
+#!/usr/bin/env bash
+
+# Benchmark driver for sdbsc.
+#
+#   usage: ./bench.sh [records] [dense|sparse] [ops] [repeats]
+#
+# Builds a database of records students, either dense (ids 1..records) or
+# sparse (records random ids up to MAX_STD_ID), then times every command
+# in a scratch directory so an existing student.db is left alone:
+#
+#   bulk      -b of the whole data set into an empty database
+#   get       -f of ops random ids that are present
+#   add       -a of ops ids that are not
+#   del       -d of the same ids
+#   count     -c, print -p and compress -x, repeats times each
+#
+# Every command is a separate sdbsc process, so latencies include process
+# start up, exactly as a user of the command line sees it.  The result is
+# one JSON object per line: a "config" line followed by one line per
+# operation with calls, items (records handled per call), ops_per_sec
+# (items per second), p50_us, p99_us and the read and write system calls
+# per call as counted by the kernel in /proc/<pid>/io (transfers the uring
+# engine hands to its ring are not system calls and are not counted).
+#
+# SDB_ENGINE, SDB_FORMAT, SDB_WAL and SDB_THREADS are passed through, e.g.
+#   SDB_ENGINE=uring ./bench.sh 50000 sparse
+
+RECORDS=${1:-20000}
+DENSITY=${2:-dense}
+OPS=${3:-500}
+REPEATS=${4:-5}
+MAX_STD_ID=100000
+SDBSC=$(realpath ./sdbsc)
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+# io_counts: sets SYSCR and SYSCW to the read and write system calls made
+# so far by this shell (or subshell) and the children it has reaped
+io_counts() {
+    local key value
+    while read -r key value; do
+        case $key in
+        syscr:) SYSCR=$value ;;
+        syscw:) SYSCW=$value ;;
+        esac
+    done < /proc/$BASHPID/io
+}
+
+# time_calls op items prep cmd...: for every line of stdin runs prep (a
+# command that is not timed) and then cmd with {} replaced by the line.
+# The latency and the system calls of each cmd are added up for report.
+time_calls() {
+    local op=$1 items=$2 prep=$3 line t0 t1 r0 w0
+    local reads=0 writes=0
+    shift 3
+    : > "$LAT"
+    while read -r line; do
+        $prep
+        io_counts
+        r0=$SYSCR w0=$SYSCW
+        t0=${EPOCHREALTIME/./}
+        "${@//\{\}/$line}" > /dev/null
+        t1=${EPOCHREALTIME/./}
+        io_counts
+        reads=$((reads + SYSCR - r0 - IO_SELF_R))
+        writes=$((writes + SYSCW - w0 - IO_SELF_W))
+        echo $((t1 - t0)) >> "$LAT"
+    done
+    report "$op" "$items" $reads $writes
+}
+
+# the first io_counts() of a pair shows up in the counts of the second
+io_counts; r0=$SYSCR w0=$SYSCW
+io_counts
+IO_SELF_R=$((SYSCR - r0)) IO_SELF_W=$((SYSCW - w0))
+
+# preparations that are not timed
+empty_db() {
+    rm -f student.*
+}
+base_db() {
+    cp base.db student.db
+    rm -f student.*.idx student.col student.db.wal
+}
+
+# report op items reads writes: prints the JSON line for the latencies in LAT
+report() {
+    sort -n "$LAT" | awk -v op="$1" -v items="$2" -v r="$3" -v w="$4" '
+        { lat[NR] = $1; total += $1 }
+        END {
+            if (NR == 0) exit
+            p50 = lat[int((NR - 1) * 0.50) + 1]
+            p99 = lat[int((NR - 1) * 0.99) + 1]
+            printf "{\"op\":\"%s\",\"calls\":%d,\"items\":%d,\"seconds\":%.6f,", op, NR, items, total / 1e6
+            printf "\"ops_per_sec\":%.1f,\"p50_us\":%d,\"p99_us\":%d,", NR * items / (total / 1e6), p50, p99
+            printf "\"read_syscalls\":%.1f,\"write_syscalls\":%.1f}\n", r / NR, w / NR
+        }'
+}
+
+[ -x "$SDBSC" ] || fail "build sdbsc first"
+case $DENSITY in
+dense)  ((RECORDS <= MAX_STD_ID)) || fail "at most $MAX_STD_ID dense records" ;;
+sparse) ((RECORDS <= MAX_STD_ID)) || fail "at most $MAX_STD_ID sparse records" ;;
+*)      fail "density is dense or sparse" ;;
+esac
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || fail "no scratch directory"
+LAT=$WORK/latency
+
+# the data set, the ids of the ops to time and ids that are not in the set
+if [ "$DENSITY" = dense ]; then
+    seq 1 "$RECORDS" > ids
+else
+    shuf -i 1-$MAX_STD_ID -n "$RECORDS" | sort -n > ids
+fi
+awk '{ printf "%d,first%d,last%d,%d\n", $1, $1, $1 % 1000, $1 % 401 }' ids > data.csv
+shuf -n "$OPS" -r ids > get_ids
+comm -23 <(seq 1 $MAX_STD_ID | sort) <(sort ids) | shuf -n "$OPS" > new_ids
+((RECORDS > 0)) || : > get_ids
+
+printf '{"op":"config","records":%d,"density":"%s","ops":%d,"repeats":%d,' \
+    "$RECORDS" "$DENSITY" "$OPS" "$REPEATS"
+printf '"engine":"%s","format":"%s","wal":"%s","threads":"%s"}\n' \
+    "${SDB_ENGINE:-io}" "${SDB_FORMAT:-legacy}" "${SDB_WAL:-off}" "${SDB_THREADS:-auto}"
+
+seq 1 "$REPEATS" | time_calls bulk "$RECORDS" empty_db "$SDBSC" -b data.csv
+[ -s student.db ] || fail "bulk load did not create a database"
+cp student.db base.db
+
+time_calls get 1 : "$SDBSC" -f {} < get_ids
+time_calls add 1 : "$SDBSC" -a {} first last 300 < new_ids
+time_calls del 1 : "$SDBSC" -d {} < new_ids
+seq 1 "$REPEATS" | time_calls count "$RECORDS" : "$SDBSC" -c
+seq 1 "$REPEATS" | time_calls print "$RECORDS" : "$SDBSC" -p
+seq 1 "$REPEATS" | time_calls compress "$RECORDS" base_db "$SDBSC" -x
@@ -1,6 +1,8 @@
 #ifndef __DB_H__
     #define __DB_H__
 
+#include <stdint.h>
+
 // Basic student database record.  Note:
 //  1. id must be > 0.  A student id==0 means the record has been deleted
 //  2. gpa is an int, should be between 0<=gpa<=500, real gpa is gpa/100.0 this
@@ -29,7 +31,304 @@ static const int STUDENT_RECORD_SIZE  = sizeof(struct student);
 static const int DELETED_STUDENT_ID = 0;
 
 
+//Database file header.  Legacy database files are a bare array of student_t
+//indexed by id.  Since id 0 is never used their first 64 bytes are always
+//zero, which lets open_db() tell the two layouts apart.  Version 1 files
+//start with this header, followed by an occupancy bitmap holding one bit per
+//possible id, and the record array begins at data_offset.  The header keeps
+//the number of live records so counting and duplicate checks do not need to
+//look at the records themselves.
+//
+//Packed files (written by compress_db()) keep only the live records, stored
+//back to back in 64 byte units starting at data_offset.  A two level
+//directory maps an id to its unit: the top level at bitmap_offset has one
+//entry per DB_DIR_FANOUT ids naming the leaf for them, and each leaf (one
+//DB_DIR_LEAF_UNITS units long, in the same area as the records) has one
+//entry per id naming its record.  Entries hold unit + 1 so 0 means none.
+//Leaves are only allocated for id ranges that have students.  New records
+//are appended at heap_units.  Deleted units are linked into a free list
+//through the gpa field of the zeroed record left behind.
+#define DB_MAGIC            0x31424453      //"SDB1"
+#define DB_FORMAT_LEGACY    0               //headerless array of student_t
+#define DB_FORMAT_V1        1               //header + bitmap + student_t array
+#define DB_FORMAT_PACKED    2               //header + directory + packed records
+#define DB_BITMAP_OFFSET    4096
+#define DB_BITMAP_BYTES     ((MAX_STD_ID + 8) / 8)
+#define DB_DATA_OFFSET      20480           //first page after the bitmap
+#define DB_DIR_FANOUT       256
+#define DB_DIR_TOP          ((MAX_STD_ID + DB_DIR_FANOUT) / DB_DIR_FANOUT)
+#define DB_DIR_LEAF_UNITS   (DB_DIR_FANOUT * sizeof(uint32_t) / sizeof(student_t))
+#define DB_PACKED_DATA_OFFSET   8192        //first page after the top level
+
+//Hashed files (SDB_FORMAT=hashed) are for ids past MAX_STD_ID, up to
+//DB_HASH_MAX_ID, where a slot per possible id would make the file absurdly
+//large.  Records live in DB_HASH_PAGE byte pages starting at data_offset,
+//slot 0 of each page holds a hash_page_hdr_t and the others hold students
+//(id 0 is a free slot).  The pages form a linear hash table: a bucket is
+//one page plus a chain of overflow pages, and whenever the table holds more
+//than DB_HASH_FILL students per bucket the next bucket in turn is split in
+//two, so a lookup reads the hash_meta_t at bitmap_offset and normally one
+//page.  Bucket b is page b + spares[g - 1], g being the number of bits in
+//b.  Overflow pages are placed after the pages set aside for every bucket
+//of the current generation, spares[g] counts those allocated up to
+//generation g.  Overflow pages emptied by a split go on a free list.  The
+//records are in hash order, not id order.
+#define DB_FORMAT_HASHED    3               //header + linear hash of pages
+#define DB_HASH_MAX_ID      INT32_MAX
+#define DB_HASH_PAGE        4096
+#define DB_HASH_SLOTS       (DB_HASH_PAGE / sizeof(student_t))
+#define DB_HASH_FILL        48              //students per bucket, of 63 slots
+#define DB_HASH_GENS        32
+#define DB_HASH_META_OFFSET 64              //right after the header
+#define DB_HASH_DATA_OFFSET 4096
+
+//Dictionary files (SDB_FORMAT=dict) have the header and occupancy bitmap
+//of version 1, but the slot of an id holds a 16 byte dict_rec_t that
+//refers to the names instead of containing them.  Every distinct name is
+//stored once in a string heap at DB_DICT_HEAP_OFFSET, as a dict_str_t
+//followed by its characters (no NUL), and is referred to by its offset in
+//the heap + 1, 0 being the empty name.  A name is found again through
+//DB_DICT_BUCKETS hash chains, each bucket at DB_DICT_BUCKET_OFFSET holds
+//the newest name of its chain.  heap_units in the header counts the heap
+//bytes in use.  Names stay in the heap when no student uses them any more
+//until -x writes the file again.
+#define DB_FORMAT_DICT      4               //header + bitmap + dict_rec_t array + names
+#define DB_DICT_BUCKETS     65536
+#define DB_DICT_BUCKET_OFFSET   (DB_DATA_OFFSET + \
+                                 ((MAX_STD_ID + 1) * sizeof(dict_rec_t) + 4095) / 4096 * 4096)
+#define DB_DICT_HEAP_OFFSET (DB_DICT_BUCKET_OFFSET + DB_DICT_BUCKETS * sizeof(uint32_t))
+#define DB_DICT_NAME_MAX    255
+
+//Version 1, packed and hashed files may be checksummed (DB_FLAG_CRC in the
+//header flags, SDB_CRC=on when the file is created).  Every live record
+//then gives up the last 4 bytes of lname to the CRC-32C of its other 60
+//bytes, which leaves room for last names of DB_CRC_LNAME - 1 characters.
+//The checksum does not depend on where the record is stored, so records
+//keep it when they are moved by -x or a bucket split.  Deleted records
+//(id 0) have none.  Dictionary records have no lname bytes to give up,
+//SDB_CRC is ignored for them.
+#define DB_FLAG_CRC         0x1
+#define DB_CRC_LNAME        28
+
+typedef struct db_header {
+    uint32_t magic;         //DB_MAGIC
+    uint32_t version;       //DB_FORMAT_*
+    uint32_t data_offset;   //file offset of record slot 0 (unit 0 if packed)
+    uint32_t bitmap_offset; //file offset of the occupancy bitmap (top level
+                            //directory if packed)
+    uint32_t max_id;        //the bitmap holds max_id+1 bits
+    uint32_t rec_count;     //number of live records
+    uint32_t flags;         //DB_FLAG_*
+    uint32_t heap_units;    //packed: units in use, the next one is appended here
+                            //dict: bytes of the string heap in use
+    uint32_t free_unit;     //packed: first unit of the free list + 1, 0 if empty
+    char     reserved[28];
+} db_header_t;
+
+typedef struct hash_meta {
+    uint32_t max_bucket;    //highest bucket in use
+    uint32_t low_mask;      //an id hashes to bucket hash & high_mask, or
+    uint32_t high_mask;     //hash & low_mask if that is past max_bucket
+    uint32_t free_page;     //first page of the free list + 1, 0 if empty
+    uint32_t version;       //changes whenever records move to another page
+    uint32_t reserved[3];
+    uint32_t spares[DB_HASH_GENS];
+} hash_meta_t;
+
+typedef struct dict_rec {
+    int32_t  id;            //0 for a free slot
+    int32_t  gpa;
+    uint32_t fname;         //heap references of the names
+    uint32_t lname;
+} dict_rec_t;
+
+typedef struct __attribute__((packed)) dict_str {
+    uint32_t next;          //reference of the next name in the chain, 0 at the end
+    uint8_t  len;           //number of characters that follow
+} dict_str_t;
+
+typedef struct hash_page_hdr {
+    int32_t  id;            //always 0, scans see an empty slot
+    uint32_t next;          //next page of the chain + 1, 0 at the end
+    char     reserved[56];
+} hash_page_hdr_t;
+
+//Secondary index files.  Each index is a hash table of buckets stored in
+//fixed size pages next to the database.  Page 0 holds the idx_header_t,
+//the following pages hold the directory (the first page of every bucket)
+//and the rest are bucket pages.  A bucket whose entries do not fit in one
+//page is a chain of pages linked through next.  Page number 0 is used as
+//the end of chain marker since it is always the header.
+#define IDX_MAGIC           0x58444953      //"SIDX"
+#define IDX_VERSION         1
+#define IDX_PAGE_SIZE       4096
+
+typedef struct idx_header {
+    uint32_t magic;         //IDX_MAGIC
+    uint32_t version;       //IDX_VERSION
+    uint32_t nbuckets;      //number of directory entries
+    uint32_t npages;        //pages in use, the next page is allocated here
+    uint64_t db_ino;        //inode and creation time of the database the
+    uint64_t db_birth;      //index was built for, see index_open()
+} idx_header_t;
+
+typedef struct idx_entry {
+    uint32_t key;           //full hash (or value) the bucket was chosen from
+    uint32_t key2;          //secondary key, e.g. hash of the first name
+    int32_t  id;            //student id the entry points to
+} idx_entry_t;
+
+#define IDX_PAGE_ENTRIES    ((IDX_PAGE_SIZE - 2 * sizeof(uint32_t)) / sizeof(idx_entry_t))
+
+typedef struct idx_page {
+    uint32_t next;          //next page of the bucket, 0 at the end
+    uint32_t count;         //entries in use on this page
+    idx_entry_t entries[IDX_PAGE_ENTRIES];
+    char     pad[IDX_PAGE_SIZE - 2 * sizeof(uint32_t) - IDX_PAGE_ENTRIES * sizeof(idx_entry_t)];
+} idx_page_t;
+
+//Write-ahead log.  With SDB_WAL=on every change to student.db is appended
+//to student.db.wal as a wal_entry_t followed by the bytes written (padded
+//to 8 bytes) before it is applied in place.  The entries of one commit
+//group end with one carrying WAL_COMMIT, and crc is the CRC-32C of the
+//entry header (with crc set to 0) and its payload.  Replay applies only
+//complete groups and stops at the first entry that does not check out.
+//The log starts with a wal_header_t naming the database file it belongs
+//to, a log written for another student.db is never replayed.  Several
+//processes may share the log, next_lsn hands out lsns across all of them.
+//Groups are applied before the log is unlocked, so while the system keeps
+//running (same boot_id) only groups from applied_lsn on are replayed.
+#define WAL_MAGIC           0x4c415753      //"SWAL"
+#define WAL_VERSION         2
+#define WAL_COMMIT          0x1
+#define WAL_BOOT_ID_LEN     40
+
+typedef struct wal_header {
+    uint32_t magic;         //WAL_MAGIC
+    uint32_t version;       //WAL_VERSION
+    uint64_t db_ino;        //inode and creation time of the database,
+    uint64_t db_birth;      //see db_identity()
+    uint64_t next_lsn;      //lsn of the next entry appended
+    uint64_t log_size;      //bytes of complete groups after the header
+    uint64_t applied_lsn;   //groups before this lsn are in the database,
+    char     boot_id[WAL_BOOT_ID_LEN];  //as long as the system was not restarted
+} wal_header_t;
+
+typedef struct wal_entry {
+    uint32_t magic;         //WAL_MAGIC
+    uint32_t crc;           //CRC-32C of header and payload
+    uint64_t lsn;           //increases by one per entry
+    int64_t  offset;        //where the payload goes in the database
+    uint32_t len;           //payload bytes, not counting the padding
+    uint32_t flags;         //WAL_COMMIT on the last entry of a group
+} wal_entry_t;
+
+//Column file.  student.col keeps the fields that scans filter and
+//aggregate on as separate arrays indexed by id, so a pass over every gpa
+//reads 4 bytes per student instead of a whole 64 byte record.  The
+//col_header_t page is followed by COL_ARRAYS arrays of int32_t, each
+//COL_ARRAY_BYTES long: the id (0 for a free slot), the gpa and the
+//name_hash() of the last name.  A record still has to be read to confirm
+//a name match.  Like the indexes the file is tied to one database file by
+//db_ino and db_birth, and ranges of ids nobody has are left as holes.
+//The header also carries col_agg_t, the sum, bounds and histogram of the
+//gpa of every student, kept up to date with each change so -g never has
+//to scan.
+#define COL_MAGIC           0x4c4f4353      //"SCOL"
+#define COL_VERSION         2
+#define COL_ID              0
+#define COL_GPA             1
+#define COL_LNAME           2
+#define COL_ARRAYS          3
+#define COL_SLOTS           (MAX_STD_ID + 1)
+#define COL_DATA_OFFSET     4096
+#define COL_ARRAY_BYTES     ((COL_SLOTS * sizeof(int32_t) + 4095) / 4096 * 4096)
+#define COL_GPA_BUCKETS     (MAX_STD_GPA + 1)
+
+typedef struct col_agg {
+    uint64_t gpa_sum;       //sum of the gpa of every student
+    int32_t  gpa_min;       //lowest and highest gpa, -1 without students
+    int32_t  gpa_max;
+    uint32_t gpa_hist[COL_GPA_BUCKETS];     //number of students with each gpa
+} col_agg_t;
+
+typedef struct col_header {
+    uint32_t magic;         //COL_MAGIC
+    uint32_t version;       //COL_VERSION
+    uint32_t count;         //number of nonzero ids
+    uint32_t reserved;
+    uint64_t db_ino;        //identity of the database, see db_identity()
+    uint64_t db_birth;
+    col_agg_t agg;          //gpa aggregates of the same students
+} col_header_t;
+
+//Change stream.  With SDB_CHANGES=on student.db.chg is created next to the
+//database, and from then on every process that opens the database adds
+//the changes of a command to it when the command commits, as one group of
+//chg_entry_t: CHG_PUT with a student as it is now stored, CHG_DEL with the
+//id of a deleted one, CHG_ZERO and CHG_COMPRESS for -z and -x.  The last
+//entry of a group carries CHG_END and crc is the CRC-32C of the entry with
+//crc set to 0.  The first group zeroes the follower and puts every student
+//the database held when the stream was created, so a replica can be built
+//from the stream alone.  Changes to one student reach the stream in the
+//order they were made, they are added while the record is still locked.
+//A command counts itself in begun before it first writes the database
+//and in ended once its group is durable in the stream, and holds a read
+//lock on the byte at CHG_LIVE_OFFSET in between.  begun != ended while
+//nobody holds that lock means a writer died or failed in between, and
+//the stream may lack a change.  Such a stream, or one past
+//CHG_REBASE_BYTES, is replaced by a new one with a fresh first group the
+//next time the database is opened; the old one is marked retired.
+//--follow keeps its position in a follow_state_t, tied to the stream and
+//the replica by their identities.
+#define CHG_MAGIC           0x47484353      //"SCHG"
+#define CHG_VERSION         2
+#define CHG_LIVE_OFFSET     ((off_t)1 << 40)    //lock only, past any entry
+#define CHG_PUT             1
+#define CHG_DEL             2
+#define CHG_ZERO            3
+#define CHG_COMPRESS        4
+#define CHG_END             0x1
+#define FOLLOW_MAGIC        0x4c4f4653      //"SFOL"
+
+typedef struct chg_header {
+    uint32_t magic;         //CHG_MAGIC
+    uint32_t version;       //CHG_VERSION
+    uint64_t begun;         //commands that started to change the database
+    uint64_t ended;         //commands whose changes are all in the stream
+    uint32_t retired;       //nonzero once a new stream replaced this one
+    char     reserved[36];
+} chg_header_t;
+
+typedef struct chg_entry {
+    uint32_t crc;           //CRC-32C of the entry
+    uint16_t op;            //CHG_*
+    uint16_t flags;         //CHG_END on the last entry of a group
+    uint64_t time;          //commit time, ns since the epoch
+    student_t rec;          //CHG_PUT: the student, CHG_DEL: only the id
+} chg_entry_t;
+
+typedef struct follow_state {
+    uint32_t magic;         //FOLLOW_MAGIC
+    uint32_t reserved;
+    uint64_t chg_ino;       //identity of the stream, see db_identity()
+    uint64_t chg_birth;
+    uint64_t db_ino;        //and of the replica
+    uint64_t db_birth;
+    uint64_t offset;        //stream bytes applied to the replica
+    uint64_t time;          //commit time of the last group applied
+} follow_state_t;
+
 #define DB_FILE     "student.db"            //name of database file
 #define TMP_DB_FILE ".tmp_student.db"       //for extra credit
+#define DB_SOCK_FILE ".sdbsc.sock"          //default socket for --serve
+#define NAME_IDX_FILE "student.name.idx"    //last/first name index
+#define GPA_IDX_FILE  "student.gpa.idx"     //gpa range index
+#define DB_WAL_FILE   "student.db.wal"      //write-ahead log
+#define COL_FILE      "student.col"         //column file
+#define CHG_FILE      "student.db.chg"      //change stream
+#define CHG_TMP_FILE  ".tmp_student.db.chg" //change stream being created
+#define FOLLOW_FILE   "student.db.follow"   //position of --follow in its stream
+#define DB_SNAP_DIR   "."                   //scan snapshots, on the same filesystem
 
 #endif
\ No newline at end of file
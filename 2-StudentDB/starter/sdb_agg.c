@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//GPA statistics (-g).  The number of students and the sum, bounds and
+//histogram of their gpa live in the column file header (col_agg_t in
+//db.h) and every add, delete and update adjusts them, so the mean, the
+//median and any percentile are read off the histogram without looking
+//at a record.  Hashed databases have no column file, for them the same
+//aggregates are gathered with a parallel scan.
+
+//aggregates gathered by one part of the scan
+typedef struct agg_part {
+    uint32_t count;
+    col_agg_t agg;
+} agg_part_t;
+
+/*
+ *  agg_records
+ *      db_scan() callback that adds the live records of each block to
+ *      the histogram of its part
+ */
+static int agg_records(student_t *recs, int n, void *arg) {
+    agg_part_t *part = arg;
+
+    for (int i = 0; i < n; i++) {
+        if (recs[i].id == 0)
+            continue;
+        part->count++;
+        col_agg_add(&part->agg, recs[i].gpa, true);
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  agg_scan
+ *      fd:     linux file descriptor
+ *      count:  filled in with the number of students
+ *      agg:    filled in with the aggregates of their gpa
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int agg_scan(int fd, uint32_t *count, col_agg_t *agg) {
+    int parts = db_scan_threads();
+    agg_part_t *part = calloc(parts, sizeof(agg_part_t));
+    int rc;
+
+    if (part == NULL)
+        return ERR_DB_FILE;
+    for (int i = 0; i < parts; i++)
+        part[i].agg.gpa_min = part[i].agg.gpa_max = -1;
+    rc = db_scan_parallel(fd, agg_records, part, sizeof(part[0]), parts);
+
+    memset(agg, 0, sizeof(*agg));
+    *count = 0;
+    for (int i = 0; i < parts; i++) {
+        *count += part[i].count;
+        agg->gpa_sum += part[i].agg.gpa_sum;
+        for (int gpa = MIN_STD_GPA; gpa <= MAX_STD_GPA; gpa++)
+            agg->gpa_hist[gpa] += part[i].agg.gpa_hist[gpa];
+    }
+    col_agg_bounds(agg);
+    free(part);
+    return rc == NO_ERROR ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  agg_percentile
+ *      agg:    aggregates of count students
+ *      count:  number of students, at least 1
+ *      pct:    percentile from 0 to 100
+ *
+ *  Uses the nearest rank: the lowest gpa that at least pct percent of the
+ *  students have or stay below.  Percentile 0 is the lowest gpa and 50 is
+ *  the median, the lower one of the two middle students for an even
+ *  count.
+ *
+ *  returns:  the gpa at the percentile
+ */
+static int agg_percentile(const col_agg_t *agg, uint32_t count, int pct) {
+    uint64_t rank = ((uint64_t)pct * count + 99) / 100;
+    uint64_t seen = 0;
+
+    if (rank == 0)
+        return agg->gpa_min;
+    for (int gpa = MIN_STD_GPA; gpa <= MAX_STD_GPA; gpa++) {
+        seen += agg->gpa_hist[gpa];
+        if (seen >= rank)
+            return gpa;
+    }
+    return agg->gpa_max;
+}
+
+/*
+ *  gpa_stats_db
+ *      fd:    linux file descriptor
+ *      n:     number of percentiles asked for
+ *      pcts:  the percentiles, whole numbers from 0 to 100
+ *
+ *  Prints the mean, median, lowest and highest gpa, then the gpa at each
+ *  percentile asked for.
+ *
+ *  returns:  number of students
+ *            ERR_DB_OP      a percentile is not valid
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *  console:  M_ERR_GPA_PCT, M_DB_EMPTY or M_GPA_STATS followed by one
+ *            M_GPA_PERCENTILE per percentile
+ */
+int gpa_stats_db(int fd, int n, char *pcts[]) {
+    col_agg_t agg;
+    uint32_t count;
+
+    for (int i = 0; i < n; i++) {
+        char *end;
+        long pct = strtol(pcts[i], &end, 10);
+
+        if (end == pcts[i] || *end != '\0' || pct < 0 || pct > 100) {
+            printf(M_ERR_GPA_PCT, pcts[i]);
+            return ERR_DB_OP;
+        }
+    }
+
+    if (col_aggregate(fd, &count, &agg) != NO_ERROR &&
+        agg_scan(fd, &count, &agg) != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    stats_add(STAT_MATCHED, count);
+    if (count == 0) {
+        printf(M_DB_EMPTY);
+        return 0;
+    }
+
+    printf(M_GPA_STATS, (int)count, agg.gpa_sum / (double)count / 100.0,
+           agg_percentile(&agg, count, 50) / 100.0, agg.gpa_min / 100.0, agg.gpa_max / 100.0);
+    for (int i = 0; i < n; i++) {
+        int pct = atoi(pcts[i]);
+        printf(M_GPA_PERCENTILE, pct, agg_percentile(&agg, count, pct) / 100.0);
+    }
+    return count;
+}
@@ -0,0 +1,670 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//rows are validated, sorted and written this many at a time
+#define BULK_BATCH_ROWS     4096
+
+//existing slots closer together than this are checked for duplicates
+//with a single read covering all of them
+#define BULK_READ_GAP       64
+#define BULK_READ_MAX       1024
+
+#define BULK_ROW_OK         0
+#define BULK_ROW_DUP        1
+#define BULK_ROW_IO         2
+#define BULK_ROW_PARSE      3
+#define BULK_ROW_RANGE      4
+#define BULK_ROW_MISSING    5
+#define BULK_ROW_CORRUPT    6
+
+typedef struct bulk_row {
+    student_t rec;      //the student to add, or the values an update assigns
+    unsigned fields;    //UPD_* fields assigned by an update row
+    int line;           //line number in the input, used for error messages
+    int status;         //BULK_ROW_*
+} bulk_row_t;
+
+//checks one input line and fills in the row, or marks why it is rejected
+typedef void (*bulk_parse_fn)(int fd, char *line, bulk_row_t *row);
+
+//applies a batch of rows, counting the students it stored in *done
+typedef int (*bulk_batch_fn)(int fd, bulk_row_t *rows, int n, int *done);
+
+//one student changed by an update batch, its rows are sorted[first] up to
+//sorted[first + cnt - 1]
+typedef struct upd_target {
+    off_t offset;
+    int first, cnt;
+    student_t old, cur;
+} upd_target_t;
+
+/*
+ *  parse_int
+ *      str:  text to convert
+ *      out:  where the value is stored
+ *
+ *  Unlike atoi() this rejects empty strings and trailing garbage so that a
+ *  mangled line in a bulk file is reported instead of loaded as id 0.
+ *
+ *  returns:  true if str was a complete integer
+ */
+static bool parse_int(char *str, int *out) {
+    char *end;
+    long val = strtol(str, &end, 10);
+
+    if (end == str || *end != '\0' || val < INT_MIN || val > INT_MAX)
+        return false;
+
+    *out = (int)val;
+    return true;
+}
+
+/*
+ *  parse_row
+ *      line:  one line of bulk input, modified in place
+ *      rec:   the record built from the line
+ *
+ *  Accepts "id,first_name,last_name,gpa" as well as whitespace separated
+ *  fields, the same order used by the -a option.
+ *
+ *  returns:  NO_ERROR        rec was filled in
+ *            EXIT_FAIL_ARGS  the line could not be parsed
+ */
+static int parse_row(char *line, student_t *rec) {
+    char *fields[4];
+    char *save = NULL;
+    char *tok;
+    int n = 0;
+    int id, gpa;
+
+    for (tok = strtok_r(line, ", \t\r\n", &save); tok != NULL;
+         tok = strtok_r(NULL, ", \t\r\n", &save)) {
+        if (n == 4)
+            return EXIT_FAIL_ARGS;
+        fields[n++] = tok;
+    }
+
+    if (n != 4 || !parse_int(fields[0], &id) || !parse_int(fields[3], &gpa))
+        return EXIT_FAIL_ARGS;
+
+    init_student(rec, id, fields[1], fields[2], gpa);
+    return NO_ERROR;
+}
+
+/*
+ *  cmp_row_id
+ *      qsort() comparator, orders rows by id and then by input line so the
+ *      first occurrence of a repeated id is the one that is kept
+ */
+static int cmp_row_id(const void *a, const void *b) {
+    const bulk_row_t *ra = *(bulk_row_t * const *)a;
+    const bulk_row_t *rb = *(bulk_row_t * const *)b;
+
+    if (ra->rec.id != rb->rec.id)
+        return ra->rec.id < rb->rec.id ? -1 : 1;
+    return ra->line - rb->line;
+}
+
+/*
+ *  mark_existing
+ *      fd:      linux file descriptor
+ *      sorted:  rows of the batch ordered by id
+ *      n:       number of rows
+ *
+ *  Flags rows whose id is already present in the database.  Ids that are
+ *  close together are checked with one read covering the whole span
+ *  instead of one read per row.  Packed and hashed files have no spans of
+ *  slots, each id is looked up in the directory or its bucket, and a
+ *  dictionary file answers from its bitmap.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on a read error
+ */
+static int mark_existing(int fd, bulk_row_t **sorted, int n) {
+    static student_t span[BULK_READ_MAX];
+    int i = 0;
+
+    if (db_format(fd) == DB_FORMAT_PACKED || db_format(fd) == DB_FORMAT_HASHED ||
+        db_format(fd) == DB_FORMAT_DICT) {
+        for (i = 0; i < n; i++) {
+            int rc = db_slot_used(fd, sorted[i]->rec.id);
+            if (rc < 0)
+                return ERR_DB_FILE;
+            if (rc == 1)
+                sorted[i]->status = BULK_ROW_DUP;
+        }
+        return NO_ERROR;
+    }
+
+    while (i < n) {
+        int first = sorted[i]->rec.id;
+        int j = i + 1;
+
+        while (j < n && sorted[j]->rec.id - sorted[j - 1]->rec.id <= BULK_READ_GAP &&
+               sorted[j]->rec.id - first < BULK_READ_MAX)
+            j++;
+
+        int slots = sorted[j - 1]->rec.id - first + 1;
+        ssize_t got = db_read_at(fd, db_slot_offset(fd, first), span,
+                                 slots * sizeof(student_t));
+        if (got == -1)
+            return ERR_DB_FILE;
+
+        for (int k = i; k < j; k++) {
+            int slot = sorted[k]->rec.id - first;
+
+            if ((slot + 1) * (ssize_t)sizeof(student_t) <= got && span[slot].id != 0)
+                sorted[k]->status = BULK_ROW_DUP;
+        }
+        i = j;
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ *  write_runs
+ *      fd:      linux file descriptor
+ *      sorted:  rows of the batch ordered by id
+ *      n:       number of rows
+ *
+ *  Writes every row still marked BULK_ROW_OK.  Rows with consecutive ids
+ *  occupy adjacent slots (a packed file gives them adjacent units), so each
+ *  run of them becomes one vectored write.  In a hashed file every row is
+ *  a run of its own.  All the runs of the batch go out together as one
+ *  db_record_batch().
+ *
+ *  returns:  number of rows written, or ERR_DB_FILE if the occupancy
+ *            bitmap could not be updated
+ */
+static int write_runs(int fd, bulk_row_t **sorted, int n) {
+    static int ids[BULK_BATCH_ROWS];
+    static struct iovec iov[BULK_BATCH_ROWS];
+    static db_io_t runs[BULK_BATCH_ROWS];
+    static int run_start[BULK_BATCH_ROWS];
+    int max_run = db_format(fd) == DB_FORMAT_HASHED ? 1 : IOV_MAX;
+    int nruns = 0, nvec = 0;
+    int written = 0;
+    int fresh = 0;
+    int i = 0;
+
+    for (int k = 0; k < n; k++) {
+        if (sorted[k]->status == BULK_ROW_OK)
+            fresh++;
+    }
+    if (db_slot_reserve(fd, fresh) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    while (i < n) {
+        if (sorted[i]->status != BULK_ROW_OK) {
+            i++;
+            continue;
+        }
+
+        int first = sorted[i]->rec.id;
+        int cnt = 0;
+        int j = i;
+
+        while (j < n && cnt < max_run && sorted[j]->status == BULK_ROW_OK &&
+               sorted[j]->rec.id == first + cnt) {
+            db_seal(fd, &sorted[j]->rec);
+            iov[nvec + cnt].iov_base = &sorted[j]->rec;
+            iov[nvec + cnt].iov_len = sizeof(student_t);
+            cnt++;
+            j++;
+        }
+
+        off_t offset = db_slot_alloc(fd, first, cnt);
+        if (offset < 0) {
+            for (int k = i; k < j; k++)
+                sorted[k]->status = BULK_ROW_IO;
+        } else {
+            runs[nruns] = (db_io_t){ .write = true, .offset = offset,
+                                     .len = cnt * sizeof(student_t),
+                                     .iov = &iov[nvec], .iovcnt = cnt };
+            run_start[nruns++] = i;
+            nvec += cnt;
+        }
+        i = j;
+    }
+
+    int rc = db_record_batch(fd, runs, nruns);
+    for (int r = 0; r < nruns; r++) {
+        bool ok = rc == NO_ERROR && runs[r].res == (ssize_t)runs[r].len;
+
+        for (int k = run_start[r]; k < run_start[r] + runs[r].iovcnt; k++) {
+            if (ok)
+                ids[written++] = sorted[k]->rec.id;
+            else
+                sorted[k]->status = BULK_ROW_IO;
+        }
+    }
+
+    if (db_mark_slots(fd, ids, written, true) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+    return written;
+}
+
+/*
+ *  report_rows
+ *      rows:       a batch of rows in input order
+ *      n:          number of rows
+ *      parse_msg:  what a line that could not be parsed should look like
+ *
+ *  returns:  the number of rows that were rejected, each one is reported
+ *            with its line number and the reason
+ */
+static int report_rows(bulk_row_t *rows, int n, const char *parse_msg) {
+    int rejected = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (rows[i].status == BULK_ROW_OK)
+            continue;
+        printf(M_ERR_BULK_ROW, rows[i].line);
+        switch (rows[i].status) {
+        case BULK_ROW_PARSE:
+            printf("%s", parse_msg);
+            break;
+        case BULK_ROW_RANGE:
+            printf(M_ERR_STD_RNG);
+            break;
+        case BULK_ROW_DUP:
+            printf(M_ERR_DB_ADD_DUP, rows[i].rec.id);
+            break;
+        case BULK_ROW_MISSING:
+            printf(M_STD_NOT_FND_MSG, rows[i].rec.id);
+            break;
+        case BULK_ROW_CORRUPT:
+            printf(M_ERR_DB_CORRUPT, rows[i].rec.id);
+            break;
+        default:
+            printf(M_ERR_DB_WRITE);
+            break;
+        }
+        rejected++;
+    }
+
+    return rejected;
+}
+
+/*
+ *  load_batch
+ *      fd:     linux file descriptor
+ *      rows:   batch of rows in input order, unparsable or out of range
+ *              rows are already marked
+ *      n:      number of rows
+ *      added:  incremented by the number of students stored
+ *
+ *  Sorts the valid rows of the batch by id, drops repeated ids and ids
+ *  already in the database, writes the rest and then reports every
+ *  rejected row in input order.
+ *
+ *  returns:  number of rows rejected, or ERR_DB_FILE on an I/O error
+ */
+static int load_batch(int fd, bulk_row_t *rows, int n, int *added) {
+    static bulk_row_t *sorted[BULK_BATCH_ROWS];
+    static student_t *stored_recs[BULK_BATCH_ROWS];
+    int valid = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (rows[i].status == BULK_ROW_OK)
+            sorted[valid++] = &rows[i];
+    }
+    qsort(sorted, valid, sizeof(sorted[0]), cmp_row_id);
+
+    for (int i = 1; i < valid; i++) {
+        if (sorted[i]->rec.id == sorted[i - 1]->rec.id)
+            sorted[i]->status = BULK_ROW_DUP;
+    }
+
+    //the slots of the whole batch stay locked until it is committed
+    if (valid > 0 && db_lock_slots(fd, sorted[0]->rec.id, sorted[valid - 1]->rec.id) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    if (mark_existing(fd, sorted, valid) != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    int written = write_runs(fd, sorted, valid);
+    if (written < 0)
+        return written;
+    *added += written;
+
+    //write_runs() only marks rows it could not store, so every row still
+    //marked ok is now in the database and belongs in the indexes
+    int stored = 0;
+    for (int i = 0; i < valid; i++) {
+        if (sorted[i]->status == BULK_ROW_OK)
+            stored_recs[stored++] = &sorted[i]->rec;
+    }
+    index_add(fd, stored_recs, stored);
+
+    //group commit, the whole batch shares one fdatasync() of the log
+    if (db_commit(fd) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    return report_rows(rows, n, M_ERR_BULK_PARSE);
+}
+
+/*
+ *  cmp_target_offset
+ *      qsort() comparator, orders update targets by their file offset
+ */
+static int cmp_target_offset(const void *a, const void *b) {
+    const upd_target_t *ta = a;
+    const upd_target_t *tb = b;
+
+    if (ta->offset != tb->offset)
+        return ta->offset < tb->offset ? -1 : 1;
+    return 0;
+}
+
+/*
+ *  mark_target
+ *      sorted:  rows of the batch ordered by id
+ *      t:       the student the rows belong to
+ *      status:  BULK_ROW_* for all of them
+ */
+static void mark_target(bulk_row_t **sorted, upd_target_t *t, int status) {
+    for (int k = t->first; k < t->first + t->cnt; k++)
+        sorted[k]->status = status;
+}
+
+/*
+ *  update_batch
+ *      fd:       linux file descriptor
+ *      rows:     batch of rows in input order, unparsable rows are already
+ *                marked
+ *      n:        number of rows
+ *      updated:  incremented by the number of students updated
+ *
+ *  Groups the rows by student, reads every student the batch touches and
+ *  applies its rows to it in input order.  Only the bytes that changed are
+ *  written back.  The reads and the writes each go out as one
+ *  db_record_batch() in file offset order, so the disk sees one sweep
+ *  across the file instead of a seek per row.
+ *
+ *  returns:  number of rows rejected, or ERR_DB_FILE on an I/O error
+ */
+static int update_batch(int fd, bulk_row_t *rows, int n, int *updated) {
+    static bulk_row_t *sorted[BULK_BATCH_ROWS];
+    static upd_target_t targets[BULK_BATCH_ROWS];
+    static db_io_t ios[BULK_BATCH_ROWS];
+    static int wrote[BULK_BATCH_ROWS];
+    static student_t *changed[BULK_BATCH_ROWS];
+    int valid = 0, nt = 0, nio = 0, nchanged = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (rows[i].status == BULK_ROW_OK)
+            sorted[valid++] = &rows[i];
+    }
+    qsort(sorted, valid, sizeof(sorted[0]), cmp_row_id);
+
+    //the slots of the whole batch stay locked until it is committed
+    if (valid > 0 && db_lock_slots(fd, sorted[0]->rec.id, sorted[valid - 1]->rec.id) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    for (int i = 0; i < valid; i++) {
+        if (i > 0 && sorted[i]->rec.id == sorted[i - 1]->rec.id) {
+            targets[nt - 1].cnt++;
+            continue;
+        }
+        targets[nt] = (upd_target_t){ .offset = db_slot_offset(fd, sorted[i]->rec.id),
+                                      .first = i, .cnt = 1 };
+        nt++;
+    }
+    qsort(targets, nt, sizeof(targets[0]), cmp_target_offset);
+
+    //a packed or hashed file has no slot at all for a missing id
+    for (int t = 0; t < nt; t++) {
+        ios[t] = (db_io_t){ .offset = targets[t].offset < 0 ? 0 : targets[t].offset,
+                            .buff = &targets[t].old,
+                            .len = targets[t].offset < 0 ? 0 : sizeof(student_t) };
+    }
+    if (db_record_batch(fd, ios, nt) != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    for (int t = 0; t < nt; t++) {
+        upd_target_t *tg = &targets[t];
+        int id = sorted[tg->first]->rec.id;
+        size_t start, len;
+
+        if (ios[t].res == -1) {
+            printf(M_ERR_DB_READ);
+            return ERR_DB_FILE;
+        }
+        if (ios[t].res != sizeof(student_t) || tg->old.id != id) {
+            mark_target(sorted, tg, BULK_ROW_MISSING);
+            continue;
+        }
+        if (!db_record_ok(fd, &tg->old)) {
+            mark_target(sorted, tg, BULK_ROW_CORRUPT);
+            continue;
+        }
+
+        tg->cur = tg->old;
+        for (int k = tg->first; k < tg->first + tg->cnt; k++)
+            patch_student(&tg->cur, &sorted[k]->rec, sorted[k]->fields);
+        db_seal(fd, &tg->cur);
+        len = update_span(&tg->old, &tg->cur, &start);
+        if (len == 0) {
+            (*updated)++;
+            continue;
+        }
+        //a dictionary record holds references, it is written whole
+        if (db_format(fd) == DB_FORMAT_DICT) {
+            start = 0;
+            len = sizeof(student_t);
+        }
+        wrote[nio] = t;
+        ios[nio++] = (db_io_t){ .write = true, .offset = tg->offset + start,
+                                .buff = (char *)&tg->cur + start, .len = len };
+    }
+
+    //targets are in offset order, so the writes are too
+    int rc = db_record_batch(fd, ios, nio);
+    for (int w = 0; w < nio; w++) {
+        upd_target_t *tg = &targets[wrote[w]];
+
+        if (rc != NO_ERROR || ios[w].res != (ssize_t)ios[w].len) {
+            mark_target(sorted, tg, BULK_ROW_IO);
+            continue;
+        }
+        index_del(fd, &tg->old);
+        changed[nchanged++] = &tg->cur;
+        (*updated)++;
+    }
+    index_add(fd, changed, nchanged);
+
+    //group commit, the whole batch shares one fdatasync() of the log
+    if (db_commit(fd) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    return report_rows(rows, n, M_ERR_BULK_UPDATE);
+}
+
+/*
+ *  load_row
+ *      bulk_parse_fn of bulk_load(), the line is id,first_name,last_name,gpa
+ */
+static void load_row(int fd, char *line, bulk_row_t *row) {
+    if (parse_row(line, &row->rec) != NO_ERROR)
+        row->status = BULK_ROW_PARSE;
+    else if (validate_range(fd, row->rec.id, row->rec.gpa) != NO_ERROR)
+        row->status = BULK_ROW_RANGE;
+}
+
+/*
+ *  update_row
+ *      bulk_parse_fn of bulk_update(), the line is an id followed by one or
+ *      more field=value assignments as given to -u
+ */
+static void update_row(int fd, char *line, bulk_row_t *row) {
+    char *save = NULL;
+    char *tok = strtok_r(line, ", \t\r\n", &save);
+    int id;
+
+    memset(&row->rec, 0, sizeof(row->rec));
+    row->fields = 0;
+    if (tok == NULL || !parse_int(tok, &id)) {
+        row->status = BULK_ROW_PARSE;
+        return;
+    }
+    row->rec.id = id;
+
+    while ((tok = strtok_r(NULL, ", \t\r\n", &save)) != NULL) {
+        if (parse_update(tok, &row->rec, &row->fields) != NO_ERROR) {
+            row->status = BULK_ROW_PARSE;
+            return;
+        }
+    }
+    if (row->fields == 0)
+        row->status = BULK_ROW_PARSE;
+    else if (validate_range(fd, id, MIN_STD_GPA) != NO_ERROR)
+        row->status = BULK_ROW_RANGE;
+}
+
+/*
+ *  bulk_run
+ *      fd:     linux file descriptor
+ *      path:   file with one row per line, or "-" for stdin
+ *      parse:  turns a line into a row
+ *      batch:  applies BULK_BATCH_ROWS rows at a time
+ *      done:   incremented by the number of students stored
+ *
+ *  Reads the input for bulk_load() and bulk_update().  Blank lines and
+ *  lines starting with # are skipped.  A bad line is reported by batch
+ *  with its line number and the run carries on with the next one.
+ *
+ *  returns:  number of rejected lines, or ERR_DB_FILE
+ */
+static int bulk_run(int fd, char *path, bulk_parse_fn parse, bulk_batch_fn batch, int *done) {
+    static bulk_row_t rows[BULK_BATCH_ROWS];
+    FILE *in = stdin;
+    char *line = NULL;
+    size_t cap = 0;
+    int lineno = 0;
+    int n = 0;
+    int rejected = 0;
+    int rc = NO_ERROR;
+
+    if (strcmp(path, "-") != 0) {
+        in = fopen(path, "r");
+        if (in == NULL) {
+            printf(M_ERR_BULK_OPEN, path);
+            return ERR_DB_FILE;
+        }
+    }
+
+    while (rc >= 0 && getline(&line, &cap, in) != -1) {
+        char *p = line;
+
+        lineno++;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\0' || *p == '\n' || *p == '\r' || *p == '#')
+            continue;
+
+        bulk_row_t *row = &rows[n];
+        row->line = lineno;
+        row->status = BULK_ROW_OK;
+        parse(fd, p, row);
+
+        if (++n == BULK_BATCH_ROWS) {
+            uint64_t start = stats_now();
+            rc = batch(fd, rows, n, done);
+            stats_latency(start);
+            if (rc > 0)
+                rejected += rc;
+            n = 0;
+        }
+    }
+
+    if (rc >= 0 && n > 0) {
+        uint64_t start = stats_now();
+        rc = batch(fd, rows, n, done);
+        stats_latency(start);
+        if (rc > 0)
+            rejected += rc;
+    }
+
+    free(line);
+    if (in != stdin)
+        fclose(in);
+
+    return rc < 0 ? rc : rejected;
+}
+
+/*
+ *  bulk_load
+ *      fd:    linux file descriptor
+ *      path:  file with one student per line, or "-" for stdin
+ *
+ *  Loads many students with a single open database.  Each line holds
+ *  id,first_name,last_name,gpa.  Blank lines and lines starting with #
+ *  are skipped.  A bad line is reported with its line number and the
+ *  load carries on with the next one.
+ *
+ *  returns:  number of rejected lines (0 if everything was loaded)
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *  console:  M_ERR_BULK_ROW followed by the reason for each rejected line,
+ *            then M_BULK_LOADED
+ */
+int bulk_load(int fd, char *path) {
+    int added = 0;
+    int rc = bulk_run(fd, path, load_row, load_batch, &added);
+
+    if (rc >= 0)
+        printf(M_BULK_LOADED, added, rc);
+    return rc;
+}
+
+/*
+ *  bulk_update
+ *      fd:    linux file descriptor
+ *      path:  file with one update per line, or "-" for stdin
+ *
+ *  Applies many -u updates with a single open database.  Each line holds
+ *  an id and the field=value assignments for it, several lines for the
+ *  same id are applied in input order.  Bad lines and ids that are not in
+ *  the database are reported with their line number.
+ *
+ *  returns:  number of rejected lines (0 if everything was applied)
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *  console:  M_ERR_BULK_ROW followed by the reason for each rejected line,
+ *            then M_BULK_UPDATED
+ */
+int bulk_update(int fd, char *path) {
+    int updated = 0;
+    int rc = bulk_run(fd, path, update_row, update_batch, &updated);
+
+    if (rc >= 0)
+        printf(M_BULK_UPDATED, updated, rc);
+    return rc;
+}
@@ -0,0 +1,774 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//Change stream (layout in db.h).  The index_*() hooks queue what every
+//command changes on the handle and db_commit() adds the queue to
+//student.db.chg as one group, after the write-ahead log has committed it
+//and before the record locks are released, and makes it durable.  Before
+//its first write a command counts itself in the stream header
+//(chg_begin()), so a change that never reached the stream because its
+//writer died or the append failed is noticed.  Such a stream is started
+//over by the next process that opens the database, and followers switch
+//to the new one.  --follow tails a stream and applies it to the database
+//in its own directory, a read replica that reporting jobs can scan
+//without getting in the way of the writers of the primary.  Applying is
+//idempotent, a group applied twice after a crash leaves the replica as
+//it was.
+
+static volatile sig_atomic_t follow_stop = 0;
+
+/*
+ *  chg_open
+ *      h:  handle of the database being opened
+ *
+ *  Called from db_attach(), opens the stream if the database has one.
+ *
+ *  returns:  NO_ERROR, or ERR_DB_FILE if there is a stream that can't be
+ *            opened
+ */
+int chg_open(db_handle_t *h) {
+    h->chg.fd = open(CHG_FILE, O_RDWR);
+    if (h->chg.fd == -1)
+        return errno == ENOENT ? NO_ERROR : ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  chg_missing
+ *      cfd:  the stream, its header locked
+ *      hdr:  its header
+ *
+ *  A writer counted in begun holds a read lock on CHG_LIVE_OFFSET until
+ *  it is counted in ended.  When the counts differ and nobody holds the
+ *  lock, a writer died or failed to add its changes.  The lock of this
+ *  process's own descriptor does not count.
+ *
+ *  returns:  true if the stream may lack a change made to the database
+ */
+static bool chg_missing(int cfd, const chg_header_t *hdr) {
+    struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET,
+                        .l_start = CHG_LIVE_OFFSET, .l_len = 1 };
+
+    if (hdr->begun == hdr->ended)
+        return false;
+    return fcntl(cfd, F_OFD_GETLK, &fl) == 0 && fl.l_type == F_UNLCK;
+}
+
+/*
+ *  chg_stale
+ *      h:  database handle with a stream
+ *
+ *  returns:  true if the stream has to start over, because it is not
+ *            a stream of this version, may lack a change or is longer than
+ *            CHG_REBASE_BYTES
+ */
+static bool chg_stale(db_handle_t *h) {
+    chg_header_t hdr;
+    struct stat st;
+    bool stale;
+
+    if (db_lock(h->chg.fd, F_RDLCK, 0, sizeof(hdr)) != NO_ERROR)
+        return false;
+    stale = pread(h->chg.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            hdr.magic != CHG_MAGIC || hdr.version != CHG_VERSION ||
+            chg_missing(h->chg.fd, &hdr) ||
+            (fstat(h->chg.fd, &st) == 0 && st.st_size > CHG_REBASE_BYTES);
+    db_lock(h->chg.fd, F_UNLCK, 0, sizeof(hdr));
+    return stale;
+}
+
+/*
+ *  chg_queue
+ *      h:   database handle
+ *      op:  CHG_*
+ *      s:   the student, only the id is kept for CHG_DEL
+ *
+ *  Adds an entry to the group of the current command.  Checksums stay
+ *  behind, a replica seals records for its own file.
+ */
+static void chg_queue(db_handle_t *h, int op, const student_t *s) {
+    chg_entry_t *e;
+
+    if (h == NULL || h->chg.fd < 0)
+        return;
+    if (h->chg.len == h->chg.cap) {
+        int cap = h->chg.cap == 0 ? 64 : h->chg.cap * 2;
+        chg_entry_t *grown = realloc(h->chg.buf, cap * sizeof(chg_entry_t));
+        if (grown == NULL) {
+            h->chg.lost = true;
+            return;
+        }
+        h->chg.buf = grown;
+        h->chg.cap = cap;
+    }
+
+    e = &h->chg.buf[h->chg.len++];
+    memset(e, 0, sizeof(*e));
+    e->op = op;
+    if (op == CHG_PUT) {
+        e->rec = *s;
+        if (h->flags & DB_FLAG_CRC)
+            memset(e->rec.lname + DB_CRC_LNAME, 0, sizeof(uint32_t));
+    } else {
+        e->rec.id = s->id;
+    }
+}
+
+/*
+ *  chg_append
+ *      h:  database handle with a non empty queue, the stream locked
+ *
+ *  Seals the queued entries as one group and appends them to the stream.
+ *  A torn entry left by a process that died while appending is
+ *  overwritten, a group that could not be written completely is cut off
+ *  again.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int chg_append(db_handle_t *h) {
+    ssize_t len = h->chg.len * sizeof(chg_entry_t);
+    struct timespec now;
+    struct stat st;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (int i = 0; i < h->chg.len; i++) {
+        chg_entry_t *e = &h->chg.buf[i];
+
+        e->time = now.tv_sec * 1000000000ull + now.tv_nsec;
+        e->flags = i == h->chg.len - 1 ? CHG_END : 0;
+        e->crc = 0;
+        e->crc = crc32c(0, e, sizeof(*e));
+    }
+    h->chg.len = 0;
+
+    if (fstat(h->chg.fd, &st) == -1)
+        return ERR_DB_FILE;
+    off_t end = st.st_size < (off_t)sizeof(chg_header_t) ? (off_t)sizeof(chg_header_t) :
+                st.st_size - (st.st_size - sizeof(chg_header_t)) % sizeof(chg_entry_t);
+    if (pwrite(h->chg.fd, h->chg.buf, len, end) != len) {
+        ftruncate(h->chg.fd, end);
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  chg_begin
+ *      fd:  database file descriptor
+ *
+ *  Called before the first write of a command (db_writev_at() and
+ *  db_io_batch()) and by -z and -x.  Counts the command in begun and
+ *  takes the read lock on CHG_LIVE_OFFSET, both made durable before the
+ *  database can change.  A stream that was replaced is swapped for the new
+ *  one first, that happens while the whole database is locked so no
+ *  change of this command went to the old one.
+ */
+void chg_begin(int fd) {
+    db_handle_t *h = db_handle(fd);
+    chg_header_t hdr;
+    bool read_ok;
+
+    if (h == NULL || h->chg.fd < 0 || h->chg.begun)
+        return;
+
+    while (true) {
+        if (db_lock(h->chg.fd, F_WRLCK, 0, sizeof(hdr)) != NO_ERROR) {
+            h->chg.lost = true;
+            return;
+        }
+        read_ok = pread(h->chg.fd, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+        if (!read_ok || !hdr.retired)
+            break;
+        close(h->chg.fd);
+        if (chg_open(h) != NO_ERROR || h->chg.fd < 0) {
+            h->chg.fd = -1;
+            h->chg.lost = true;
+            return;
+        }
+    }
+
+    hdr.begun++;
+    if (!read_ok || pwrite(h->chg.fd, &hdr.begun, sizeof(hdr.begun),
+                           offsetof(chg_header_t, begun)) != sizeof(hdr.begun) ||
+        fdatasync(h->chg.fd) == -1 ||
+        db_lock(h->chg.fd, F_RDLCK, CHG_LIVE_OFFSET, 1) != NO_ERROR)
+        h->chg.lost = true;
+    else
+        h->chg.begun = true;
+    db_lock(h->chg.fd, F_UNLCK, 0, sizeof(hdr));
+}
+
+/*
+ *  chg_end
+ *      h:     database handle
+ *      keep:  false if the changes were not committed
+ *
+ *  Appends the group of the command and makes it durable, and only then
+ *  counts the command in ended.  If anything went wrong, or the write-ahead
+ *  log could not tell whether the changes are in the database, ended is
+ *  left alone and the stream counts as missing a change once the command
+ *  lets go of CHG_LIVE_OFFSET.
+ *
+ *  returns:  NO_ERROR, or ERR_DB_FILE if a change did not reach the stream
+ */
+static int chg_end(db_handle_t *h, bool keep) {
+    bool complete = keep && !h->chg.lost;
+    chg_header_t hdr;
+
+    if (!h->chg.begun) {
+        h->chg.len = 0;
+        h->chg.lost = false;
+        return complete || !keep ? NO_ERROR : ERR_DB_FILE;
+    }
+
+    if (db_lock(h->chg.fd, F_WRLCK, 0, sizeof(hdr)) != NO_ERROR) {
+        complete = false;
+    } else {
+        if (complete && h->chg.len > 0 &&
+            (chg_append(h) != NO_ERROR || fdatasync(h->chg.fd) == -1))
+            complete = false;
+        if (complete && pread(h->chg.fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)) {
+            hdr.ended++;
+            complete = pwrite(h->chg.fd, &hdr.ended, sizeof(hdr.ended),
+                              offsetof(chg_header_t, ended)) == sizeof(hdr.ended);
+        } else {
+            complete = false;
+        }
+    }
+    db_lock(h->chg.fd, F_UNLCK, CHG_LIVE_OFFSET, 1);
+    db_lock(h->chg.fd, F_UNLCK, 0, sizeof(hdr));
+
+    h->chg.begun = false;
+    h->chg.len = 0;
+    h->chg.lost = false;
+    return complete || !keep ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  chg_flush
+ *      fd:    linux file descriptor
+ *      keep:  false if the changes were not committed
+ *
+ *  Called by db_commit() while the records are still locked, adds the
+ *  changes of the command to the stream or throws them away.
+ *
+ *  returns:  NO_ERROR, or ERR_DB_FILE if a change did not reach the stream
+ */
+int chg_flush(int fd, bool keep) {
+    db_handle_t *h = db_handle(fd);
+
+    if (h == NULL || h->chg.fd < 0)
+        return NO_ERROR;
+    return chg_end(h, keep);
+}
+
+/*
+ *  chg_close
+ *      h:  handle of the database being closed
+ *
+ *  Adds what is still queued, -z closes the database it empties before
+ *  that command commits.
+ */
+void chg_close(db_handle_t *h) {
+    if (h->chg.fd >= 0) {
+        chg_end(h, true);
+        close(h->chg.fd);
+    }
+    free(h->chg.buf);
+    memset(&h->chg, 0, sizeof(h->chg));
+    h->chg.fd = -1;
+}
+
+/*
+ *  chg_snapshot
+ *      db_scan() callback that queues every live student
+ */
+static int chg_snapshot(student_t *recs, int n, void *arg) {
+    db_handle_t *h = arg;
+
+    for (int i = 0; i < n; i++) {
+        if (recs[i].id != 0)
+            chg_queue(h, CHG_PUT, &recs[i]);
+    }
+    return h->chg.lost ? ERR_DB_FILE : NO_ERROR;
+}
+
+/*
+ *  chg_retire
+ *      cfd:  a stream that was just replaced, closed here
+ *
+ *  Processes that still have it open find retired set in chg_begin() and
+ *  move to the new stream.
+ */
+static void chg_retire(int cfd) {
+    uint32_t retired = 1;
+
+    if (db_lock(cfd, F_WRLCK, 0, sizeof(chg_header_t)) == NO_ERROR) {
+        pwrite(cfd, &retired, sizeof(retired), offsetof(chg_header_t, retired));
+        db_lock(cfd, F_UNLCK, 0, sizeof(chg_header_t));
+    }
+    close(cfd);
+}
+
+/*
+ *  chg_create
+ *      fd:  linux file descriptor, the whole file is write locked
+ *      h:   its handle, with no stream or with the one being replaced
+ *
+ *  Writes a new stream whose first group zeroes a replica and puts every
+ *  student of the database.  It is written as CHG_TMP_FILE and renamed,
+ *  so a stream that exists always has that group.  A stream it replaces
+ *  is retired.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int chg_create(int fd, db_handle_t *h) {
+    chg_header_t hdr = { .magic = CHG_MAGIC, .version = CHG_VERSION };
+    int old_fd = h->chg.fd;
+    int rc = NO_ERROR;
+
+    h->chg.fd = open(CHG_TMP_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (h->chg.fd == -1) {
+        h->chg.fd = old_fd;
+        return ERR_DB_FILE;
+    }
+
+    h->chg.len = 0;
+    chg_queue(h, CHG_ZERO, &EMPTY_STUDENT_RECORD);
+    if (db_scan(fd, chg_snapshot, h) != NO_ERROR || h->chg.lost ||
+        pwrite(h->chg.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        rc = ERR_DB_FILE;
+    if (rc == NO_ERROR)
+        rc = chg_append(h);
+    if (rc == NO_ERROR && (fsync(h->chg.fd) == -1 || rename(CHG_TMP_FILE, CHG_FILE) == -1))
+        rc = ERR_DB_FILE;
+
+    if (rc != NO_ERROR) {
+        close(h->chg.fd);
+        unlink(CHG_TMP_FILE);
+        h->chg.fd = old_fd;
+        h->chg.len = 0;
+        h->chg.lost = false;
+        return rc;
+    }
+    if (old_fd >= 0)
+        chg_retire(old_fd);
+    return NO_ERROR;
+}
+
+/*
+ *  chg_start
+ *      fd:  linux file descriptor
+ *
+ *  Called when the database is opened.  With SDB_CHANGES=on creates the
+ *  stream of a database that has none, and starts a stream over that is
+ *  stale, see chg_stale().  The whole file is locked meanwhile: writers
+ *  add to the stream before they unlock, so none can be half done.
+ *  Processes that opened the database before the stream existed don't
+ *  add to it, it should be started before they are.  Followers of a
+ *  stream that started over replay its first group, which rebuilds their
+ *  replica.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int chg_start(int fd) {
+    db_handle_t *h = db_handle(fd);
+    char *env = getenv(SDB_ENV_CHANGES);
+    bool on = env != NULL && strcmp(env, "on") == 0;
+    int rc;
+
+    if (h == NULL || (h->chg.fd < 0 && !on) || (h->chg.fd >= 0 && !chg_stale(h)))
+        return NO_ERROR;
+    if (db_lock_file(fd, F_WRLCK) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    //another process may have created or replaced it first
+    if (h->chg.fd >= 0)
+        close(h->chg.fd);
+    rc = chg_open(h);
+    if (rc == NO_ERROR && (h->chg.fd < 0 || chg_stale(h)))
+        rc = chg_create(fd, h);
+    db_lock_file(fd, F_UNLCK);
+    return rc;
+}
+
+/*
+ *  chg_put
+ *      fd:    database file descriptor
+ *      recs:  students that were just stored
+ *      n:     number of students
+ */
+void chg_put(int fd, student_t **recs, int n) {
+    db_handle_t *h = db_handle(fd);
+
+    for (int i = 0; i < n; i++)
+        chg_queue(h, CHG_PUT, recs[i]);
+}
+
+/*
+ *  chg_del
+ *      fd:  database file descriptor
+ *      s:   the student that was just deleted
+ */
+void chg_del(int fd, student_t *s) {
+    chg_queue(db_handle(fd), CHG_DEL, s);
+}
+
+/*
+ *  chg_zero
+ *      fd:  database file descriptor, about to be emptied by -z
+ */
+void chg_zero(int fd) {
+    chg_begin(fd);
+    chg_queue(db_handle(fd), CHG_ZERO, &EMPTY_STUDENT_RECORD);
+}
+
+/*
+ *  chg_compress
+ *      fd:  database file descriptor, just compressed by -x
+ */
+void chg_compress(int fd) {
+    chg_begin(fd);
+    chg_queue(db_handle(fd), CHG_COMPRESS, &EMPTY_STUDENT_RECORD);
+}
+
+/*
+ *  follow_put
+ *      fd:  replica file descriptor
+ *      s:   student of a CHG_PUT entry
+ *
+ *  Adds the student, or writes it over the one with the same id.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_OP if the replica can't hold the
+ *            id, ERR_DB_FILE on an I/O error
+ */
+static int follow_put(int fd, student_t *s) {
+    student_t old;
+    off_t offset;
+    int rc;
+
+    if (validate_range(fd, s->id, s->gpa) != NO_ERROR) {
+        printf(M_ERR_STD_RNG);
+        return ERR_DB_OP;
+    }
+    if (db_lock_slots(fd, s->id, s->id) != NO_ERROR)
+        return ERR_DB_FILE;
+    rc = get_student(fd, s->id, &old);
+    if (rc != NO_ERROR && rc != SRCH_NOT_FOUND)
+        return ERR_DB_FILE;
+
+    db_seal(fd, s);
+    if (rc == NO_ERROR) {
+        offset = db_slot_offset(fd, s->id);
+        if (offset < 0 || db_write_record(fd, offset, s) != sizeof(student_t))
+            return ERR_DB_FILE;
+        index_del(fd, &old);
+    } else {
+        offset = db_slot_reserve(fd, 1) == NO_ERROR ? db_slot_alloc(fd, s->id, 1) : -1;
+        if (offset < 0 || db_write_record(fd, offset, s) != sizeof(student_t) ||
+            db_mark_slots(fd, &s->id, 1, true) != NO_ERROR)
+            return ERR_DB_FILE;
+    }
+
+    index_add(fd, &s, 1);
+    return NO_ERROR;
+}
+
+/*
+ *  follow_del
+ *      fd:  replica file descriptor
+ *      id:  id of a CHG_DEL entry
+ *
+ *  returns:  NO_ERROR if the student is gone, ERR_DB_FILE on an I/O error
+ */
+static int follow_del(int fd, int id) {
+    student_t old;
+    int rc;
+
+    if (db_lock_slots(fd, id, id) != NO_ERROR)
+        return ERR_DB_FILE;
+    rc = get_student(fd, id, &old);
+    if (rc == SRCH_NOT_FOUND)
+        return NO_ERROR;
+    if (rc != NO_ERROR)
+        return ERR_DB_FILE;
+
+    if (db_write_record(fd, db_slot_offset(fd, id), &EMPTY_STUDENT_RECORD) != sizeof(student_t) ||
+        db_mark_slots(fd, &id, 1, false) != NO_ERROR)
+        return ERR_DB_FILE;
+    index_del(fd, &old);
+    return NO_ERROR;
+}
+
+/*
+ *  follow_apply
+ *      fd:  pointer to the replica descriptor, -z and -x replace it
+ *      e:   complete groups of entries
+ *      n:   number of entries
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_OP or ERR_DB_FILE on the first
+ *            entry that could not be applied
+ */
+static int follow_apply(int *fd, chg_entry_t *e, int n) {
+    int rc = NO_ERROR;
+
+    for (int i = 0; i < n && rc == NO_ERROR; i++) {
+        switch (e[i].op) {
+        case CHG_PUT:
+            rc = follow_put(*fd, &e[i].rec);
+            break;
+        case CHG_DEL:
+            rc = follow_del(*fd, e[i].rec.id);
+            break;
+        case CHG_ZERO:
+            rc = zero_db(fd);
+            break;
+        case CHG_COMPRESS:
+            *fd = compress_db(*fd);
+            rc = *fd < 0 ? ERR_DB_FILE : NO_ERROR;
+            break;
+        }
+    }
+    return rc;
+}
+
+/*
+ *  follow_ready
+ *      e:  entries read from the stream
+ *      n:  number of entries
+ *
+ *  returns:  the number of entries up to the end of the last complete
+ *            group, entries after one that does not check out (a group
+ *            that is still being appended) are not counted
+ */
+static int follow_ready(chg_entry_t *e, int n) {
+    int ready = 0;
+
+    for (int i = 0; i < n; i++) {
+        uint32_t crc = e[i].crc;
+
+        e[i].crc = 0;
+        bool ok = crc32c(0, &e[i], sizeof(e[i])) == crc &&
+                  e[i].op >= CHG_PUT && e[i].op <= CHG_COMPRESS;
+        e[i].crc = crc;
+        if (!ok)
+            break;
+        if (e[i].flags & CHG_END)
+            ready = i + 1;
+    }
+    return ready;
+}
+
+/*
+ *  follow_load
+ *      sfd:     the follow state file
+ *      chg_fd:  the stream
+ *      fd:      the replica
+ *      st:      receives where to go on
+ *
+ *  A state written for another stream or another replica is not used,
+ *  the replica is then built again from the start of the stream.
+ */
+static void follow_load(int sfd, int chg_fd, int fd, follow_state_t *st) {
+    follow_state_t want = { .magic = FOLLOW_MAGIC, .offset = sizeof(chg_header_t) };
+
+    db_identity(chg_fd, &want.chg_ino, &want.chg_birth);
+    db_identity(fd, &want.db_ino, &want.db_birth);
+    if (pread(sfd, st, sizeof(*st), 0) != sizeof(*st) ||
+        memcmp(st, &want, offsetof(follow_state_t, offset)) != 0)
+        *st = want;
+}
+
+/*
+ *  follow_replaced
+ *      chg_fd:  the stream being followed, swapped for the new one
+ *      path:    where it was opened
+ *
+ *  returns:  true if path now names another stream, started over by the
+ *            primary
+ */
+static bool follow_replaced(int *chg_fd, char *path) {
+    uint64_t ino, birth, new_ino, new_birth;
+    chg_header_t hdr;
+    int new_fd = open(path, O_RDONLY);
+
+    if (new_fd == -1)
+        return false;
+    db_identity(*chg_fd, &ino, &birth);
+    db_identity(new_fd, &new_ino, &new_birth);
+    if ((new_ino == ino && new_birth == birth) ||
+        pread(new_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.magic != CHG_MAGIC || hdr.version != CHG_VERSION) {
+        close(new_fd);
+        return false;
+    }
+
+    close(*chg_fd);
+    *chg_fd = new_fd;
+    return true;
+}
+
+/*
+ *  follow_lost
+ *      chg_fd:  the stream being followed
+ *
+ *  returns:  true if the stream may lack a change, see chg_missing()
+ */
+static bool follow_lost(int chg_fd) {
+    chg_header_t hdr;
+    bool lost;
+
+    if (db_lock(chg_fd, F_RDLCK, 0, sizeof(hdr)) != NO_ERROR)
+        return false;
+    lost = pread(chg_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && chg_missing(chg_fd, &hdr);
+    db_lock(chg_fd, F_UNLCK, 0, sizeof(hdr));
+    return lost;
+}
+
+/*
+ *  handle_follow_signal
+ *      SIGINT/SIGTERM handler, --follow stops after the group it is at
+ */
+static void handle_follow_signal(int sig) {
+    (void)sig;
+    follow_stop = 1;
+}
+
+/*
+ *  follow_changes
+ *      fd:    pointer to the replica descriptor, the database in the
+ *             current directory
+ *      path:  the change stream of the primary
+ *      once:  stop once everything in the stream is applied
+ *
+ *  --follow.  Reads the stream from where the replica left off and
+ *  applies every complete group, a batch of groups per commit of the
+ *  replica.  The position is saved in FOLLOW_FILE after each commit.
+ *  Without once it then waits for more, looking every CHG_POLL_MS, until
+ *  it gets SIGINT or SIGTERM.  When the primary starts the stream over,
+ *  the follower moves to the new one and replays it from the start.
+ *
+ *  returns:  EXIT_OK, EXIT_FAIL_ARGS if path is not a change stream, or
+ *            EXIT_FAIL_DB, also when once finds the stream lacks a change
+ *
+ *  console:  M_CHG_LOST once if the stream lacks a change, M_CHG_APPLIED
+ *            when it stops
+ */
+int follow_changes(int *fd, char *path, bool once) {
+    struct sigaction sa = {0};
+    chg_header_t hdr;
+    follow_state_t st;
+    chg_entry_t *buf;
+    int cap = CHG_READ_ENTRIES;
+    int applied = 0;
+    bool warned = false;
+    int rc = NO_ERROR;
+    int chg_fd, sfd;
+
+    chg_fd = open(path, O_RDONLY);
+    if (chg_fd == -1) {
+        printf(M_ERR_CHG_OPEN, path);
+        return EXIT_FAIL_ARGS;
+    }
+    if (pread(chg_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.magic != CHG_MAGIC || hdr.version != CHG_VERSION) {
+        printf(M_ERR_CHG_STREAM, path);
+        close(chg_fd);
+        return EXIT_FAIL_ARGS;
+    }
+
+    sfd = open(FOLLOW_FILE, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    buf = malloc(cap * sizeof(chg_entry_t));
+    if (sfd == -1 || buf == NULL) {
+        printf(M_ERR_DB_OPEN);
+        rc = ERR_DB_FILE;
+    } else {
+        follow_load(sfd, chg_fd, *fd, &st);
+    }
+
+    sa.sa_handler = handle_follow_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (rc == NO_ERROR && !follow_stop) {
+        ssize_t got = pread(chg_fd, buf, cap * sizeof(chg_entry_t), st.offset);
+        if (got == -1) {
+            printf(M_ERR_CHG_OPEN, path);
+            rc = ERR_DB_FILE;
+            break;
+        }
+
+        int n = follow_ready(buf, got / sizeof(chg_entry_t));
+        if (n == 0 && got == (ssize_t)(cap * sizeof(chg_entry_t))) {
+            //one group bigger than the buffer
+            chg_entry_t *grown = realloc(buf, cap * 2 * sizeof(chg_entry_t));
+            if (grown == NULL) {
+                rc = ERR_DB_FILE;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+            continue;
+        }
+        if (n == 0) {
+            if (follow_replaced(&chg_fd, path)) {
+                follow_load(sfd, chg_fd, *fd, &st);
+                warned = false;
+                continue;
+            }
+            if (follow_lost(chg_fd)) {
+                if (!warned)
+                    printf(M_CHG_LOST, path);
+                warned = true;
+                if (once) {
+                    rc = ERR_DB_FILE;
+                    break;
+                }
+            }
+            if (once)
+                break;
+            poll(NULL, 0, CHG_POLL_MS);
+            continue;
+        }
+
+        rc = follow_apply(fd, buf, n);
+        if (rc == NO_ERROR && db_commit(*fd) != NO_ERROR) {
+            printf(M_ERR_DB_WRITE);
+            rc = ERR_DB_FILE;
+        }
+        if (rc != NO_ERROR)
+            break;
+
+        //-z and -x may have given the replica a new identity
+        st.offset += n * sizeof(chg_entry_t);
+        st.time = buf[n - 1].time;
+        db_identity(*fd, &st.db_ino, &st.db_birth);
+        if (pwrite(sfd, &st, sizeof(st), 0) != sizeof(st)) {
+            printf(M_ERR_DB_WRITE);
+            rc = ERR_DB_FILE;
+        }
+        applied += n;
+    }
+
+    free(buf);
+    if (sfd != -1)
+        close(sfd);
+    close(chg_fd);
+    printf(M_CHG_APPLIED, applied);
+    return rc == NO_ERROR ? EXIT_OK : rc == ERR_DB_OP ? EXIT_FAIL_ARGS : EXIT_FAIL_DB;
+}
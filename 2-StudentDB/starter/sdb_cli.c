@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  connect_db_server
+ *      sock_path:  file system path of the server's unix domain socket
+ *
+ *  returns:  connected socket, or ERR_SDB_COMM if no server is listening
+ */
+int connect_db_server(char *sock_path) {
+    struct sockaddr_un addr = {0};
+    int cli_socket;
+
+    if (strlen(sock_path) >= sizeof(addr.sun_path))
+        return ERR_SDB_COMM;
+
+    cli_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (cli_socket == -1)
+        return ERR_SDB_COMM;
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock_path);
+    if (connect(cli_socket, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(cli_socket);
+        return ERR_SDB_COMM;
+    }
+
+    return cli_socket;
+}
+
+/*
+ *  exec_remote_command
+ *      sock_path:  file system path of the server's unix domain socket
+ *      argc/argv:  the command line exactly as given to sdbsc
+ *
+ *  Thin client mode.  The arguments after argv[0] are packed as NUL
+ *  terminated strings behind an sdb_req_hdr_t and sent to the server.
+ *  The text the server sends back is written to stdout unchanged so the
+ *  output matches running the command locally.  File names given to -b
+ *  are made absolute since the server may run in another directory.
+ *
+ *  returns:  the exit code of the remote operation, or EXIT_FAIL_DB if
+ *            the server could not be reached
+ */
+int exec_remote_command(char *sock_path, int argc, char *argv[]) {
+    static char args[SDB_REQ_MAX_LEN];
+    char path[PATH_MAX];
+    sdb_req_hdr_t req = {0};
+    sdb_rsp_hdr_t rsp;
+    char buff[SDB_RSP_BUFF_SZ];
+    size_t len = 0;
+    int cli_socket;
+
+    if (argc - 1 > SDB_REQ_MAX_ARGS) {
+        usage(argv[0]);
+        return EXIT_FAIL_ARGS;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+
+        if (i == 2 && (strcmp(argv[1], "-b") == 0 || strcmp(argv[1], "-U") == 0 ||
+                       strcmp(argv[1], "-t") == 0)) {
+            if (strcmp(arg, "-") == 0) {
+                printf(M_ERR_SVR_STDIN);
+                return EXIT_FAIL_ARGS;
+            }
+            if (realpath(arg, path) != NULL)
+                arg = path;
+        }
+
+        size_t n = strlen(arg) + 1;
+        if (len + n > sizeof(args)) {
+            usage(argv[0]);
+            return EXIT_FAIL_ARGS;
+        }
+        memcpy(args + len, arg, n);
+        len += n;
+    }
+
+    req.magic = SDB_PROTO_MAGIC;
+    req.argc = argc - 1;
+    req.len = len;
+
+    cli_socket = connect_db_server(sock_path);
+    if (cli_socket < 0) {
+        printf(M_ERR_SVR_CONNECT, sock_path);
+        return EXIT_FAIL_DB;
+    }
+
+    if (send_all(cli_socket, &req, sizeof(req)) != NO_ERROR ||
+        send_all(cli_socket, args, len) != NO_ERROR ||
+        recv_all(cli_socket, &rsp, sizeof(rsp)) != NO_ERROR) {
+        printf(M_ERR_SVR_COMM, sock_path);
+        close(cli_socket);
+        return EXIT_FAIL_DB;
+    }
+
+    while (rsp.len > 0) {
+        size_t chunk = rsp.len < sizeof(buff) ? rsp.len : sizeof(buff);
+
+        if (recv_all(cli_socket, buff, chunk) != NO_ERROR) {
+            printf(M_ERR_SVR_COMM, sock_path);
+            close(cli_socket);
+            return EXIT_FAIL_DB;
+        }
+        fwrite(buff, 1, chunk, stdout);
+        rsp.len -= chunk;
+    }
+
+    close(cli_socket);
+    return rsp.exit_code;
+}
@@ -0,0 +1,466 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//The column file (layout in db.h) is a shadow copy of the id, gpa and last
+//name of every student.  Like the secondary indexes it is created the
+//first time a scan can use it and from then on the index_*() hooks keep it
+//in step with the database, together with the gpa aggregates in its
+//header.
+
+/*
+ *  col_offset
+ *      column:  COL_ID, COL_GPA or COL_LNAME
+ *      id:      student id
+ *
+ *  returns:  the file offset of the entry for id in the column
+ */
+static off_t col_offset(int column, int id) {
+    return COL_DATA_OFFSET + (off_t)column * COL_ARRAY_BYTES + (off_t)id * sizeof(int32_t);
+}
+
+/*
+ *  col_owner
+ *      fd:     database file descriptor
+ *      owner:  filled in with what the column file header should contain
+ */
+static void col_owner(int fd, col_header_t *owner) {
+    memset(owner, 0, sizeof(*owner));
+    owner->magic = COL_MAGIC;
+    owner->version = COL_VERSION;
+    db_identity(fd, &owner->db_ino, &owner->db_birth);
+}
+
+/*
+ *  col_agg_bounds
+ *      agg:  aggregates with an up to date histogram
+ *
+ *  Sets gpa_min and gpa_max from the histogram, a walk over at most
+ *  COL_GPA_BUCKETS buckets whatever the number of students.
+ */
+void col_agg_bounds(col_agg_t *agg) {
+    agg->gpa_min = agg->gpa_max = -1;
+    for (int gpa = MIN_STD_GPA; gpa <= MAX_STD_GPA; gpa++) {
+        if (agg->gpa_hist[gpa] == 0)
+            continue;
+        if (agg->gpa_min < 0)
+            agg->gpa_min = gpa;
+        agg->gpa_max = gpa;
+    }
+}
+
+/*
+ *  col_agg_add
+ *      agg:  aggregates to adjust
+ *      gpa:  gpa of a student
+ *      add:  true to count the student in, false to take it out
+ */
+void col_agg_add(col_agg_t *agg, int gpa, bool add) {
+    if (gpa < MIN_STD_GPA || gpa > MAX_STD_GPA)
+        return;
+
+    if (add) {
+        agg->gpa_hist[gpa]++;
+        agg->gpa_sum += gpa;
+        if (agg->gpa_min < 0 || gpa < agg->gpa_min)
+            agg->gpa_min = gpa;
+        if (gpa > agg->gpa_max)
+            agg->gpa_max = gpa;
+        return;
+    }
+
+    if (agg->gpa_hist[gpa] == 0)
+        return;
+    agg->gpa_hist[gpa]--;
+    agg->gpa_sum -= gpa;
+    //only emptying the bucket of a bound moves it
+    if (agg->gpa_hist[gpa] == 0 && (gpa == agg->gpa_min || gpa == agg->gpa_max))
+        col_agg_bounds(agg);
+}
+
+//arrays gathered by col_collect() while building the file
+typedef struct col_build_state {
+    int32_t *cols[COL_ARRAYS];
+    uint32_t count;
+    col_agg_t agg;
+} col_build_state_t;
+
+/*
+ *  col_collect
+ *      db_scan() callback that fills the in memory columns
+ */
+static int col_collect(student_t *recs, int n, void *arg) {
+    col_build_state_t *st = arg;
+
+    for (int i = 0; i < n; i++) {
+        int id = recs[i].id;
+
+        if (id < MIN_STD_ID || id > MAX_STD_ID || st->cols[COL_ID][id] != 0)
+            continue;
+        st->cols[COL_ID][id] = id;
+        st->cols[COL_GPA][id] = recs[i].gpa;
+        st->cols[COL_LNAME][id] = name_hash(recs[i].lname, sizeof(recs[i].lname));
+        st->count++;
+        col_agg_add(&st->agg, recs[i].gpa, true);
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  col_build
+ *      fd:   database file descriptor
+ *      cfd:  column file descriptor
+ *
+ *  Fills the column file from scratch with one scan of the database.  The
+ *  arrays are written only up to the highest id in use, the rest of each
+ *  one stays a hole.  The scan runs before the column file is locked so
+ *  the lock order of db_lock() holds.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int col_build(int fd, int cfd) {
+    col_build_state_t st = {0};
+    col_header_t hdr;
+    int rc = NO_ERROR;
+    int top = 0;
+
+    st.agg.gpa_min = st.agg.gpa_max = -1;
+    for (int c = 0; c < COL_ARRAYS; c++) {
+        st.cols[c] = calloc(COL_SLOTS, sizeof(int32_t));
+        if (st.cols[c] == NULL)
+            rc = ERR_DB_FILE;
+    }
+    if (rc == NO_ERROR)
+        rc = db_scan(fd, col_collect, &st);
+    if (rc == NO_ERROR && db_lock(cfd, F_WRLCK, 0, 0) != NO_ERROR)
+        rc = ERR_DB_FILE;
+
+    if (rc == NO_ERROR) {
+        for (int id = COL_SLOTS - 1; id > 0 && top == 0; id--) {
+            if (st.cols[COL_ID][id] != 0)
+                top = id + 1;
+        }
+
+        col_owner(fd, &hdr);
+        hdr.count = st.count;
+        hdr.agg = st.agg;
+        if (ftruncate(cfd, 0) == -1 ||
+            ftruncate(cfd, col_offset(COL_ARRAYS, 0)) == -1)
+            rc = ERR_DB_FILE;
+        for (int c = 0; c < COL_ARRAYS && rc == NO_ERROR; c++) {
+            ssize_t len = top * sizeof(int32_t);
+            if (pwrite(cfd, st.cols[c], len, col_offset(c, 0)) != len)
+                rc = ERR_DB_FILE;
+        }
+        //the header goes last, a half built file is never trusted
+        if (rc == NO_ERROR && pwrite(cfd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            rc = ERR_DB_FILE;
+        db_lock(cfd, F_UNLCK, 0, 0);
+    }
+
+    for (int c = 0; c < COL_ARRAYS; c++)
+        free(st.cols[c]);
+    return rc == NO_ERROR ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  col_drop
+ *      h:  database handle
+ *
+ *  Used when the column file could not be updated.  The next scan that
+ *  wants it builds a fresh one.
+ */
+static void col_drop(db_handle_t *h) {
+    if (h->col_fd >= 0)
+        close(h->col_fd);
+    h->col_fd = -1;
+    unlink(COL_FILE);
+}
+
+/*
+ *  col_open
+ *      fd:     database file descriptor
+ *      build:  create and fill the column file if there is no usable one
+ *
+ *  Works like index_open(): the file is opened the first time it is
+ *  needed and stays open until close_db() or until another process
+ *  deletes it.  Without build a missing or stale file is reported as
+ *  absent, and looked for again on the next call.
+ *
+ *  returns:  column file descriptor, or -1 if there is no usable file
+ */
+int col_open(int fd, bool build) {
+    db_handle_t *h = db_handle(fd);
+    col_header_t owner, hdr;
+    bool fresh;
+    int cfd;
+
+    //the arrays are indexed by id, they can't cover a hashed file
+    if (h == NULL || h->format == DB_FORMAT_HASHED)
+        return -1;
+    if (h->col_fd >= 0 && !db_file_gone(h->col_fd))
+        return h->col_fd;
+    if (h->col_fd >= 0)
+        close(h->col_fd);
+    h->col_fd = -1;
+
+    cfd = open(COL_FILE, O_RDWR | (build ? O_CREAT : 0), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (cfd == -1)
+        return -1;
+
+    col_owner(fd, &owner);
+    if (db_lock(cfd, F_RDLCK, 0, sizeof(hdr)) != NO_ERROR) {
+        close(cfd);
+        return -1;
+    }
+    fresh = pread(cfd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            memcmp(&hdr.magic, &owner.magic, sizeof(hdr.magic) + sizeof(hdr.version)) != 0 ||
+            hdr.db_ino != owner.db_ino || hdr.db_birth != owner.db_birth;
+    db_lock(cfd, F_UNLCK, 0, 0);
+
+    if (fresh && (!build || col_build(fd, cfd) != NO_ERROR)) {
+        close(cfd);
+        unlink(COL_FILE);
+        return -1;
+    }
+
+    h->col_fd = cfd;
+    return cfd;
+}
+
+/*
+ *  col_close
+ *      h:  database handle being closed
+ */
+void col_close(db_handle_t *h) {
+    if (h->col_fd >= 0)
+        close(h->col_fd);
+    h->col_fd = -1;
+}
+
+/*
+ *  col_update
+ *      cfd:    column file descriptor, locked
+ *      s:      student to store, or to clear when add is false
+ *      add:    true for a student that was just stored
+ *      agg:    aggregates adjusted by the change
+ *      delta:  adjusted by the change in the number of ids
+ *
+ *  The gpa the column held for the id is what is taken out of the
+ *  aggregates, an update takes out the old gpa and adds the new one.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int col_update(int cfd, student_t *s, bool add, col_agg_t *agg, int *delta) {
+    int32_t id, old_gpa;
+
+    if (s->id < MIN_STD_ID || s->id > MAX_STD_ID)
+        return NO_ERROR;
+    if (pread(cfd, &id, sizeof(id), col_offset(COL_ID, s->id)) != sizeof(id))
+        id = 0;
+    if (id != 0) {
+        if (pread(cfd, &old_gpa, sizeof(old_gpa), col_offset(COL_GPA, s->id)) != sizeof(old_gpa))
+            return ERR_DB_FILE;
+        col_agg_add(agg, old_gpa, false);
+    }
+
+    if (!add) {
+        if (id == 0)
+            return NO_ERROR;
+        id = 0;
+        (*delta)--;
+        return pwrite(cfd, &id, sizeof(id), col_offset(COL_ID, s->id)) == sizeof(id) ?
+               NO_ERROR : ERR_DB_FILE;
+    }
+
+    int32_t gpa = s->gpa;
+    int32_t lname = name_hash(s->lname, sizeof(s->lname));
+    if (pwrite(cfd, &gpa, sizeof(gpa), col_offset(COL_GPA, s->id)) != sizeof(gpa) ||
+        pwrite(cfd, &lname, sizeof(lname), col_offset(COL_LNAME, s->id)) != sizeof(lname))
+        return ERR_DB_FILE;
+    col_agg_add(agg, gpa, true);
+
+    //the id goes last, it is what makes the entry visible to scans
+    if (id == 0)
+        (*delta)++;
+    id = s->id;
+    return pwrite(cfd, &id, sizeof(id), col_offset(COL_ID, s->id)) == sizeof(id) ?
+           NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  col_apply
+ *      fd:    database file descriptor
+ *      recs:  students that changed
+ *      n:     number of students
+ *      add:   true if they were stored, false if deleted
+ *
+ *  Brings an existing column file and its aggregates up to date, it is
+ *  dropped if that fails.  The aggregates are read and written once per
+ *  call whatever the number of students.
+ */
+static void col_apply(int fd, student_t **recs, int n, bool add) {
+    db_handle_t *h = db_handle(fd);
+    int cfd = col_open(fd, false);
+    off_t agg_off = offsetof(col_header_t, agg);
+    col_agg_t agg;
+    uint32_t count;
+    int delta = 0;
+    int rc = NO_ERROR;
+
+    if (cfd < 0 || n == 0)
+        return;
+    if (db_lock(cfd, F_WRLCK, 0, 0) != NO_ERROR) {
+        col_drop(h);
+        return;
+    }
+
+    if (pread(cfd, &agg, sizeof(agg), agg_off) != sizeof(agg))
+        rc = ERR_DB_FILE;
+    for (int i = 0; i < n && rc == NO_ERROR; i++)
+        rc = col_update(cfd, recs[i], add, &agg, &delta);
+    if (rc == NO_ERROR && pwrite(cfd, &agg, sizeof(agg), agg_off) != sizeof(agg))
+        rc = ERR_DB_FILE;
+
+    off_t count_off = offsetof(col_header_t, count);
+    if (rc == NO_ERROR && delta != 0) {
+        if (pread(cfd, &count, sizeof(count), count_off) != sizeof(count))
+            rc = ERR_DB_FILE;
+        count += delta;
+        if (rc == NO_ERROR && pwrite(cfd, &count, sizeof(count), count_off) != sizeof(count))
+            rc = ERR_DB_FILE;
+    }
+
+    db_lock(cfd, F_UNLCK, 0, 0);
+    if (rc != NO_ERROR)
+        col_drop(h);
+}
+
+/*
+ *  col_add
+ *      fd:    database file descriptor
+ *      recs:  students that were just stored
+ *      n:     number of students
+ */
+void col_add(int fd, student_t **recs, int n) {
+    col_apply(fd, recs, n, true);
+}
+
+/*
+ *  col_del
+ *      fd:  database file descriptor
+ *      s:   the student that was just deleted
+ */
+void col_del(int fd, student_t *s) {
+    col_apply(fd, &s, 1, false);
+}
+
+/*
+ *  col_rebuild
+ *      fd:  database file descriptor
+ *
+ *  Rebuilds an existing column file after the database was rewritten (-x)
+ *  or emptied (-z).
+ */
+void col_rebuild(int fd) {
+    db_handle_t *h = db_handle(fd);
+    int cfd = col_open(fd, false);
+
+    if (cfd >= 0 && col_build(fd, cfd) != NO_ERROR)
+        col_drop(h);
+}
+
+/*
+ *  col_discard
+ *      fd:  database file descriptor
+ *
+ *  Drops an existing column file, see index_discard().
+ */
+void col_discard(int fd) {
+    if (col_open(fd, false) >= 0)
+        col_drop(db_handle(fd));
+}
+
+/*
+ *  col_count
+ *      fd:  database file descriptor
+ *
+ *  returns:  the number of students according to an existing column file
+ *            ERR_DB_OP      there is no usable column file
+ */
+int col_count(int fd) {
+    int cfd = col_open(fd, false);
+    uint32_t count;
+
+    if (cfd < 0)
+        return ERR_DB_OP;
+    if (db_lock(cfd, F_RDLCK, 0, 0) != NO_ERROR)
+        return ERR_DB_OP;
+    ssize_t got = pread(cfd, &count, sizeof(count), offsetof(col_header_t, count));
+    db_lock(cfd, F_UNLCK, 0, 0);
+
+    return got == sizeof(count) ? (int)count : ERR_DB_OP;
+}
+
+/*
+ *  col_aggregate
+ *      fd:     database file descriptor
+ *      count:  filled in with the number of students
+ *      agg:    filled in with the aggregates of their gpa
+ *
+ *  Builds the column file when there is none yet, from then on reading
+ *  the aggregates costs one read of the header.
+ *
+ *  returns:  NO_ERROR on success
+ *            ERR_DB_OP      there is no usable column file
+ */
+int col_aggregate(int fd, uint32_t *count, col_agg_t *agg) {
+    int cfd = col_open(fd, true);
+    col_header_t hdr;
+
+    if (cfd < 0)
+        return ERR_DB_OP;
+    if (db_lock(cfd, F_RDLCK, 0, 0) != NO_ERROR)
+        return ERR_DB_OP;
+    ssize_t got = pread(cfd, &hdr, sizeof(hdr), 0);
+    db_lock(cfd, F_UNLCK, 0, 0);
+    if (got != sizeof(hdr))
+        return ERR_DB_OP;
+
+    *count = hdr.count;
+    *agg = hdr.agg;
+    return NO_ERROR;
+}
+
+/*
+ *  col_read
+ *      cfd:     column file descriptor
+ *      column:  COL_ID, COL_GPA or COL_LNAME
+ *      first:   first id wanted
+ *      n:       number of entries
+ *      buff:    where the entries go
+ *
+ *  Entries past the end of the file read as 0.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on a read error
+ */
+int col_read(int cfd, int column, int first, int n, int32_t *buff) {
+    ssize_t len = n * sizeof(int32_t);
+    ssize_t got = pread(cfd, buff, len, col_offset(column, first));
+
+    if (got == -1)
+        return ERR_DB_FILE;
+    if (got < len)
+        memset((char *)buff + got, 0, len - got);
+    return NO_ERROR;
+}
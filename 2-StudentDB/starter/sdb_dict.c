@@ -0,0 +1,516 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//Dictionary format (layout in db.h).  A record costs 16 bytes and a name
+//that some other student already has costs nothing more, and scans read
+//the compact records plus the heap of distinct names once.  Everything
+//goes through db_read_at() and db_write_at() so every engine and the
+//write-ahead log work unchanged.  One writer at a time changes records:
+//the heap length in the header stays locked until the command commits.
+//Readers follow the chains without a lock, a name is always written
+//before the bucket points at it.
+
+#define HEAP_LEN_OFF    offsetof(db_header_t, heap_units)
+
+/*
+ *  bucket_offset
+ *      name:  first or last name as stored in a student_t
+ *      max:   size of the field
+ *
+ *  returns:  file offset of the bucket the name is chained from
+ */
+static off_t bucket_offset(const char *name, size_t max) {
+    return DB_DICT_BUCKET_OFFSET + (off_t)(name_hash(name, max) % DB_DICT_BUCKETS) * sizeof(uint32_t);
+}
+
+/*
+ *  dict_entry
+ *      fd:    database or snapshot descriptor
+ *      ref:   reference of a name, not 0
+ *      str:   receives the header of the name
+ *      text:  receives its characters, room for DB_DICT_NAME_MAX
+ *
+ *  returns:  NO_ERROR, or ERR_DB_FILE on a read error or a reference
+ *            past the end of the heap
+ */
+static int dict_entry(int fd, uint32_t ref, dict_str_t *str, char *text) {
+    char buff[sizeof(dict_str_t) + DB_DICT_NAME_MAX];
+    ssize_t got = db_read_at(fd, DB_DICT_HEAP_OFFSET + ref - 1, buff, sizeof(buff));
+
+    if (got < (ssize_t)sizeof(dict_str_t))
+        return ERR_DB_FILE;
+    memcpy(str, buff, sizeof(*str));
+    if (got < (ssize_t)(sizeof(*str) + str->len))
+        return ERR_DB_FILE;
+    memcpy(text, buff + sizeof(*str), str->len);
+    return NO_ERROR;
+}
+
+/*
+ *  dict_find
+ *      fd:    linux file descriptor
+ *      ref:   newest name of the chain, 0 if the chain is empty
+ *      name:  the name looked for
+ *      len:   its length
+ *
+ *  returns:  reference of the name, 0 if it is not in the chain, or
+ *            ERR_DB_FILE
+ */
+static int64_t dict_find(int fd, uint32_t ref, const char *name, size_t len) {
+    char text[DB_DICT_NAME_MAX];
+    dict_str_t str;
+
+    for (; ref != 0; ref = str.next) {
+        if (dict_entry(fd, ref, &str, text) != NO_ERROR)
+            return ERR_DB_FILE;
+        if (str.len == len && memcmp(text, name, len) == 0)
+            return ref;
+    }
+    return 0;
+}
+
+/*
+ *  dict_intern
+ *      fd:    linux file descriptor, the heap is locked
+ *      name:  first or last name as stored in a student_t
+ *      max:   size of the field
+ *      ref:   set to the reference of the name
+ *
+ *  Looks the name up and adds it to the heap if it is not there yet.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int dict_intern(int fd, const char *name, size_t max, uint32_t *ref) {
+    char buff[sizeof(dict_str_t) + DB_DICT_NAME_MAX];
+    size_t len = strnlen(name, max - 1);
+    off_t bucket = bucket_offset(name, max);
+    dict_str_t str;
+    uint32_t heap_len;
+    int64_t found;
+
+    *ref = 0;
+    if (len == 0)
+        return NO_ERROR;
+
+    //a bucket past the end of the file has never been used
+    str.next = 0;
+    if (db_read_at(fd, bucket, &str.next, sizeof(str.next)) == -1)
+        return ERR_DB_FILE;
+    found = dict_find(fd, str.next, name, len);
+    if (found != 0) {
+        *ref = found;
+        return found < 0 ? ERR_DB_FILE : NO_ERROR;
+    }
+
+    if (db_read_at(fd, HEAP_LEN_OFF, &heap_len, sizeof(heap_len)) != sizeof(heap_len))
+        return ERR_DB_FILE;
+    str.len = len;
+    memcpy(buff, &str, sizeof(str));
+    memcpy(buff + sizeof(str), name, len);
+
+    ssize_t entry = sizeof(str) + len;
+    *ref = heap_len + 1;
+    heap_len += entry;
+    if (db_write_at(fd, DB_DICT_HEAP_OFFSET + *ref - 1, buff, entry) != entry ||
+        db_write_at(fd, bucket, ref, sizeof(*ref)) != sizeof(*ref) ||
+        db_write_at(fd, HEAP_LEN_OFF, &heap_len, sizeof(heap_len)) != sizeof(heap_len))
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  dict_name
+ *      fd:     linux file descriptor
+ *      ref:    reference of the name, 0 for the empty name
+ *      field:  first or last name of a zeroed student_t
+ *      max:    size of the field, longer names are truncated
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int dict_name(int fd, uint32_t ref, char *field, size_t max) {
+    char text[DB_DICT_NAME_MAX];
+    dict_str_t str;
+
+    if (ref == 0)
+        return NO_ERROR;
+    if (dict_entry(fd, ref, &str, text) != NO_ERROR)
+        return ERR_DB_FILE;
+    memcpy(field, text, str.len < max - 1 ? str.len : max - 1);
+    return NO_ERROR;
+}
+
+/*
+ *  dict_read
+ *      fd:      linux file descriptor of a dictionary database
+ *      offset:  file offset of the slot, see db_slot_offset()
+ *      s:       receives the student, with its names looked up
+ *
+ *  returns:  sizeof(student_t), 0 if the slot is past the end of the
+ *            file, or -1 on an I/O error, like db_read_at() of a student_t
+ */
+ssize_t dict_read(int fd, off_t offset, student_t *s) {
+    dict_rec_t rec;
+    ssize_t got = db_read_at(fd, offset, &rec, sizeof(rec));
+
+    if (got != sizeof(rec))
+        return got == -1 ? -1 : 0;
+
+    memset(s, 0, sizeof(*s));
+    s->id = rec.id;
+    s->gpa = rec.gpa;
+    if (rec.id != 0 && (dict_name(fd, rec.fname, s->fname, sizeof(s->fname)) != NO_ERROR ||
+                        dict_name(fd, rec.lname, s->lname, sizeof(s->lname)) != NO_ERROR))
+        return -1;
+    return sizeof(student_t);
+}
+
+/*
+ *  dict_write
+ *      fd:      linux file descriptor of a dictionary database
+ *      offset:  file offset of the slot, see db_slot_offset()
+ *      s:       student to store, id 0 empties the slot
+ *
+ *  returns:  sizeof(student_t) on success or -1, like db_write_at() of a
+ *            student_t
+ */
+ssize_t dict_write(int fd, off_t offset, const student_t *s) {
+    dict_rec_t rec = {0};
+
+    //taken even when no name is added: a writer always holds the heap
+    //before it locks the bitmap in db_mark_slots()
+    if (db_lock(fd, F_WRLCK, HEAP_LEN_OFF, sizeof(uint32_t)) != NO_ERROR)
+        return -1;
+    if (s->id != 0) {
+        rec.id = s->id;
+        rec.gpa = s->gpa;
+        if (dict_intern(fd, s->fname, sizeof(s->fname), &rec.fname) != NO_ERROR ||
+            dict_intern(fd, s->lname, sizeof(s->lname), &rec.lname) != NO_ERROR)
+            return -1;
+    }
+    return db_write_at(fd, offset, &rec, sizeof(rec)) == sizeof(rec) ? (ssize_t)sizeof(student_t) : -1;
+}
+
+/*
+ *  heap_name
+ *      heap:   the string heap read into memory
+ *      len:    bytes of it in use
+ *      ref:    reference of the name, 0 for the empty name
+ *      field:  first or last name of a zeroed student_t
+ *      max:    size of the field
+ *
+ *  returns:  NO_ERROR, or ERR_DB_FILE if ref points past the heap
+ */
+static int heap_name(const char *heap, uint32_t len, uint32_t ref, char *field, size_t max) {
+    dict_str_t str;
+
+    if (ref == 0)
+        return NO_ERROR;
+    if (ref - 1 + sizeof(str) > len)
+        return ERR_DB_FILE;
+    memcpy(&str, heap + ref - 1, sizeof(str));
+    if (ref - 1 + sizeof(str) + str.len > len)
+        return ERR_DB_FILE;
+    memcpy(field, heap + ref - 1 + sizeof(str), str.len < max - 1 ? str.len : max - 1);
+    return NO_ERROR;
+}
+
+/*
+ *  dict_scan
+ *      fd:     linux file descriptor of a dictionary database
+ *      src:    where the records are read, fd or a snapshot of it
+ *      first:  first id to visit
+ *      last:   id just past the last one
+ *      fn:     callback invoked with blocks of records
+ *      arg:    passed through to fn
+ *
+ *  db_scan() for dictionary files, db_scan_parallel() gives every thread
+ *  its own range of ids.  The heap is read into memory once, then the
+ *  compact records are read DB_SCAN_BLOCK / sizeof(student_t) at a time
+ *  and the live ones handed to fn as student_t with their names filled
+ *  in.  Ranges the bitmap says are empty are not read at all.  The caller
+ *  holds the file lock or took the snapshot.
+ *
+ *  returns:  NO_ERROR, ERR_DB_FILE or the negative value returned by fn
+ */
+int dict_scan(int fd, int src, int first, int last, db_scan_fn fn, void *arg) {
+    db_handle_t *h = db_handle(fd);
+    int max = DB_SCAN_BLOCK / sizeof(student_t);
+    dict_rec_t recs[DB_SCAN_BLOCK / sizeof(student_t)];
+    size_t bits_len = last > first ? (last - 1) / 8 - first / 8 + 1 : 0;
+    uint8_t *bits = calloc(bits_len + 1, 1);
+    student_t *block = malloc(DB_SCAN_BLOCK);
+    char *heap = NULL;
+    uint32_t heap_len = 0;
+    int rc = NO_ERROR;
+    int n = 0;
+
+    if (bits == NULL || block == NULL ||
+        db_read_at(src, HEAP_LEN_OFF, &heap_len, sizeof(heap_len)) != sizeof(heap_len) ||
+        db_read_at(src, h->bitmap_off + first / 8, bits, bits_len) == -1)
+        rc = ERR_DB_FILE;
+    if (rc == NO_ERROR) {
+        heap = malloc(heap_len + 1);
+        if (heap == NULL || db_read_at(src, DB_DICT_HEAP_OFFSET, heap, heap_len) != heap_len)
+            rc = ERR_DB_FILE;
+    }
+
+    for (int id = first; rc >= 0 && id < last; id += max) {
+        int cnt = last - id < max ? last - id : max;
+        bool any = false;
+
+        for (int b = id / 8; b <= (id + cnt - 1) / 8 && !any; b++)
+            any = bits[b - first / 8] != 0;
+        if (!any)
+            continue;
+
+        ssize_t got = db_read_at(src, h->data_off + (off_t)id * sizeof(dict_rec_t), recs,
+                                 cnt * sizeof(dict_rec_t));
+        if (got == -1) {
+            rc = ERR_DB_FILE;
+            break;
+        }
+
+        for (int i = 0; i < got / (ssize_t)sizeof(dict_rec_t) && rc >= 0; i++) {
+            if (recs[i].id == 0)
+                continue;
+            if (n == max) {
+                stats_add(STAT_SCANNED, n);
+                rc = fn(block, n, arg);
+                n = 0;
+                if (rc < 0)
+                    break;
+            }
+
+            student_t *s = &block[n++];
+            memset(s, 0, sizeof(*s));
+            s->id = recs[i].id;
+            s->gpa = recs[i].gpa;
+            if (heap_name(heap, heap_len, recs[i].fname, s->fname, sizeof(s->fname)) != NO_ERROR ||
+                heap_name(heap, heap_len, recs[i].lname, s->lname, sizeof(s->lname)) != NO_ERROR)
+                rc = ERR_DB_FILE;
+        }
+    }
+
+    if (rc >= 0 && n > 0) {
+        stats_add(STAT_SCANNED, n);
+        rc = fn(block, n, arg);
+    }
+
+    free(heap);
+    free(block);
+    free(bits);
+    return rc;
+}
+
+//the new file as dict_pack() builds it in memory
+typedef struct dict_pack_state {
+    uint8_t *bitmap;
+    dict_rec_t *recs;
+    uint32_t *buckets;
+    char *heap;
+    uint32_t heap_len, heap_size;
+    uint32_t count;
+    int max_id;
+} dict_pack_state_t;
+
+/*
+ *  pack_intern
+ *      st:    state of the new file
+ *      name:  first or last name as stored in a student_t
+ *      max:   size of the field
+ *      ref:   set to the reference of the name in the new heap
+ *
+ *  dict_intern() for the heap being built in memory.
+ *
+ *  returns:  NO_ERROR, or ERR_DB_FILE if out of memory
+ */
+static int pack_intern(dict_pack_state_t *st, const char *name, size_t max, uint32_t *ref) {
+    size_t len = strnlen(name, max - 1);
+    uint32_t *bucket = &st->buckets[name_hash(name, max) % DB_DICT_BUCKETS];
+    dict_str_t str;
+
+    *ref = 0;
+    if (len == 0)
+        return NO_ERROR;
+    for (uint32_t r = *bucket; r != 0; r = str.next) {
+        memcpy(&str, st->heap + r - 1, sizeof(str));
+        if (str.len == len && memcmp(st->heap + r - 1 + sizeof(str), name, len) == 0) {
+            *ref = r;
+            return NO_ERROR;
+        }
+    }
+
+    if (st->heap_len + sizeof(str) + len > st->heap_size) {
+        uint32_t size = st->heap_size == 0 ? DB_SCAN_BLOCK : st->heap_size * 2;
+        char *grown = realloc(st->heap, size);
+        if (grown == NULL)
+            return ERR_DB_FILE;
+        st->heap = grown;
+        st->heap_size = size;
+    }
+
+    str.next = *bucket;
+    str.len = len;
+    memcpy(st->heap + st->heap_len, &str, sizeof(str));
+    memcpy(st->heap + st->heap_len + sizeof(str), name, len);
+    *ref = st->heap_len + 1;
+    *bucket = *ref;
+    st->heap_len += sizeof(str) + len;
+    return NO_ERROR;
+}
+
+/*
+ *  pack_students
+ *      db_scan() callback that adds every live student to the new file
+ */
+static int pack_students(student_t *recs, int n, void *arg) {
+    dict_pack_state_t *st = arg;
+
+    for (int i = 0; i < n; i++) {
+        int id = recs[i].id;
+        dict_rec_t *rec;
+
+        if (id == 0)
+            continue;
+        if (id < MIN_STD_ID || id > MAX_STD_ID)
+            return ERR_DB_FILE;
+
+        rec = &st->recs[id];
+        rec->id = id;
+        rec->gpa = recs[i].gpa;
+        if (pack_intern(st, recs[i].fname, sizeof(recs[i].fname), &rec->fname) != NO_ERROR ||
+            pack_intern(st, recs[i].lname, sizeof(recs[i].lname), &rec->lname) != NO_ERROR)
+            return ERR_DB_FILE;
+
+        st->bitmap[id / 8] |= 1 << (id % 8);
+        st->count++;
+        if (id > st->max_id)
+            st->max_id = id;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  dict_write_file
+ *      tmp_fd:  the new, empty file
+ *      st:      its contents
+ *      flags:   DB_FLAG_* for the header
+ *
+ *  Only the pages of the bucket array that have a chain are written, the
+ *  others stay holes.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int dict_write_file(int tmp_fd, dict_pack_state_t *st, uint32_t flags) {
+    size_t page = 4096 / sizeof(uint32_t);
+    db_header_t hdr;
+
+    db_init_header(&hdr, DB_FORMAT_DICT);
+    hdr.rec_count = st->count;
+    hdr.heap_units = st->heap_len;
+    hdr.flags = flags;
+
+    ssize_t len = (st->max_id + 1) * sizeof(dict_rec_t);
+    if (pwrite(tmp_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        pwrite(tmp_fd, st->bitmap, DB_BITMAP_BYTES, DB_BITMAP_OFFSET) != DB_BITMAP_BYTES ||
+        (st->max_id > 0 && pwrite(tmp_fd, st->recs, len, DB_DATA_OFFSET) != len))
+        return ERR_DB_FILE;
+
+    for (size_t b = 0; b < DB_DICT_BUCKETS; b += page) {
+        bool used = false;
+
+        for (size_t i = b; i < b + page && !used; i++)
+            used = st->buckets[i] != 0;
+        if (used && pwrite(tmp_fd, &st->buckets[b], 4096, DB_DICT_BUCKET_OFFSET +
+                           b * sizeof(uint32_t)) != 4096)
+            return ERR_DB_FILE;
+    }
+
+    off_t size = st->heap_len > 0 ? (off_t)DB_DICT_HEAP_OFFSET + st->heap_len :
+                 DB_DATA_OFFSET + len;
+    if ((st->heap_len > 0 &&
+         pwrite(tmp_fd, st->heap, st->heap_len, DB_DICT_HEAP_OFFSET) != st->heap_len) ||
+        ftruncate(tmp_fd, size) == -1 || fsync(tmp_fd) == -1)
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  dict_pack
+ *      fd:  linux file descriptor of a dictionary database
+ *
+ *  compress_db() for dictionary files.  Writes every live student into a
+ *  fresh dictionary file (TMP_DB_FILE) whose heap holds only the names
+ *  still in use, then renames it over DB_FILE.  fd is closed, also on
+ *  failure.
+ *
+ *  returns:  fd of the new database, or ERR_DB_FILE on failure
+ */
+int dict_pack(int fd) {
+    dict_pack_state_t st = {0};
+    uint32_t flags = db_flags(fd);
+    int tmp_fd;
+    int rc;
+
+    if (db_commit(fd) != NO_ERROR || db_lock_file(fd, F_WRLCK) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
+    st.bitmap = calloc(1, DB_BITMAP_BYTES);
+    st.recs = calloc(MAX_STD_ID + 1, sizeof(dict_rec_t));
+    st.buckets = calloc(DB_DICT_BUCKETS, sizeof(uint32_t));
+    rc = st.bitmap == NULL || st.recs == NULL || st.buckets == NULL ? ERR_DB_FILE : NO_ERROR;
+    if (rc == NO_ERROR)
+        rc = db_scan(fd, pack_students, &st);
+    if (rc != NO_ERROR)
+        printf(M_ERR_DB_READ);
+
+    tmp_fd = -1;
+    if (rc == NO_ERROR) {
+        tmp_fd = open(TMP_DB_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        if (tmp_fd == -1) {
+            printf(M_ERR_DB_OPEN);
+            rc = ERR_DB_FILE;
+        }
+    }
+    if (rc == NO_ERROR && dict_write_file(tmp_fd, &st, flags) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        rc = ERR_DB_FILE;
+    }
+
+    free(st.bitmap);
+    free(st.recs);
+    free(st.buckets);
+    free(st.heap);
+    if (tmp_fd != -1)
+        close(tmp_fd);
+    if (rc != NO_ERROR) {
+        unlink(TMP_DB_FILE);
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
+    //renamed while the old file is still locked, so a writer waiting for
+    //the lock finds the new file in place once it gets it
+    rc = rename(TMP_DB_FILE, DB_FILE);
+    close_db(fd);
+    if (rc == -1) {
+        printf(M_ERR_DB_CREATE);
+        return ERR_DB_FILE;
+    }
+
+    return open_db(DB_FILE, false);
+}
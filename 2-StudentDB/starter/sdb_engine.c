@@ -0,0 +1,1143 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//Every descriptor returned by open_db() has a handle in this table that
+//remembers which storage engine is serving it.  Descriptors that were not
+//opened by open_db() (or that have been closed) simply fall back to the
+//plain I/O engine.
+static db_handle_t db_handles[DB_MAX_HANDLES];
+
+/*
+ *  db_engine_from_env
+ *
+ *  Reads SDB_ENGINE and SDB_SYNC from the environment.  Unknown values
+ *  fall back to the defaults (plain I/O, msync on close).
+ */
+static void db_engine_from_env(db_handle_t *h) {
+    char *engine = getenv(SDB_ENV_ENGINE);
+    char *sync = getenv(SDB_ENV_SYNC);
+
+    h->engine = DB_ENGINE_IO;
+    if (engine != NULL && strcmp(engine, "mmap") == 0)
+        h->engine = DB_ENGINE_MMAP;
+    if (engine != NULL && strcmp(engine, "uring") == 0)
+        h->engine = DB_ENGINE_URING;
+
+    h->sync_mode = DB_SYNC_CLOSE;
+    if (sync != NULL) {
+        if (strcmp(sync, "none") == 0)
+            h->sync_mode = DB_SYNC_NONE;
+        else if (strcmp(sync, "write") == 0)
+            h->sync_mode = DB_SYNC_WRITE;
+    }
+}
+
+/*
+ *  db_handle
+ *      fd:  linux file descriptor
+ *
+ *  returns:  the handle registered for fd, or NULL if fd was not opened
+ *            through open_db()
+ */
+db_handle_t *db_handle(int fd) {
+    for (int i = 0; i < DB_MAX_HANDLES; i++) {
+        if (db_handles[i].in_use && db_handles[i].fd == fd)
+            return &db_handles[i];
+    }
+    return NULL;
+}
+
+/*
+ *  db_map_to
+ *      h:    handle of an mmap engine database
+ *      len:  the number of bytes that should be mapped
+ *
+ *  Grows (or establishes) the shared mapping so that it covers len bytes.
+ *  The caller is responsible for making sure the file is at least len
+ *  bytes long.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE if the mapping failed
+ */
+static int db_map_to(db_handle_t *h, size_t len) {
+    char *map;
+
+    if (len <= h->map_len)
+        return NO_ERROR;
+
+    if (h->map == NULL)
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
+    else
+        map = mremap(h->map, h->map_len, len, MREMAP_MAYMOVE);
+
+    if (map == MAP_FAILED)
+        return ERR_DB_FILE;
+
+    h->map = map;
+    h->map_len = len;
+    return NO_ERROR;
+}
+
+/*
+ *  db_map_refresh
+ *      h:  handle of an mmap engine database
+ *
+ *  Another process may have grown the file since we mapped it, so extend
+ *  the mapping to the current file size before scanning.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int db_map_refresh(db_handle_t *h) {
+    struct stat st;
+
+    if (fstat(h->fd, &st) == -1)
+        return ERR_DB_FILE;
+
+    return db_map_to(h, (size_t)st.st_size);
+}
+
+/*
+ *  db_map_grow
+ *      h:    handle of an mmap engine database
+ *      end:  offset just past the last byte about to be written
+ *
+ *  Extends the file when it is shorter than end and remaps it so the
+ *  whole file is addressable.  The file is grown by writing the last byte
+ *  of the caller's own (locked) range rather than with ftruncate(), which
+ *  would cut off anything another writer appended since the fstat().
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int db_map_grow(db_handle_t *h, size_t end) {
+    struct stat st;
+
+    if (end <= h->map_len)
+        return NO_ERROR;
+
+    if (fstat(h->fd, &st) == -1)
+        return ERR_DB_FILE;
+    if ((size_t)st.st_size < end && pwrite(h->fd, "", 1, end - 1) != 1)
+        return ERR_DB_FILE;
+
+    return db_map_to(h, end > (size_t)st.st_size ? end : (size_t)st.st_size);
+}
+
+/*
+ *  db_attach_handle
+ *      h:   free entry of the handle table
+ *      fd:  descriptor of DB_FILE
+ *
+ *  Body of db_attach(), db_reopen() also uses it to set up the entry of a
+ *  descriptor again.  fd is closed if this fails.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int db_attach_handle(db_handle_t *h, int fd) {
+    memset(h, 0, sizeof(*h));
+    h->in_use = true;
+    h->fd = fd;
+    for (int i = 0; i < DB_IDX_COUNT; i++)
+        h->idx_fd[i] = -1;
+    h->col_fd = -1;
+    h->wal.fd = -1;
+    h->chg.fd = -1;
+    db_engine_from_env(h);
+
+    if (h->engine == DB_ENGINE_MMAP && db_map_refresh(h) != NO_ERROR) {
+        h->in_use = false;
+        close(fd);
+        return ERR_DB_FILE;
+    }
+    //without io_uring the same requests are served by plain I/O
+    if (h->engine == DB_ENGINE_URING) {
+        h->ring = uring_open(DB_URING_DEPTH);
+        if (h->ring == NULL)
+            h->engine = DB_ENGINE_IO;
+    }
+
+    if (wal_attach(h) != NO_ERROR) {
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
+    if (db_detect_format(h) != NO_ERROR || chg_open(h) != NO_ERROR) {
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
+    //from now on locks check that DB_FILE is still this file
+    db_identity(fd, &h->ino, &h->birth);
+    return NO_ERROR;
+}
+
+/*
+ *  db_attach
+ *      fd:  descriptor just opened by open_db()
+ *
+ *  Registers fd in the handle table, for the mmap engine maps the current
+ *  contents of the file (the uring engine sets up its ring), replays the
+ *  write-ahead log if there is one, works out which layout the file uses
+ *  and opens its change stream if it has one.  fd is closed if this fails.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int db_attach(int fd) {
+    for (int i = 0; i < DB_MAX_HANDLES; i++) {
+        if (!db_handles[i].in_use)
+            return db_attach_handle(&db_handles[i], fd);
+    }
+
+    close(fd);
+    return ERR_DB_FILE;
+}
+
+/*
+ *  db_detach
+ *      h:  database handle
+ *
+ *  Commits what is left in the write-ahead log, flushes and unmaps the
+ *  mmap engine region (if any), closes the secondary indexes and the
+ *  change stream that were opened for the handle and frees it.  The
+ *  descriptor itself stays open.
+ */
+static void db_detach(db_handle_t *h) {
+    wal_detach(h);
+    if (h->map != NULL) {
+        if (h->sync_mode == DB_SYNC_CLOSE)
+            msync(h->map, h->map_len, MS_SYNC);
+        munmap(h->map, h->map_len);
+    }
+    uring_close(h->ring);
+    h->ring = NULL;
+    index_close(h);
+    chg_close(h);
+    h->in_use = false;
+}
+
+/*
+ *  close_db
+ *      fd:  linux file descriptor returned by open_db()
+ *
+ *  Detaches fd from its handle (see db_detach()) and closes it.
+ *
+ *  returns:  the return value of close()
+ */
+int close_db(int fd) {
+    db_handle_t *h = db_handle(fd);
+
+    if (h != NULL)
+        db_detach(h);
+
+    return close(fd);
+}
+
+/*
+ *  db_replaced
+ *      h:  database handle, may be NULL
+ *
+ *  -x and --upgrade write a new file and rename it over DB_FILE while they
+ *  hold the old one locked.  A process that opened the old file before
+ *  that and waited for a lock gets it once the old file is closed, but
+ *  anything it wrote there would be lost with the old file.
+ *
+ *  returns:  true if DB_FILE now names a different file than the one h
+ *            was opened on
+ */
+static bool db_replaced(db_handle_t *h) {
+    struct statx stx;
+    uint64_t birth = 0;
+
+    if (h == NULL || h->ino == 0 ||
+        statx(AT_FDCWD, DB_FILE, 0, STATX_INO | STATX_BTIME, &stx) != 0)
+        return false;
+    if (stx.stx_mask & STATX_BTIME)
+        birth = stx.stx_btime.tv_sec * 1000000000ull + stx.stx_btime.tv_nsec;
+    return stx.stx_ino != h->ino || birth != h->birth;
+}
+
+/*
+ *  db_reopen
+ *      h:  handle of a database that db_replaced() reported
+ *
+ *  Moves the descriptor of h over to the file DB_FILE names now, the
+ *  descriptor number stays the same so callers carry on with it.  Nothing
+ *  may be locked on it, a transaction that is open carries over to the
+ *  new file.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int db_reopen(db_handle_t *h) {
+    int fd = h->fd;
+    bool txn = h->wal.txn;
+    int new_fd = open(DB_FILE, O_RDWR);
+
+    if (new_fd == -1)
+        return ERR_DB_FILE;
+
+    db_detach(h);
+    if (dup2(new_fd, fd) == -1) {
+        close(new_fd);
+        return ERR_DB_FILE;
+    }
+    close(new_fd);
+
+    if (db_attach_handle(h, fd) != NO_ERROR || chg_start(fd) != NO_ERROR)
+        return ERR_DB_FILE;
+    if (txn && wal_txn_begin(fd) != NO_ERROR)
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  db_follow
+ *      fd:  linux file descriptor returned by open_db()
+ *
+ *  Lets a descriptor that is kept open across commands (the server's)
+ *  catch up with a -x or --upgrade run by another process, see
+ *  db_replaced().  Nothing may be locked on fd.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE if the new file could not
+ *            be opened
+ */
+int db_follow(int fd) {
+    db_handle_t *h = db_handle(fd);
+
+    return db_replaced(h) ? db_reopen(h) : NO_ERROR;
+}
+
+/*
+ *  db_read_at
+ *      fd:      linux file descriptor
+ *      offset:  byte offset in the database file
+ *      buff:    where to copy the data
+ *      len:     number of bytes wanted
+ *
+ *  Reads len bytes at offset using the engine serving fd.  Reading past
+ *  the end of the file is not an error, the short count is returned.
+ *  Changes still waiting in the write-ahead log are copied over what was
+ *  read so a command always sees its own writes.
+ *
+ *  returns:  number of bytes copied into buff, or -1 on an I/O error
+ */
+ssize_t db_read_at(int fd, off_t offset, void *buff, size_t len) {
+    db_handle_t *h = db_handle(fd);
+    uint64_t start = stats_enabled() ? stats_now() : 0;
+    ssize_t got;
+
+    if (h != NULL && h->engine == DB_ENGINE_MMAP) {
+        if ((size_t)offset + len > h->map_len && db_map_refresh(h) != NO_ERROR)
+            return -1;
+        got = 0;
+        if ((size_t)offset < h->map_len) {
+            got = (size_t)offset + len > h->map_len ? h->map_len - offset : len;
+            memcpy(buff, h->map + offset, got);
+        }
+        stats_add(STAT_BYTES_READ, got);
+    } else {
+        got = pread(fd, buff, len, offset);
+        stats_io(STAT_READS, start, got);
+    }
+
+    if (got >= 0 && h != NULL && h->wal.len > 0)
+        got = wal_overlay(h, offset, buff, len, got);
+    return got;
+}
+
+/*
+ *  db_write_at
+ *      fd:      linux file descriptor
+ *      offset:  byte offset in the database file
+ *      buff:    data to store
+ *      len:     number of bytes to store
+ *
+ *  Single buffer version of db_writev_at().
+ *
+ *  returns:  number of bytes written, or -1 on an I/O error
+ */
+ssize_t db_write_at(int fd, off_t offset, const void *buff, size_t len) {
+    struct iovec iov = { .iov_base = (void *)buff, .iov_len = len };
+
+    return db_writev_at(fd, offset, &iov, 1);
+}
+
+/*
+ *  db_writev_at
+ *      fd:      linux file descriptor
+ *      offset:  byte offset in the database file
+ *      iov:     buffers to store back to back starting at offset
+ *      iovcnt:  number of entries in iov
+ *
+ *  Stores a run of data at offset.  With the write-ahead log enabled the
+ *  data is only queued in the log and reaches the database file when
+ *  wal_commit() runs, otherwise it is applied right away.  The first write
+ *  of a command counts it in the change stream, see chg_begin().
+ *
+ *  returns:  number of bytes written, or -1 on an I/O error
+ */
+ssize_t db_writev_at(int fd, off_t offset, const struct iovec *iov, int iovcnt) {
+    db_handle_t *h = db_handle(fd);
+
+    chg_begin(fd);
+    if (h != NULL && h->wal.fd >= 0)
+        return wal_log(h, offset, iov, iovcnt);
+
+    return db_apply_at(fd, offset, iov, iovcnt);
+}
+
+/*
+ *  db_apply_at
+ *      fd:      linux file descriptor
+ *      offset:  byte offset in the database file
+ *      iov:     buffers to store back to back starting at offset
+ *      iovcnt:  number of entries in iov
+ *
+ *  Writes straight into the database file using the engine serving fd,
+ *  bypassing the write-ahead log.  The I/O engine issues a single
+ *  pwritev() for the whole run.  The mmap engine grows the file with
+ *  pwrite() + mremap() when the write lands past the end of the current
+ *  mapping.
+ *
+ *  returns:  number of bytes written, or -1 on an I/O error
+ */
+ssize_t db_apply_at(int fd, off_t offset, const struct iovec *iov, int iovcnt) {
+    db_handle_t *h = db_handle(fd);
+
+    if (h != NULL && h->engine == DB_ENGINE_MMAP) {
+        size_t total = 0;
+
+        for (int i = 0; i < iovcnt; i++)
+            total += iov[i].iov_len;
+        if (db_map_grow(h, (size_t)offset + total) != NO_ERROR)
+            return -1;
+
+        char *dst = h->map + offset;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+            dst += iov[i].iov_len;
+        }
+
+        if (h->sync_mode == DB_SYNC_WRITE) {
+            long page = sysconf(_SC_PAGESIZE);
+            off_t start = offset & ~(page - 1);
+            if (msync(h->map + start, offset + total - start, MS_SYNC) == -1)
+                return -1;
+        }
+        stats_add(STAT_BYTES_WRITTEN, total);
+        return total;
+    }
+
+    uint64_t start = stats_enabled() ? stats_now() : 0;
+    ssize_t done = pwritev(fd, iov, iovcnt, offset);
+    stats_io(STAT_WRITES, start, done);
+    return done;
+}
+
+/*
+ *  db_io_batch
+ *      fd:   linux file descriptor
+ *      ios:  all reads or all writes, to different parts of the file
+ *      n:    number of transfers
+ *
+ *  Runs a batch of independent transfers.  The uring engine keeps up to
+ *  DB_URING_DEPTH of them in flight, the other engines (and writes that
+ *  go to the write-ahead log) run them one after the other through
+ *  db_read_at() and db_writev_at().  Reads see pending logged changes like
+ *  db_read_at() does.  Each io->res tells how its transfer went.
+ *
+ *  returns:  NO_ERROR, or ERR_DB_FILE if the ring failed
+ */
+int db_io_batch(int fd, db_io_t *ios, int n) {
+    db_handle_t *h = db_handle(fd);
+
+    if (n == 0)
+        return NO_ERROR;
+    if (h == NULL || h->ring == NULL || (ios[0].write && h->wal.fd >= 0)) {
+        for (int i = 0; i < n; i++) {
+            struct iovec one = { .iov_base = ios[i].buff, .iov_len = ios[i].len };
+
+            if (ios[i].write && ios[i].iov != NULL)
+                ios[i].res = db_writev_at(fd, ios[i].offset, ios[i].iov, ios[i].iovcnt);
+            else if (ios[i].write)
+                ios[i].res = db_writev_at(fd, ios[i].offset, &one, 1);
+            else
+                ios[i].res = db_read_at(fd, ios[i].offset, ios[i].buff, ios[i].len);
+        }
+        return NO_ERROR;
+    }
+
+    if (ios[0].write)
+        chg_begin(fd);
+    if (uring_batch(h->ring, fd, ios, n) != NO_ERROR)
+        return ERR_DB_FILE;
+    for (int i = 0; i < n && h->wal.len > 0; i++) {
+        if (!ios[i].write && ios[i].res >= 0)
+            ios[i].res = wal_overlay(h, ios[i].offset, ios[i].buff, ios[i].len, ios[i].res);
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  db_sync
+ *      h:  database handle
+ *
+ *  Forces everything written to the database file so far to disk.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int db_sync(db_handle_t *h) {
+    if (h->map != NULL && msync(h->map, h->map_len, MS_SYNC) == -1)
+        return ERR_DB_FILE;
+    if (h->map == NULL && fdatasync(h->fd) == -1)
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  db_lock
+ *      fd:     database, index or log file descriptor
+ *      type:   F_RDLCK, F_WRLCK or F_UNLCK
+ *      start:  first byte of the range
+ *      len:    number of bytes, 0 for everything from start on
+ *
+ *  Byte range locks coordinate several sdbsc processes using the same
+ *  files.  They are open file description locks (F_OFD_SETLKW), so they
+ *  belong to the descriptor rather than the process and are dropped when
+ *  it is closed.  These locks do not detect deadlocks, so they are always
+ *  taken in the same order: student.db record slots, then its bitmap,
+ *  then its header, then index files, then the write-ahead log, then the
+ *  change stream.
+ *
+ *  returns:  NO_ERROR once the lock is held, ERR_DB_FILE on failure
+ */
+int db_lock(int fd, short type, off_t start, off_t len) {
+    struct flock fl = {
+        .l_type = type,
+        .l_whence = SEEK_SET,
+        .l_start = start,
+        .l_len = len,
+    };
+
+    while (fcntl(fd, type == F_UNLCK ? F_OFD_SETLK : F_OFD_SETLKW, &fl) == -1) {
+        if (errno != EINTR)
+            return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  db_lock_file
+ *      fd:    linux file descriptor
+ *      type:  F_RDLCK for scans, F_WRLCK for operations that replace or
+ *             truncate the file, F_UNLCK to release
+ *
+ *  If DB_FILE was replaced while we waited (see db_replaced()) fd is
+ *  moved over to the new file and locked there.
+ *
+ *  returns:  NO_ERROR once the lock is held, ERR_DB_FILE on failure
+ */
+int db_lock_file(int fd, short type) {
+    db_handle_t *h = db_handle(fd);
+
+    for (;;) {
+        if (db_lock(fd, type, 0, 0) != NO_ERROR)
+            return ERR_DB_FILE;
+        if (type == F_UNLCK || !db_replaced(h))
+            break;
+        db_lock(fd, F_UNLCK, 0, 0);
+        if (db_reopen(h) != NO_ERROR)
+            return ERR_DB_FILE;
+    }
+    if (h != NULL)
+        h->file_lock = type == F_UNLCK ? 0 : type;
+    return NO_ERROR;
+}
+
+/*
+ *  db_lock_slots
+ *      fd:     linux file descriptor
+ *      first:  lowest id
+ *      last:   highest id
+ *
+ *  Exclusively locks the record slots from first to last.  The lock is
+ *  held until db_commit() so that no other process can see or change the
+ *  records before they are in the file.  A packed file has no fixed slot
+ *  for an id, the bytes the slot would cover in an id indexed file only
+ *  serve as the name of the lock there.  Splits move the records of a
+ *  hashed file between pages, so there the hash meta data is locked and
+ *  one writer at a time changes the file.  Like db_lock_file() this
+ *  follows DB_FILE when it was replaced while we waited.
+ *
+ *  returns:  NO_ERROR once the lock is held, ERR_DB_FILE on failure
+ */
+int db_lock_slots(int fd, int first, int last) {
+    db_handle_t *h = db_handle(fd);
+    int rc;
+
+    if (h != NULL && h->file_lock == F_WRLCK)
+        return NO_ERROR;
+    for (;;) {
+        off_t base = h == NULL ? 0 : h->data_off;
+
+        if (h != NULL && h->format == DB_FORMAT_HASHED)
+            rc = db_lock(fd, F_WRLCK, h->bitmap_off, sizeof(hash_meta_t));
+        else
+            rc = db_lock(fd, F_WRLCK, base + (off_t)first * sizeof(student_t),
+                         (off_t)(last - first + 1) * sizeof(student_t));
+        if (rc != NO_ERROR || !db_replaced(h))
+            return rc;
+
+        //the new file may have another layout, lock again from scratch
+        db_lock(fd, F_UNLCK, 0, 0);
+        if (db_reopen(h) != NO_ERROR)
+            return ERR_DB_FILE;
+    }
+}
+
+/*
+ *  db_commit
+ *      fd:  linux file descriptor
+ *
+ *  Ends the changes made by the current command: commits them to the
+ *  write-ahead log (if it is in use), adds them to the change stream (if
+ *  there is one) durably and releases every lock held on fd.  Inside a
+ *  transaction this waits for wal_txn_end().
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE if the commit failed
+ */
+int db_commit(int fd) {
+    db_handle_t *h = db_handle(fd);
+
+    if (h != NULL && h->wal.txn)
+        return NO_ERROR;
+
+    int rc = wal_commit(fd);
+
+    //still locked, so the stream gets changes to a student in order
+    if (chg_flush(fd, rc == NO_ERROR) != NO_ERROR)
+        rc = ERR_DB_FILE;
+    db_lock_file(fd, F_UNLCK);
+    return rc;
+}
+
+/*
+ *  db_identity
+ *      fd:     linux file descriptor
+ *      ino:    set to the inode number of the file
+ *      birth:  set to the creation time of the file in nanoseconds, 0 if
+ *              the file system does not record it
+ *
+ *  Files that live next to the database (indexes, the log) remember the
+ *  identity of the database they were written for.  If student.db is
+ *  deleted and created again they no longer match and are not trusted.
+ */
+void db_identity(int fd, uint64_t *ino, uint64_t *birth) {
+    struct statx stx;
+
+    *ino = 0;
+    *birth = 0;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_INO | STATX_BTIME, &stx) == 0) {
+        *ino = stx.stx_ino;
+        if (stx.stx_mask & STATX_BTIME)
+            *birth = stx.stx_btime.tv_sec * 1000000000ull + stx.stx_btime.tv_nsec;
+    }
+}
+
+/*
+ *  db_file_gone
+ *      fd:  descriptor of an index or the column file
+ *
+ *  Such a file is deleted by whoever could not update it and the next
+ *  command that wants it builds a new one under the same name, so a
+ *  descriptor kept open from before then would write where nobody reads.
+ *
+ *  returns:  true if the file fd has open was deleted
+ */
+bool db_file_gone(int fd) {
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && st.st_nlink == 0;
+}
+
+/*
+ *  db_next_extent
+ *      fd:     linux file descriptor
+ *      pos:    offset to start looking from
+ *      size:   size of the file
+ *      start:  set to the first record aligned offset holding data
+ *      stop:   set to the record aligned offset where that data ends
+ *
+ *  Asks the file system where the next allocated range is with
+ *  lseek(SEEK_DATA/SEEK_HOLE) so that scans skip the holes left between
+ *  sparse ids.  File systems without hole reporting make the rest of the
+ *  file look like one extent.
+ *
+ *  returns:  true if an extent was found, false at the end of the data
+ */
+static bool db_next_extent(int fd, off_t pos, off_t size, off_t *start, off_t *stop) {
+    off_t data, hole;
+
+    if (pos >= size)
+        return false;
+
+    data = lseek(fd, pos, SEEK_DATA);
+    stats_add(STAT_SEEKS, 1);
+    if (data == -1) {
+        if (errno == ENXIO)
+            return false;
+        data = pos;
+        hole = size;
+    } else {
+        hole = lseek(fd, data, SEEK_HOLE);
+        stats_add(STAT_SEEKS, 1);
+        if (hole == -1 || hole > size)
+            hole = size;
+    }
+
+    *start = data - data % sizeof(student_t);
+    *stop = hole + (sizeof(student_t) - hole % sizeof(student_t)) % sizeof(student_t);
+    if (*stop > size - size % (off_t)sizeof(student_t))
+        *stop = size - size % sizeof(student_t);
+
+    return *start < *stop;
+}
+
+/*
+ *  db_next_chunk
+ *      fd:    linux file descriptor
+ *      end:   offset the scan stops at
+ *      pos:   where the previous chunk ended, advanced past this one
+ *      stop:  end of the extent pos is in, updated when a new one starts
+ *      io:    filled in with the read for the chunk
+ *
+ *  Cuts the data extents into reads of up to DB_SCAN_BLOCK bytes.
+ *
+ *  returns:  true if there was another chunk to read
+ */
+static bool db_next_chunk(int fd, off_t end, off_t *pos, off_t *stop, db_io_t *io) {
+    if (*pos >= *stop) {
+        off_t start;
+
+        if (!db_next_extent(fd, *pos, end, &start, stop))
+            return false;
+        *pos = start;
+    }
+    io->offset = *pos;
+    io->len = *stop - *pos < DB_SCAN_BLOCK ? *stop - *pos : DB_SCAN_BLOCK;
+    *pos += io->len;
+    return true;
+}
+
+/*
+ *  db_scan_ahead
+ *      Same as db_scan_range() for the uring engine.  Two blocks are used:
+ *      while fn works on one the read of the next is already in flight.
+ *      The ring is made for this one scan, so parallel scans each get
+ *      their own.
+ */
+static int db_scan_ahead(int fd, off_t pos, off_t end, db_scan_fn fn, void *arg) {
+    db_ring_t *ring = uring_open(2);
+    db_io_t io[2] = {0};
+    bool queued[2] = {false, false};
+    bool landed[2] = {false, false};
+    off_t stop = pos;
+    uint64_t tag;
+    ssize_t res;
+    int rc = NO_ERROR;
+
+    io[0].buff = malloc(DB_SCAN_BLOCK);
+    io[1].buff = malloc(DB_SCAN_BLOCK);
+    if (ring == NULL || io[0].buff == NULL || io[1].buff == NULL)
+        rc = ERR_DB_FILE;
+
+    for (int b = 0; b < 2 && rc == NO_ERROR; b++) {
+        queued[b] = db_next_chunk(fd, end, &pos, &stop, &io[b]);
+        if (queued[b])
+            uring_queue(ring, fd, &io[b], b);
+    }
+
+    //blocks are handed to fn in the order they were queued, each one is
+    //refilled as soon as fn is done with it
+    for (int cur = 0; rc >= 0 && queued[cur]; cur = !cur) {
+        while (!landed[cur] && rc == NO_ERROR) {
+            if (uring_wait(ring, &tag, &res) != NO_ERROR) {
+                rc = ERR_DB_FILE;
+            } else {
+                io[tag].res = res;
+                landed[tag] = true;
+                stats_add(STAT_RING_IOS, 1);
+                stats_add(STAT_BYTES_READ, res > 0 ? res : 0);
+            }
+        }
+        if (rc != NO_ERROR || io[cur].res == -1) {
+            rc = ERR_DB_FILE;
+            break;
+        }
+
+        queued[cur] = landed[cur] = false;
+        if (io[cur].res >= (ssize_t)sizeof(student_t)) {
+            stats_add(STAT_SCANNED, io[cur].res / sizeof(student_t));
+            rc = fn(io[cur].buff, io[cur].res / sizeof(student_t), arg);
+        }
+
+        queued[cur] = rc >= 0 && db_next_chunk(fd, end, &pos, &stop, &io[cur]);
+        if (queued[cur])
+            uring_queue(ring, fd, &io[cur], cur);
+    }
+
+    //after an error a read may still be in flight, let it land before
+    //its buffer goes away
+    while (ring != NULL && uring_wait(ring, &tag, &res) == NO_ERROR)
+        ;
+    uring_close(ring);
+    free(io[0].buff);
+    free(io[1].buff);
+    return rc;
+}
+
+/*
+ *  db_scan_range
+ *      h:     handle of the database, NULL if it was not opened through
+ *             open_db()
+ *      fd:    linux file descriptor, the database or a snapshot of it
+ *      pos:   record aligned offset to start at
+ *      end:   offset to stop at, the file size for a whole scan
+ *      fn:    callback invoked with blocks of records
+ *      arg:   passed through to fn
+ *
+ *  Hands the record slots of the data extents between pos and end to fn.
+ *  The mapping of an mmap engine handle must already cover end, this
+ *  never remaps so several threads can run it on the same handle.
+ *
+ *  returns:  NO_ERROR, ERR_DB_FILE or the negative value returned by fn
+ */
+static int db_scan_range(db_handle_t *h, int fd, off_t pos, off_t end, db_scan_fn fn, void *arg) {
+    bool mapped = h != NULL && h->engine == DB_ENGINE_MMAP && fd == h->fd;
+    student_t *block = NULL;
+    off_t start, stop;
+    int rc = NO_ERROR;
+
+    if (h != NULL && h->engine == DB_ENGINE_URING)
+        return db_scan_ahead(fd, pos, end, fn, arg);
+    if (!mapped) {
+        block = malloc(DB_SCAN_BLOCK);
+        if (block == NULL)
+            return ERR_DB_FILE;
+    }
+
+    while (rc >= 0 && db_next_extent(fd, pos, end, &start, &stop)) {
+        if (mapped) {
+            stats_add(STAT_SCANNED, (stop - start) / sizeof(student_t));
+            rc = fn((student_t *)(h->map + start), (stop - start) / sizeof(student_t), arg);
+            pos = stop;
+            continue;
+        }
+
+        for (pos = start; rc >= 0 && pos < stop; ) {
+            size_t want = stop - pos < DB_SCAN_BLOCK ? stop - pos : DB_SCAN_BLOCK;
+            uint64_t begun = stats_enabled() ? stats_now() : 0;
+            ssize_t got = pread(fd, block, want, pos);
+
+            stats_io(STAT_READS, begun, got);
+
+            if (got == -1) {
+                rc = ERR_DB_FILE;
+                break;
+            }
+            if (got < (ssize_t)sizeof(student_t)) {
+                pos = stop;
+                break;
+            }
+            stats_add(STAT_SCANNED, got / sizeof(student_t));
+            rc = fn(block, got / sizeof(student_t), arg);
+            pos += got - got % sizeof(student_t);
+        }
+    }
+
+    free(block);
+    return rc;
+}
+
+/*
+ *  db_snapshot_copy
+ *      fd:    linux file descriptor, read locked
+ *      snap:  empty file on the same filesystem
+ *      size:  size of fd
+ *
+ *  Copies the data extents of fd into snap inside the kernel, holes stay
+ *  holes.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int db_snapshot_copy(int fd, int snap, off_t size) {
+    off_t start, stop;
+
+    for (off_t pos = 0; db_next_extent(fd, pos, size, &start, &stop); pos = stop) {
+        loff_t in = start, out = start;
+
+        while (in < stop) {
+            ssize_t got = copy_file_range(fd, &in, snap, &out, stop - in, 0);
+            if (got <= 0)
+                return ERR_DB_FILE;
+        }
+    }
+    return ftruncate(snap, size) == 0 ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  db_snapshot
+ *      fd:  linux file descriptor, read locked
+ *      st:  fstat() of fd
+ *
+ *  Makes a private, unnamed copy of the file for a scan to read, so the
+ *  file lock can be dropped while the scan runs.  A reflink (FICLONE)
+ *  shares the blocks with the file and costs next to nothing, where the
+ *  filesystem has none the data extents are copied.  Small files are not
+ *  worth it, and SDB_SNAPSHOT=off turns snapshots off.
+ *
+ *  returns:  descriptor of the snapshot, or fd if the scan should read fd
+ *            under the lock
+ */
+static int db_snapshot(int fd, struct stat *st) {
+    char *env = getenv(SDB_ENV_SNAPSHOT);
+    int snap;
+
+    if ((env != NULL && strcmp(env, "off") == 0) || (off_t)st->st_blocks * 512 < DB_SNAP_MIN)
+        return fd;
+
+    snap = open(DB_SNAP_DIR, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+    if (snap == -1)
+        return fd;
+    if (ioctl(snap, FICLONE, fd) == 0 || db_snapshot_copy(fd, snap, st->st_size) == NO_ERROR)
+        return snap;
+    close(snap);
+    return fd;
+}
+
+/*
+ *  db_scan_begin
+ *      fd:    linux file descriptor
+ *      h:     handle of fd, may be NULL
+ *      st:    filled in with the size of the file
+ *      src:   set to the descriptor the scan reads, fd or a snapshot
+ *
+ *  Gets the file ready to be scanned: logged changes are applied, writers
+ *  are kept out with a whole file read lock (unless the caller already
+ *  holds the file exclusively) and the mmap engine maps the whole file.
+ *  If a snapshot of the file can be made the lock is dropped again right
+ *  away, writers then only wait while the snapshot is taken.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int db_scan_begin(int fd, db_handle_t *h, struct stat *st, int *src) {
+    bool owner = h != NULL && h->file_lock == F_WRLCK;
+
+    //the scan reads the file directly, so logged changes must be in it
+    if (!owner && (wal_commit(fd) != NO_ERROR || db_lock_file(fd, F_RDLCK) != NO_ERROR))
+        return ERR_DB_FILE;
+    if ((h != NULL && h->engine == DB_ENGINE_MMAP && db_map_refresh(h) != NO_ERROR) ||
+        fstat(fd, st) == -1) {
+        if (!owner)
+            db_lock_file(fd, F_UNLCK);
+        return ERR_DB_FILE;
+    }
+
+    *src = owner ? fd : db_snapshot(fd, st);
+    if (*src != fd)
+        db_lock_file(fd, F_UNLCK);
+    return NO_ERROR;
+}
+
+/*
+ *  db_scan_end
+ *      fd:    linux file descriptor
+ *      h:     handle of fd, may be NULL
+ *      src:   the descriptor db_scan_begin() picked
+ *
+ *  Drops the lock or the snapshot taken by db_scan_begin().
+ */
+static void db_scan_end(int fd, db_handle_t *h, int src) {
+    if (src != fd)
+        close(src);
+    else if (h == NULL || h->file_lock != F_WRLCK)
+        db_lock_file(fd, F_UNLCK);
+}
+
+/*
+ *  db_scan
+ *      fd:   linux file descriptor
+ *      fn:   callback invoked with blocks of records
+ *      arg:  passed through to fn
+ *
+ *  Walks the record slots in the file in id order and hands them to fn in
+ *  blocks, starting at record slot 0 (after the header, if any).  The
+ *  scan sees the file as it was when it started: files of DB_SNAP_MIN
+ *  bytes of data or more are read from a snapshot (see db_snapshot()),
+ *  smaller ones stay read locked for the duration of the scan.  Only the data
+ *  extents of the file are visited, slots inside a hole can never hold a
+ *  student so they are skipped without being read.  The I/O engine reads
+ *  each extent DB_SCAN_BLOCK bytes at a time with pread(), the mmap engine
+ *  passes pointers straight into the mapped region.  Deleted (id==0) slots
+ *  inside an extent are included, it is up to fn to skip them.  Packed
+ *  files are walked through their directory by packed_scan() instead,
+ *  dictionary files decoded by dict_scan().  If fn returns a negative
+ *  value the scan stops and that value is returned.
+ *
+ *  returns:  NO_ERROR       the whole file was scanned
+ *            ERR_DB_FILE    database file I/O issue
+ *            <0             the value returned by fn
+ */
+int db_scan(int fd, db_scan_fn fn, void *arg) {
+    db_handle_t *h = db_handle(fd);
+    struct stat st;
+    int src, rc;
+
+    if (db_scan_begin(fd, h, &st, &src) != NO_ERROR)
+        return ERR_DB_FILE;
+    if (h != NULL && h->format == DB_FORMAT_PACKED)
+        rc = packed_scan(fd, src, 0, DB_DIR_TOP, fn, arg);
+    else if (h != NULL && h->format == DB_FORMAT_DICT)
+        rc = dict_scan(fd, src, 0, MAX_STD_ID + 1, fn, arg);
+    else
+        rc = db_scan_range(h, src, h == NULL ? 0 : h->data_off, st.st_size, fn, arg);
+    db_scan_end(fd, h, src);
+    return rc < 0 ? rc : NO_ERROR;
+}
+
+/*
+ *  db_scan_threads
+ *
+ *  returns:  the number of threads full file scans may use, SDB_THREADS
+ *            or else one per online cpu, at most DB_SCAN_MAX_THREADS
+ */
+int db_scan_threads(void) {
+    char *env = getenv(SDB_ENV_THREADS);
+    long n = env != NULL ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+        n = 1;
+    return n > DB_SCAN_MAX_THREADS ? DB_SCAN_MAX_THREADS : n;
+}
+
+//one thread's share of a db_scan_parallel()
+typedef struct db_scan_part {
+    db_handle_t *h;
+    int fd, src;        //the database, and the descriptor that is read
+    off_t from, to;     //file offsets, top directory entries for packed files,
+                        //ids for dictionary files
+    db_scan_fn fn;
+    void *arg;
+    int rc;
+    pthread_t thread;
+} db_scan_part_t;
+
+/*
+ *  db_scan_worker
+ *      Thread body of db_scan_parallel(), scans one part
+ */
+static void *db_scan_worker(void *arg) {
+    db_scan_part_t *part = arg;
+
+    if (part->h != NULL && part->h->format == DB_FORMAT_PACKED)
+        part->rc = packed_scan(part->fd, part->src, part->from, part->to, part->fn, part->arg);
+    else if (part->h != NULL && part->h->format == DB_FORMAT_DICT)
+        part->rc = dict_scan(part->fd, part->src, part->from, part->to, part->fn, part->arg);
+    else
+        part->rc = db_scan_range(part->h, part->src, part->from, part->to, part->fn, part->arg);
+    return NULL;
+}
+
+/*
+ *  db_scan_parallel
+ *      fd:        linux file descriptor
+ *      fn:        callback invoked with blocks of records
+ *      args:      array of parts argument blocks, one per part
+ *      arg_size:  size of one argument block
+ *      parts:     at most this many threads are used, see db_scan_threads()
+ *
+ *  Like db_scan() but the slots are split into up to parts consecutive id
+ *  ranges that are scanned at the same time, each by its own thread with
+ *  its own read buffer.  Part i calls fn with args + i * arg_size, so fn
+ *  only ever touches state private to its thread.  Parts are in id order:
+ *  merging the results of part 0, 1, ... gives the same order as db_scan().
+ *  Parts that a small file doesn't need are simply never called.  The
+ *  locking is the same as for db_scan(), the threads share the lock of the
+ *  calling thread.
+ *
+ *  returns:  NO_ERROR       the whole file was scanned
+ *            ERR_DB_FILE    database file I/O issue
+ *            <0             the first negative value returned by fn
+ */
+int db_scan_parallel(int fd, db_scan_fn fn, void *args, size_t arg_size, int parts) {
+    db_handle_t *h = db_handle(fd);
+    db_scan_part_t part[DB_SCAN_MAX_THREADS];
+    bool packed = h != NULL && h->format == DB_FORMAT_PACKED;
+    bool dict = h != NULL && h->format == DB_FORMAT_DICT;
+    off_t first, slots;
+    struct stat st;
+    int rc = NO_ERROR;
+    int started = 0;
+    int src;
+
+    if (db_scan_begin(fd, h, &st, &src) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    //packed files split their top level directory, dictionary files their
+    //ids, the others their slots
+    first = packed || dict || h == NULL ? 0 : h->data_off;
+    slots = packed ? DB_DIR_TOP : dict ? MAX_STD_ID + 1 :
+            st.st_size > first ? (st.st_size - first) / sizeof(student_t) : 0;
+    if (parts > DB_SCAN_MAX_THREADS)
+        parts = DB_SCAN_MAX_THREADS;
+    if (!packed && !dict && parts > (st.st_size - first) / DB_SCAN_MIN_PART)
+        parts = (st.st_size - first) / DB_SCAN_MIN_PART;
+    if (parts < 1)
+        parts = 1;
+
+    for (int i = 0; i < parts; i++) {
+        off_t lo = slots * i / parts, hi = slots * (i + 1) / parts;
+
+        part[i].h = h;
+        part[i].fd = fd;
+        part[i].src = src;
+        part[i].from = packed || dict ? lo : first + lo * (off_t)sizeof(student_t);
+        part[i].to = packed || dict ? hi : i == parts - 1 ? st.st_size : first + hi * (off_t)sizeof(student_t);
+        part[i].fn = fn;
+        part[i].arg = (char *)args + i * arg_size;
+        part[i].rc = NO_ERROR;
+    }
+
+    //the calling thread takes part 0 itself
+    for (int i = 1; i < parts; i++) {
+        if (pthread_create(&part[i].thread, NULL, db_scan_worker, &part[i]) != 0) {
+            rc = ERR_DB_FILE;
+            break;
+        }
+        started = i;
+    }
+    if (rc == NO_ERROR)
+        db_scan_worker(&part[0]);
+    for (int i = 1; i <= started; i++)
+        pthread_join(part[i].thread, NULL);
+
+    for (int i = 0; i < parts && rc == NO_ERROR; i++) {
+        if (part[i].rc < 0)
+            rc = part[i].rc;
+    }
+    db_scan_end(fd, h, src);
+    return rc;
+}
@@ -0,0 +1,828 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  db_format_from_env
+ *
+ *  returns:  the layout new database files should be created with, taken
+ *            from SDB_FORMAT (legacy unless it says v1, packed, hashed or
+ *            dict)
+ */
+int db_format_from_env(void) {
+    char *format = getenv(SDB_ENV_FORMAT);
+
+    if (format != NULL && strcmp(format, "v1") == 0)
+        return DB_FORMAT_V1;
+    if (format != NULL && strcmp(format, "packed") == 0)
+        return DB_FORMAT_PACKED;
+    if (format != NULL && strcmp(format, "hashed") == 0)
+        return DB_FORMAT_HASHED;
+    if (format != NULL && strcmp(format, "dict") == 0)
+        return DB_FORMAT_DICT;
+    return DB_FORMAT_LEGACY;
+}
+
+/*
+ *  db_flags_from_env
+ *
+ *  returns:  the DB_FLAG_* new database files should get, DB_FLAG_CRC if
+ *            SDB_CRC=on
+ */
+uint32_t db_flags_from_env(void) {
+    char *crc = getenv(SDB_ENV_CRC);
+
+    return crc != NULL && strcmp(crc, "on") == 0 ? DB_FLAG_CRC : 0;
+}
+
+/*
+ *  db_init_header
+ *      hdr:     header to fill in
+ *      format:  DB_FORMAT_* of the new file
+ */
+void db_init_header(db_header_t *hdr, int format) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = DB_MAGIC;
+    hdr->version = format;
+    hdr->data_offset = format == DB_FORMAT_PACKED ? DB_PACKED_DATA_OFFSET : DB_DATA_OFFSET;
+    hdr->bitmap_offset = DB_BITMAP_OFFSET;
+    hdr->max_id = MAX_STD_ID;
+    if (format == DB_FORMAT_HASHED) {
+        hdr->data_offset = DB_HASH_DATA_OFFSET;
+        hdr->bitmap_offset = DB_HASH_META_OFFSET;
+        hdr->max_id = DB_HASH_MAX_ID;
+    }
+}
+
+/*
+ *  db_use_header
+ *      h:    handle to update
+ *      hdr:  header read from (or just written to) the file
+ */
+static void db_use_header(db_handle_t *h, db_header_t *hdr) {
+    h->format = hdr->version;
+    h->data_off = hdr->data_offset;
+    h->bitmap_off = hdr->bitmap_offset;
+    h->flags = hdr->flags;
+}
+
+/*
+ *  db_create_format
+ *      fd:      descriptor of an empty database file
+ *      format:  DB_FORMAT_* to initialize the file with
+ *      flags:   DB_FLAG_* for the header
+ *
+ *  Legacy files need no initialization and have no room for flags.
+ *  Version 1, packed, hashed and dictionary files get a header, the
+ *  bitmap, directory or hash meta data area is left as a hole that reads
+ *  back as all zeros (a hash table with one empty bucket, a dictionary
+ *  with no names).  Dictionary files can't be checksummed, DB_FLAG_CRC is
+ *  dropped for them.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int db_create_format(int fd, int format, uint32_t flags) {
+    db_handle_t *h = db_handle(fd);
+    db_header_t hdr;
+
+    if (h == NULL)
+        return ERR_DB_FILE;
+
+    if (format == DB_FORMAT_LEGACY) {
+        h->format = DB_FORMAT_LEGACY;
+        h->data_off = 0;
+        h->bitmap_off = 0;
+        h->flags = 0;
+        return NO_ERROR;
+    }
+
+    db_init_header(&hdr, format);
+    hdr.flags = format == DB_FORMAT_DICT ? flags & ~DB_FLAG_CRC : flags;
+    if (db_write_at(fd, 0, &hdr, sizeof(hdr)) != sizeof(hdr))
+        return ERR_DB_FILE;
+    if (ftruncate(fd, hdr.data_offset) == -1)
+        return ERR_DB_FILE;
+
+    db_use_header(h, &hdr);
+    return NO_ERROR;
+}
+
+/*
+ *  db_detect_format
+ *      h:  handle of a freshly opened database
+ *
+ *  Looks at the start of the file to decide which layout it uses.  An
+ *  empty file is initialized with the layout requested by SDB_FORMAT,
+ *  with the whole file locked unless that layout has no header.
+ *
+ *  returns:  NO_ERROR       h->format and the offsets are set
+ *            ERR_DB_FILE    I/O error or a header this program can't read
+ */
+int db_detect_format(db_handle_t *h) {
+    int format = db_format_from_env();
+    db_header_t hdr;
+    ssize_t got;
+    int rc;
+
+    got = db_read_at(h->fd, 0, &hdr, sizeof(hdr));
+    if (got == 0 && format != DB_FORMAT_LEGACY) {
+        //another process may be creating the file too, only the first one
+        //to lock it writes the header, the rest read it.  Otherwise the
+        //ftruncate() of a late one would cut off what was added since.
+        if (db_lock_file(h->fd, F_WRLCK) != NO_ERROR)
+            return ERR_DB_FILE;
+        got = db_read_at(h->fd, 0, &hdr, sizeof(hdr));
+        rc = got == 0 ? db_create_format(h->fd, format, db_flags_from_env()) : NO_ERROR;
+        db_lock_file(h->fd, F_UNLCK);
+        if (rc != NO_ERROR)
+            return ERR_DB_FILE;
+        if (got == 0)
+            return NO_ERROR;
+    }
+    if (got == -1)
+        return ERR_DB_FILE;
+
+    if (got == 0)
+        return db_create_format(h->fd, format, db_flags_from_env());
+
+    if (got == sizeof(hdr) && hdr.magic == DB_MAGIC) {
+        if (hdr.version != DB_FORMAT_V1 && hdr.version != DB_FORMAT_PACKED &&
+            hdr.version != DB_FORMAT_HASHED && hdr.version != DB_FORMAT_DICT) {
+            printf(M_ERR_DB_FORMAT, hdr.version);
+            return ERR_DB_FILE;
+        }
+        db_use_header(h, &hdr);
+        return NO_ERROR;
+    }
+
+    h->format = DB_FORMAT_LEGACY;
+    h->data_off = 0;
+    h->bitmap_off = 0;
+    h->flags = 0;
+    return NO_ERROR;
+}
+
+/*
+ *  db_format
+ *      fd:  linux file descriptor
+ *
+ *  returns:  the DB_FORMAT_* layout of the database behind fd
+ */
+int db_format(int fd) {
+    db_handle_t *h = db_handle(fd);
+
+    return h == NULL ? DB_FORMAT_LEGACY : h->format;
+}
+
+/*
+ *  db_flags
+ *      fd:  linux file descriptor
+ *
+ *  returns:  the DB_FLAG_* of the database behind fd
+ */
+uint32_t db_flags(int fd) {
+    db_handle_t *h = db_handle(fd);
+
+    return h == NULL ? 0 : h->flags;
+}
+
+/*
+ *  record_crc
+ *      s:  student record
+ *
+ *  returns:  CRC-32C of the record without the 4 checksum bytes at the
+ *            end of lname
+ */
+uint32_t record_crc(const student_t *s) {
+    size_t at = offsetof(student_t, lname) + DB_CRC_LNAME;
+    uint32_t crc = crc32c(0, s, at);
+
+    return crc32c(crc, (const char *)s + at + sizeof(uint32_t),
+                  sizeof(student_t) - at - sizeof(uint32_t));
+}
+
+/*
+ *  db_seal
+ *      fd:  linux file descriptor
+ *      s:   record about to be written
+ *
+ *  In a checksummed database the last name is cut to DB_CRC_LNAME - 1
+ *  characters and the checksum stored behind it, other databases take
+ *  the record as it is.
+ */
+void db_seal(int fd, student_t *s) {
+    if (!(db_flags(fd) & DB_FLAG_CRC))
+        return;
+
+    memset(s->lname + DB_CRC_LNAME - 1, 0, sizeof(s->lname) - DB_CRC_LNAME + 1);
+    uint32_t crc = record_crc(s);
+    memcpy(s->lname + DB_CRC_LNAME, &crc, sizeof(crc));
+}
+
+/*
+ *  db_record_ok
+ *      fd:  linux file descriptor
+ *      s:   record as it was read
+ *
+ *  returns:  false if the database is checksummed and s is a live record
+ *            whose checksum does not match
+ */
+bool db_record_ok(int fd, const student_t *s) {
+    uint32_t crc;
+
+    if (s->id == 0 || !(db_flags(fd) & DB_FLAG_CRC))
+        return true;
+    memcpy(&crc, s->lname + DB_CRC_LNAME, sizeof(crc));
+    return crc == record_crc(s);
+}
+
+/*
+ *  db_slot_offset
+ *      fd:  linux file descriptor
+ *      id:  student id
+ *
+ *  returns:  the file offset of the record slot for id, -1 if the file is
+ *            packed or hashed and does not hold id (or its directory can't
+ *            be read).  A dictionary slot holds a dict_rec_t, it is read
+ *            and written with db_read_record() and db_write_record()
+ */
+off_t db_slot_offset(int fd, int id) {
+    db_handle_t *h = db_handle(fd);
+    off_t base = h == NULL ? 0 : h->data_off;
+    off_t offset;
+
+    if (h != NULL && h->format == DB_FORMAT_PACKED)
+        return packed_locate(fd, id, &offset) == 1 ? offset : -1;
+    if (h != NULL && h->format == DB_FORMAT_HASHED)
+        return hash_locate(fd, id, &offset) == 1 ? offset : -1;
+    if (h != NULL && h->format == DB_FORMAT_DICT)
+        return base + (off_t)id * sizeof(dict_rec_t);
+
+    return base + (off_t)id * sizeof(student_t);
+}
+
+/*
+ *  db_read_record
+ *      fd:      linux file descriptor
+ *      offset:  file offset of the slot, see db_slot_offset()
+ *      s:       receives the student
+ *
+ *  Other layouts store the student_t as it is, a dictionary file looks
+ *  its names up.
+ *
+ *  returns:  sizeof(student_t), fewer bytes past the end of the file, or
+ *            -1 on an I/O error, like db_read_at()
+ */
+ssize_t db_read_record(int fd, off_t offset, student_t *s) {
+    if (db_format(fd) == DB_FORMAT_DICT)
+        return dict_read(fd, offset, s);
+    return db_read_at(fd, offset, s, sizeof(student_t));
+}
+
+/*
+ *  db_write_record
+ *      fd:      linux file descriptor
+ *      offset:  file offset of the slot, see db_slot_offset()
+ *      s:       student to store, a zeroed one empties the slot
+ *
+ *  returns:  sizeof(student_t) on success, like db_write_at()
+ */
+ssize_t db_write_record(int fd, off_t offset, const student_t *s) {
+    if (db_format(fd) == DB_FORMAT_DICT)
+        return dict_write(fd, offset, s);
+    return db_write_at(fd, offset, s, sizeof(student_t));
+}
+
+/*
+ *  db_record_batch
+ *      fd:   linux file descriptor
+ *      ios:  transfers of whole student_t records, see db_io_batch()
+ *      n:    number of transfers
+ *
+ *  db_io_batch() for student records.  A dictionary file has no student_t
+ *  on disk, every record of a transfer goes through dict_read() or
+ *  dict_write() and res counts student_t bytes as if it had.
+ *
+ *  returns:  NO_ERROR, or ERR_DB_FILE if the batch could not be submitted
+ */
+int db_record_batch(int fd, db_io_t *ios, int n) {
+    if (db_format(fd) != DB_FORMAT_DICT)
+        return db_io_batch(fd, ios, n);
+
+    for (int i = 0; i < n; i++) {
+        int cnt = ios[i].iov != NULL ? ios[i].iovcnt : (int)(ios[i].len / sizeof(student_t));
+
+        ios[i].res = 0;
+        for (int k = 0; k < cnt; k++) {
+            student_t *s = ios[i].iov != NULL ? ios[i].iov[k].iov_base : (student_t *)ios[i].buff + k;
+            off_t offset = ios[i].offset + (off_t)k * sizeof(dict_rec_t);
+            ssize_t res = ios[i].write ? dict_write(fd, offset, s) : dict_read(fd, offset, s);
+
+            if (res <= 0) {
+                ios[i].res = res == -1 ? -1 : ios[i].res;
+                break;
+            }
+            ios[i].res += res;
+        }
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  db_slot_alloc
+ *      fd:     linux file descriptor
+ *      first:  lowest id
+ *      n:      number of consecutive ids, none of them in the database
+ *
+ *  Finds room for the records of ids first to first+n-1 before they are
+ *  written.  Other layouts have a fixed slot for every id, a packed file
+ *  appends n adjacent units and points the directory at them.  A hashed
+ *  file places every id in its own bucket, so it takes one id at a time.
+ *
+ *  returns:  the file offset of the slot for first, or -1 on failure
+ */
+off_t db_slot_alloc(int fd, int first, int n) {
+    if (db_format(fd) == DB_FORMAT_PACKED)
+        return packed_alloc(fd, first, n);
+    if (db_format(fd) == DB_FORMAT_HASHED)
+        return n == 1 ? hash_alloc(fd, first) : -1;
+
+    return db_slot_offset(fd, first);
+}
+
+/*
+ *  db_slot_reserve
+ *      fd:  linux file descriptor
+ *      n:   number of records about to be added
+ *
+ *  Called before db_slot_alloc() is called for a batch of new records.  A
+ *  hashed file splits its buckets now, while no slot it handed out is
+ *  still waiting for its record, so the batch does not pile up in overlong
+ *  chains.  Other layouts have nothing to prepare.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int db_slot_reserve(int fd, int n) {
+    if (db_format(fd) != DB_FORMAT_HASHED || n == 0)
+        return NO_ERROR;
+
+    int count = db_header_count(fd);
+    if (count < 0)
+        return ERR_DB_FILE;
+    return hash_grow(fd, count + n);
+}
+
+/*
+ *  db_slot_used
+ *      fd:  linux file descriptor
+ *      id:  student id
+ *
+ *  Checks the occupancy bitmap, a single byte read instead of reading and
+ *  decoding the whole record.  Packed files look the id up in their
+ *  directory instead, hashed files in their bucket.
+ *
+ *  returns:  1              the slot holds a student
+ *            0              the slot is free
+ *            ERR_DB_OP      the database has no bitmap (legacy layout)
+ *            ERR_DB_FILE    database file I/O issue
+ */
+int db_slot_used(int fd, int id) {
+    db_handle_t *h = db_handle(fd);
+    uint8_t byte;
+
+    if (h == NULL || h->format == DB_FORMAT_LEGACY)
+        return ERR_DB_OP;
+    if (h->format == DB_FORMAT_PACKED) {
+        off_t offset;
+        return packed_locate(fd, id, &offset);
+    }
+    if (h->format == DB_FORMAT_HASHED) {
+        off_t offset;
+        return hash_locate(fd, id, &offset);
+    }
+
+    if (db_read_at(fd, h->bitmap_off + id / 8, &byte, 1) != 1)
+        return ERR_DB_FILE;
+
+    return (byte >> (id % 8)) & 1;
+}
+
+/*
+ *  db_add_count
+ *      fd:     linux file descriptor
+ *      delta:  change in the number of live records
+ *
+ *  The count is shared by every writer, it stays locked until the command
+ *  commits.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int db_add_count(int fd, int delta) {
+    off_t count_off = offsetof(db_header_t, rec_count);
+    uint32_t count;
+
+    if (db_lock(fd, F_WRLCK, count_off, sizeof(count)) != NO_ERROR)
+        return ERR_DB_FILE;
+    if (db_read_at(fd, count_off, &count, sizeof(count)) != sizeof(count))
+        return ERR_DB_FILE;
+    count += delta;
+    if (db_write_at(fd, count_off, &count, sizeof(count)) != sizeof(count))
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  db_mark_slots
+ *      fd:    linux file descriptor
+ *      ids:   ids whose slots were just written
+ *      n:     number of ids
+ *      used:  true if the slots now hold students, false if emptied
+ *
+ *  Keeps the bitmap and the live record count in the header in step with
+ *  the record array.  The bitmap bytes spanning all ids are read and
+ *  written back once, so a bulk load pays two I/Os per batch.  Packed
+ *  files take emptied ids out of their directory instead, new ids were
+ *  put in it by db_slot_alloc().  Hashed files only keep the count, the
+ *  caller has checked every id was (or was not) there.  Legacy databases
+ *  have nothing to maintain.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int db_mark_slots(int fd, const int *ids, int n, bool used) {
+    static uint8_t span[DB_BITMAP_BYTES];
+    db_handle_t *h = db_handle(fd);
+    int lo = MAX_STD_ID, hi = 0;
+    int delta = 0;
+
+    if (h == NULL || h->format == DB_FORMAT_LEGACY || n == 0)
+        return NO_ERROR;
+
+    if (h->format == DB_FORMAT_PACKED) {
+        delta = used ? n : packed_free(fd, ids, n);
+        if (delta < 0)
+            return ERR_DB_FILE;
+        return db_add_count(fd, used ? delta : -delta);
+    }
+    if (h->format == DB_FORMAT_HASHED) {
+        return db_add_count(fd, used ? n : -n);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (ids[i] < lo)
+            lo = ids[i];
+        if (ids[i] > hi)
+            hi = ids[i];
+    }
+
+    //the bitmap bytes are shared with neighbouring ids, they stay locked
+    //until the command commits
+    size_t first = lo / 8;
+    size_t len = hi / 8 - first + 1;
+    if (db_lock(fd, F_WRLCK, h->bitmap_off + first, len) != NO_ERROR)
+        return ERR_DB_FILE;
+    if (db_read_at(fd, h->bitmap_off + first, span, len) != (ssize_t)len)
+        return ERR_DB_FILE;
+
+    for (int i = 0; i < n; i++) {
+        uint8_t *byte = &span[ids[i] / 8 - first];
+        uint8_t bit = 1 << (ids[i] % 8);
+
+        if (used && !(*byte & bit)) {
+            *byte |= bit;
+            delta++;
+        } else if (!used && (*byte & bit)) {
+            *byte &= ~bit;
+            delta--;
+        }
+    }
+
+    if (db_write_at(fd, h->bitmap_off + first, span, len) != (ssize_t)len)
+        return ERR_DB_FILE;
+
+    return db_add_count(fd, delta);
+}
+
+/*
+ *  db_header_count
+ *      fd:  linux file descriptor
+ *
+ *  returns:  the live record count kept in the header
+ *            ERR_DB_OP      the database has no header (legacy layout)
+ *            ERR_DB_FILE    database file I/O issue
+ */
+int db_header_count(int fd) {
+    uint32_t count;
+
+    if (db_format(fd) == DB_FORMAT_LEGACY)
+        return ERR_DB_OP;
+
+    if (db_read_at(fd, offsetof(db_header_t, rec_count), &count, sizeof(count)) != sizeof(count))
+        return ERR_DB_FILE;
+
+    return count;
+}
+
+/*
+ *  db_max_id
+ *      fd:  linux file descriptor
+ *
+ *  returns:  the highest student id the database can hold
+ */
+int db_max_id(int fd) {
+    return db_format(fd) == DB_FORMAT_HASHED ? DB_HASH_MAX_ID : MAX_STD_ID;
+}
+
+/*
+ *  first_clear
+ *      bits:  bitmap, bit i is bit i % 8 of byte i / 8.  Readable up to
+ *             the end of the 64 bit word holding bit to - 1
+ *      from:  first bit to look at
+ *      to:    bit to stop at
+ *
+ *  Checks 64 bits per step, the first clear bit of a word is found with
+ *  one count trailing zeros instruction.
+ *
+ *  returns:  the first clear bit from from on, or -1 if all are set
+ */
+static long first_clear(const uint8_t *bits, long from, long to) {
+    for (long w = from & ~63L; w < to; w += 64) {
+        uint64_t word;
+
+        memcpy(&word, bits + w / 8, sizeof(word));
+        word = ~le64toh(word);
+        if (w < from)
+            word &= ~0ull << (from - w);
+        if (word != 0) {
+            long bit = w + __builtin_ctzll(word);
+            return bit < to ? bit : -1;
+        }
+    }
+    return -1;
+}
+
+//ids in use within a window of ids, collected by mark_used()
+typedef struct free_id_state {
+    uint8_t *bits;
+    int lo;
+    long n;
+    long seen;      //students in the whole file
+} free_id_state_t;
+
+/*
+ *  mark_used
+ *      db_scan() callback that sets the bit of every id in the window
+ */
+static int mark_used(student_t *recs, int n, void *arg) {
+    free_id_state_t *st = arg;
+
+    for (int i = 0; i < n; i++) {
+        long bit = (long)recs[i].id - st->lo;
+
+        if (recs[i].id != 0 && bit >= 0 && bit < st->n)
+            st->bits[bit / 8] |= 1 << (bit % 8);
+        st->seen += recs[i].id != 0;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  db_free_id
+ *      fd:  linux file descriptor
+ *      lo:  lowest id wanted
+ *      hi:  highest id wanted
+ *
+ *  Finds the lowest id from lo to hi that has no student.  Version 1 and
+ *  dictionary files read their occupancy bitmap for the range once and
+ *  search it a word at a time.  The other layouts have no bitmap, one
+ *  scan builds one in memory.  A file holding count students has a free
+ *  id among any count + 1 of them, so a hashed file only needs that many
+ *  bits however wide the range is (one more scan with a wider window is
+ *  needed if other processes added students after the count was read).
+ *  The answer is only a hint, the caller still has to lock the slot and
+ *  check it.
+ *
+ *  returns:  the id, 0 if every id in the range is taken, or ERR_DB_FILE
+ */
+int db_free_id(int fd, int lo, int hi) {
+    db_handle_t *h = db_handle(fd);
+    free_id_state_t st;
+    long bit;
+
+    if (h != NULL && (h->format == DB_FORMAT_V1 || h->format == DB_FORMAT_DICT)) {
+        long base = lo & ~63L;
+        size_t len = ((hi | 63L) - base + 1) / 8;
+
+        st.bits = calloc(len, 1);
+        if (st.bits == NULL || db_read_at(fd, h->bitmap_off + base / 8, st.bits, len) < 0) {
+            free(st.bits);
+            return ERR_DB_FILE;
+        }
+        bit = first_clear(st.bits, lo - base, (long)hi - base + 1);
+        free(st.bits);
+        return bit < 0 ? 0 : base + bit;
+    }
+
+    long range = (long)hi - lo + 1;
+    long count = db_header_count(fd);
+
+    st.lo = lo;
+    st.seen = count < 0 ? range : count;
+    do {
+        st.n = st.seen < range ? st.seen + 1 : range;
+        st.seen = 0;
+        st.bits = calloc((st.n + 63) / 64, sizeof(uint64_t));
+        if (st.bits == NULL || db_scan(fd, mark_used, &st) != NO_ERROR) {
+            free(st.bits);
+            return ERR_DB_FILE;
+        }
+        bit = first_clear(st.bits, 0, st.n);
+        free(st.bits);
+    } while (bit < 0 && st.n < range && st.seen >= st.n);
+    return bit < 0 ? 0 : lo + bit;
+}
+
+//state shared with rebuild_records() while writing the new file
+typedef struct rebuild_state {
+    int tmp_fd;
+    uint8_t *bitmap;
+    uint32_t count;
+    int max_id;
+    student_t run[DB_SCAN_BLOCK / sizeof(student_t)];
+    int run_len;
+} rebuild_state_t;
+
+/*
+ *  flush_run
+ *      st:  rebuild state holding a run of records with consecutive ids
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_OP if the write failed
+ */
+static int flush_run(rebuild_state_t *st) {
+    if (st->run_len == 0)
+        return NO_ERROR;
+
+    off_t offset = DB_DATA_OFFSET + (off_t)st->run[0].id * sizeof(student_t);
+    ssize_t len = st->run_len * sizeof(student_t);
+    st->run_len = 0;
+
+    if (pwrite(st->tmp_fd, st->run, len, offset) != len) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_OP;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  rebuild_records
+ *      db_scan() callback that places every live record in its slot of the
+ *      new file.  The slot comes from the id stored in the record, so files
+ *      packed by an older compress_db() are repaired as well.
+ */
+static int rebuild_records(student_t *recs, int n, void *arg) {
+    rebuild_state_t *st = arg;
+    int max_run = sizeof(st->run) / sizeof(st->run[0]);
+
+    for (int i = 0; i < n; i++) {
+        int id = recs[i].id;
+
+        if (id == 0)
+            continue;
+        if (id < MIN_STD_ID || id > MAX_STD_ID) {
+            printf(M_ERR_DB_READ);
+            return ERR_DB_OP;
+        }
+
+        if (st->run_len > 0 &&
+            (st->run_len == max_run || st->run[st->run_len - 1].id + 1 != id)) {
+            if (flush_run(st) != NO_ERROR)
+                return ERR_DB_OP;
+        }
+        st->run[st->run_len++] = recs[i];
+
+        if (!(st->bitmap[id / 8] & (1 << (id % 8)))) {
+            st->bitmap[id / 8] |= 1 << (id % 8);
+            st->count++;
+        }
+        if (id > st->max_id)
+            st->max_id = id;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  rebuild_db
+ *      fd:  linux file descriptor
+ *
+ *  Writes every live record of the database into a fresh version 1 file
+ *  (TMP_DB_FILE) with an accurate header and bitmap, then renames it over
+ *  DB_FILE.  Deleted records are not copied so they end up as holes.
+ *  This is how legacy databases are upgraded, compress_db() writes a
+ *  packed file with pack_db() instead.  fd is closed, also on failure.
+ *
+ *  returns:  fd of the rebuilt database, or ERR_DB_FILE on failure
+ */
+int rebuild_db(int fd) {
+    static rebuild_state_t st;
+    db_header_t hdr;
+    int rc;
+
+    if (db_commit(fd) != NO_ERROR || db_lock_file(fd, F_WRLCK) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.bitmap = calloc(1, DB_BITMAP_BYTES);
+    if (st.bitmap == NULL) {
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
+    st.tmp_fd = open(TMP_DB_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (st.tmp_fd == -1) {
+        printf(M_ERR_DB_OPEN);
+        free(st.bitmap);
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
+    rc = db_scan(fd, rebuild_records, &st);
+    if (rc == NO_ERROR)
+        rc = flush_run(&st);
+    if (rc == ERR_DB_FILE)
+        printf(M_ERR_DB_READ);
+
+    if (rc == NO_ERROR) {
+        db_init_header(&hdr, DB_FORMAT_V1);
+        hdr.rec_count = st.count;
+        hdr.flags = db_flags(fd);
+
+        off_t size = DB_DATA_OFFSET;
+        if (st.max_id > 0)
+            size += (off_t)(st.max_id + 1) * sizeof(student_t);
+
+        if (pwrite(st.tmp_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            pwrite(st.tmp_fd, st.bitmap, DB_BITMAP_BYTES, DB_BITMAP_OFFSET) != DB_BITMAP_BYTES ||
+            ftruncate(st.tmp_fd, size) == -1 || fsync(st.tmp_fd) == -1) {
+            printf(M_ERR_DB_WRITE);
+            rc = ERR_DB_FILE;
+        }
+    }
+
+    free(st.bitmap);
+    close(st.tmp_fd);
+    if (rc != NO_ERROR) {
+        unlink(TMP_DB_FILE);
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
+    //renamed while the old file is still locked, see db_replaced()
+    rc = rename(TMP_DB_FILE, DB_FILE);
+    close_db(fd);
+    if (rc == -1) {
+        printf(M_ERR_DB_CREATE);
+        return ERR_DB_FILE;
+    }
+
+    return open_db(DB_FILE, false);
+}
+
+/*
+ *  upgrade_db
+ *      fd:  linux file descriptor
+ *
+ *  Converts a legacy headerless database to the version 1 layout.
+ *  Databases that already have a header (version 1 or packed) are left
+ *  alone.
+ *
+ *  returns:  fd of the (possibly new) database file, or ERR_DB_FILE
+ *
+ *  console:  M_DB_UPGRADED or M_DB_FORMAT_CURRENT on success
+ */
+int upgrade_db(int fd) {
+    if (db_format(fd) != DB_FORMAT_LEGACY) {
+        printf(M_DB_FORMAT_CURRENT, db_format(fd));
+        return fd;
+    }
+
+    fd = rebuild_db(fd);
+    if (fd < 0)
+        return ERR_DB_FILE;
+
+    printf(M_DB_UPGRADED, DB_FORMAT_V1);
+    return fd;
+}
@@ -0,0 +1,484 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//Hashed database files, a linear hash table of pages (layout in db.h).
+//Writers hold the lock on the hash_meta_t taken by db_lock_slots() until
+//they commit, so only one of them changes the table at a time.  Lookups do
+//not lock: a split copies the records that move into the new bucket
+//before it publishes the new meta data and removes them from the old
+//bucket after, and a lookup that comes up empty checks that the version
+//did not change underneath it.  Everything goes through db_read_at() and
+//db_write_at() so every engine and the write-ahead log work unchanged.
+
+//gpa of a slot handed out by hash_alloc() whose record is not written yet
+#define HASH_RESERVED       -1
+
+//a bucket page as read into memory, slot 0 is the page header
+typedef student_t hash_page_t[DB_HASH_SLOTS];
+
+/*
+ *  hash_id
+ *      id:  student id
+ *
+ *  Mixes the bits of id (the murmur3 finalizer) so ids that follow a
+ *  pattern still spread over the buckets.
+ *
+ *  returns:  hash of id
+ */
+static uint32_t hash_id(int id) {
+    uint32_t h = id;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+/*
+ *  hash_gen
+ *      bucket:  bucket number
+ *
+ *  returns:  the generation of the bucket, the number of bits it takes
+ */
+static int hash_gen(uint32_t bucket) {
+    return bucket == 0 ? 0 : 32 - __builtin_clz(bucket);
+}
+
+/*
+ *  hash_bucket
+ *      m:   table meta data
+ *      id:  student id
+ *
+ *  returns:  the bucket id belongs in
+ */
+static uint32_t hash_bucket(const hash_meta_t *m, int id) {
+    uint32_t bucket = hash_id(id) & m->high_mask;
+
+    return bucket > m->max_bucket ? bucket & m->low_mask : bucket;
+}
+
+/*
+ *  bucket_page
+ *      m:       table meta data
+ *      bucket:  bucket number
+ *
+ *  returns:  the first page of the bucket
+ */
+static uint32_t bucket_page(const hash_meta_t *m, uint32_t bucket) {
+    int gen = hash_gen(bucket);
+
+    return bucket + (gen > 0 ? m->spares[gen - 1] : 0);
+}
+
+/*
+ *  page_offset
+ *      h:     database handle
+ *      page:  page number
+ *      slot:  slot in the page
+ *
+ *  returns:  the file offset of the slot
+ */
+static off_t page_offset(db_handle_t *h, uint32_t page, int slot) {
+    return h->data_off + (off_t)page * DB_HASH_PAGE + slot * sizeof(student_t);
+}
+
+/*
+ *  read_meta
+ *      h:  database handle
+ *      m:  receives the table meta data
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int read_meta(db_handle_t *h, hash_meta_t *m) {
+    return db_read_at(h->fd, h->bitmap_off, m, sizeof(*m)) == sizeof(*m) ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  write_meta
+ *      h:  database handle, the meta data is locked
+ *      m:  table meta data to store
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int write_meta(db_handle_t *h, const hash_meta_t *m) {
+    return db_write_at(h->fd, h->bitmap_off, m, sizeof(*m)) == sizeof(*m) ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  read_page
+ *      h:     database handle
+ *      page:  page number
+ *      pg:    receives the page, the part past the end of the file (or
+ *             in a hole) reads as zeros
+ *
+ *  returns:  the next page of the chain + 1, 0 at the end, or ERR_DB_FILE
+ */
+static int64_t read_page(db_handle_t *h, uint32_t page, hash_page_t pg) {
+    hash_page_hdr_t hdr;
+    ssize_t got = db_read_at(h->fd, page_offset(h, page, 0), pg, DB_HASH_PAGE);
+
+    if (got == -1)
+        return ERR_DB_FILE;
+    memset((char *)pg + got, 0, DB_HASH_PAGE - got);
+    memcpy(&hdr, &pg[0], sizeof(hdr));
+    return hdr.next;
+}
+
+/*
+ *  write_link
+ *      h:     database handle
+ *      page:  page whose header is written
+ *      next:  next page of the chain + 1, 0 at the end
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int write_link(db_handle_t *h, uint32_t page, uint32_t next) {
+    hash_page_hdr_t hdr = {0};
+
+    hdr.next = next;
+    return db_write_at(h->fd, page_offset(h, page, 0), &hdr, sizeof(hdr)) == sizeof(hdr) ?
+           NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  hash_locate
+ *      fd:      linux file descriptor of a hashed database
+ *      id:      student id
+ *      offset:  set to the file offset of the record for id
+ *
+ *  Walks the chain of the bucket of id.  If id is not there and a split
+ *  moved records in the meantime the lookup is done again.
+ *
+ *  returns:  1              id is in the database, *offset is set
+ *            0              id is not in the database
+ *            ERR_DB_FILE    database file I/O issue
+ */
+int hash_locate(int fd, int id, off_t *offset) {
+    db_handle_t *h = db_handle(fd);
+    static hash_page_t pg;
+    hash_meta_t m;
+    uint32_t version;
+
+    if (id < MIN_STD_ID)
+        return 0;
+
+    do {
+        if (read_meta(h, &m) != NO_ERROR)
+            return ERR_DB_FILE;
+
+        int64_t next = bucket_page(&m, hash_bucket(&m, id)) + 1;
+        while (next > 0) {
+            uint32_t page = next - 1;
+
+            next = read_page(h, page, pg);
+            if (next < 0)
+                return ERR_DB_FILE;
+            for (unsigned s = 1; s < DB_HASH_SLOTS; s++) {
+                if (pg[s].id == id) {
+                    *offset = page_offset(h, page, s);
+                    return 1;
+                }
+            }
+        }
+
+        version = m.version;
+        if (read_meta(h, &m) != NO_ERROR)
+            return ERR_DB_FILE;
+    } while (m.version != version);
+
+    return 0;
+}
+
+/*
+ *  hash_new_page
+ *      h:     database handle, the meta data is locked
+ *      m:     table meta data, updated but not written
+ *      page:  set to an empty page that belongs to no chain
+ *
+ *  Takes a page off the free list, or else the next overflow page of the
+ *  current generation.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int hash_new_page(db_handle_t *h, hash_meta_t *m, uint32_t *page) {
+    static hash_page_t pg;
+
+    if (m->free_page != 0) {
+        *page = m->free_page - 1;
+        int64_t next = read_page(h, *page, pg);
+        if (next < 0 || write_link(h, *page, 0) != NO_ERROR)
+            return ERR_DB_FILE;
+        m->free_page = next;
+        return NO_ERROR;
+    }
+
+    int gen = hash_gen(m->max_bucket);
+    *page = (1u << gen) + m->spares[gen];
+    m->spares[gen]++;
+    return NO_ERROR;
+}
+
+/*
+ *  hash_alloc
+ *      fd:  linux file descriptor of a hashed database, the meta data is
+ *           locked by db_lock_slots()
+ *      id:  student id, not in the database
+ *
+ *  Finds a free slot for id in its bucket, adding an overflow page to the
+ *  chain if every slot is taken.  The slot is marked reserved so the next
+ *  call does not hand it out again before the caller writes the record.
+ *
+ *  returns:  the file offset of the slot, or -1 on failure
+ */
+off_t hash_alloc(int fd, int id) {
+    static const student_t reserved = { .gpa = HASH_RESERVED };
+    db_handle_t *h = db_handle(fd);
+    static hash_page_t pg;
+    hash_meta_t m;
+    uint32_t page, fresh;
+    int64_t next;
+    off_t offset = -1;
+
+    if (read_meta(h, &m) != NO_ERROR)
+        return -1;
+
+    page = bucket_page(&m, hash_bucket(&m, id));
+    for (;;) {
+        next = read_page(h, page, pg);
+        if (next < 0)
+            return -1;
+        for (unsigned s = 1; s < DB_HASH_SLOTS && offset < 0; s++) {
+            if (pg[s].id == 0 && pg[s].gpa != HASH_RESERVED)
+                offset = page_offset(h, page, s);
+        }
+        if (offset >= 0 || next == 0)
+            break;
+        page = next - 1;
+    }
+
+    //the chain is full, a new page goes on its end
+    if (offset < 0) {
+        if (hash_new_page(h, &m, &fresh) != NO_ERROR || write_meta(h, &m) != NO_ERROR ||
+            write_link(h, page, fresh + 1) != NO_ERROR)
+            return -1;
+        offset = page_offset(h, fresh, 1);
+    }
+
+    if (db_write_at(fd, offset, &reserved, sizeof(reserved)) != sizeof(reserved))
+        return -1;
+    return offset;
+}
+
+/*
+ *  fill_chain
+ *      h:     database handle, the meta data is locked
+ *      m:     table meta data, updated but not written
+ *      page:  first page of a chain that is not in use yet
+ *      recs:  students to store in the chain
+ *      n:     number of students
+ *
+ *  Writes recs into a new chain, overflow pages are added as needed.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int fill_chain(db_handle_t *h, hash_meta_t *m, uint32_t page, student_t *recs, int n) {
+    static hash_page_t pg;
+    int per_page = DB_HASH_SLOTS - 1;
+
+    for (int first = 0; first == 0 || first < n; first += per_page) {
+        hash_page_hdr_t hdr = {0};
+        int cnt = n - first < per_page ? n - first : per_page;
+        uint32_t next;
+
+        if (first + per_page < n) {
+            if (hash_new_page(h, m, &next) != NO_ERROR)
+                return ERR_DB_FILE;
+            hdr.next = next + 1;
+        }
+
+        memset(pg, 0, sizeof(pg));
+        memcpy(&pg[0], &hdr, sizeof(hdr));
+        if (cnt > 0)
+            memcpy(&pg[1], &recs[first], cnt * sizeof(student_t));
+        if (db_write_at(h->fd, page_offset(h, page, 0), pg, sizeof(pg)) != sizeof(pg))
+            return ERR_DB_FILE;
+        page = hdr.next - 1;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  gather_moves
+ *      h:       database handle
+ *      m:       table meta data with the new masks
+ *      bucket:  the bucket being split
+ *      target:  the new bucket
+ *      move:    set to the records that go to target (malloc()ed)
+ *
+ *  returns:  number of records in *move, or ERR_DB_FILE
+ */
+static int gather_moves(db_handle_t *h, const hash_meta_t *m, uint32_t bucket,
+                        uint32_t target, student_t **move) {
+    static hash_page_t pg;
+    int64_t next = bucket_page(m, bucket) + 1;
+    int n = 0, size = 0;
+
+    *move = NULL;
+    while (next > 0) {
+        next = read_page(h, next - 1, pg);
+        if (next < 0)
+            return ERR_DB_FILE;
+
+        if (n + (int)DB_HASH_SLOTS > size) {
+            student_t *more = realloc(*move, (size + DB_HASH_SLOTS) * 2 * sizeof(student_t));
+            if (more == NULL)
+                return ERR_DB_FILE;
+            *move = more;
+            size = (size + DB_HASH_SLOTS) * 2;
+        }
+        for (unsigned s = 1; s < DB_HASH_SLOTS; s++) {
+            if (pg[s].id != 0 && (hash_id(pg[s].id) & m->high_mask) == target)
+                (*move)[n++] = pg[s];
+        }
+    }
+    return n;
+}
+
+/*
+ *  drop_moves
+ *      h:       database handle, the meta data is locked
+ *      m:       table meta data, updated but not written
+ *      bucket:  the bucket that was split
+ *      target:  the new bucket
+ *
+ *  Clears the slots of the records that went to target.  The records
+ *  that stay keep their slots, so a lookup walking the chain meanwhile
+ *  still finds them.  Pages left empty at the end of the chain go on the
+ *  free list.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int drop_moves(db_handle_t *h, hash_meta_t *m, uint32_t bucket, uint32_t target) {
+    static hash_page_t pg;
+    uint32_t page = bucket_page(m, bucket);
+    uint32_t last_used = page;
+    int64_t next;
+
+    for (;;) {
+        bool changed = false, used = false;
+
+        next = read_page(h, page, pg);
+        if (next < 0)
+            return ERR_DB_FILE;
+        for (unsigned s = 1; s < DB_HASH_SLOTS; s++) {
+            if (pg[s].id != 0 && (hash_id(pg[s].id) & m->high_mask) == target) {
+                pg[s] = EMPTY_STUDENT_RECORD;
+                changed = true;
+            }
+            used = used || pg[s].id != 0 || pg[s].gpa == HASH_RESERVED;
+        }
+        if (changed && db_write_at(h->fd, page_offset(h, page, 0), pg, sizeof(pg)) != sizeof(pg))
+            return ERR_DB_FILE;
+        if (used)
+            last_used = page;
+        if (next == 0)
+            break;
+        page = next - 1;
+    }
+
+    //cut the chain after the last page still in use, then free the rest
+    next = read_page(h, last_used, pg);
+    if (next < 0 || (next > 0 && write_link(h, last_used, 0) != NO_ERROR))
+        return ERR_DB_FILE;
+    while (next > 0) {
+        page = next - 1;
+        next = read_page(h, page, pg);
+        if (next < 0 || write_link(h, page, m->free_page) != NO_ERROR)
+            return ERR_DB_FILE;
+        m->free_page = page + 1;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  hash_split
+ *      h:  database handle, the meta data is locked
+ *      m:  table meta data, written when done
+ *
+ *  Adds bucket max_bucket + 1 and moves into it the records of the bucket
+ *  it splits from whose hash now selects it.  The moved records are in the
+ *  new bucket before the new meta data is published, and are cleared from
+ *  the old one only after that.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int hash_split(db_handle_t *h, hash_meta_t *m) {
+    uint32_t target = m->max_bucket + 1;
+    student_t *move;
+    int rc = NO_ERROR;
+
+    if (target > m->high_mask) {
+        m->low_mask = m->high_mask;
+        m->high_mask = target | m->low_mask;
+    }
+    int gen = hash_gen(target);
+    if (gen > hash_gen(m->max_bucket))
+        m->spares[gen] = m->spares[gen - 1];
+    uint32_t bucket = target & m->low_mask;
+
+    int n = gather_moves(h, m, bucket, target, &move);
+    if (n < 0)
+        rc = ERR_DB_FILE;
+
+    m->max_bucket = target;
+    m->version++;
+    if (rc == NO_ERROR)
+        rc = fill_chain(h, m, bucket_page(m, target), move, n);
+    if (rc == NO_ERROR)
+        rc = write_meta(h, m);
+    if (rc == NO_ERROR && n > 0)
+        rc = drop_moves(h, m, bucket, target);
+    if (rc == NO_ERROR && n > 0)
+        rc = write_meta(h, m);
+
+    free(move);
+    return rc;
+}
+
+/*
+ *  hash_grow
+ *      fd:     linux file descriptor of a hashed database, the meta data
+ *              is locked by db_lock_slots()
+ *      count:  number of students the database is about to hold
+ *
+ *  Splits buckets until they hold at most DB_HASH_FILL students on
+ *  average.  A split leaves slots handed out by hash_alloc() where they
+ *  are, so this must run before the slots for new records are taken, see
+ *  db_slot_reserve().
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int hash_grow(int fd, int count) {
+    db_handle_t *h = db_handle(fd);
+    hash_meta_t m;
+
+    if (read_meta(h, &m) != NO_ERROR)
+        return ERR_DB_FILE;
+    while ((uint64_t)count > ((uint64_t)m.max_bucket + 1) * DB_HASH_FILL) {
+        if (hash_split(h, &m) != NO_ERROR)
+            return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
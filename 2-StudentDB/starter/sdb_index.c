@@ -0,0 +1,845 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//Secondary indexes known to sdbsc.  Each one lives in its own file, see
+//the layout notes in db.h, and is kept up to date by the index_*() hooks
+//below once it exists.  An index is created the first time a query needs
+//it, so databases that are never queried by name pay nothing.
+static const struct {
+    char     *path;
+    uint32_t  nbuckets;
+} idx_defs[DB_IDX_COUNT] = {
+    [DB_IDX_NAME] = { NAME_IDX_FILE, NAME_IDX_BUCKETS },
+    [DB_IDX_GPA]  = { GPA_IDX_FILE,  GPA_IDX_BUCKETS },
+};
+
+/*
+ *  idx_dir_pages
+ *      nbuckets:  number of buckets in the index
+ *
+ *  returns:  the number of pages the directory occupies
+ */
+static uint32_t idx_dir_pages(uint32_t nbuckets) {
+    return (nbuckets * sizeof(uint32_t) + IDX_PAGE_SIZE - 1) / IDX_PAGE_SIZE;
+}
+
+static int idx_read_page(int ifd, uint32_t pno, idx_page_t *pg) {
+    if (pread(ifd, pg, IDX_PAGE_SIZE, (off_t)pno * IDX_PAGE_SIZE) != IDX_PAGE_SIZE)
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+static int idx_write_page(int ifd, uint32_t pno, idx_page_t *pg) {
+    if (pwrite(ifd, pg, IDX_PAGE_SIZE, (off_t)pno * IDX_PAGE_SIZE) != IDX_PAGE_SIZE)
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+static int idx_read_header(int ifd, idx_header_t *hdr) {
+    if (pread(ifd, hdr, sizeof(*hdr), 0) != sizeof(*hdr))
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  idx_bucket_head
+ *      ifd:     index file descriptor
+ *      bucket:  bucket number
+ *
+ *  returns:  the first page of the bucket (0 if it is empty), or
+ *            ERR_DB_FILE on a read error
+ */
+static int64_t idx_bucket_head(int ifd, uint32_t bucket) {
+    uint32_t head;
+
+    if (pread(ifd, &head, sizeof(head), IDX_PAGE_SIZE + (off_t)bucket * sizeof(head)) != sizeof(head))
+        return ERR_DB_FILE;
+    return head;
+}
+
+/*
+ *  idx_init
+ *      ifd:    index file descriptor
+ *      owner:  nbuckets, db_ino and db_birth for the new header
+ *
+ *  Empties the index, leaving a header and an all zero directory.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int idx_init(int ifd, const idx_header_t *owner) {
+    idx_header_t hdr = *owner;
+
+    hdr.magic = IDX_MAGIC;
+    hdr.version = IDX_VERSION;
+    hdr.npages = 1 + idx_dir_pages(hdr.nbuckets);
+
+    if (ftruncate(ifd, 0) == -1 ||
+        pwrite(ifd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        ftruncate(ifd, (off_t)hdr.npages * IDX_PAGE_SIZE) == -1)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  idx_open
+ *      path:    index file name
+ *      owner:   expected nbuckets and identity of the database
+ *      create:  create the file if it does not exist
+ *      fresh:   set to true when the index is new, or belonged to another
+ *               database file and has been emptied, and still has to be
+ *               filled
+ *
+ *  returns:  index file descriptor, or -1 if the file does not exist (and
+ *            create is false) or can't be used
+ */
+int idx_open(char *path, const idx_header_t *owner, bool create, bool *fresh) {
+    idx_header_t hdr;
+    struct stat st;
+    int ifd;
+
+    ifd = open(path, O_RDWR | (create ? O_CREAT : 0), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (ifd == -1)
+        return -1;
+
+    *fresh = false;
+    if (db_lock(ifd, F_WRLCK, 0, 0) != NO_ERROR || fstat(ifd, &st) == -1) {
+        close(ifd);
+        return -1;
+    }
+
+    if (st.st_size == 0 || idx_read_header(ifd, &hdr) != NO_ERROR ||
+        hdr.magic != IDX_MAGIC || hdr.version != IDX_VERSION ||
+        hdr.nbuckets != owner->nbuckets || hdr.db_ino != owner->db_ino ||
+        hdr.db_birth != owner->db_birth) {
+        if (idx_init(ifd, owner) != NO_ERROR) {
+            close(ifd);
+            return -1;
+        }
+        *fresh = true;
+    }
+
+    db_lock(ifd, F_UNLCK, 0, 0);
+    return ifd;
+}
+
+/*
+ *  cmp_item_bucket
+ *      qsort() comparator, groups index items by bucket
+ */
+static int cmp_item_bucket(const void *a, const void *b) {
+    const idx_item_t *ia = a;
+    const idx_item_t *ib = b;
+
+    if (ia->bucket != ib->bucket)
+        return ia->bucket < ib->bucket ? -1 : 1;
+    return 0;
+}
+
+/*
+ *  idx_insert
+ *      ifd:    index file descriptor
+ *      items:  entries to add together with their bucket, reordered
+ *      n:      number of items
+ *
+ *  Items are grouped by bucket so every touched bucket costs one page read
+ *  and one page write no matter how many entries it receives.  New
+ *  entries go into the first page of the bucket; when it is full a new
+ *  page is allocated at the end of the file and becomes the first page.
+ *  The index is locked exclusively while it is being changed.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int idx_insert(int ifd, idx_item_t *items, int n) {
+    static idx_page_t pg;
+    idx_header_t hdr;
+    uint32_t *dir = NULL;
+    bool dir_dirty = false;
+    int rc = NO_ERROR;
+
+    if (n == 0)
+        return NO_ERROR;
+    if (db_lock(ifd, F_WRLCK, 0, 0) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    size_t dir_len = 0;
+    if (idx_read_header(ifd, &hdr) != NO_ERROR)
+        rc = ERR_DB_FILE;
+    if (rc == NO_ERROR) {
+        dir_len = hdr.nbuckets * sizeof(uint32_t);
+        dir = malloc(dir_len);
+        if (dir == NULL || pread(ifd, dir, dir_len, IDX_PAGE_SIZE) != (ssize_t)dir_len)
+            rc = ERR_DB_FILE;
+    }
+    if (rc != NO_ERROR) {
+        free(dir);
+        db_lock(ifd, F_UNLCK, 0, 0);
+        return rc;
+    }
+
+    qsort(items, n, sizeof(items[0]), cmp_item_bucket);
+
+    for (int i = 0; i < n && rc == NO_ERROR; ) {
+        uint32_t bucket = items[i].bucket % hdr.nbuckets;
+        uint32_t head = dir[bucket];
+
+        if (head != 0 && idx_read_page(ifd, head, &pg) != NO_ERROR) {
+            rc = ERR_DB_FILE;
+            break;
+        }
+
+        for ( ; i < n && items[i].bucket % hdr.nbuckets == bucket; i++) {
+            if (head == 0 || pg.count == IDX_PAGE_ENTRIES) {
+                if (head != 0 && idx_write_page(ifd, head, &pg) != NO_ERROR) {
+                    rc = ERR_DB_FILE;
+                    break;
+                }
+                memset(&pg, 0, sizeof(pg));
+                pg.next = head;
+                head = hdr.npages++;
+            }
+            pg.entries[pg.count++] = items[i].entry;
+        }
+
+        if (rc == NO_ERROR && idx_write_page(ifd, head, &pg) != NO_ERROR)
+            rc = ERR_DB_FILE;
+        if (dir[bucket] != head) {
+            dir[bucket] = head;
+            dir_dirty = true;
+        }
+    }
+
+    if (rc == NO_ERROR && dir_dirty) {
+        if (pwrite(ifd, dir, dir_len, IDX_PAGE_SIZE) != (ssize_t)dir_len ||
+            pwrite(ifd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            rc = ERR_DB_FILE;
+    }
+
+    free(dir);
+    db_lock(ifd, F_UNLCK, 0, 0);
+    return rc;
+}
+
+/*
+ *  idx_remove_entry
+ *      ifd:   index file descriptor, locked by the caller
+ *      item:  entry to remove, matched on bucket, key and id
+ *
+ *  The entry is replaced by the last entry of its page so pages stay
+ *  densely packed.
+ *
+ *  returns:  NO_ERROR       entry removed
+ *            SRCH_NOT_FOUND the entry was not in the index
+ *            ERR_DB_FILE    index file I/O issue
+ */
+static int idx_remove_entry(int ifd, idx_item_t *item) {
+    static idx_page_t pg;
+    idx_header_t hdr;
+    int64_t pno;
+
+    if (idx_read_header(ifd, &hdr) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    pno = idx_bucket_head(ifd, item->bucket % hdr.nbuckets);
+    while (pno > 0) {
+        if (idx_read_page(ifd, pno, &pg) != NO_ERROR)
+            return ERR_DB_FILE;
+
+        for (uint32_t k = 0; k < pg.count; k++) {
+            idx_entry_t *e = &pg.entries[k];
+
+            if (e->id == item->entry.id && e->key == item->entry.key) {
+                *e = pg.entries[--pg.count];
+                return idx_write_page(ifd, pno, &pg);
+            }
+        }
+        pno = pg.next;
+    }
+
+    return pno < 0 ? ERR_DB_FILE : SRCH_NOT_FOUND;
+}
+
+/*
+ *  idx_remove
+ *      ifd:   index file descriptor
+ *      item:  entry to remove, see idx_remove_entry()
+ *
+ *  returns:  NO_ERROR, SRCH_NOT_FOUND or ERR_DB_FILE
+ */
+int idx_remove(int ifd, idx_item_t *item) {
+    int rc;
+
+    if (db_lock(ifd, F_WRLCK, 0, 0) != NO_ERROR)
+        return ERR_DB_FILE;
+    rc = idx_remove_entry(ifd, item);
+    db_lock(ifd, F_UNLCK, 0, 0);
+    return rc;
+}
+
+/*
+ *  idx_walk_bucket
+ *      ifd:     index file descriptor, locked by the caller
+ *      bucket:  bucket to visit
+ *      fn:      called for every entry in the bucket, a negative return
+ *               value stops the walk
+ *      arg:     passed through to fn
+ *
+ *  returns:  NO_ERROR, ERR_DB_FILE on a read error, or fn's negative value
+ */
+static int idx_walk_bucket(int ifd, uint32_t bucket, idx_visit_fn fn, void *arg) {
+    static idx_page_t pg;
+    idx_header_t hdr;
+    int64_t pno;
+
+    if (idx_read_header(ifd, &hdr) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    pno = idx_bucket_head(ifd, bucket % hdr.nbuckets);
+    while (pno > 0) {
+        if (idx_read_page(ifd, pno, &pg) != NO_ERROR)
+            return ERR_DB_FILE;
+
+        for (uint32_t k = 0; k < pg.count; k++) {
+            int rc = fn(&pg.entries[k], arg);
+            if (rc < 0)
+                return rc;
+        }
+        pno = pg.next;
+    }
+
+    return pno < 0 ? ERR_DB_FILE : NO_ERROR;
+}
+
+/*
+ *  idx_lookup
+ *      ifd:     index file descriptor
+ *      bucket:  bucket to visit, see idx_walk_bucket()
+ *      fn:      called for every entry in the bucket
+ *      arg:     passed through to fn
+ *
+ *  The index is read locked while the bucket is walked.
+ *
+ *  returns:  NO_ERROR, ERR_DB_FILE on a read error, or fn's negative value
+ */
+int idx_lookup(int ifd, uint32_t bucket, idx_visit_fn fn, void *arg) {
+    int rc;
+
+    if (db_lock(ifd, F_RDLCK, 0, 0) != NO_ERROR)
+        return ERR_DB_FILE;
+    rc = idx_walk_bucket(ifd, bucket, fn, arg);
+    db_lock(ifd, F_UNLCK, 0, 0);
+    return rc;
+}
+
+/*
+ *  name_hash
+ *      name:  first or last name
+ *      max:   size of the record field the name is stored in
+ *
+ *  FNV-1a over the name as it would be stored in a student_t, so names
+ *  too long for the record hash the same as their truncated copies.
+ *
+ *  returns:  32 bit hash of the name
+ */
+uint32_t name_hash(const char *name, size_t max) {
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < max - 1 && name[i] != '\0'; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ *  index_item
+ *      which:  DB_IDX_* index the item is for
+ *      s:      the student being indexed
+ *      item:   filled in with the bucket and entry for s
+ */
+static void index_item(int which, const student_t *s, idx_item_t *item) {
+    memset(item, 0, sizeof(*item));
+    item->entry.id = s->id;
+
+    switch (which) {
+    case DB_IDX_NAME:
+        item->entry.key = name_hash(s->lname, sizeof(s->lname));
+        item->entry.key2 = name_hash(s->fname, sizeof(s->fname));
+        item->bucket = item->entry.key;
+        break;
+    case DB_IDX_GPA:
+        item->entry.key = s->gpa;
+        item->bucket = s->gpa - MIN_STD_GPA;
+        break;
+    }
+}
+
+//state shared with collect_items() while building an index
+typedef struct build_state {
+    int which;
+    idx_item_t *items;
+    int n;
+    int cap;
+} build_state_t;
+
+/*
+ *  collect_items
+ *      db_scan() callback that gathers an index item for every live record
+ */
+static int collect_items(student_t *recs, int n, void *arg) {
+    build_state_t *st = arg;
+
+    for (int i = 0; i < n; i++) {
+        if (recs[i].id == 0)
+            continue;
+        if (st->n == st->cap) {
+            int cap = st->cap == 0 ? 1024 : st->cap * 2;
+            idx_item_t *items = realloc(st->items, cap * sizeof(idx_item_t));
+            if (items == NULL)
+                return ERR_DB_OP;
+            st->items = items;
+            st->cap = cap;
+        }
+        index_item(st->which, &recs[i], &st->items[st->n++]);
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  index_owner
+ *      fd:     database file descriptor
+ *      which:  DB_IDX_* index
+ *      owner:  filled in with what the index header should contain
+ *
+ *  An index records the identity of the database file it was built from.
+ *  If student.db is deleted and created again, or replaced by another
+ *  file, the old index no longer matches and is rebuilt instead of
+ *  returning ids from a different database.
+ */
+static void index_owner(int fd, int which, idx_header_t *owner) {
+    memset(owner, 0, sizeof(*owner));
+    owner->nbuckets = idx_defs[which].nbuckets;
+    db_identity(fd, &owner->db_ino, &owner->db_birth);
+}
+
+/*
+ *  index_build
+ *      fd:     database file descriptor
+ *      which:  DB_IDX_* index to build
+ *      ifd:    index file descriptor
+ *
+ *  Fills an index from scratch with one scan of the database.  The scan
+ *  runs before the index is locked so the lock order of db_lock() holds.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int index_build(int fd, int which, int ifd) {
+    build_state_t st = { .which = which };
+    idx_header_t owner;
+    int rc;
+
+    index_owner(fd, which, &owner);
+    rc = db_scan(fd, collect_items, &st);
+    if (rc == NO_ERROR && db_lock(ifd, F_WRLCK, 0, 0) != NO_ERROR)
+        rc = ERR_DB_FILE;
+    if (rc == NO_ERROR) {
+        rc = idx_init(ifd, &owner);
+        if (rc == NO_ERROR)
+            rc = idx_insert(ifd, st.items, st.n);
+        db_lock(ifd, F_UNLCK, 0, 0);
+    }
+
+    free(st.items);
+    return rc == NO_ERROR ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  index_drop
+ *      h:      database handle
+ *      which:  DB_IDX_* index to discard
+ *
+ *  Used when an index could not be updated.  Removing the file is always
+ *  safe, the next query that needs the index builds a fresh one.
+ */
+static void index_drop(db_handle_t *h, int which) {
+    if (h->idx_fd[which] >= 0)
+        close(h->idx_fd[which]);
+    h->idx_fd[which] = -1;
+    unlink(idx_defs[which].path);
+}
+
+/*
+ *  index_open
+ *      fd:     database file descriptor
+ *      which:  DB_IDX_* index wanted
+ *      build:  create and fill the index if it does not exist yet
+ *
+ *  Index files are opened the first time they are needed and stay open
+ *  until close_db() or until another process deletes them.  Without
+ *  build, a missing index is simply reported as absent so writers do not
+ *  create indexes nobody asked for.  It is looked for again every time,
+ *  another process may build it in the meantime.
+ *
+ *  returns:  index file descriptor, or -1 if there is no usable index
+ */
+int index_open(int fd, int which, bool build) {
+    db_handle_t *h = db_handle(fd);
+    idx_header_t owner;
+    bool fresh;
+    int ifd;
+
+    if (h == NULL)
+        return -1;
+    if (h->idx_fd[which] >= 0 && !db_file_gone(h->idx_fd[which]))
+        return h->idx_fd[which];
+    if (h->idx_fd[which] >= 0)
+        close(h->idx_fd[which]);
+    h->idx_fd[which] = -1;
+
+    index_owner(fd, which, &owner);
+    ifd = idx_open(idx_defs[which].path, &owner, build, &fresh);
+    if (ifd < 0)
+        return -1;
+
+    if (fresh && (!build || index_build(fd, which, ifd) != NO_ERROR)) {
+        close(ifd);
+        unlink(idx_defs[which].path);
+        return -1;
+    }
+
+    h->idx_fd[which] = ifd;
+    return ifd;
+}
+
+/*
+ *  index_close
+ *      h:  database handle being closed
+ *
+ *  Closes the secondary indexes and the column file.
+ */
+void index_close(db_handle_t *h) {
+    for (int which = 0; which < DB_IDX_COUNT; which++) {
+        if (h->idx_fd[which] >= 0)
+            close(h->idx_fd[which]);
+        h->idx_fd[which] = -1;
+    }
+    col_close(h);
+}
+
+/*
+ *  index_add
+ *      fd:    database file descriptor
+ *      recs:  students that were just stored
+ *      n:     number of students
+ *
+ *  Adds the students to every existing secondary index and to the column
+ *  file, and queues them for the change stream.
+ */
+void index_add(int fd, student_t **recs, int n) {
+    db_handle_t *h = db_handle(fd);
+    idx_item_t *items;
+
+    if (h == NULL || n == 0)
+        return;
+
+    items = malloc(n * sizeof(idx_item_t));
+    for (int which = 0; which < DB_IDX_COUNT; which++) {
+        int ifd = index_open(fd, which, false);
+        if (ifd < 0)
+            continue;
+        if (items == NULL) {
+            index_drop(h, which);
+            continue;
+        }
+        for (int i = 0; i < n; i++)
+            index_item(which, recs[i], &items[i]);
+        if (idx_insert(ifd, items, n) != NO_ERROR)
+            index_drop(h, which);
+    }
+    free(items);
+    col_add(fd, recs, n);
+    chg_put(fd, recs, n);
+}
+
+/*
+ *  index_del
+ *      fd:  database file descriptor
+ *      s:   the student that was just deleted, as it was stored
+ *
+ *  Removes the student from every existing secondary index and from the
+ *  column file, and queues the deletion for the change stream.
+ */
+void index_del(int fd, student_t *s) {
+    db_handle_t *h = db_handle(fd);
+    idx_item_t item;
+
+    if (h == NULL)
+        return;
+
+    for (int which = 0; which < DB_IDX_COUNT; which++) {
+        int ifd = index_open(fd, which, false);
+        if (ifd < 0)
+            continue;
+        index_item(which, s, &item);
+        if (idx_remove(ifd, &item) == ERR_DB_FILE)
+            index_drop(h, which);
+    }
+    col_del(fd, s);
+    chg_del(fd, s);
+}
+
+/*
+ *  index_rebuild
+ *      fd:  database file descriptor
+ *
+ *  Rebuilds every existing secondary index and the column file from the
+ *  database, used after the database file was rewritten (-x) or emptied
+ *  (-z).
+ */
+void index_rebuild(int fd) {
+    db_handle_t *h = db_handle(fd);
+
+    if (h == NULL)
+        return;
+
+    for (int which = 0; which < DB_IDX_COUNT; which++) {
+        int ifd = index_open(fd, which, false);
+        if (ifd >= 0 && index_build(fd, which, ifd) != NO_ERROR)
+            index_drop(h, which);
+    }
+    col_rebuild(fd);
+}
+
+/*
+ *  index_discard
+ *      fd:  database file descriptor
+ *
+ *  Drops every existing secondary index and the column file, used when a
+ *  transaction is rolled back after it already changed them.  The next
+ *  command that wants one builds it again.
+ */
+void index_discard(int fd) {
+    db_handle_t *h = db_handle(fd);
+
+    if (h == NULL)
+        return;
+
+    for (int which = 0; which < DB_IDX_COUNT; which++) {
+        if (index_open(fd, which, false) >= 0)
+            index_drop(h, which);
+    }
+    col_discard(fd);
+}
+
+//state shared with match_name() during a name lookup
+typedef struct name_query {
+    uint32_t lkey;
+    uint32_t fkey;
+    bool match_fname;
+    int *ids;
+    int n;
+    int cap;
+} name_query_t;
+
+/*
+ *  match_name
+ *      idx_lookup() callback collecting the ids whose hashes match
+ */
+static int match_name(idx_entry_t *e, void *arg) {
+    name_query_t *q = arg;
+
+    if (e->key != q->lkey || (q->match_fname && e->key2 != q->fkey))
+        return NO_ERROR;
+
+    if (q->n == q->cap) {
+        int cap = q->cap == 0 ? 64 : q->cap * 2;
+        int *ids = realloc(q->ids, cap * sizeof(int));
+        if (ids == NULL)
+            return ERR_DB_OP;
+        q->ids = ids;
+        q->cap = cap;
+    }
+    q->ids[q->n++] = e->id;
+    return NO_ERROR;
+}
+
+static int cmp_int(const void *a, const void *b) {
+    int ia = *(const int *)a;
+    int ib = *(const int *)b;
+
+    return (ia > ib) - (ia < ib);
+}
+
+/*
+ *  find_by_name
+ *      fd:    database file descriptor
+ *      spec:  "lastname" or "lastname,firstname"
+ *
+ *  Looks the name up in the name index (building it on first use) and
+ *  prints the matching students in id order.  The index only holds name
+ *  hashes, so each candidate record is read and its names compared before
+ *  it is printed.
+ *
+ *  returns:  number of students printed
+ *            SRCH_NOT_FOUND nobody has that name
+ *            ERR_DB_FILE    database or index file I/O issue
+ */
+int find_by_name(int fd, char *spec) {
+    char lname[sizeof(((student_t *)0)->lname)] = {0};
+    char fname[sizeof(((student_t *)0)->fname)] = {0};
+    name_query_t q = {0};
+    student_t student;
+    char *comma;
+    int printed = 0;
+    int ifd, rc;
+
+    comma = strchr(spec, ',');
+    if (comma != NULL) {
+        strncpy(fname, comma + 1, sizeof(fname) - 1);
+        q.match_fname = true;
+    }
+    strncpy(lname, spec, comma == NULL ? sizeof(lname) - 1 :
+            (size_t)(comma - spec) < sizeof(lname) - 1 ? (size_t)(comma - spec) : sizeof(lname) - 1);
+
+    ifd = index_open(fd, DB_IDX_NAME, true);
+    if (ifd < 0) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    q.lkey = name_hash(lname, sizeof(lname));
+    q.fkey = name_hash(fname, sizeof(fname));
+    rc = idx_lookup(ifd, q.lkey, match_name, &q);
+    if (rc != NO_ERROR) {
+        free(q.ids);
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    qsort(q.ids, q.n, sizeof(int), cmp_int);
+    for (int i = 0; i < q.n; i++) {
+        if (i > 0 && q.ids[i] == q.ids[i - 1])
+            continue;
+        rc = get_student(fd, q.ids[i], &student);
+        if (rc == ERR_DB_FILE)
+            break;
+        if (rc != NO_ERROR || strcmp(student.lname, lname) != 0 ||
+            (q.match_fname && strcmp(student.fname, fname) != 0))
+            continue;
+
+        if (printed++ == 0)
+            printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+        printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname, student.lname,
+               student.gpa / 100.0);
+        stats_add(STAT_MATCHED, 1);
+    }
+    free(q.ids);
+
+    if (rc == ERR_DB_FILE)
+        return ERR_DB_FILE;
+    if (printed == 0) {
+        printf(M_STD_NAME_NOT_FND, spec);
+        return SRCH_NOT_FOUND;
+    }
+    return printed;
+}
+
+//ids found in one gpa bucket, see find_by_gpa()
+typedef struct gpa_query {
+    int *ids;
+    int n;
+    int cap;
+} gpa_query_t;
+
+/*
+ *  collect_gpa_ids
+ *      idx_lookup() callback gathering every id in a gpa bucket
+ */
+static int collect_gpa_ids(idx_entry_t *e, void *arg) {
+    gpa_query_t *q = arg;
+
+    if (q->n == q->cap) {
+        int cap = q->cap == 0 ? 256 : q->cap * 2;
+        int *ids = realloc(q->ids, cap * sizeof(int));
+        if (ids == NULL)
+            return ERR_DB_OP;
+        q->ids = ids;
+        q->cap = cap;
+    }
+    q->ids[q->n++] = e->id;
+    return NO_ERROR;
+}
+
+/*
+ *  find_by_gpa
+ *      fd:  database file descriptor
+ *      lo:  lowest gpa wanted, as a 3 digit int
+ *      hi:  highest gpa wanted, as a 3 digit int
+ *
+ *  Walks the gpa index (building it on first use) one bucket per gpa
+ *  value from lo to hi and prints the students as each bucket is read,
+ *  so the output is ordered by gpa and then by id and nothing is held
+ *  beyond one bucket.  Only the matching records are read, the rest of
+ *  the database is never touched.
+ *
+ *  returns:  number of students printed
+ *            SRCH_NOT_FOUND nobody has a gpa in the range
+ *            ERR_DB_FILE    database or index file I/O issue
+ */
+int find_by_gpa(int fd, int lo, int hi) {
+    gpa_query_t q = {0};
+    student_t student;
+    int printed = 0;
+    int ifd, rc = NO_ERROR;
+
+    ifd = index_open(fd, DB_IDX_GPA, true);
+    if (ifd < 0) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    for (int gpa = lo; gpa <= hi && rc != ERR_DB_FILE; gpa++) {
+        q.n = 0;
+        if (idx_lookup(ifd, gpa - MIN_STD_GPA, collect_gpa_ids, &q) != NO_ERROR) {
+            printf(M_ERR_DB_READ);
+            rc = ERR_DB_FILE;
+            break;
+        }
+
+        qsort(q.ids, q.n, sizeof(int), cmp_int);
+        for (int i = 0; i < q.n; i++) {
+            if (i > 0 && q.ids[i] == q.ids[i - 1])
+                continue;
+            rc = get_student(fd, q.ids[i], &student);
+            if (rc == ERR_DB_FILE)
+                break;
+            if (rc != NO_ERROR || student.gpa != gpa)
+                continue;
+
+            if (printed++ == 0)
+                printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+            printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname, student.lname,
+                   student.gpa / 100.0);
+            stats_add(STAT_MATCHED, 1);
+        }
+    }
+    free(q.ids);
+
+    if (rc == ERR_DB_FILE)
+        return ERR_DB_FILE;
+    if (printed == 0) {
+        printf(M_STD_GPA_NOT_FND, lo, hi);
+        return SRCH_NOT_FOUND;
+    }
+    return printed;
+}
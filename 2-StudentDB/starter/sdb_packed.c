@@ -0,0 +1,521 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//Packed database files, written by compress_db().  The records sit back to
+//back and a two level directory (see db.h) maps an id to the unit holding
+//its record, so a lookup costs three small reads no matter how the file was
+//packed.  Everything here goes through db_read_at() and db_write_at() so
+//both engines and the write-ahead log work unchanged.
+
+//header fields handing out units, read and written together
+#define HEAP_FIELDS_OFF     offsetof(db_header_t, heap_units)
+
+/*
+ *  unit_offset
+ *      h:     database handle
+ *      unit:  unit number (not + 1)
+ *
+ *  returns:  the file offset of the unit
+ */
+static off_t unit_offset(db_handle_t *h, uint32_t unit) {
+    return h->data_off + (off_t)unit * sizeof(student_t);
+}
+
+/*
+ *  top_offset
+ *      h:   database handle
+ *      id:  student id
+ *
+ *  returns:  the file offset of the top level entry covering id
+ */
+static off_t top_offset(db_handle_t *h, int id) {
+    return h->bitmap_off + (off_t)(id / DB_DIR_FANOUT) * sizeof(uint32_t);
+}
+
+/*
+ *  packed_entry
+ *      h:      database handle
+ *      id:     student id
+ *      where:  set to the file offset of the leaf entry for id
+ *
+ *  returns:  1              the leaf exists, *where is set
+ *            0              no student in id's range has a leaf yet
+ *            ERR_DB_FILE    database file I/O issue
+ */
+static int packed_entry(db_handle_t *h, int id, off_t *where) {
+    uint32_t leaf;
+
+    if (db_read_at(h->fd, top_offset(h, id), &leaf, sizeof(leaf)) != sizeof(leaf))
+        return ERR_DB_FILE;
+    if (leaf == 0)
+        return 0;
+
+    *where = unit_offset(h, leaf - 1) + (id % DB_DIR_FANOUT) * sizeof(uint32_t);
+    return 1;
+}
+
+/*
+ *  packed_take
+ *      h:     database handle
+ *      n:     number of adjacent units wanted
+ *      unit:  set to the first of them
+ *
+ *  Single units come off the free list when it has any, everything else
+ *  is appended at the end of the heap.  The header fields stay locked
+ *  until the command commits.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int packed_take(db_handle_t *h, int n, uint32_t *unit) {
+    uint32_t heap[2];   //heap_units, free_unit
+    student_t dead;
+
+    if (db_lock(h->fd, F_WRLCK, HEAP_FIELDS_OFF, sizeof(heap)) != NO_ERROR ||
+        db_read_at(h->fd, HEAP_FIELDS_OFF, heap, sizeof(heap)) != sizeof(heap))
+        return ERR_DB_FILE;
+
+    if (n == 1 && heap[1] != 0) {
+        *unit = heap[1] - 1;
+        if (db_read_at(h->fd, unit_offset(h, *unit), &dead, sizeof(dead)) != sizeof(dead))
+            return ERR_DB_FILE;
+        heap[1] = dead.gpa;
+    } else {
+        *unit = heap[0];
+        heap[0] += n;
+    }
+
+    if (db_write_at(h->fd, HEAP_FIELDS_OFF, heap, sizeof(heap)) != sizeof(heap))
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  packed_leaf
+ *      h:      database handle, the top level entry for id is locked
+ *      id:     student id
+ *      where:  set to the file offset of the leaf entry for id
+ *
+ *  Like packed_entry() but allocates (and zeroes) the leaf if the range
+ *  of id has none yet.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int packed_leaf(db_handle_t *h, int id, off_t *where) {
+    static const uint32_t empty[DB_DIR_FANOUT];
+    uint32_t leaf;
+    int rc = packed_entry(h, id, where);
+
+    if (rc != 0)
+        return rc == 1 ? NO_ERROR : ERR_DB_FILE;
+
+    if (packed_take(h, DB_DIR_LEAF_UNITS, &leaf) != NO_ERROR ||
+        db_write_at(h->fd, unit_offset(h, leaf), empty, sizeof(empty)) != sizeof(empty))
+        return ERR_DB_FILE;
+
+    //the leaf is published only once it is zeroed
+    leaf++;
+    if (db_write_at(h->fd, top_offset(h, id), &leaf, sizeof(leaf)) != sizeof(leaf))
+        return ERR_DB_FILE;
+
+    *where = unit_offset(h, leaf - 1) + (id % DB_DIR_FANOUT) * sizeof(uint32_t);
+    return NO_ERROR;
+}
+
+/*
+ *  packed_locate
+ *      fd:      linux file descriptor of a packed database
+ *      id:      student id
+ *      offset:  set to the file offset of the record for id
+ *
+ *  returns:  1              id is in the database, *offset is set
+ *            0              id is not in the database
+ *            ERR_DB_FILE    database file I/O issue
+ */
+int packed_locate(int fd, int id, off_t *offset) {
+    db_handle_t *h = db_handle(fd);
+    uint32_t unit;
+    off_t where;
+
+    if (id < 0 || id > MAX_STD_ID)
+        return 0;
+
+    int rc = packed_entry(h, id, &where);
+    if (rc != 1)
+        return rc;
+
+    if (db_read_at(fd, where, &unit, sizeof(unit)) != sizeof(unit))
+        return ERR_DB_FILE;
+    if (unit == 0)
+        return 0;
+
+    *offset = unit_offset(h, unit - 1);
+    return 1;
+}
+
+/*
+ *  packed_alloc
+ *      fd:     linux file descriptor of a packed database
+ *      first:  lowest id
+ *      n:      number of consecutive ids, none of them in the database
+ *
+ *  Gives the ids n adjacent units and points their directory entries at
+ *  them, the caller writes the records.  A reader that finds an entry
+ *  before its record is written sees an id that does not match and
+ *  treats the student as absent.  The top level entries are locked before
+ *  the header fields, following the order of db_lock().
+ *
+ *  returns:  the file offset of the unit for first, or -1 on failure
+ */
+off_t packed_alloc(int fd, int first, int n) {
+    db_handle_t *h = db_handle(fd);
+    off_t top = top_offset(h, first);
+    off_t where;
+    uint32_t unit;
+
+    if (db_lock(fd, F_WRLCK, top, top_offset(h, first + n - 1) - top + sizeof(uint32_t)) != NO_ERROR)
+        return -1;
+
+    //leaves first, so a single unit still comes off the free list
+    for (int id = first; id < first + n; id++) {
+        if ((id == first || id % DB_DIR_FANOUT == 0) && packed_leaf(h, id, &where) != NO_ERROR)
+            return -1;
+    }
+    if (packed_take(h, n, &unit) != NO_ERROR)
+        return -1;
+
+    for (int i = 0; i < n; i++) {
+        uint32_t entry = unit + i + 1;
+
+        if (packed_entry(h, first + i, &where) != 1 ||
+            db_write_at(fd, where, &entry, sizeof(entry)) != sizeof(entry))
+            return -1;
+    }
+
+    return unit_offset(h, unit);
+}
+
+/*
+ *  packed_free
+ *      fd:   linux file descriptor of a packed database
+ *      ids:  ids that were deleted
+ *      n:    number of ids
+ *
+ *  Clears the directory entries of the ids and puts their units on the
+ *  free list.  Leaves are never freed, compress_db() drops empty ones.
+ *
+ *  returns:  number of ids that were in the directory, or ERR_DB_FILE
+ */
+int packed_free(int fd, const int *ids, int n) {
+    db_handle_t *h = db_handle(fd);
+    const uint32_t none = 0;
+    uint32_t heap[2];   //heap_units, free_unit
+    int freed = 0;
+
+    for (int i = 0; i < n; i++) {
+        student_t dead = EMPTY_STUDENT_RECORD;
+        uint32_t unit;
+        off_t where;
+        int rc = packed_entry(h, ids[i], &where);
+
+        if (rc < 0 || (rc == 1 && db_read_at(fd, where, &unit, sizeof(unit)) != sizeof(unit)))
+            return ERR_DB_FILE;
+        if (rc == 0 || unit == 0)
+            continue;
+
+        if (db_write_at(fd, where, &none, sizeof(none)) != sizeof(none) ||
+            db_lock(fd, F_WRLCK, HEAP_FIELDS_OFF, sizeof(heap)) != NO_ERROR ||
+            db_read_at(fd, HEAP_FIELDS_OFF, heap, sizeof(heap)) != sizeof(heap))
+            return ERR_DB_FILE;
+
+        dead.gpa = heap[1];
+        heap[1] = unit;
+        if (db_write_at(fd, unit_offset(h, unit - 1), &dead, sizeof(dead)) != sizeof(dead) ||
+            db_write_at(fd, HEAP_FIELDS_OFF, heap, sizeof(heap)) != sizeof(heap))
+            return ERR_DB_FILE;
+        freed++;
+    }
+
+    return freed;
+}
+
+/*
+ *  packed_scan
+ *      fd:     linux file descriptor of a packed database
+ *      src:    where the records are read, fd or a snapshot of it
+ *      first:  first top level directory entry to walk
+ *      last:   entry just past the last one to walk
+ *      fn:     callback invoked with blocks of records
+ *      arg:    passed through to fn
+ *
+ *  db_scan() for packed files, db_scan_parallel() gives every thread its
+ *  own range of top level entries.  The directory is walked in id order and
+ *  the records it points at are gathered into blocks of up to
+ *  DB_SCAN_BLOCK bytes, units that are adjacent in the file are read
+ *  together.  The caller holds the file lock or took the snapshot.
+ *
+ *  returns:  NO_ERROR, ERR_DB_FILE or the negative value returned by fn
+ */
+int packed_scan(int fd, int src, int first, int last, db_scan_fn fn, void *arg) {
+    db_handle_t *h = db_handle(fd);
+    int max = DB_SCAN_BLOCK / sizeof(student_t);
+    uint32_t top[DB_DIR_TOP];
+    uint32_t leaf[DB_DIR_FANOUT];
+    student_t *block;
+    int rc = NO_ERROR;
+    int n = 0;
+
+    block = malloc(DB_SCAN_BLOCK);
+    if (block == NULL)
+        return ERR_DB_FILE;
+    if (db_read_at(src, h->bitmap_off, top, sizeof(top)) != sizeof(top))
+        rc = ERR_DB_FILE;
+
+    for (int t = first; rc >= 0 && t < last; t++) {
+        if (top[t] == 0)
+            continue;
+        if (db_read_at(src, unit_offset(h, top[t] - 1), leaf, sizeof(leaf)) != sizeof(leaf)) {
+            rc = ERR_DB_FILE;
+            break;
+        }
+
+        for (int i = 0; rc >= 0 && i < DB_DIR_FANOUT; ) {
+            if (leaf[i] == 0) {
+                i++;
+                continue;
+            }
+            if (n == max) {
+                stats_add(STAT_SCANNED, n);
+                rc = fn(block, n, arg);
+                n = 0;
+                continue;
+            }
+
+            int len = 1;
+            while (i + len < DB_DIR_FANOUT && len < max - n && leaf[i + len] == leaf[i] + len)
+                len++;
+
+            ssize_t want = len * sizeof(student_t);
+            if (db_read_at(src, unit_offset(h, leaf[i] - 1), block + n, want) != want)
+                rc = ERR_DB_FILE;
+            n += len;
+            i += len;
+        }
+    }
+
+    if (rc >= 0 && n > 0) {
+        stats_add(STAT_SCANNED, n);
+        rc = fn(block, n, arg);
+    }
+
+    free(block);
+    return rc;
+}
+
+//state shared with pack_records() while writing the packed file
+typedef struct pack_state {
+    int tmp_fd;
+    uint32_t *leaves[DB_DIR_TOP];
+    uint32_t units;     //units handed out so far
+    student_t run[DB_SCAN_BLOCK / sizeof(student_t)];
+    int run_len;
+} pack_state_t;
+
+/*
+ *  flush_pack_run
+ *      st:  pack state holding the records that end at unit st->units
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_OP if the write failed
+ */
+static int flush_pack_run(pack_state_t *st) {
+    if (st->run_len == 0)
+        return NO_ERROR;
+
+    off_t offset = DB_PACKED_DATA_OFFSET + (off_t)(st->units - st->run_len) * sizeof(student_t);
+    ssize_t len = st->run_len * sizeof(student_t);
+    st->run_len = 0;
+
+    if (pwrite(st->tmp_fd, st->run, len, offset) != len) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_OP;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  pack_records
+ *      Called with the records gathered by each part in turn, appends
+ *      every live record to the packed file and notes its unit in the
+ *      in-memory directory.  Like rebuild_records() the id comes from the
+ *      record, so files packed by an older compress_db() are repaired, and
+ *      a repeated id keeps its first record.
+ */
+static int pack_records(student_t *recs, int n, void *arg) {
+    pack_state_t *st = arg;
+    int max_run = sizeof(st->run) / sizeof(st->run[0]);
+
+    for (int i = 0; i < n; i++) {
+        int id = recs[i].id;
+
+        if (id == 0)
+            continue;
+        if (id < MIN_STD_ID || id > MAX_STD_ID) {
+            printf(M_ERR_DB_READ);
+            return ERR_DB_OP;
+        }
+
+        uint32_t **leaf = &st->leaves[id / DB_DIR_FANOUT];
+        if (*leaf == NULL) {
+            *leaf = calloc(DB_DIR_FANOUT, sizeof(uint32_t));
+            if (*leaf == NULL)
+                return ERR_DB_OP;
+        }
+        if ((*leaf)[id % DB_DIR_FANOUT] != 0)
+            continue;
+
+        if (st->run_len == max_run && flush_pack_run(st) != NO_ERROR)
+            return ERR_DB_OP;
+        st->run[st->run_len++] = recs[i];
+        (*leaf)[id % DB_DIR_FANOUT] = ++st->units;
+    }
+    return NO_ERROR;
+}
+
+//live records gathered by one part of the pack_db() scan
+typedef struct pack_part {
+    student_t *recs;
+    int n, size;
+} pack_part_t;
+
+/*
+ *  gather_records
+ *      db_scan() callback that copies the live records of each block into
+ *      the array of its part
+ */
+static int gather_records(student_t *recs, int n, void *arg) {
+    pack_part_t *part = arg;
+
+    for (int i = 0; i < n; i++) {
+        if (recs[i].id == 0)
+            continue;
+        if (part->n == part->size) {
+            int size = part->size == 0 ? (int)(DB_SCAN_BLOCK / sizeof(student_t)) : part->size * 2;
+            student_t *grown = realloc(part->recs, size * sizeof(student_t));
+            if (grown == NULL)
+                return ERR_DB_FILE;
+            part->recs = grown;
+            part->size = size;
+        }
+        part->recs[part->n++] = recs[i];
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  pack_db
+ *      fd:  linux file descriptor
+ *
+ *  Writes every live record of the database, whatever its layout, into a
+ *  fresh packed file (TMP_DB_FILE) in id order, followed by the leaves of
+ *  the directory, then renames it over DB_FILE.  The result holds no
+ *  holes, no deleted records and no empty leaves.  fd is closed, also on
+ *  failure, which releases the lock taken on the whole file.  The old
+ *  file is read by a parallel scan that gathers the live records of each
+ *  part, the parts are then appended in id order.
+ *
+ *  returns:  fd of the packed database, or ERR_DB_FILE on failure
+ */
+int pack_db(int fd) {
+    static pack_state_t st;
+    pack_part_t part[DB_SCAN_MAX_THREADS] = {0};
+    int parts = db_scan_threads();
+    uint32_t top[DB_DIR_TOP] = {0};
+    db_header_t hdr;
+    int rc;
+
+    if (db_commit(fd) != NO_ERROR || db_lock_file(fd, F_WRLCK) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.tmp_fd = open(TMP_DB_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (st.tmp_fd == -1) {
+        printf(M_ERR_DB_OPEN);
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
+    rc = db_scan_parallel(fd, gather_records, part, sizeof(part[0]), parts);
+    for (int i = 0; i < parts; i++) {
+        if (rc == NO_ERROR)
+            rc = pack_records(part[i].recs, part[i].n, &st);
+        free(part[i].recs);
+    }
+    if (rc == NO_ERROR)
+        rc = flush_pack_run(&st);
+    if (rc == ERR_DB_FILE)
+        printf(M_ERR_DB_READ);
+
+    db_init_header(&hdr, DB_FORMAT_PACKED);
+    hdr.rec_count = st.units;
+    hdr.flags = db_flags(fd);
+
+    for (int t = 0; t < DB_DIR_TOP; t++) {
+        if (st.leaves[t] == NULL)
+            continue;
+        if (rc == NO_ERROR) {
+            ssize_t len = DB_DIR_FANOUT * sizeof(uint32_t);
+            off_t offset = DB_PACKED_DATA_OFFSET + (off_t)st.units * sizeof(student_t);
+
+            top[t] = st.units + 1;
+            st.units += DB_DIR_LEAF_UNITS;
+            if (pwrite(st.tmp_fd, st.leaves[t], len, offset) != len) {
+                printf(M_ERR_DB_WRITE);
+                rc = ERR_DB_FILE;
+            }
+        }
+        free(st.leaves[t]);
+    }
+
+    if (rc == NO_ERROR) {
+        hdr.heap_units = st.units;
+        off_t size = DB_PACKED_DATA_OFFSET + (off_t)st.units * sizeof(student_t);
+
+        if (pwrite(st.tmp_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            pwrite(st.tmp_fd, top, sizeof(top), DB_BITMAP_OFFSET) != sizeof(top) ||
+            ftruncate(st.tmp_fd, size) == -1 || fsync(st.tmp_fd) == -1) {
+            printf(M_ERR_DB_WRITE);
+            rc = ERR_DB_FILE;
+        }
+    }
+
+    close(st.tmp_fd);
+    if (rc != NO_ERROR) {
+        unlink(TMP_DB_FILE);
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
+    //renamed while the old file is still locked, so a writer waiting for
+    //the lock finds the new file in place once it gets it
+    rc = rename(TMP_DB_FILE, DB_FILE);
+    close_db(fd);
+    if (rc == -1) {
+        printf(M_ERR_DB_CREATE);
+        return ERR_DB_FILE;
+    }
+
+    return open_db(DB_FILE, false);
+}
@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <immintrin.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//Filtered scans for -q.  The predicate is compiled once into a range per
+//numeric field plus a short list of residual terms (name comparisons and
+//!=).  Each block handed out by db_scan() goes through a kernel that tests
+//the id and gpa ranges of many records at once and returns a bitmask of
+//candidates, only those are checked against the residual terms and
+//formatted.  When the column file (sdb_column.c) is there, or can be
+//built, the kernel runs over its id and gpa arrays instead and only the
+//candidates are read from the database.  The AVX2 kernel is picked at run
+//time when the CPU has it, SDB_SIMD=off forces the scalar one.
+
+#define QUERY_FIELD_ID      0
+#define QUERY_FIELD_GPA     1
+#define QUERY_FIELD_FNAME   2
+#define QUERY_FIELD_LNAME   3
+
+#define QUERY_OP_EQ         0
+#define QUERY_OP_NE         1
+#define QUERY_OP_LT         2
+#define QUERY_OP_LE         3
+#define QUERY_OP_GT         4
+#define QUERY_OP_GE         5
+
+#define QUERY_MAX_TERMS     16
+#define QUERY_CHUNK         64      //records per candidate bitmask
+
+//a term the range kernel can't answer
+typedef struct query_term {
+    int  field;     //QUERY_FIELD_*
+    int  op;        //QUERY_OP_EQ or QUERY_OP_NE
+    int  value;     //numeric fields
+    char text[sizeof(((student_t *)0)->lname)];    //name fields
+} query_term_t;
+
+//a compiled predicate, every term must hold
+typedef struct query {
+    int32_t lo[2];  //inclusive id and gpa ranges, indexed by QUERY_FIELD_*
+    int32_t hi[2];
+    query_term_t terms[QUERY_MAX_TERMS];
+    int nterms;
+    bool keyed;         //lname_key holds the hash of an lname== term
+    int32_t lname_key;
+    int printed;
+} query_t;
+
+typedef uint64_t (*query_kernel_fn)(const query_t *q, const int32_t *id, const int32_t *gpa,
+                                    int stride, int n);
+
+#define RECORD_STRIDE       ((int)(sizeof(student_t) / sizeof(int32_t)))
+#define QUERY_COL_BLOCK     4096    //column entries read at a time
+
+static const struct {
+    const char *name;
+    int field;
+} query_fields[] = {
+    { "id",    QUERY_FIELD_ID },
+    { "gpa",   QUERY_FIELD_GPA },
+    { "fname", QUERY_FIELD_FNAME },
+    { "lname", QUERY_FIELD_LNAME },
+};
+
+//longer operators first so "<=" is not read as "<"
+static const struct {
+    const char *text;
+    int op;
+} query_ops[] = {
+    { "==", QUERY_OP_EQ }, { "!=", QUERY_OP_NE },
+    { "<=", QUERY_OP_LE }, { ">=", QUERY_OP_GE },
+    { "<",  QUERY_OP_LT }, { ">",  QUERY_OP_GT },
+    { "=",  QUERY_OP_EQ },
+};
+
+/*
+ *  skip_spaces
+ *      p:  position in the query text
+ *
+ *  returns:  the first character at or after p that is not a space
+ */
+static char *skip_spaces(char *p) {
+    while (*p == ' ' || *p == '\t')
+        p++;
+    return p;
+}
+
+/*
+ *  narrow
+ *      q:      query being compiled
+ *      field:  QUERY_FIELD_ID or QUERY_FIELD_GPA
+ *      op:     QUERY_OP_*, anything but QUERY_OP_NE
+ *      value:  right hand side of the comparison
+ *
+ *  Folds a comparison into the range of the field.  A range that ends up
+ *  empty simply matches nothing.
+ */
+static void narrow(query_t *q, int field, int op, long value) {
+    long lo = q->lo[field], hi = q->hi[field];
+
+    switch (op) {
+    case QUERY_OP_EQ:
+        lo = value > lo ? value : lo;
+        hi = value < hi ? value : hi;
+        break;
+    case QUERY_OP_LT:
+        hi = value - 1 < hi ? value - 1 : hi;
+        break;
+    case QUERY_OP_LE:
+        hi = value < hi ? value : hi;
+        break;
+    case QUERY_OP_GT:
+        lo = value + 1 > lo ? value + 1 : lo;
+        break;
+    case QUERY_OP_GE:
+        lo = value > lo ? value : lo;
+        break;
+    }
+
+    //an empty range, keep it representable
+    if (lo > hi) {
+        lo = 1;
+        hi = 0;
+    }
+    q->lo[field] = lo;
+    q->hi[field] = hi;
+}
+
+/*
+ *  compile_query
+ *      text:  predicate such as "gpa>=350 && lname==doe", modified in place
+ *      q:     the compiled query
+ *
+ *  Terms are field op value joined by &&.  id and gpa (as a 3 digit int)
+ *  take any comparison, fname and lname only == and !=.  Names run up to
+ *  the next && and are compared like the -n option compares them.
+ *
+ *  returns:  NULL on success, otherwise where the text stopped making sense
+ */
+static char *compile_query(char *text, query_t *q) {
+    char *p = text;
+
+    memset(q, 0, sizeof(*q));
+    q->lo[QUERY_FIELD_ID] = MIN_STD_ID;     //also skips deleted slots
+    q->hi[QUERY_FIELD_ID] = INT32_MAX;
+    q->lo[QUERY_FIELD_GPA] = INT32_MIN;
+    q->hi[QUERY_FIELD_GPA] = INT32_MAX;
+
+    for (;;) {
+        char *start = p = skip_spaces(p);
+        int field = -1, op = -1;
+        size_t len;
+
+        for (size_t i = 0; i < sizeof(query_fields) / sizeof(query_fields[0]); i++) {
+            len = strlen(query_fields[i].name);
+            if (strncmp(p, query_fields[i].name, len) == 0 &&
+                strchr("=!<> \t", p[len]) != NULL) {
+                field = query_fields[i].field;
+                p = skip_spaces(p + len);
+                break;
+            }
+        }
+        for (size_t i = 0; field >= 0 && i < sizeof(query_ops) / sizeof(query_ops[0]); i++) {
+            len = strlen(query_ops[i].text);
+            if (strncmp(p, query_ops[i].text, len) == 0) {
+                op = query_ops[i].op;
+                p = skip_spaces(p + len);
+                break;
+            }
+        }
+        if (op < 0)
+            return start;
+
+        char *end = strstr(p, "&&");
+        bool last = end == NULL;
+        char *next = last ? NULL : end + 2;
+        if (last)
+            end = p + strlen(p);
+        while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+        *end = '\0';
+        if (*p == '\0')
+            return start;
+
+        if (field == QUERY_FIELD_ID || field == QUERY_FIELD_GPA) {
+            char *num_end;
+            long value = strtol(p, &num_end, 10);
+
+            if (*num_end != '\0' || value < INT32_MIN || value > INT32_MAX)
+                return start;
+            if (op != QUERY_OP_NE) {
+                narrow(q, field, op, value);
+                if (last)
+                    return NULL;
+                p = next;
+                continue;
+            }
+        } else if (op != QUERY_OP_EQ && op != QUERY_OP_NE) {
+            return start;
+        }
+
+        if (q->nterms == QUERY_MAX_TERMS)
+            return start;
+        query_term_t *t = &q->terms[q->nterms++];
+        t->field = field;
+        t->op = op;
+        t->value = atoi(p);
+        strncpy(t->text, p, field == QUERY_FIELD_FNAME ?
+                sizeof(((student_t *)0)->fname) - 1 : sizeof(t->text) - 1);
+        if (field == QUERY_FIELD_LNAME && op == QUERY_OP_EQ && !q->keyed) {
+            q->keyed = true;
+            q->lname_key = name_hash(t->text, sizeof(t->text));
+        }
+
+        if (last)
+            return NULL;
+        p = next;
+    }
+}
+
+/*
+ *  match_scalar
+ *      q:       compiled query
+ *      id:      id of the first record
+ *      gpa:     gpa of the first record
+ *      stride:  ints from one record's fields to the next one's, 16 for a
+ *               block of student_t and 1 for the column file
+ *      n:       number of records, at most QUERY_CHUNK
+ *
+ *  returns:  bit i set if record i is inside the id and gpa ranges
+ */
+static uint64_t match_scalar(const query_t *q, const int32_t *id, const int32_t *gpa,
+                             int stride, int n) {
+    uint64_t mask = 0;
+
+    for (int i = 0; i < n; i++) {
+        int32_t x = id[i * stride], g = gpa[i * stride];
+        bool in = x >= q->lo[QUERY_FIELD_ID] && x <= q->hi[QUERY_FIELD_ID] &&
+                  g >= q->lo[QUERY_FIELD_GPA] && g <= q->hi[QUERY_FIELD_GPA];
+        mask |= (uint64_t)in << i;
+    }
+    return mask;
+}
+
+/*
+ *  match_avx2
+ *      Same as match_scalar(), eight records at a time.  Columns are read
+ *      with plain vector loads.  In a block of student_t the fields are 16
+ *      ints apart, so one gather collects the ids of eight records and
+ *      another one starting at gpa collects their gpas.
+ */
+__attribute__((target("avx2")))
+static uint64_t match_avx2(const query_t *q, const int32_t *id, const int32_t *gpa,
+                           int stride, int n) {
+    const __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                             _mm256_set1_epi32(stride));
+    const __m256i id_lo = _mm256_set1_epi32(q->lo[QUERY_FIELD_ID]);
+    const __m256i id_hi = _mm256_set1_epi32(q->hi[QUERY_FIELD_ID]);
+    const __m256i gpa_lo = _mm256_set1_epi32(q->lo[QUERY_FIELD_GPA]);
+    const __m256i gpa_hi = _mm256_set1_epi32(q->hi[QUERY_FIELD_GPA]);
+    uint64_t mask = 0;
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        const int32_t *pi = id + i * stride, *pg = gpa + i * stride;
+        __m256i x, g;
+
+        if (stride == 1) {
+            x = _mm256_loadu_si256((const __m256i *)pi);
+            g = _mm256_loadu_si256((const __m256i *)pg);
+        } else {
+            x = _mm256_i32gather_epi32(pi, index, sizeof(int32_t));
+            g = _mm256_i32gather_epi32(pg, index, sizeof(int32_t));
+        }
+
+        //a value is outside [lo, hi] if lo > value or value > hi
+        __m256i out = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpgt_epi32(id_lo, x), _mm256_cmpgt_epi32(x, id_hi)),
+            _mm256_or_si256(_mm256_cmpgt_epi32(gpa_lo, g), _mm256_cmpgt_epi32(g, gpa_hi)));
+        uint32_t bits = ~_mm256_movemask_ps(_mm256_castsi256_ps(out)) & 0xff;
+        mask |= (uint64_t)bits << i;
+    }
+
+    if (i < n)
+        mask |= match_scalar(q, id + i * stride, gpa + i * stride, stride, n - i) << i;
+    return mask;
+}
+
+/*
+ *  query_kernel
+ *
+ *  returns:  the range kernel to use on this CPU
+ */
+static query_kernel_fn query_kernel(void) {
+    char *simd = getenv(SDB_ENV_SIMD);
+
+    if (simd != NULL && strcmp(simd, "off") == 0)
+        return match_scalar;
+    if (__builtin_cpu_supports("avx2"))
+        return match_avx2;
+    return match_scalar;
+}
+
+/*
+ *  match_terms
+ *      q:  compiled query
+ *      s:  record that passed the range kernel
+ *
+ *  returns:  true if s satisfies every residual term
+ */
+static bool match_terms(const query_t *q, const student_t *s) {
+    for (int i = 0; i < q->nterms; i++) {
+        const query_term_t *t = &q->terms[i];
+        bool equal;
+
+        switch (t->field) {
+        case QUERY_FIELD_ID:
+            equal = s->id == t->value;
+            break;
+        case QUERY_FIELD_GPA:
+            equal = s->gpa == t->value;
+            break;
+        case QUERY_FIELD_FNAME:
+            equal = strncmp(s->fname, t->text, sizeof(s->fname)) == 0;
+            break;
+        default:
+            equal = strncmp(s->lname, t->text, sizeof(s->lname)) == 0;
+            break;
+        }
+        if (equal != (t->op == QUERY_OP_EQ))
+            return false;
+    }
+    return true;
+}
+
+//state shared with query_records()
+typedef struct query_scan {
+    query_t q;
+    query_kernel_fn kernel;
+} query_scan_t;
+
+/*
+ *  print_match
+ *      q:  compiled query
+ *      s:  a record inside the id and gpa ranges
+ *
+ *  Prints s if it passes the residual terms, the header goes before the
+ *  first one.
+ */
+static void print_match(query_t *q, student_t *s) {
+    if (q->nterms > 0 && !match_terms(q, s))
+        return;
+    if (q->printed++ == 0)
+        printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+    printf(STUDENT_PRINT_FMT_STRING, s->id, s->fname, s->lname, s->gpa / 100.0);
+    stats_add(STAT_MATCHED, 1);
+}
+
+/*
+ *  query_records
+ *      db_scan() callback that runs the kernel over each block in chunks
+ *      of QUERY_CHUNK records and prints the records that match
+ */
+static int query_records(student_t *recs, int n, void *arg) {
+    query_scan_t *st = arg;
+
+    for (int base = 0; base < n; base += QUERY_CHUNK) {
+        int len = n - base < QUERY_CHUNK ? n - base : QUERY_CHUNK;
+        uint64_t mask = st->kernel(&st->q, &recs[base].id, &recs[base].gpa, RECORD_STRIDE, len);
+
+        while (mask != 0) {
+            student_t *s = &recs[base + __builtin_ctzll(mask)];
+
+            mask &= mask - 1;
+            print_match(&st->q, s);
+        }
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  query_columns
+ *      fd:   database file descriptor
+ *      cfd:  column file descriptor
+ *      st:   compiled query and kernel
+ *
+ *  Runs the kernel straight over the id and gpa columns, QUERY_COL_BLOCK
+ *  ids at a time, and skips the blocks outside the id range without
+ *  reading them.  An lname== term is first checked against the hash
+ *  column.  Only the candidates left are read from the database, and are
+ *  checked again against the record in case the column file lags behind
+ *  a writer.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int query_columns(int fd, int cfd, query_scan_t *st) {
+    static int32_t ids[QUERY_COL_BLOCK], gpas[QUERY_COL_BLOCK], lnames[QUERY_COL_BLOCK];
+    query_t *q = &st->q;
+    int rc = NO_ERROR;
+
+    for (int first = 0; first < COL_SLOTS && rc == NO_ERROR; first += QUERY_COL_BLOCK) {
+        int n = COL_SLOTS - first < QUERY_COL_BLOCK ? COL_SLOTS - first : QUERY_COL_BLOCK;
+
+        if (first + n - 1 < q->lo[QUERY_FIELD_ID] || first > q->hi[QUERY_FIELD_ID])
+            continue;
+        //the lock is dropped before any record is read, records come
+        //first in the lock order
+        if (db_lock(cfd, F_RDLCK, 0, 0) != NO_ERROR)
+            return ERR_DB_FILE;
+        if (col_read(cfd, COL_ID, first, n, ids) != NO_ERROR ||
+            col_read(cfd, COL_GPA, first, n, gpas) != NO_ERROR ||
+            (q->keyed && col_read(cfd, COL_LNAME, first, n, lnames) != NO_ERROR))
+            rc = ERR_DB_FILE;
+        db_lock(cfd, F_UNLCK, 0, 0);
+
+        for (int base = 0; base < n && rc == NO_ERROR; base += QUERY_CHUNK) {
+            int len = n - base < QUERY_CHUNK ? n - base : QUERY_CHUNK;
+            uint64_t mask = st->kernel(q, ids + base, gpas + base, 1, len);
+
+            while (mask != 0) {
+                int i = base + __builtin_ctzll(mask);
+                student_t s;
+
+                mask &= mask - 1;
+                if (q->keyed && lnames[i] != q->lname_key)
+                    continue;
+
+                int found = get_student(fd, ids[i], &s);
+                if (found == SRCH_NOT_FOUND)
+                    continue;
+                if (found != NO_ERROR) {
+                    rc = ERR_DB_FILE;
+                    break;
+                }
+                if (match_scalar(q, &s.id, &s.gpa, RECORD_STRIDE, 1) != 0)
+                    print_match(q, &s);
+            }
+        }
+    }
+    return rc;
+}
+
+/*
+ *  query_db
+ *      fd:    linux file descriptor
+ *      text:  the predicate, see compile_query()
+ *
+ *  Prints the students matching the predicate in id order with a single
+ *  scan of the database.
+ *
+ *  returns:  number of students printed
+ *            SRCH_NOT_FOUND nobody matches
+ *            ERR_DB_OP      the predicate could not be parsed
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *  console:  M_ERR_QUERY, M_STD_QUERY_NOT_FND or the matching records
+ */
+int query_db(int fd, char *text) {
+    static query_scan_t st;
+    char *copy = strdup(text);
+    char *bad;
+    int cfd, rc;
+
+    if (copy == NULL)
+        return ERR_DB_FILE;
+    bad = compile_query(copy, &st.q);
+    if (bad != NULL) {
+        printf(M_ERR_QUERY, text + (bad - copy));
+        free(copy);
+        return ERR_DB_OP;
+    }
+    free(copy);
+
+    st.kernel = query_kernel();
+    cfd = col_open(fd, true);
+    if (cfd >= 0)
+        rc = query_columns(fd, cfd, &st);
+    else
+        rc = db_scan(fd, query_records, &st);
+    if (rc != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    if (st.q.printed == 0) {
+        printf(M_STD_QUERY_NOT_FND, text);
+        return SRCH_NOT_FOUND;
+    }
+    return st.q.printed;
+}
@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//Scrubbing (-V).  A checksummed database (DB_FLAG_CRC) is read with a
+//parallel scan and every live record is checked against the CRC-32C
+//stored with it, so a flipped bit or a torn write is found without
+//waiting for someone to look the student up.  The scan goes through the
+//same engine and snapshot as -p, the threads only compute checksums.
+
+//records checked by one part of the scan and the ids that failed
+typedef struct scrub_part {
+    int checked;
+    int *bad;
+    int nbad, size;
+} scrub_part_t;
+
+/*
+ *  scrub_records
+ *      db_scan() callback that checks the live records of each block
+ */
+static int scrub_records(student_t *recs, int n, void *arg) {
+    scrub_part_t *part = arg;
+
+    for (int i = 0; i < n; i++) {
+        uint32_t crc;
+
+        if (recs[i].id == 0)
+            continue;
+        part->checked++;
+        memcpy(&crc, recs[i].lname + DB_CRC_LNAME, sizeof(crc));
+        if (crc == record_crc(&recs[i]))
+            continue;
+
+        if (part->nbad == part->size) {
+            int size = part->size == 0 ? 64 : part->size * 2;
+            int *grown = realloc(part->bad, size * sizeof(int));
+            if (grown == NULL)
+                return ERR_DB_FILE;
+            part->bad = grown;
+            part->size = size;
+        }
+        part->bad[part->nbad++] = recs[i].id;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  cmp_id
+ *      qsort() comparator for ids
+ */
+static int cmp_id(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ *  scrub_db
+ *      fd:  linux file descriptor
+ *
+ *  Verifies the checksum of every record.  The ids of corrupt records are
+ *  printed in order, as stored: a bit flipped in the id itself shows up
+ *  as an id nobody added.
+ *
+ *  returns:  number of corrupt records
+ *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_OP      the database has no checksums
+ *
+ *  console:  M_ERR_DB_CORRUPT for each corrupt record, then M_DB_SCRUBBED
+ */
+int scrub_db(int fd) {
+    scrub_part_t part[DB_SCAN_MAX_THREADS];
+    int parts = db_scan_threads();
+    int checked = 0, nbad = 0;
+    int *bad = NULL;
+    int rc;
+
+    if (!(db_flags(fd) & DB_FLAG_CRC)) {
+        printf(M_ERR_DB_NO_CRC);
+        return ERR_DB_OP;
+    }
+
+    memset(part, 0, sizeof(part));
+    rc = db_scan_parallel(fd, scrub_records, part, sizeof(part[0]), parts);
+    for (int i = 0; i < parts; i++) {
+        checked += part[i].checked;
+        nbad += part[i].nbad;
+    }
+    if (rc == NO_ERROR && nbad > 0) {
+        bad = malloc(nbad * sizeof(int));
+        rc = bad == NULL ? ERR_DB_FILE : NO_ERROR;
+    }
+    for (int i = 0, n = 0; i < parts; i++) {
+        if (bad != NULL)
+            memcpy(bad + n, part[i].bad, part[i].nbad * sizeof(int));
+        n += part[i].nbad;
+        free(part[i].bad);
+    }
+    if (rc != NO_ERROR) {
+        free(bad);
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    if (nbad > 0)
+        qsort(bad, nbad, sizeof(int), cmp_id);
+    for (int i = 0; i < nbad; i++)
+        printf(M_ERR_DB_CORRUPT, bad[i]);
+    free(bad);
+
+    stats_add(STAT_MATCHED, nbad);
+    printf(M_DB_SCRUBBED, checked, nbad);
+    return nbad;
+}
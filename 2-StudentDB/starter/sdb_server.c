@@ -0,0 +1,599 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//set from the signal handler to shut the server down cleanly
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+/*
+ *  recv_all / send_all
+ *      sock:  connected socket
+ *      buff:  data to receive into / send from
+ *      len:   exact number of bytes to transfer
+ *
+ *  The protocol uses fixed size headers followed by a payload, both of
+ *  which may be split across several segments by the kernel.
+ *
+ *  returns:  NO_ERROR when len bytes were transferred
+ *            ERR_SDB_COMM on an error or if the peer closed the socket
+ */
+int recv_all(int sock, void *buff, size_t len) {
+    char *p = buff;
+
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return ERR_SDB_COMM;
+        p += n;
+        len -= n;
+    }
+    return NO_ERROR;
+}
+
+int send_all(int sock, const void *buff, size_t len) {
+    const char *p = buff;
+
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return ERR_SDB_COMM;
+        p += n;
+        len -= n;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  boot_db_server
+ *      sock_path:  file system path of the unix domain socket
+ *
+ *  Creates, binds and listens on the server socket.  A socket file left
+ *  behind by a server that did not shut down cleanly is replaced.  The
+ *  socket is bound under a temporary name and renamed into place once it
+ *  listens, so a client that sees the file can always connect.
+ *
+ *  returns:  the listening socket, or ERR_SDB_COMM on failure
+ */
+int boot_db_server(char *sock_path) {
+    struct sockaddr_un addr = {0};
+    int svr_socket;
+
+    if (strlen(sock_path) + strlen(SDB_SVR_TMP_SUFFIX) >= sizeof(addr.sun_path))
+        return ERR_SDB_COMM;
+
+    svr_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (svr_socket == -1)
+        return ERR_SDB_COMM;
+
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s%s", sock_path, SDB_SVR_TMP_SUFFIX);
+    unlink(addr.sun_path);
+
+    if (bind(svr_socket, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(svr_socket, SDB_SVR_BACKLOG) == -1 ||
+        rename(addr.sun_path, sock_path) == -1) {
+        unlink(addr.sun_path);
+        close(svr_socket);
+        return ERR_SDB_COMM;
+    }
+
+    return svr_socket;
+}
+
+/*
+ *  capture_output
+ *      out_fd:     memfd that collects what the operation prints
+ *      saved_fd:   duplicate of the real stdout
+ *      start:      true before running the operation, false after
+ *
+ *  Every operation reports its result with printf(), so while a request
+ *  is running stdout is pointed at a memory file whose contents become the
+ *  response payload.
+ */
+static void capture_output(int out_fd, int saved_fd, bool start) {
+    fflush(stdout);
+    if (start) {
+        if (ftruncate(out_fd, 0) == 0)
+            lseek(out_fd, 0, SEEK_SET);
+        dup2(out_fd, STDOUT_FILENO);
+    } else {
+        dup2(saved_fd, STDOUT_FILENO);
+    }
+}
+
+/*
+ *  recv_request
+ *      cli_socket:  connected client, non-blocking
+ *      conn:        what has arrived of its current request
+ *
+ *  Takes whatever has arrived without waiting for the rest, a client that
+ *  sends part of a request and stops holds up no one else.  Nothing past
+ *  the end of the request is read, a next one stays in the socket and
+ *  poll() reports it again.
+ *
+ *  returns:  NO_ERROR           the request is complete in conn
+ *            REQ_PENDING_SC     more of it is still to come
+ *            ERR_SDB_COMM       client went away or sent garbage
+ */
+static int recv_request(int cli_socket, sdb_conn_t *conn) {
+    sdb_req_hdr_t *req = &conn->hdr;
+
+    while (true) {
+        size_t want;
+        char *dst;
+
+        if (conn->got < sizeof(*req)) {
+            dst = (char *)req + conn->got;
+            want = sizeof(*req) - conn->got;
+        } else {
+            size_t have = conn->got - sizeof(*req);
+
+            if (req->magic != SDB_PROTO_MAGIC || req->argc == 0 ||
+                req->argc > SDB_REQ_MAX_ARGS || req->len > SDB_REQ_MAX_LEN)
+                return ERR_SDB_COMM;
+            if (have == req->len) {
+                conn->args[req->len] = '\0';
+                conn->got = 0;
+                return NO_ERROR;
+            }
+            dst = conn->args + have;
+            want = req->len - have;
+        }
+
+        ssize_t n = recv(cli_socket, dst, want, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return REQ_PENDING_SC;
+        if (n <= 0)
+            return ERR_SDB_COMM;
+        conn->got += n;
+    }
+}
+
+/*
+ *  exec_db_request
+ *      cli_socket:  connected client
+ *      conn:        receive state of the client, see recv_request()
+ *      fd:          pointer to the open database, see run_command()
+ *      out_fd:      memfd used to capture the response text
+ *      saved_fd:    duplicate of the real stdout
+ *      rsp:         filled in with the exit code and the text the
+ *                   operation printed
+ *
+ *  Receives what has arrived of a request and once it is complete runs it
+ *  against the already open database, which is reopened first if another
+ *  process replaced DB_FILE.  The response is not sent here, see
+ *  process_db_requests().
+ *
+ *  returns:  NO_ERROR           request handled, keep the connection
+ *            REQ_PENDING_SC     the request is not complete yet
+ *            ERR_SDB_COMM       client went away or sent garbage
+ *            STOP_SERVER_SC     client asked the server to stop
+ */
+int exec_db_request(int cli_socket, sdb_conn_t *conn, int *fd, int out_fd, int saved_fd, sdb_rsp_t *rsp) {
+    char *argv[SDB_REQ_MAX_ARGS + 2];
+    char *args = conn->args;
+    sdb_req_hdr_t *req = &conn->hdr;
+    off_t logged;
+    int argc = 0;
+    int rc;
+
+    rc = recv_request(cli_socket, conn);
+    if (rc != NO_ERROR)
+        return rc;
+
+    //rebuild argv from the NUL separated strings, argv[0] is not sent
+    argv[argc++] = "sdbsc";
+    for (char *p = args; argc <= req->argc; p += strlen(p) + 1) {
+        if (p >= args + req->len)
+            return ERR_SDB_COMM;
+        argv[argc++] = p;
+    }
+    argv[argc] = NULL;
+
+    memset(rsp, 0, sizeof(*rsp));
+    rsp->sock = cli_socket;
+
+    //the database stays open between requests, another process may have
+    //replaced the file with -x or --upgrade since the last one
+    if (db_follow(*fd) != NO_ERROR) {
+        close_db(*fd);
+        *fd = -1;
+    }
+    logged = wal_size(*fd);
+
+    capture_output(out_fd, saved_fd, true);
+    if (strcmp(argv[1], SDB_STOP_CMD) == 0) {
+        printf(M_SVR_STOPPING);
+        rsp->hdr.exit_code = EXIT_OK;
+        rc = STOP_SERVER_SC;
+    } else if (argv[1][0] != '-' || argv[1][1] == 'h' || strcmp(argv[1], "--serve") == 0) {
+        usage(argv[0]);
+        rsp->hdr.exit_code = EXIT_FAIL_ARGS;
+    } else {
+        uint64_t start = stats_now();
+        rsp->hdr.exit_code = *fd < 0 ? EXIT_FAIL_DB : run_command(fd, argc, argv);
+        stats_latency(start);
+        if (*fd < 0) {
+            *fd = open_db(DB_FILE, false);
+            if (*fd < 0)
+                rc = STOP_SERVER_SC;
+        }
+    }
+    capture_output(out_fd, saved_fd, false);
+
+    rsp->logged = *fd >= 0 && wal_size(*fd) != logged;
+    rsp->keep = rc == NO_ERROR;
+
+    off_t len = lseek(out_fd, 0, SEEK_END);
+    if (len > 0) {
+        rsp->text = malloc(len);
+        if (rsp->text == NULL || pread(out_fd, rsp->text, len, 0) != len)
+            len = 0;
+    }
+    rsp->hdr.len = len;
+
+    return rc;
+}
+
+/*
+ *  queue_db_response
+ *      rsp:      response built by exec_db_request()
+ *      durable:  false if the group commit that covers rsp failed
+ *      conn:     state of the client the response goes to
+ *
+ *  Appends the response to what the client still has to be sent, see
+ *  send_pending().  A request whose changes could not be committed is
+ *  answered with EXIT_FAIL_DB and M_ERR_DB_WRITE added to its output.
+ *
+ *  returns:  NO_ERROR when queued, ERR_SDB_COMM if out of memory
+ */
+static int queue_db_response(sdb_rsp_t *rsp, bool durable, sdb_conn_t *conn) {
+    size_t len;
+    char *out;
+
+    if (rsp->logged && !durable) {
+        size_t extra = strlen(M_ERR_DB_WRITE);
+        char *text = realloc(rsp->text, rsp->hdr.len + extra);
+        if (text != NULL) {
+            memcpy(text + rsp->hdr.len, M_ERR_DB_WRITE, extra);
+            rsp->text = text;
+            rsp->hdr.len += extra;
+        }
+        rsp->hdr.exit_code = EXIT_FAIL_DB;
+    }
+
+    len = sizeof(rsp->hdr) + rsp->hdr.len;
+    out = realloc(conn->out, conn->out_len + len);
+    if (out != NULL) {
+        memcpy(out + conn->out_len, &rsp->hdr, sizeof(rsp->hdr));
+        if (rsp->hdr.len > 0)
+            memcpy(out + conn->out_len + sizeof(rsp->hdr), rsp->text, rsp->hdr.len);
+        if (conn->out_len == 0)
+            conn->out_since = stats_now();
+        conn->out = out;
+        conn->out_len += len;
+        conn->done |= !rsp->keep;
+    }
+
+    free(rsp->text);
+    rsp->text = NULL;
+    return out != NULL ? NO_ERROR : ERR_SDB_COMM;
+}
+
+/*
+ *  send_pending
+ *      sock:  client socket, non-blocking
+ *      conn:  state of the client
+ *
+ *  Sends as much of the queued responses as the socket takes right now.
+ *  The rest goes out when poll() reports POLLOUT, so a client that reads
+ *  its responses slowly holds up no one else.
+ *
+ *  returns:  NO_ERROR           everything queued was sent
+ *            REQ_PENDING_SC     some of it is still queued
+ *            ERR_SDB_COMM       client went away
+ */
+static int send_pending(int sock, sdb_conn_t *conn) {
+    while (conn->out_sent < conn->out_len) {
+        ssize_t n = send(sock, conn->out + conn->out_sent, conn->out_len - conn->out_sent,
+                         MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return REQ_PENDING_SC;
+        if (n <= 0)
+            return ERR_SDB_COMM;
+        conn->out_sent += n;
+        conn->out_since = stats_now();
+    }
+
+    free(conn->out);
+    conn->out = NULL;
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    return NO_ERROR;
+}
+
+/*
+ *  drop_client
+ *      fds:    poll set, fds[0] is the listening socket
+ *      conns:  receive state of each client, indexed like fds
+ *      nfds:   number of entries in fds
+ *      sock:   client socket to close and remove
+ */
+static void drop_client(struct pollfd *fds, sdb_conn_t *conns, int *nfds, int sock) {
+    for (int i = 1; i < *nfds; i++) {
+        if (fds[i].fd == sock) {
+            free(conns[i].out);
+            --(*nfds);
+            fds[i] = fds[*nfds];
+            conns[i] = conns[*nfds];
+            break;
+        }
+    }
+    close(sock);
+}
+
+/*
+ *  send_client
+ *      fds:    poll set, fds[0] is the listening socket
+ *      conns:  state of each client, indexed like fds
+ *      nfds:   number of entries in fds
+ *      i:      entry of the client
+ *
+ *  Sends what is queued for the client.  While some of it is left the
+ *  client is only polled for POLLOUT, its next request waits until it
+ *  took this response.  A client that was sent its last response, or
+ *  went away, is dropped.
+ */
+static void send_client(struct pollfd *fds, sdb_conn_t *conns, int *nfds, int i) {
+    int rc = send_pending(fds[i].fd, &conns[i]);
+
+    fds[i].events = rc == REQ_PENDING_SC ? POLLOUT : POLLIN;
+    if (rc == ERR_SDB_COMM || (rc == NO_ERROR && conns[i].done))
+        drop_client(fds, conns, nfds, fds[i].fd);
+}
+
+/*
+ *  drop_stalled
+ *      fds:    poll set, fds[0] is the listening socket
+ *      conns:  state of each client, indexed like fds
+ *      nfds:   number of entries in fds
+ *
+ *  Drops the clients that have taken none of their response for
+ *  SDB_SVR_SEND_MS.
+ *
+ *  returns:  true if a response is still waiting to be sent
+ */
+static bool drop_stalled(struct pollfd *fds, sdb_conn_t *conns, int *nfds) {
+    uint64_t now = stats_now();
+    bool sending = false;
+
+    for (int i = *nfds - 1; i >= 1; i--) {
+        if (conns[i].out_len == 0)
+            continue;
+        if (now - conns[i].out_since >= SDB_SVR_SEND_MS * 1000000ull)
+            drop_client(fds, conns, nfds, fds[i].fd);
+        else
+            sending = true;
+    }
+    return sending;
+}
+
+/*
+ *  flush_clients
+ *      fds:    poll set, fds[0] is the listening socket
+ *      conns:  state of each client, indexed like fds
+ *      nfds:   number of entries in fds
+ *
+ *  On the way out, gives the responses still queued (the one to --stop
+ *  among them) up to SDB_SVR_SEND_MS to go out.
+ */
+static void flush_clients(struct pollfd *fds, sdb_conn_t *conns, int nfds) {
+    uint64_t until = stats_now() + SDB_SVR_SEND_MS * 1000000ull;
+    uint64_t now;
+    bool sending;
+
+    do {
+        sending = false;
+        for (int i = 1; i < nfds; i++) {
+            fds[i].events = 0;
+            if (conns[i].out_len == 0)
+                continue;
+            if (send_pending(fds[i].fd, &conns[i]) == REQ_PENDING_SC) {
+                fds[i].events = POLLOUT;
+                sending = true;
+            } else {
+                conns[i].out_len = 0;
+            }
+        }
+        now = stats_now();
+    } while (sending && now < until && poll(fds + 1, nfds - 1, (until - now) / 1000000) > 0);
+}
+
+/*
+ *  process_db_requests
+ *      svr_socket:  listening socket from boot_db_server()
+ *      fd:          pointer to the open database
+ *
+ *  Multiplexes the listening socket and all connected clients with
+ *  poll().  Clients may send any number of requests over one connection,
+ *  each request is run to completion before the next one is looked at.
+ *  Client sockets are non-blocking and a request is only run once all of
+ *  it has arrived, a slow or stuck client never stalls the others.
+ *
+ *  The requests that arrive in one poll round form a commit group: their
+ *  responses are held back until one db_commit() has made all of their
+ *  changes durable.  Responses are queued per client and sent as its
+ *  socket takes them, see send_client().  When the write-ahead log is in use and no request
+ *  arrives for WAL_IDLE_MS the log is checkpointed in the background.
+ *
+ *  returns:  NO_ERROR when stopped by a client or a signal
+ *            ERR_SDB_COMM if the server could not continue
+ */
+int process_db_requests(int svr_socket, int *fd) {
+    static sdb_rsp_t pending[SDB_SVR_MAX_CLIENTS];
+    static sdb_conn_t conns[SDB_SVR_MAX_CLIENTS + 1];
+    struct pollfd fds[SDB_SVR_MAX_CLIENTS + 1];
+    int nfds = 1;
+    int out_fd, saved_fd;
+    int rc = NO_ERROR;
+
+    out_fd = memfd_create("sdbsc-response", 0);
+    saved_fd = dup(STDOUT_FILENO);
+    if (out_fd == -1 || saved_fd == -1)
+        return ERR_SDB_COMM;
+
+    fds[0].fd = svr_socket;
+    fds[0].events = POLLIN;
+
+    while (!stop_requested && rc != STOP_SERVER_SC) {
+        int timeout = *fd >= 0 && wal_size(*fd) > 0 ? WAL_IDLE_MS : -1;
+
+        //wake up in time to drop a client that stopped taking its response
+        if (drop_stalled(fds, conns, &nfds) && (timeout < 0 || timeout > SDB_SVR_SEND_MS))
+            timeout = SDB_SVR_SEND_MS;
+        int ready = poll(fds, nfds, timeout);
+
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            rc = ERR_SDB_COMM;
+            break;
+        }
+        if (ready == 0) {
+            wal_checkpoint(*fd);
+            continue;
+        }
+
+        int npending = 0;
+        for (int i = nfds - 1; i >= 1; i--) {
+            if (fds[i].revents == 0)
+                continue;
+            if (conns[i].out_len > 0) {
+                send_client(fds, conns, &nfds, i);
+                continue;
+            }
+
+            int req_rc = ERR_SDB_COMM;
+            if (fds[i].revents & POLLIN)
+                req_rc = exec_db_request(fds[i].fd, &conns[i], fd, out_fd, saved_fd,
+                                         &pending[npending]);
+
+            if (req_rc == REQ_PENDING_SC)
+                continue;
+            if (req_rc == STOP_SERVER_SC)
+                rc = STOP_SERVER_SC;
+            if (req_rc == ERR_SDB_COMM) {
+                drop_client(fds, conns, &nfds, fds[i].fd);
+                continue;
+            }
+            npending++;
+        }
+
+        bool durable = *fd < 0 || db_commit(*fd) == NO_ERROR;
+        for (int i = 0; i < npending; i++) {
+            int c = 1;
+            while (c < nfds && fds[c].fd != pending[i].sock)
+                c++;
+            if (c == nfds)
+                free(pending[i].text);
+            else if (queue_db_response(&pending[i], durable, &conns[c]) != NO_ERROR)
+                drop_client(fds, conns, &nfds, pending[i].sock);
+            else
+                send_client(fds, conns, &nfds, c);
+        }
+
+        if ((fds[0].revents & POLLIN) && nfds <= SDB_SVR_MAX_CLIENTS) {
+            int cli_socket = accept4(svr_socket, NULL, NULL, SOCK_NONBLOCK);
+            if (cli_socket != -1) {
+                fds[nfds].fd = cli_socket;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                memset(&conns[nfds], 0, sizeof(conns[nfds]));
+                nfds++;
+            }
+        }
+    }
+
+    flush_clients(fds, conns, nfds);
+    for (int i = 1; i < nfds; i++) {
+        free(conns[i].out);
+        conns[i].out = NULL;
+        close(fds[i].fd);
+    }
+    close(out_fd);
+    close(saved_fd);
+
+    return rc == ERR_SDB_COMM ? ERR_SDB_COMM : NO_ERROR;
+}
+
+/*
+ *  start_db_server
+ *      sock_path:  file system path of the unix domain socket
+ *
+ *  Opens the database once and serves requests until a client sends
+ *  --stop or the process receives SIGINT/SIGTERM.  The socket file is
+ *  removed on the way out.
+ *
+ *  returns:  EXIT_OK on a clean shutdown, EXIT_FAIL_DB otherwise
+ */
+int start_db_server(char *sock_path) {
+    struct sigaction sa = {0};
+    int svr_socket;
+    int fd;
+    int rc;
+
+    fd = open_db(DB_FILE, false);
+    if (fd < 0)
+        return EXIT_FAIL_DB;
+
+    svr_socket = boot_db_server(sock_path);
+    if (svr_socket < 0) {
+        printf(M_ERR_SVR_SOCKET, sock_path);
+        close_db(fd);
+        return EXIT_FAIL_DB;
+    }
+
+    sa.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf(M_SVR_STARTED, sock_path);
+    fflush(stdout);
+
+    rc = process_db_requests(svr_socket, &fd);
+
+    close(svr_socket);
+    unlink(sock_path);
+    if (fd >= 0)
+        close_db(fd);
+
+    printf(M_SVR_STOPPED);
+    return rc == NO_ERROR ? EXIT_OK : EXIT_FAIL_DB;
+}
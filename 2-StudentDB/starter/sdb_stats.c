@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//Operation statistics for -S and SDB_STATS.  The engine counts its system
+//calls, bytes and the time spent in them, scans count the records they
+//visit and the commands the records they report.  Counters are updated
+//with relaxed atomics because parallel scans run on several threads.
+//Bulk loads and the server also record a latency per batch or request in
+//a log-linear histogram.  Everything is written to stderr as one JSON
+//object when the process exits.
+
+//each power of two is split into 2^STAT_SUB_BITS linear buckets, so a
+//value is known to within 1/2^STAT_SUB_BITS of itself
+#define STAT_SUB_BITS       3
+#define STAT_SUB_BUCKETS    (1 << STAT_SUB_BITS)
+#define STAT_HIST_BUCKETS   (64 * STAT_SUB_BUCKETS)
+
+static const char *stat_names[STAT_COUNT] = {
+    [STAT_READS]         = "read_calls",
+    [STAT_WRITES]        = "write_calls",
+    [STAT_SEEKS]         = "lseek_calls",
+    [STAT_RING_IOS]      = "ring_ios",
+    [STAT_BYTES_READ]    = "bytes_read",
+    [STAT_BYTES_WRITTEN] = "bytes_written",
+    [STAT_IO_NS]         = "io_ns",
+    [STAT_SCANNED]       = "records_scanned",
+    [STAT_MATCHED]       = "records_matched",
+};
+
+static struct {
+    bool enabled;
+    const char *op;
+    uint64_t start_ns;
+    uint64_t counters[STAT_COUNT];
+    uint64_t hist[STAT_HIST_BUCKETS];
+    uint64_t samples, min_us, max_us;
+} stats;
+
+/*
+ *  stats_now
+ *
+ *  returns:  monotonic clock in nanoseconds
+ */
+uint64_t stats_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ *  stats_enabled
+ *
+ *  returns:  true if statistics are being collected
+ */
+bool stats_enabled(void) {
+    return stats.enabled;
+}
+
+/*
+ *  stats_add
+ *      counter:  STAT_*
+ *      n:        amount to add
+ */
+void stats_add(int counter, uint64_t n) {
+    if (stats.enabled)
+        __atomic_fetch_add(&stats.counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/*
+ *  stats_io
+ *      counter:  STAT_READS or STAT_WRITES
+ *      start:    stats_now() taken before the call, 0 if it was not
+ *      bytes:    what the call returned
+ *
+ *  Accounts one read or write system call on the database file.
+ */
+void stats_io(int counter, uint64_t start, ssize_t bytes) {
+    if (!stats.enabled)
+        return;
+    stats_add(counter, 1);
+    if (bytes > 0)
+        stats_add(counter == STAT_WRITES ? STAT_BYTES_WRITTEN : STAT_BYTES_READ, bytes);
+    if (start != 0)
+        stats_add(STAT_IO_NS, stats_now() - start);
+}
+
+/*
+ *  stat_bucket
+ *      us:  latency in microseconds
+ *
+ *  returns:  histogram bucket of us
+ */
+static int stat_bucket(uint64_t us) {
+    if (us < STAT_SUB_BUCKETS)
+        return us;
+
+    //the top STAT_SUB_BITS + 1 bits of us pick the bucket
+    int exp = 63 - __builtin_clzll(us) - STAT_SUB_BITS;
+    return (exp + 1) * STAT_SUB_BUCKETS + (us >> exp) - STAT_SUB_BUCKETS;
+}
+
+/*
+ *  stat_bucket_top
+ *      b:  histogram bucket
+ *
+ *  returns:  the largest latency that falls into bucket b
+ */
+static uint64_t stat_bucket_top(int b) {
+    if (b < STAT_SUB_BUCKETS)
+        return b;
+
+    int exp = b / STAT_SUB_BUCKETS - 1;
+    uint64_t base = (uint64_t)(b % STAT_SUB_BUCKETS + STAT_SUB_BUCKETS) << exp;
+    return base + ((1ull << exp) - 1);
+}
+
+/*
+ *  stats_latency
+ *      start:  stats_now() taken when the batch or request began
+ *
+ *  Records how long it took in the histogram.  Only the main thread
+ *  calls this.
+ */
+void stats_latency(uint64_t start) {
+    if (!stats.enabled)
+        return;
+
+    uint64_t us = (stats_now() - start) / 1000;
+    stats.hist[stat_bucket(us)]++;
+    if (stats.samples == 0 || us < stats.min_us)
+        stats.min_us = us;
+    if (us > stats.max_us)
+        stats.max_us = us;
+    stats.samples++;
+}
+
+/*
+ *  stat_percentile
+ *      p:  percentile, 0 to 100
+ *
+ *  returns:  upper bound of the bucket holding the p-th percentile
+ */
+static uint64_t stat_percentile(double p) {
+    uint64_t want = (uint64_t)(stats.samples * p / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    if (want == 0)
+        want = 1;
+    for (int b = 0; b < STAT_HIST_BUCKETS; b++) {
+        seen += stats.hist[b];
+        if (seen >= want)
+            return stat_bucket_top(b) < stats.max_us ? stat_bucket_top(b) : stats.max_us;
+    }
+    return stats.max_us;
+}
+
+/*
+ *  stats_report
+ *      atexit() handler that writes the statistics to stderr
+ */
+static void stats_report(void) {
+    struct rusage ru;
+    double wall = (stats_now() - stats.start_ns) / 1e9;
+
+    //the command's own output comes first on a terminal
+    fflush(stdout);
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(stderr, "{\"op\":\"%s\",\"wall_seconds\":%.6f,", stats.op, wall);
+    fprintf(stderr, "\"user_seconds\":%.6f,\"sys_seconds\":%.6f",
+            ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+            ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+    for (int c = 0; c < STAT_COUNT; c++)
+        fprintf(stderr, ",\"%s\":%llu", stat_names[c], (unsigned long long)stats.counters[c]);
+
+    if (stats.samples > 0) {
+        fprintf(stderr, ",\"latency_us\":{\"count\":%llu,\"min\":%llu,\"p50\":%llu,"
+                "\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu,\"buckets\":[",
+                (unsigned long long)stats.samples, (unsigned long long)stats.min_us,
+                (unsigned long long)stat_percentile(50), (unsigned long long)stat_percentile(90),
+                (unsigned long long)stat_percentile(99), (unsigned long long)stat_percentile(99.9),
+                (unsigned long long)stats.max_us);
+        //[upper bound in us, count] for every bucket that was hit
+        bool first = true;
+        for (int b = 0; b < STAT_HIST_BUCKETS; b++) {
+            if (stats.hist[b] == 0)
+                continue;
+            fprintf(stderr, "%s[%llu,%llu]", first ? "" : ",",
+                    (unsigned long long)stat_bucket_top(b), (unsigned long long)stats.hist[b]);
+            first = false;
+        }
+        fprintf(stderr, "]}");
+    }
+    fprintf(stderr, "}\n");
+}
+
+/*
+ *  stats_start
+ *      op:  the command being run, e.g. "-p", named in the report
+ *
+ *  Turns collection on and arranges for the report at exit.
+ */
+void stats_start(const char *op) {
+    if (stats.enabled)
+        return;
+    stats.enabled = true;
+    stats.op = op;
+    stats.start_ns = stats_now();
+    atexit(stats_report);
+}
@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//Transactions (-t).  A script of -a, -d and -u commands runs against one
+//open database inside a write-ahead log transaction (see wal_txn_begin()):
+//the changes of every command pile up in the log buffer and the record
+//locks they take are kept, so the script either reaches the log as one
+//commit group with a single fdatasync() or, if any command fails, is
+//thrown away before anything was written to the database file.
+
+//one command of a transaction script
+typedef struct txn_op {
+    int line;       //line number in the script, used for error messages
+    int argc;
+    char *argv[SDB_REQ_MAX_ARGS + 2];
+} txn_op_t;
+
+/*
+ *  txn_parse
+ *      exename:  argv[0] of the commands
+ *      line:     one line of the script, modified in place and referenced
+ *                by op
+ *      op:       the command on the line
+ *
+ *  returns:  NO_ERROR if the line holds a command a transaction may run,
+ *            ERR_DB_OP otherwise
+ */
+static int txn_parse(char *exename, char *line, txn_op_t *op) {
+    char *save = NULL;
+    char *tok;
+
+    op->argc = 0;
+    op->argv[op->argc++] = exename;
+    for (tok = strtok_r(line, " \t\r\n", &save); tok != NULL;
+         tok = strtok_r(NULL, " \t\r\n", &save)) {
+        if (op->argc == SDB_REQ_MAX_ARGS + 1)
+            return ERR_DB_OP;
+        op->argv[op->argc++] = tok;
+    }
+    op->argv[op->argc] = NULL;
+
+    if (op->argc < 2 || (strcmp(op->argv[1], "-a") != 0 && strcmp(op->argv[1], "-d") != 0 &&
+                         strcmp(op->argv[1], "-u") != 0))
+        return ERR_DB_OP;
+    return NO_ERROR;
+}
+
+/*
+ *  txn_read
+ *      exename:  argv[0] of the commands
+ *      in:       the script
+ *      ops:      receives the commands, to be freed by the caller
+ *      lines:    receives the text the commands point into, one entry per
+ *                command, each to be freed by the caller.  Both are NULL
+ *                after an error
+ *
+ *  Reads the whole script before anything runs, so a typo on the last
+ *  line can't leave the earlier ones applied.  Blank lines and lines
+ *  starting with # are skipped.
+ *
+ *  returns:  number of commands, ERR_DB_OP if a line is not a command a
+ *            transaction can run, ERR_DB_FILE if out of memory
+ */
+static int txn_read(char *exename, FILE *in, txn_op_t **ops, char ***lines) {
+    char *line = NULL;
+    size_t cap = 0;
+    int lineno = 0;
+    int n = 0, max = 0;
+    int rc = NO_ERROR;
+
+    *ops = NULL;
+    *lines = NULL;
+    while (rc == NO_ERROR && getline(&line, &cap, in) != -1) {
+        char *p = line;
+
+        lineno++;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\0' || *p == '\n' || *p == '\r' || *p == '#')
+            continue;
+
+        if (n == max) {
+            max = max == 0 ? 64 : max * 2;
+            txn_op_t *more_ops = realloc(*ops, max * sizeof(txn_op_t));
+            if (more_ops != NULL)
+                *ops = more_ops;
+            char **more_lines = realloc(*lines, max * sizeof(char *));
+            if (more_lines != NULL)
+                *lines = more_lines;
+            if (more_ops == NULL || more_lines == NULL) {
+                rc = ERR_DB_FILE;
+                break;
+            }
+        }
+
+        //the command keeps pointers into its line, it gets a buffer of
+        //its own
+        (*lines)[n] = line;
+        (*ops)[n].line = lineno;
+        if (txn_parse(exename, p, &(*ops)[n]) != NO_ERROR) {
+            printf(M_ERR_BULK_ROW, lineno);
+            printf(M_ERR_TXN_OP);
+            rc = ERR_DB_OP;
+        }
+        n++;
+        line = NULL;
+        cap = 0;
+    }
+
+    free(line);
+    if (rc != NO_ERROR) {
+        for (int i = 0; i < n; i++)
+            free((*lines)[i]);
+        free(*lines);
+        free(*ops);
+        *lines = NULL;
+        *ops = NULL;
+        return rc;
+    }
+    return n;
+}
+
+/*
+ *  run_transaction
+ *      fd:       pointer to the open database descriptor
+ *      exename:  argv[0], for usage messages of the commands
+ *      path:     the script, one command per line, or "-" for stdin
+ *
+ *  Runs every command of the script with run_command(), each prints what
+ *  it normally does.  The first one that fails rolls the whole script
+ *  back: its changes are dropped from the log buffer, and since the
+ *  secondary indexes and the column file were already updated they are
+ *  discarded to be rebuilt when next needed.
+ *
+ *  returns:  NO_ERROR       every command was applied
+ *            ERR_DB_OP      the script could not be read, nothing ran
+ *            ERR_DB_FILE    a command failed and nothing was changed, or
+ *                           the transaction could not be committed
+ *
+ *  console:  M_TXN_COMMITTED or M_TXN_ROLLED_BACK
+ */
+int run_transaction(int *fd, char *exename, char *path) {
+    FILE *in = stdin;
+    txn_op_t *ops;
+    char **lines;
+    int failed = 0;
+    int rc, n;
+
+    if (strcmp(path, "-") != 0) {
+        in = fopen(path, "r");
+        if (in == NULL) {
+            printf(M_ERR_BULK_OPEN, path);
+            return ERR_DB_OP;
+        }
+    }
+    n = txn_read(exename, in, &ops, &lines);
+    if (in != stdin)
+        fclose(in);
+
+    rc = n < 0 ? n : wal_txn_begin(*fd);
+    if (rc == ERR_DB_FILE)
+        printf(M_ERR_DB_WRITE);
+
+    for (int i = 0; i < n && rc == NO_ERROR && failed == 0; i++) {
+        if (run_command(fd, ops[i].argc, ops[i].argv) != EXIT_OK)
+            failed = ops[i].line;
+    }
+
+    if (rc == NO_ERROR && failed != 0) {
+        wal_txn_end(*fd, false);
+        index_discard(*fd);
+        printf(M_TXN_ROLLED_BACK, failed);
+        rc = ERR_DB_FILE;
+    } else if (rc == NO_ERROR && wal_txn_end(*fd, true) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        rc = ERR_DB_FILE;
+    } else if (rc == NO_ERROR) {
+        printf(M_TXN_COMMITTED, n);
+    }
+
+    for (int i = 0; i < n; i++)
+        free(lines[i]);
+    free(lines);
+    free(ops);
+    return rc;
+}
@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//A minimal io_uring driven through the raw system calls, so nothing
+//beyond the kernel headers is needed.  Used by the uring engine to keep
+//many reads and writes in flight for batches (db_io_batch()) and to read
+//ahead while scanning.  A ring belongs to one thread.
+
+struct db_ring {
+    int fd;
+    unsigned depth;         //entries that may be queued or in flight
+    unsigned queued;        //filled in, not yet handed to the kernel
+    unsigned inflight;      //handed to the kernel, not yet reaped
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+/*
+ *  uring_open
+ *      depth:  number of I/Os that may be in flight at once
+ *
+ *  returns:  a new ring, or NULL if the kernel does not provide one (too
+ *            old, or io_uring disabled), the caller then uses plain I/O
+ */
+db_ring_t *uring_open(unsigned depth) {
+    struct io_uring_params p;
+    db_ring_t *ring = calloc(1, sizeof(*ring));
+
+    if (ring == NULL)
+        return NULL;
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+    ring->depth = depth;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_map = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = ring->sq_map;
+    if (ring->sq_map != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+        ring->cq_map = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uring_close(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_map, *cq = ring->cq_map;
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return ring;
+}
+
+/*
+ *  uring_close
+ *      ring:  ring from uring_open(), may be NULL
+ *
+ *  Anything still in flight is waited for by the kernel when the ring
+ *  descriptor is closed.
+ */
+void uring_close(db_ring_t *ring) {
+    if (ring == NULL)
+        return;
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_len);
+    if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED)
+        munmap(ring->sq_map, ring->sq_len);
+    close(ring->fd);
+    free(ring);
+}
+
+/*
+ *  uring_queue
+ *      ring:  the ring
+ *      fd:    file to read or write
+ *      io:    the transfer, io->iov (or else io->buff and io->len) says
+ *             where the data goes
+ *      tag:   returned by uring_wait() when the transfer completes
+ *
+ *  Fills in a submission entry, the kernel sees it at the next
+ *  uring_wait().
+ *
+ *  returns:  NO_ERROR, or ERR_DB_OP if depth transfers are already queued
+ *            or in flight
+ */
+int uring_queue(db_ring_t *ring, int fd, const db_io_t *io, uint64_t tag) {
+    if (ring->queued + ring->inflight == ring->depth)
+        return ERR_DB_OP;
+
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->off = io->offset;
+    sqe->user_data = tag;
+    if (io->iov != NULL) {
+        sqe->opcode = io->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (uintptr_t)io->iov;
+        sqe->len = io->iovcnt;
+    } else {
+        sqe->opcode = io->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->addr = (uintptr_t)io->buff;
+        sqe->len = io->len;
+    }
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return NO_ERROR;
+}
+
+/*
+ *  uring_wait
+ *      ring:  the ring
+ *      tag:   set to the tag of the transfer that completed
+ *      res:   set to the bytes transferred, or -1 with errno set
+ *
+ *  Hands what is queued to the kernel and waits until some transfer has
+ *  completed.  Completions come in any order.
+ *
+ *  returns:  NO_ERROR, or ERR_DB_FILE if nothing is in flight or the ring
+ *            failed
+ */
+int uring_wait(db_ring_t *ring, uint64_t *tag, ssize_t *res) {
+    for (;;) {
+        unsigned head = *ring->cq_head;
+
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+            *tag = cqe->user_data;
+            *res = cqe->res;
+            if (cqe->res < 0) {
+                errno = -cqe->res;
+                *res = -1;
+            }
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            ring->inflight--;
+            return NO_ERROR;
+        }
+        if (ring->queued + ring->inflight == 0)
+            return ERR_DB_FILE;
+
+        int done = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1,
+                           IORING_ENTER_GETEVENTS, NULL, 0);
+        if (done < 0) {
+            if (errno == EINTR)
+                continue;
+            return ERR_DB_FILE;
+        }
+        ring->queued -= done;
+        ring->inflight += done;
+    }
+}
+
+/*
+ *  uring_batch
+ *      ring:  the ring, nothing may be queued or in flight
+ *      fd:    file to read or write
+ *      ios:   the transfers
+ *      n:     number of transfers
+ *
+ *  Runs every transfer with up to depth of them in flight, a new one is
+ *  queued each time one completes.  io->res receives the result.
+ *
+ *  returns:  NO_ERROR, or ERR_DB_FILE if the ring failed
+ */
+int uring_batch(db_ring_t *ring, int fd, db_io_t *ios, int n) {
+    int next = 0;
+
+    for (int done = 0; done < n; done++) {
+        uint64_t tag;
+        ssize_t res;
+
+        while (next < n && uring_queue(ring, fd, &ios[next], next) == NO_ERROR)
+            next++;
+        if (uring_wait(ring, &tag, &res) != NO_ERROR)
+            return ERR_DB_FILE;
+        ios[tag].res = res;
+        stats_add(STAT_RING_IOS, 1);
+        if (res > 0)
+            stats_add(ios[tag].write ? STAT_BYTES_WRITTEN : STAT_BYTES_READ, res);
+    }
+    return NO_ERROR;
+}
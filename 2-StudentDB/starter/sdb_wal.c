@@ -0,0 +1,685 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <nmmintrin.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// Database include files
+#include "db.h"
+#include "sdbsc.h"
+
+//log entries are padded so that every wal_entry_t is 8 byte aligned
+#define WAL_PAD(len)    (((len) + 7) & ~(size_t)7)
+
+static uint32_t crc_table[256];
+static uint32_t (*crc_kernel)(uint32_t crc, const uint8_t *p, size_t len);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/*
+ *  crc32c_sw
+ *      Table driven CRC-32C update, one byte at a time.  crc is the
+ *      running register value, not inverted.
+ */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len-- > 0)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+/*
+ *  crc32c_sse42
+ *      Same as crc32c_sw() with the SSE4.2 crc32 instruction, eight bytes
+ *      at a time.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), p += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = c;
+    while (len-- > 0)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+/*
+ *  crc32c_init
+ *      pthread_once() routine that builds the table and picks the kernel,
+ *      the instruction unless the CPU lacks it or SDB_SIMD=off
+ */
+static void crc32c_init(void) {
+    char *simd = getenv(SDB_ENV_SIMD);
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        crc_table[i] = c;
+    }
+    crc_kernel = crc32c_sw;
+    if ((simd == NULL || strcmp(simd, "off") != 0) && __builtin_cpu_supports("sse4.2"))
+        crc_kernel = crc32c_sse42;
+}
+
+/*
+ *  crc32c
+ *      crc:   0, or the result of a previous call to continue a checksum
+ *      buff:  data to checksum
+ *      len:   number of bytes
+ *
+ *  CRC-32C (Castagnoli polynomial, as used by iSCSI and ext4).  Safe to
+ *  call from several scan threads at once.
+ *
+ *  returns:  the updated checksum
+ */
+uint32_t crc32c(uint32_t crc, const void *buff, size_t len) {
+    pthread_once(&crc_once, crc32c_init);
+    return ~crc_kernel(~crc, buff, len);
+}
+
+/*
+ *  wal_entry_crc
+ *      e:  log entry followed by its payload
+ *
+ *  returns:  the checksum of e as it should be stored in e->crc
+ */
+static uint32_t wal_entry_crc(wal_entry_t *e) {
+    uint32_t saved = e->crc;
+    uint32_t crc;
+
+    e->crc = 0;
+    crc = crc32c(0, e, sizeof(*e) + e->len);
+    e->crc = saved;
+    return crc;
+}
+
+/*
+ *  wal_apply
+ *      h:      database handle
+ *      buff:   log entries
+ *      start:  offset in buff of the first entry to apply
+ *      end:    offset in buff just past the last entry to apply
+ *
+ *  Writes the payload of every entry into the database file.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int wal_apply(db_handle_t *h, char *buff, size_t start, size_t end) {
+    while (start < end) {
+        wal_entry_t *e = (wal_entry_t *)(buff + start);
+        struct iovec iov = { .iov_base = e + 1, .iov_len = e->len };
+
+        if (db_apply_at(h->fd, e->offset, &iov, 1) != (ssize_t)e->len)
+            return ERR_DB_FILE;
+        start += sizeof(*e) + WAL_PAD(e->len);
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  wal_boot_id
+ *      id:  filled in with the kernel boot id, empty if unknown
+ *
+ *  The page cache survives the crash of a process but not of the system,
+ *  so a log written during the current boot only needs the groups that
+ *  were never applied, while after a reboot all of it has to be replayed.
+ */
+static void wal_boot_id(char id[WAL_BOOT_ID_LEN]) {
+    int bfd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+
+    memset(id, 0, WAL_BOOT_ID_LEN);
+    if (bfd >= 0) {
+        if (read(bfd, id, WAL_BOOT_ID_LEN - 1) <= 0)
+            memset(id, 0, WAL_BOOT_ID_LEN);
+        close(bfd);
+    }
+}
+
+/*
+ *  wal_replay_from
+ *      hdr:  the log header
+ *
+ *  returns:  lsn of the first entry that may not be in the database file
+ */
+static uint64_t wal_replay_from(wal_header_t *hdr) {
+    char boot_id[WAL_BOOT_ID_LEN];
+
+    wal_boot_id(boot_id);
+    if (boot_id[0] == '\0' || memcmp(boot_id, hdr->boot_id, WAL_BOOT_ID_LEN) != 0)
+        return 0;
+    return hdr->applied_lsn;
+}
+
+/*
+ *  wal_replay
+ *      h:     database handle whose log was just opened
+ *      from:  groups ending before this lsn are already in the database
+ *
+ *  Applies every complete commit group in the log that ends at or after
+ *  from to the database file.  Entries are physical (offset + bytes), so
+ *  applying a group that already reached the database is harmless.
+ *  Reading stops at the first entry with a bad magic, checksum or lsn;
+ *  that is where a crash cut off the log, and the log is truncated back
+ *  to the last complete group.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int wal_replay(db_handle_t *h, uint64_t from) {
+    struct stat st;
+    char *log;
+    size_t pos = 0, group = 0;
+    uint64_t lsn = 0;
+    bool first = true;
+    int rc = NO_ERROR;
+
+    if (fstat(h->wal.fd, &st) == -1)
+        return ERR_DB_FILE;
+    if (st.st_size <= (off_t)sizeof(wal_header_t))
+        return NO_ERROR;
+
+    size_t size = st.st_size - sizeof(wal_header_t);
+    log = malloc(size);
+    if (log == NULL)
+        return ERR_DB_FILE;
+    if (pread(h->wal.fd, log, size, sizeof(wal_header_t)) != (ssize_t)size) {
+        free(log);
+        return ERR_DB_FILE;
+    }
+
+    while (rc == NO_ERROR && size - pos >= sizeof(wal_entry_t)) {
+        wal_entry_t *e = (wal_entry_t *)(log + pos);
+
+        if (e->magic != WAL_MAGIC || e->len > size - pos - sizeof(*e) ||
+            WAL_PAD(e->len) > size - pos - sizeof(*e) ||
+            (!first && e->lsn != lsn + 1) || e->crc != wal_entry_crc(e))
+            break;
+
+        lsn = e->lsn;
+        first = false;
+        pos += sizeof(*e) + WAL_PAD(e->len);
+
+        if (e->flags & WAL_COMMIT) {
+            if (lsn >= from)
+                rc = wal_apply(h, log, group, pos);
+            group = pos;
+        }
+    }
+    free(log);
+
+    if (rc == NO_ERROR && group < size &&
+        ftruncate(h->wal.fd, sizeof(wal_header_t) + group) == -1)
+        rc = ERR_DB_FILE;
+
+    h->wal.size = group;
+    return rc;
+}
+
+/*
+ *  wal_mark_applied
+ *      h:        database handle
+ *      applied:  every group ending before this lsn is in the database
+ *
+ *  Recorded together with the boot id, see wal_boot_id().  It is not
+ *  synced; if it is lost the next open just replays more than needed.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int wal_mark_applied(db_handle_t *h, uint64_t applied) {
+    struct {
+        uint64_t applied_lsn;
+        char     boot_id[WAL_BOOT_ID_LEN];
+    } mark = { .applied_lsn = applied };
+
+    wal_boot_id(mark.boot_id);
+    if (pwrite(h->wal.fd, &mark, sizeof(mark), offsetof(wal_header_t, applied_lsn)) != sizeof(mark))
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  wal_truncate
+ *      h:  database handle, its log is locked
+ *
+ *  Drops every entry of the log, the header stays.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int wal_truncate(db_handle_t *h) {
+    uint64_t log_size = 0;
+
+    if (pwrite(h->wal.fd, &log_size, sizeof(log_size), offsetof(wal_header_t, log_size)) != sizeof(log_size) ||
+        ftruncate(h->wal.fd, sizeof(wal_header_t)) == -1)
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  wal_open
+ *      h:        handle of the database
+ *      enabled:  keep the log open for the changes that follow
+ *
+ *  Body of wal_attach(), wal_txn_begin() also uses it to turn the log on
+ *  for one transaction.  A log left behind by an earlier run is always
+ *  checked, whether or not SDB_WAL is set, since it may hold committed
+ *  changes that never reached the database.  Normally there are none and
+ *  nothing is replayed.  Groups that do need replaying are applied with
+ *  the whole database locked, so no other process can observe the older
+ *  values the replay writes on the way.
+ *
+ *  When enabled the log stays open and every later change goes through
+ *  it.  Otherwise the database is synced and the log emptied, because
+ *  writes made without the log must not be overwritten by a later replay.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int wal_open(db_handle_t *h, bool enabled) {
+    int flags = O_RDWR | (enabled ? O_CREAT : 0);
+    wal_header_t want = { .magic = WAL_MAGIC, .version = WAL_VERSION };
+    wal_header_t hdr;
+    bool owned, db_locked = false;
+    int rc = NO_ERROR;
+
+    h->wal.fd = open(DB_WAL_FILE, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (h->wal.fd == -1)
+        return !enabled && errno == ENOENT ? NO_ERROR : ERR_DB_FILE;
+
+    db_identity(h->fd, &want.db_ino, &want.db_birth);
+    for (;;) {
+        if (db_lock(h->wal.fd, F_WRLCK, 0, 0) != NO_ERROR) {
+            rc = ERR_DB_FILE;
+            break;
+        }
+
+        owned = pread(h->wal.fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+                memcmp(&hdr, &want, offsetof(wal_header_t, next_lsn)) == 0;
+        if (!owned || db_locked || wal_replay_from(&hdr) >= hdr.next_lsn)
+            break;
+
+        //the database has to be locked before the log, start over
+        db_lock(h->wal.fd, F_UNLCK, 0, 0);
+        if (db_lock_file(h->fd, F_WRLCK) != NO_ERROR) {
+            rc = ERR_DB_FILE;
+            break;
+        }
+        db_locked = true;
+    }
+
+    if (rc == NO_ERROR && owned && db_locked) {
+        rc = wal_replay(h, wal_replay_from(&hdr));
+        if (rc == NO_ERROR)
+            rc = wal_mark_applied(h, hdr.next_lsn);
+    } else if (rc == NO_ERROR && owned) {
+        //everything is applied, just drop a group a crashed process was
+        //still appending
+        h->wal.size = hdr.log_size;
+        if (ftruncate(h->wal.fd, sizeof(hdr) + hdr.log_size) == -1)
+            rc = ERR_DB_FILE;
+    } else if (rc == NO_ERROR && enabled) {
+        //new log, or one left over from another database file
+        wal_boot_id(want.boot_id);
+        if (ftruncate(h->wal.fd, 0) == -1 ||
+            pwrite(h->wal.fd, &want, sizeof(want), 0) != sizeof(want))
+            rc = ERR_DB_FILE;
+    }
+
+    //emptied rather than removed, other processes may have it open with
+    //SDB_WAL=on and their groups must still land in a log that is replayed
+    if (rc == NO_ERROR && !enabled && owned && hdr.log_size > 0 &&
+        (db_sync(h) != NO_ERROR || wal_truncate(h) != NO_ERROR))
+        rc = ERR_DB_FILE;
+
+    db_lock(h->wal.fd, F_UNLCK, 0, 0);
+    if (db_locked)
+        db_lock_file(h->fd, F_UNLCK);
+    if (!enabled) {
+        close(h->wal.fd);
+        h->wal.fd = -1;
+    }
+    return rc;
+}
+
+/*
+ *  wal_attach
+ *      h:  handle of the database being opened
+ *
+ *  Called from db_attach(), opens the log as SDB_WAL asks.  See
+ *  wal_open().
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int wal_attach(db_handle_t *h) {
+    char *env = getenv(SDB_ENV_WAL);
+
+    return wal_open(h, env != NULL && (strcmp(env, "on") == 0 || strcmp(env, "1") == 0));
+}
+
+/*
+ *  wal_detach
+ *      h:  handle of the database being closed
+ *
+ *  Commits whatever is still pending and closes the log.  The log is not
+ *  checkpointed, the next open replays it.
+ */
+void wal_detach(db_handle_t *h) {
+    if (h->wal.fd >= 0) {
+        wal_commit(h->fd);
+        close(h->wal.fd);
+    }
+
+    free(h->wal.buf);
+    memset(&h->wal, 0, sizeof(h->wal));
+    h->wal.fd = -1;
+}
+
+/*
+ *  wal_log
+ *      h:       database handle with the log enabled
+ *      offset:  byte offset in the database file
+ *      iov:     buffers to store back to back starting at offset
+ *      iovcnt:  number of entries in iov
+ *
+ *  Queues one log entry for the write.  Nothing reaches the disk until
+ *  wal_commit().
+ *
+ *  returns:  number of bytes queued, or -1 if out of memory
+ */
+ssize_t wal_log(db_handle_t *h, off_t offset, const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    size_t need;
+    wal_entry_t *e;
+
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    need = sizeof(*e) + WAL_PAD(total);
+    if (h->wal.len + need > h->wal.cap) {
+        size_t cap = h->wal.cap == 0 ? 64 * 1024 : h->wal.cap;
+        while (cap < h->wal.len + need)
+            cap *= 2;
+        char *buf = realloc(h->wal.buf, cap);
+        if (buf == NULL)
+            return -1;
+        h->wal.buf = buf;
+        h->wal.cap = cap;
+    }
+
+    e = (wal_entry_t *)(h->wal.buf + h->wal.len);
+    memset(e, 0, need);
+    e->magic = WAL_MAGIC;
+    e->offset = offset;
+    e->len = total;
+
+    char *dst = (char *)(e + 1);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+
+    h->wal.last = h->wal.len;
+    h->wal.len += need;
+    return total;
+}
+
+/*
+ *  wal_overlay
+ *      h:       database handle
+ *      offset:  byte offset that was read
+ *      buff:    data read from the database file
+ *      len:     number of bytes wanted
+ *      got:     number of bytes the read returned
+ *
+ *  Copies pending log entries that overlap the read over buff, oldest
+ *  first, so the newest change wins.  Entries that extend the file make
+ *  the read longer; any gap in between reads as zeros like a hole would.
+ *
+ *  returns:  the number of valid bytes now in buff
+ */
+ssize_t wal_overlay(db_handle_t *h, off_t offset, void *buff, size_t len, ssize_t got) {
+    size_t valid = got;
+
+    for (size_t pos = 0; pos < h->wal.len; ) {
+        wal_entry_t *e = (wal_entry_t *)(h->wal.buf + pos);
+        off_t lo = offset > e->offset ? offset : e->offset;
+        off_t hi = offset + (off_t)len < e->offset + (off_t)e->len ?
+                   offset + (off_t)len : e->offset + (off_t)e->len;
+
+        if (lo < hi) {
+            if ((size_t)(lo - offset) > valid)
+                memset((char *)buff + valid, 0, lo - offset - valid);
+            memcpy((char *)buff + (lo - offset), (char *)(e + 1) + (lo - e->offset), hi - lo);
+            if ((size_t)(hi - offset) > valid)
+                valid = hi - offset;
+        }
+        pos += sizeof(*e) + WAL_PAD(e->len);
+    }
+
+    return valid;
+}
+
+/*
+ *  wal_commit
+ *      fd:  database file descriptor
+ *
+ *  Group commit.  Every change queued since the last commit is appended
+ *  to the log with one write and made durable with one fdatasync(), and
+ *  only then applied to the database file, so a crash can never leave a
+ *  torn record that the log can't repair.  Nothing is committed while a
+ *  transaction is open.  The log is locked while this
+ *  happens so groups from several processes never interleave.  Once the
+ *  log grows past WAL_CHECKPOINT_BYTES it is checkpointed.
+ *
+ *  returns:  NO_ERROR on success (or if there was nothing to commit),
+ *            ERR_DB_FILE if the changes could not be made durable
+ */
+int wal_commit(int fd) {
+    db_handle_t *h = db_handle(fd);
+    wal_header_t hdr;
+    struct stat st;
+    size_t done = 0;
+    int rc = NO_ERROR;
+
+    if (h == NULL || h->wal.fd < 0 || h->wal.len == 0 || h->wal.txn)
+        return NO_ERROR;
+    if (db_lock(h->wal.fd, F_WRLCK, 0, 0) != NO_ERROR ||
+        fstat(h->wal.fd, &st) == -1 ||
+        pread(h->wal.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        h->wal.len = 0;
+        db_lock(h->wal.fd, F_UNLCK, 0, 0);
+        return ERR_DB_FILE;
+    }
+
+    ((wal_entry_t *)(h->wal.buf + h->wal.last))->flags |= WAL_COMMIT;
+    for (size_t pos = 0; pos < h->wal.len; ) {
+        wal_entry_t *e = (wal_entry_t *)(h->wal.buf + pos);
+        e->lsn = hdr.next_lsn++;
+        e->crc = wal_entry_crc(e);
+        pos += sizeof(*e) + WAL_PAD(e->len);
+    }
+
+    while (done < h->wal.len) {
+        ssize_t n = pwrite(h->wal.fd, h->wal.buf + done, h->wal.len - done, st.st_size + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+
+    //next_lsn and log_size are adjacent and always written together
+    uint64_t tail[2] = { hdr.next_lsn, st.st_size + h->wal.len - sizeof(hdr) };
+    if (done < h->wal.len ||
+        pwrite(h->wal.fd, tail, sizeof(tail), offsetof(wal_header_t, next_lsn)) == -1 ||
+        fdatasync(h->wal.fd) == -1) {
+        //drop the group, the log must not end in a partial one
+        rc = ERR_DB_FILE;
+        if (ftruncate(h->wal.fd, st.st_size) == -1)
+            st.st_size += done;
+        done = 0;
+    } else {
+        rc = wal_apply(h, h->wal.buf, 0, h->wal.len);
+        if (rc == NO_ERROR)
+            rc = wal_mark_applied(h, hdr.next_lsn);
+    }
+
+    h->wal.size = st.st_size + done - sizeof(wal_header_t);
+    h->wal.len = 0;
+    db_lock(h->wal.fd, F_UNLCK, 0, 0);
+
+    if (rc == NO_ERROR && h->wal.size >= WAL_CHECKPOINT_BYTES)
+        return wal_checkpoint(fd);
+    return rc;
+}
+
+/*
+ *  wal_checkpoint
+ *      fd:  database file descriptor
+ *
+ *  Commits pending changes, syncs the database file so everything in the
+ *  log is on disk in place, then empties the log.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int wal_checkpoint(int fd) {
+    db_handle_t *h = db_handle(fd);
+    struct stat st;
+    int rc = NO_ERROR;
+
+    if (h == NULL || h->wal.fd < 0)
+        return NO_ERROR;
+    if (wal_commit(fd) != NO_ERROR || db_lock(h->wal.fd, F_WRLCK, 0, 0) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    //other processes may have committed since, their groups were applied
+    //before they let go of the lock so the sync covers them too
+    if (fstat(h->wal.fd, &st) == -1)
+        rc = ERR_DB_FILE;
+    else if (st.st_size > (off_t)sizeof(wal_header_t) &&
+             (db_sync(h) != NO_ERROR || wal_truncate(h) != NO_ERROR))
+        rc = ERR_DB_FILE;
+
+    if (rc == NO_ERROR)
+        h->wal.size = 0;
+    db_lock(h->wal.fd, F_UNLCK, 0, 0);
+    return rc;
+}
+
+/*
+ *  wal_reset
+ *      fd:  database file descriptor
+ *
+ *  Throws away pending changes and the log itself, used when the database
+ *  file is about to be truncated and replaying the log would bring the
+ *  old records back.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+int wal_reset(int fd) {
+    db_handle_t *h = db_handle(fd);
+
+    if (h == NULL || h->wal.fd < 0)
+        return NO_ERROR;
+
+    h->wal.len = 0;
+    h->wal.size = 0;
+    if (db_lock(h->wal.fd, F_WRLCK, 0, 0) != NO_ERROR)
+        return ERR_DB_FILE;
+    int rc = wal_truncate(h);
+    db_lock(h->wal.fd, F_UNLCK, 0, 0);
+    return rc;
+}
+
+/*
+ *  wal_size
+ *      fd:  database file descriptor
+ *
+ *  returns:  bytes of entries in the log plus bytes pending, 0 when
+ *            there is no log or it is empty
+ */
+off_t wal_size(int fd) {
+    db_handle_t *h = db_handle(fd);
+
+    if (h == NULL || h->wal.fd < 0)
+        return 0;
+    return h->wal.size + h->wal.len;
+}
+
+/*
+ *  wal_txn_begin
+ *      fd:  database file descriptor
+ *
+ *  Opens a transaction.  From now on changes pile up in the log buffer
+ *  and db_commit() leaves them and the record locks alone, so either all
+ *  of them reach the log as one commit group or wal_txn_end() throws them
+ *  away.  Without SDB_WAL the log is turned on for the transaction.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE if there is no log
+ */
+int wal_txn_begin(int fd) {
+    db_handle_t *h = db_handle(fd);
+
+    if (h == NULL)
+        return ERR_DB_FILE;
+    if (h->wal.fd < 0) {
+        if (wal_open(h, true) != NO_ERROR)
+            return ERR_DB_FILE;
+        h->wal.temp = true;
+    }
+
+    //changes queued before the transaction are not part of it
+    h->wal.txn_len = h->wal.len;
+    h->wal.txn_last = h->wal.last;
+    h->chg.txn_len = h->chg.len;
+    h->wal.txn = true;
+    return NO_ERROR;
+}
+
+/*
+ *  wal_txn_end
+ *      fd:      database file descriptor
+ *      commit:  true to keep the changes, false to throw them away
+ *
+ *  Closes the transaction.  Kept changes are committed by the next
+ *  db_commit() together with anything else pending, with one fdatasync()
+ *  of the log.  Changes thrown away never reach the change stream
+ *  either.  A log that was only turned on for the transaction is
+ *  committed right here, checkpointed and closed again.
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE if the changes could not
+ *            be committed
+ */
+int wal_txn_end(int fd, bool commit) {
+    db_handle_t *h = db_handle(fd);
+    int rc = NO_ERROR;
+
+    if (h == NULL || !h->wal.txn)
+        return ERR_DB_FILE;
+    h->wal.txn = false;
+    if (!commit) {
+        h->wal.len = h->wal.txn_len;
+        h->wal.last = h->wal.txn_last;
+        h->chg.len = h->chg.txn_len;
+    }
+    if (!h->wal.temp)
+        return NO_ERROR;
+
+    //same as wal_attach() without SDB_WAL, later writes bypass the log
+    //so it must not be replayed over them.  The checkpoint empties it.
+    rc = wal_checkpoint(fd);
+    close(h->wal.fd);
+    free(h->wal.buf);
+    memset(&h->wal, 0, sizeof(h->wal));
+    h->wal.fd = -1;
+    return rc;
+}
@@ -35,6 +35,19 @@ int open_db(char *dbFile, bool should_truncate) {
         return ERR_DB_FILE;
     }
 
+    if (db_attach(fd) != NO_ERROR) {
+        printf(M_ERR_DB_OPEN);
+        return ERR_DB_FILE;
+    }
+
+    // with SDB_CHANGES=on the first open starts the change stream, an
+    // emptied file is left for the next one
+    if (!should_truncate && chg_start(fd) != NO_ERROR) {
+        printf(M_ERR_DB_OPEN);
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
     return fd;
 }
 
@@ -46,17 +59,19 @@ int open_db(char *dbFile, bool should_truncate) {
  *      *s:  a pointer where the located (if found) student data will be copied
  *
  *  returns:  NO_ERROR       student located and copied into *s
- *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_FILE    database file I/O issue, or the record failed
+ *                           its checksum
  *            SRCH_NOT_FOUND student was not located in the database
  */
 int get_student(int fd, int id, student_t *s) {
-    off_t offset = id * sizeof(student_t);
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;
+    off_t offset = db_slot_offset(fd, id);
+    if (offset < 0) {
+        // a packed file has no slot for an id it does not hold
+        s->id = 0;
+        return SRCH_NOT_FOUND;
     }
 
-    ssize_t bytes_read = read(fd, s, sizeof(student_t));
+    ssize_t bytes_read = db_read_record(fd, offset, s);
     if (bytes_read == -1) {
         printf(M_ERR_DB_READ);
         return ERR_DB_FILE;
@@ -65,10 +80,248 @@ int get_student(int fd, int id, student_t *s) {
         return SRCH_NOT_FOUND;
     }
 
-    if (s->id == 0) {
+    // a packed record that is being reused for another id does not count
+    if (s->id == 0 || s->id != id) {
         return SRCH_NOT_FOUND;
     }
 
+    if (!db_record_ok(fd, s)) {
+        printf(M_ERR_DB_CORRUPT, id);
+        return ERR_DB_FILE;
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ *  get_students
+ *      fd:     linux file descriptor
+ *      ids:    student ids to look up
+ *      n:      number of ids
+ *      recs:   receives the record of ids[i] in recs[i], id 0 if missing
+ *
+ *  get_student() for many ids at once.  The reads are issued as one
+ *  db_record_batch(), so the uring engine has them all in flight together.
+ *
+ *  returns:  number of students found, or ERR_DB_FILE on an I/O error or
+ *            if a record failed its checksum
+ */
+int get_students(int fd, const int *ids, int n, student_t *recs) {
+    db_io_t *ios = calloc(n, sizeof(db_io_t));
+    int found = 0, rc;
+
+    if (ios == NULL)
+        return ERR_DB_FILE;
+    for (int i = 0; i < n; i++) {
+        off_t offset = db_slot_offset(fd, ids[i]);
+
+        recs[i].id = 0;
+        ios[i].offset = offset < 0 ? 0 : offset;
+        ios[i].buff = &recs[i];
+        ios[i].len = offset < 0 ? 0 : sizeof(student_t);
+    }
+
+    rc = db_record_batch(fd, ios, n);
+    for (int i = 0; i < n && rc == NO_ERROR; i++) {
+        if (ios[i].res == -1)
+            rc = ERR_DB_FILE;
+        else if (ios[i].res != sizeof(student_t) || recs[i].id != ids[i])
+            recs[i].id = 0;
+        else if (!db_record_ok(fd, &recs[i])) {
+            printf(M_ERR_DB_CORRUPT, ids[i]);
+            free(ios);
+            return ERR_DB_FILE;
+        } else
+            found++;
+    }
+
+    free(ios);
+    if (rc != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    return found;
+}
+
+/*
+ *  find_students
+ *      fd:    linux file descriptor
+ *      argc:  number of ids
+ *      argv:  the ids as given on the command line
+ *
+ *  -f with more than one id.  Prints the students that were found under
+ *  one header, in the order asked for, and reports the others.
+ *
+ *  returns:  number of ids not found, or ERR_DB_FILE on an I/O error
+ */
+static int find_students(int fd, int argc, char *argv[]) {
+    int *ids = malloc(argc * sizeof(int));
+    student_t *recs = malloc(argc * sizeof(student_t));
+    int found = ERR_DB_FILE;
+    bool header_printed = false;
+
+    if (ids != NULL && recs != NULL) {
+        for (int i = 0; i < argc; i++)
+            ids[i] = atoi(argv[i]);
+        found = get_students(fd, ids, argc, recs);
+    }
+
+    for (int i = 0; i < argc && found >= 0; i++) {
+        if (recs[i].id == 0) {
+            printf(M_STD_NOT_FND_MSG, ids[i]);
+            continue;
+        }
+        if (!header_printed)
+            printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST NAME", "LAST NAME", "GPA");
+        header_printed = true;
+        printf(STUDENT_PRINT_FMT_STRING, recs[i].id, recs[i].fname, recs[i].lname,
+               recs[i].gpa / 100.0);
+        stats_add(STAT_MATCHED, 1);
+    }
+
+    free(ids);
+    free(recs);
+    return found < 0 ? found : argc - found;
+}
+
+/*
+ *  init_student
+ *      *s:     the record to fill in
+ *      id:     student id
+ *      fname:  student first name
+ *      lname:  student last name
+ *      gpa:    GPA as an integer
+ *
+ *  Builds a zero padded student record, names that do not fit are
+ *  truncated and remain NUL terminated.
+ */
+void init_student(student_t *s, int id, char *fname, char *lname, int gpa) {
+    memset(s, 0, sizeof(student_t));
+    s->id = id;
+    strncpy(s->fname, fname, sizeof(s->fname) - 1);
+    strncpy(s->lname, lname, sizeof(s->lname) - 1);
+    s->gpa = gpa;
+}
+
+/*
+ *  parse_update
+ *      assign:  one field=value of an update, fname, lname or gpa
+ *      patch:   receives the value in the named field
+ *      fields:  the UPD_* bit of the field is set
+ *
+ *  A later assignment to the same field replaces an earlier one.  Names
+ *  that do not fit are truncated like in init_student().
+ *
+ *  returns:  NO_ERROR on success, EXIT_FAIL_ARGS if assign is not an
+ *            assignment to a known field
+ */
+int parse_update(char *assign, student_t *patch, unsigned *fields) {
+    char *value = strchr(assign, '=');
+    char *end;
+
+    if (value == NULL)
+        return EXIT_FAIL_ARGS;
+    value++;
+
+    if (strncmp(assign, "fname=", 6) == 0) {
+        memset(patch->fname, 0, sizeof(patch->fname));
+        strncpy(patch->fname, value, sizeof(patch->fname) - 1);
+        *fields |= UPD_FNAME;
+    } else if (strncmp(assign, "lname=", 6) == 0) {
+        memset(patch->lname, 0, sizeof(patch->lname));
+        strncpy(patch->lname, value, sizeof(patch->lname) - 1);
+        *fields |= UPD_LNAME;
+    } else if (strncmp(assign, "gpa=", 4) == 0) {
+        long gpa = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || gpa < MIN_STD_GPA || gpa > MAX_STD_GPA)
+            return EXIT_FAIL_ARGS;
+        patch->gpa = gpa;
+        *fields |= UPD_GPA;
+    } else {
+        return EXIT_FAIL_ARGS;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  patch_student
+ *      s:       record being updated
+ *      patch:   new values collected by parse_update()
+ *      fields:  UPD_* bits of the fields to take from patch
+ */
+void patch_student(student_t *s, const student_t *patch, unsigned fields) {
+    if (fields & UPD_FNAME)
+        memcpy(s->fname, patch->fname, sizeof(s->fname));
+    if (fields & UPD_LNAME)
+        memcpy(s->lname, patch->lname, sizeof(s->lname));
+    if (fields & UPD_GPA)
+        s->gpa = patch->gpa;
+}
+
+/*
+ *  update_span
+ *      old:    record as it is stored
+ *      s:      the same record after the update
+ *      start:  set to the offset of the first byte that differs
+ *
+ *  returns:  number of bytes from the first to the last one that differs,
+ *            only those have to be written.  0 if nothing changed
+ */
+size_t update_span(const student_t *old, const student_t *s, size_t *start) {
+    const unsigned char *a = (const unsigned char *)old;
+    const unsigned char *b = (const unsigned char *)s;
+    size_t first = 0, last = sizeof(student_t);
+
+    while (first < last && a[first] == b[first])
+        first++;
+    while (last > first && a[last - 1] == b[last - 1])
+        last--;
+    *start = first;
+    return last - first;
+}
+
+/*
+ *  slot_taken
+ *      fd:  linux file descriptor
+ *      id:  student id, its slot is locked
+ *
+ *  Databases with a header answer from the occupancy bitmap (or directory
+ *  or bucket), legacy ones have to read the slot.
+ *
+ *  returns:  1 if id is in the database, 0 if not, ERR_DB_FILE on a read
+ *            error
+ */
+static int slot_taken(int fd, int id) {
+    student_t student;
+
+    int rc = db_slot_used(fd, id);
+    if (rc == ERR_DB_OP) {
+        rc = get_student(fd, id, &student);
+        rc = rc == NO_ERROR ? 1 : rc == SRCH_NOT_FOUND ? 0 : rc;
+    }
+    return rc < 0 ? ERR_DB_FILE : rc;
+}
+
+/*
+ *  store_student
+ *      fd:  linux file descriptor
+ *      s:   the new student, its slot is locked and free
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on failure
+ */
+static int store_student(int fd, student_t *s) {
+    off_t offset = db_slot_reserve(fd, 1) == NO_ERROR ? db_slot_alloc(fd, s->id, 1) : -1;
+
+    db_seal(fd, s);
+    if (offset < 0 ||
+        db_write_record(fd, offset, s) != sizeof(student_t) ||
+        db_mark_slots(fd, &s->id, 1, true) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    index_add(fd, &s, 1);
+    printf(M_STD_ADDED, s->id);
     return NO_ERROR;
 }
 
@@ -85,40 +338,104 @@ int get_student(int fd, int id, student_t *s) {
  *            ERR_DB_OP      student already exists
  */
 int add_student(int fd, int id, char *fname, char *lname, int gpa) {
-    student_t student;
-    student_t new_student = {0};
+    student_t new_student;
 
-    if (validate_range(id, gpa) != NO_ERROR) {
+    if (validate_range(fd, id, gpa) != NO_ERROR) {
         printf(M_ERR_STD_RNG);
         return ERR_DB_OP;
     }
 
-    int rc = get_student(fd, id, &student);
-    if (rc == NO_ERROR) {
+    // the slot stays locked until the command commits, so two processes
+    // adding the same id can't both pass the duplicate check
+    if (db_lock_slots(fd, id, id) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    int rc = slot_taken(fd, id);
+    if (rc == 1) {
         printf(M_ERR_DB_ADD_DUP, id);
         return ERR_DB_OP;
-    } else if (rc != SRCH_NOT_FOUND) {
-        return rc;
+    } else if (rc < 0) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
     }
 
-    new_student.id = id;
-    strncpy(new_student.fname, fname, sizeof(new_student.fname) - 1);
-    strncpy(new_student.lname, lname, sizeof(new_student.lname) - 1);
-    new_student.gpa = gpa;
+    init_student(&new_student, id, fname, lname, gpa);
+    return store_student(fd, &new_student);
+}
 
-    off_t offset = id * sizeof(student_t);
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        printf(M_ERR_DB_WRITE);
-        return ERR_DB_FILE;
+/*
+ *  id_range
+ *      fd:  linux file descriptor
+ *      lo:  set to the lowest id -A may hand out
+ *      hi:  set to the highest
+ *
+ *  Takes the range from SDB_ID_RANGE (lo-hi), every valid id if unset.
+ *
+ *  returns:  NO_ERROR, or EXIT_FAIL_ARGS if the range is not valid
+ */
+static int id_range(int fd, int *lo, int *hi) {
+    char *env = getenv(SDB_ENV_ID_RANGE);
+    char extra;
+
+    *lo = MIN_STD_ID;
+    *hi = db_max_id(fd);
+    if (env != NULL && sscanf(env, "%d-%d%c", lo, hi, &extra) != 2)
+        return EXIT_FAIL_ARGS;
+    if (*lo > *hi || validate_range(fd, *lo, MIN_STD_GPA) != NO_ERROR ||
+        validate_range(fd, *hi, MIN_STD_GPA) != NO_ERROR)
+        return EXIT_FAIL_ARGS;
+    return NO_ERROR;
+}
+
+/*
+ *  add_auto_student
+ *      fd:     linux file descriptor
+ *      fname:  student first name
+ *      lname:  student last name
+ *      gpa:    GPA as an integer
+ *
+ *  Adds the student under the lowest free id of SDB_ID_RANGE, found with
+ *  db_free_id() instead of trying ids one at a time.  If another process
+ *  takes that id before its slot is locked, the search carries on past
+ *  it.
+ *
+ *  returns:  NO_ERROR       student added to database, M_STD_ADDED names
+ *                           the id
+ *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_OP      the gpa or range is not valid, or every id in
+ *                           the range is taken
+ */
+int add_auto_student(int fd, char *fname, char *lname, int gpa) {
+    student_t new_student;
+    int lo, hi, id, rc;
+
+    if (id_range(fd, &lo, &hi) != NO_ERROR || validate_range(fd, lo, gpa) != NO_ERROR) {
+        printf(M_ERR_STD_RNG);
+        return ERR_DB_OP;
     }
 
-    if (write(fd, &new_student, sizeof(student_t)) != sizeof(student_t)) {
-        printf(M_ERR_DB_WRITE);
+    for (int from = lo; ; from = id + 1) {
+        id = db_free_id(fd, from, hi);
+        if (id < 0 || (id > 0 && db_lock_slots(fd, id, id) != NO_ERROR)) {
+            printf(M_ERR_DB_READ);
+            return ERR_DB_FILE;
+        }
+        rc = id == 0 ? 1 : slot_taken(fd, id);
+        if (rc != 1 || id == 0 || id == hi)
+            break;
+    }
+    if (rc == 1) {
+        printf(M_ERR_NO_FREE_ID, lo, hi);
+        return ERR_DB_OP;
+    } else if (rc < 0) {
+        printf(M_ERR_DB_READ);
         return ERR_DB_FILE;
     }
 
-    printf(M_STD_ADDED, id);
-    return NO_ERROR;
+    init_student(&new_student, id, fname, lname, gpa);
+    return store_student(fd, &new_student);
 }
 
 /*
@@ -133,6 +450,11 @@ int add_student(int fd, int id, char *fname, char *lname, int gpa) {
 int del_student(int fd, int id) {
     student_t student;
 
+    if (db_lock_slots(fd, id, id) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
     int rc = get_student(fd, id, &student);
     if (rc != NO_ERROR) {
         if (rc == SRCH_NOT_FOUND) {
@@ -141,18 +463,99 @@ int del_student(int fd, int id) {
         return ERR_DB_OP;
     }
 
-    off_t offset = id * sizeof(student_t);
-    if (lseek(fd, offset, SEEK_SET) == -1) {
+    off_t offset = db_slot_offset(fd, id);
+    if (db_write_record(fd, offset, &EMPTY_STUDENT_RECORD) != sizeof(student_t) ||
+        db_mark_slots(fd, &id, 1, false) != NO_ERROR) {
         printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;
     }
 
-    if (write(fd, &EMPTY_STUDENT_RECORD, sizeof(student_t)) != sizeof(student_t)) {
+    index_del(fd, &student);
+
+    printf(M_STD_DEL_MSG, id);
+    return NO_ERROR;
+}
+
+/*
+ *  update_student
+ *      fd:       linux file descriptor
+ *      id:       student id to be updated
+ *      n:        number of assignments
+ *      assigns:  field=value for each field that changes
+ *
+ *  Changes a student in place.  The slot stays locked from the read of the
+ *  record to the commit, and only the bytes that differ are written, so
+ *  the student is never missing and no other field is touched.
+ *
+ *  returns:  NO_ERROR       student updated
+ *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_OP      an assignment or the id is not valid
+ *            SRCH_NOT_FOUND student not in database
+ */
+int update_student(int fd, int id, int n, char *assigns[]) {
+    student_t student, patch = {0};
+    student_t updated;
+    unsigned fields = 0;
+    size_t start, len;
+
+    for (int i = 0; i < n; i++) {
+        if (parse_update(assigns[i], &patch, &fields) != NO_ERROR) {
+            printf(M_ERR_UPDATE, assigns[i]);
+            return ERR_DB_OP;
+        }
+    }
+    if (validate_range(fd, id, MIN_STD_GPA) != NO_ERROR) {
+        printf(M_ERR_STD_RNG);
+        return ERR_DB_OP;
+    }
+
+    if (db_lock_slots(fd, id, id) != NO_ERROR) {
         printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;
     }
 
-    printf(M_STD_DEL_MSG, id);
+    int rc = get_student(fd, id, &student);
+    if (rc == SRCH_NOT_FOUND) {
+        printf(M_STD_NOT_FND_MSG, id);
+        return SRCH_NOT_FOUND;
+    } else if (rc != NO_ERROR) {
+        return ERR_DB_FILE;
+    }
+
+    updated = student;
+    patch_student(&updated, &patch, fields);
+    db_seal(fd, &updated);
+    len = update_span(&student, &updated, &start);
+    if (len > 0) {
+        off_t offset = db_slot_offset(fd, id);
+        //a dictionary record holds references, it is written whole
+        bool whole = db_format(fd) == DB_FORMAT_DICT;
+        if (offset < 0 || (whole && db_write_record(fd, offset, &updated) != sizeof(student_t)) ||
+            (!whole && db_write_at(fd, offset + start, (char *)&updated + start, len) != (ssize_t)len)) {
+            printf(M_ERR_DB_WRITE);
+            return ERR_DB_FILE;
+        }
+
+        student_t *added = &updated;
+        index_del(fd, &student);
+        index_add(fd, &added, 1);
+    }
+
+    printf(M_STD_UPDATED, id);
+    return NO_ERROR;
+}
+
+/*
+ *  count_records
+ *      db_scan() callback that counts the live records in each block
+ */
+static int count_records(student_t *recs, int n, void *arg) {
+    int *count = arg;
+
+    for (int i = 0; i < n; i++) {
+        if (recs[i].id != 0)
+            (*count)++;
+    }
     return NO_ERROR;
 }
 
@@ -160,24 +563,35 @@ int del_student(int fd, int id) {
  *  count_db_records
  *      fd:     linux file descriptor
  *
+ *  Legacy databases without a column file are counted with a parallel
+ *  scan, every thread counts its own part.
+ *
  *  returns:  <number>       number of records in db on success
  *            ERR_DB_FILE    database file I/O issue
  */
 int count_db_records(int fd) {
-    student_t student;
-    int count = 0;
-
-    if (lseek(fd, 0, SEEK_SET) == -1) {
+    int count = db_header_count(fd);
+
+    // legacy databases without a header take the count kept in the column
+    // file, and are scanned only when there is none
+    if (count == ERR_DB_OP)
+        count = col_count(fd);
+    if (count == ERR_DB_OP) {
+        int parts = db_scan_threads();
+        int counts[DB_SCAN_MAX_THREADS] = {0};
+
+        count = 0;
+        if (db_scan_parallel(fd, count_records, counts, sizeof(counts[0]), parts) != NO_ERROR)
+            count = ERR_DB_FILE;
+        for (int i = 0; i < parts && count >= 0; i++)
+            count += counts[i];
+    }
+    if (count < 0) {
         printf(M_ERR_DB_READ);
         return ERR_DB_FILE;
     }
 
-    while (read(fd, &student, sizeof(student_t)) == sizeof(student_t)) {
-        if (student.id != 0) {
-            count++;
-        }
-    }
-
+    stats_add(STAT_MATCHED, count);
     if (count == 0) {
         printf(M_DB_EMPTY);
     } else {
@@ -187,34 +601,74 @@ int count_db_records(int fd) {
     return count;
 }
 
+//output of one part of the print_db() scan
+typedef struct print_part {
+    FILE *out;      //memory stream over text/len
+    char *text;
+    size_t len;
+    int printed;
+} print_part_t;
+
+/*
+ *  print_records
+ *      db_scan() callback that formats the live records in each block
+ *      into the memory stream of its part
+ */
+static int print_records(student_t *recs, int n, void *arg) {
+    print_part_t *part = arg;
+
+    for (int i = 0; i < n; i++) {
+        if (recs[i].id != 0) {
+            float gpa = recs[i].gpa / 100.0;
+            fprintf(part->out, STUDENT_PRINT_FMT_STRING, recs[i].id, recs[i].fname, recs[i].lname, gpa);
+            part->printed++;
+        }
+    }
+    return NO_ERROR;
+}
+
 /*
  *  print_db
  *      fd:     linux file descriptor
  *
+ *  The records are formatted by a parallel scan, each thread into a
+ *  buffer of its own, and the buffers are written out in id order.
+ *
  *  returns:  NO_ERROR       on success
  *            ERR_DB_FILE    database file I/O issue
  */
 int print_db(int fd) {
-    student_t student;
-    bool header_printed = false;
-
-    if (lseek(fd, 0, SEEK_SET) == -1) {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;
+    print_part_t part[DB_SCAN_MAX_THREADS] = {0};
+    int parts = db_scan_threads();
+    int printed = 0;
+    int rc = NO_ERROR;
+
+    for (int i = 0; i < parts && rc == NO_ERROR; i++) {
+        part[i].out = open_memstream(&part[i].text, &part[i].len);
+        if (part[i].out == NULL)
+            rc = ERR_DB_FILE;
     }
-
-    while (read(fd, &student, sizeof(student_t)) == sizeof(student_t)) {
-        if (student.id != 0) {
-            if (!header_printed) {
+    if (rc == NO_ERROR && db_scan_parallel(fd, print_records, part, sizeof(part[0]), parts) != NO_ERROR)
+        rc = ERR_DB_FILE;
+
+    for (int i = 0; i < parts; i++) {
+        if (part[i].out != NULL)
+            fclose(part[i].out);
+        if (rc == NO_ERROR && part[i].printed > 0) {
+            if (printed == 0)
                 printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
-                header_printed = true;
-            }
-            float gpa = student.gpa / 100.0;
-            printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname, student.lname, gpa);
+            fwrite(part[i].text, 1, part[i].len, stdout);
+            printed += part[i].printed;
+            stats_add(STAT_MATCHED, part[i].printed);
         }
+        free(part[i].text);
     }
 
-    if (!header_printed) {
+    if (rc != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    if (printed == 0) {
         printf(M_DB_EMPTY);
     }
 
@@ -234,79 +688,102 @@ void print_student(student_t *s) {
     float gpa = s->gpa / 100.0;
     printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST NAME", "LAST NAME", "GPA");
     printf(STUDENT_PRINT_FMT_STRING, s->id, s->fname, s->lname, gpa);
+    stats_add(STAT_MATCHED, 1);
 }
 
 /*
  *  compress_db
  *      fd:     linux file descriptor
  *
+ *  Rewrites the database as a packed file holding only the live records,
+ *  with a directory that keeps -f, -a and -d at a constant cost.  A
+ *  dictionary file stays one, dict_pack() drops the names nobody uses
+ *  any more.
+ *
  *  returns:  <number>       fd of the compressed database file
  *            ERR_DB_FILE    database file I/O issue
  */
 int compress_db(int fd) {
-    int tmp_fd;
-    student_t student;
-
-    tmp_fd = open(TMP_DB_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-    if (tmp_fd == -1) {
-        printf(M_ERR_DB_OPEN);
-        return ERR_DB_FILE;
+    // the packed directory only covers ids up to MAX_STD_ID
+    if (db_format(fd) == DB_FORMAT_HASHED) {
+        printf(M_DB_HASHED_KEEP);
+        return fd;
     }
 
-    if (lseek(fd, 0, SEEK_SET) == -1) {
-        printf(M_ERR_DB_READ);
-        close(tmp_fd);
+    fd = db_format(fd) == DB_FORMAT_DICT ? dict_pack(fd) : pack_db(fd);
+    if (fd < 0)
         return ERR_DB_FILE;
-    }
 
-    ssize_t bytes_read;
-    while ((bytes_read = read(fd, &student, sizeof(student_t))) > 0) {
-        if (bytes_read != sizeof(student_t)) {
-            printf(M_ERR_DB_READ);
-            close(tmp_fd);
-            return ERR_DB_FILE;
-        }
-        if (student.id != 0) {
-            if (write(tmp_fd, &student, sizeof(student_t)) != sizeof(student_t)) {
-                printf(M_ERR_DB_WRITE);
-                close(tmp_fd);
-                return ERR_DB_FILE;
-            }
-        }
-    }
+    index_rebuild(fd);
+    chg_compress(fd);
+    printf(M_DB_COMPRESSED_OK);
+    return fd;
+}
 
-    if (bytes_read == -1) {
-        printf(M_ERR_DB_READ);
-        close(tmp_fd);
+/*
+ *  zero_db
+ *      fd:  pointer to the open database descriptor, replaced by the
+ *           descriptor of the emptied database
+ *
+ *  Empties the database for -z.  The file keeps the layout it had, and
+ *  record checksums if it had them, except that a packed file (what -x
+ *  leaves behind) starts over in the layout new files get.  Pending
+ *  changes and the write-ahead log are thrown away first, replaying the
+ *  log must not bring the records back.  Other processes are locked out
+ *  while the file is truncated and its header written again.
+ *
+ *  returns:  NO_ERROR       the database is empty
+ *            ERR_DB_FILE    database file I/O issue, *fd may be < 0
+ */
+int zero_db(int *fd) {
+    int format = db_format(*fd);
+    uint32_t flags = db_flags(*fd) | db_flags_from_env();
+    int old_fd;
+
+    if (format == DB_FORMAT_PACKED)
+        format = db_format_from_env();
+    wal_reset(*fd);
+    if (db_lock_file(*fd, F_WRLCK) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;
     }
 
-    close(fd);
-    close(tmp_fd);
-
-    if (rename(TMP_DB_FILE, DB_FILE) == -1) {
-        printf(M_ERR_DB_CREATE);
-        return ERR_DB_FILE;
+    //the stream gets the zero when the old descriptor is closed, the
+    //command is counted in it before the file is truncated
+    chg_zero(*fd);
+    old_fd = *fd;
+
+    //a dup() shares the open file and so the lock, which outlives the old
+    //descriptor.  A descriptor of its own would wait for the lock in
+    //db_detect_format().
+    *fd = dup(old_fd);
+    if (*fd != -1 && ftruncate(*fd, 0) == -1) {
+        close(*fd);
+        *fd = -1;
     }
-
-    fd = open_db(DB_FILE, false);
-    if (fd == -1) {
+    close_db(old_fd);
+    if (*fd != -1 && db_attach(*fd) != NO_ERROR)
+        *fd = -1;
+    if (*fd < 0)
         printf(M_ERR_DB_OPEN);
+    if (*fd < 0 || db_lock_file(*fd, F_WRLCK) != NO_ERROR ||
+        db_create_format(*fd, format, flags) != NO_ERROR)
         return ERR_DB_FILE;
-    }
 
-    printf(M_DB_COMPRESSED_OK);
-    return fd;
+    index_rebuild(*fd);
+    return NO_ERROR;
 }
 
 /*
  *  validate_range
+ *      fd:  linux file descriptor
  *      id:  proposed student id
  *      gpa: proposed gpa
  *
  *  This function validates that the id and gpa are in the allowable ranges
  *  as per the specifications.  It checks if the values are within the
- *  inclusive range using constents in db.h
+ *  inclusive range using constents in db.h, a hashed database takes ids up
+ *  to DB_HASH_MAX_ID
  *
  *  returns:    NO_ERROR       on success, both ID and GPA are in range
  *              EXIT_FAIL_ARGS if either ID or GPA is out of range
@@ -314,8 +791,8 @@ int compress_db(int fd) {
  *  console:  This function does not produce any output
  *
  */
-int validate_range(int id, int gpa) {
-    if (id < MIN_STD_ID || id > MAX_STD_ID)
+int validate_range(int fd, int id, int gpa) {
+    if (id < MIN_STD_ID || id > db_max_id(fd))
         return EXIT_FAIL_ARGS;
 
     if (gpa < MIN_STD_GPA || gpa > MAX_STD_GPA)
@@ -336,58 +813,85 @@ int validate_range(int id, int gpa) {
  *
  */
 void usage(char *exename) {
-    printf("usage: %s -[h|a|c|d|f|p|z] options.  Where:\n", exename);
+    printf("usage: %s [-S] -[h|a|A|b|c|d|f|g|n|p|q|r|t|u|U|V|x|z] options.  Where:\n", exename);
     printf("\t-h:  prints help\n");
+    printf("\t-S:  before another option, reports statistics as JSON on stderr\n");
     printf("\t-a id first_name last_name gpa(as 3 digit int):  adds a student\n");
+    printf("\t-A first_name last_name gpa:  adds a student under the lowest free id\n");
+    printf("\t-b file:  bulk loads id,first_name,last_name,gpa lines (- for stdin)\n");
     printf("\t-c:  counts the records in the database\n");
     printf("\t-d id:  deletes a student\n");
-    printf("\t-f id:  finds and prints a student in the database\n");
+    printf("\t-f id [id...]:  finds and prints students in the database\n");
+    printf("\t-g [percentile...]:  prints gpa mean, median, min, max and the gpa at each percentile\n");
+    printf("\t-n last_name[,first_name]:  finds students by name using the name index\n");
     printf("\t-p:  prints all records in the student database\n");
-    printf("\t-x:  compress the database file [EXTRA CREDIT]\n");
+    printf("\t-q \"predicate\":  prints students matching e.g. \"gpa>=350 && lname==doe\"\n");
+    printf("\t-r lo hi:  prints students with lo <= gpa <= hi using the gpa index\n");
+    printf("\t-t script:  runs the -a, -d and -u lines of script all or nothing (- for stdin)\n");
+    printf("\t-u id field=value...:  updates fname, lname and/or gpa of a student in place\n");
+    printf("\t-U file:  applies id field=value... lines as -u does (- for stdin)\n");
+    printf("\t-V:  verifies the checksum of every record, corrupt ids are reported\n");
+    printf("\t-x:  compress the database file into the packed format\n");
     printf("\t-z:  zero db file (remove all records)\n");
+    printf("\t--upgrade:  convert a headerless db file to format version %d\n", DB_FORMAT_V1);
+    printf("\t--serve [socket]:  keep the db open and serve requests (default %s)\n", DB_SOCK_FILE);
+    printf("\t--stop:  stop the server named by SDB_SERVER\n");
+    printf("\t--follow stream [--once]:  apply the %s of another db to this one as it grows\n", CHG_FILE);
+    printf("environment:\n");
+    printf("\tSDB_ENGINE=io|mmap|uring:  storage engine (default io)\n");
+    printf("\tSDB_SYNC=close|none|write:  when the mmap engine calls msync (default close)\n");
+    printf("\tSDB_FORMAT=legacy|v1|packed|hashed|dict:  layout used when creating a db file (default legacy)\n");
+    printf("\tSDB_SERVER=socket:  send the command to a running sdbsc --serve\n");
+    printf("\tSDB_WAL=on:  log changes to %s and commit them with one fdatasync\n", DB_WAL_FILE);
+    printf("\tSDB_SIMD=off:  evaluate -q without the AVX2 kernel and checksums without SSE4.2\n");
+    printf("\tSDB_THREADS=n:  threads used by -p, -c and -x (default one per cpu)\n");
+    printf("\tSDB_STATS=on:  same as -S\n");
+    printf("\tSDB_ID_RANGE=lo-hi:  ids -A may hand out (default all)\n");
+    printf("\tSDB_CRC=on:  checksum every record of a db file created with a header\n");
+    printf("\tSDB_CHANGES=on:  add every committed change to %s for --follow\n", CHG_FILE);
+    printf("\tSDB_SNAPSHOT=off:  scans hold the file lock instead of reading a snapshot\n");
 }
 
 
-// Welcome to main()
-int main(int argc, char *argv[])
+/*
+ *  run_command
+ *      fd:    pointer to the open database descriptor.  It is updated when
+ *             the operation replaces the database file (-x and -z)
+ *      argc:  number of entries in argv
+ *      argv:  command line, argv[1] holds the option and argv[0] is only
+ *             used for the usage message
+ *
+ *  Runs one database operation.  main() uses this for the command line
+ *  and the server (sdb_server.c) uses it for every request it receives.
+ *
+ *  returns:  the exit code that should be returned to the shell
+ */
+int run_command(int *fd, int argc, char *argv[])
 {
     char opt;      // user selected option
-    int fd;        // file descriptor of database files
     int rc;        // return code from various operations
     int exit_code; // exit code to shell
     int id;        // userid from argv[2]
     int gpa;       // gpa from argv[5]
+    int lo, hi;    // gpa range from argv[2] and argv[3]
 
     // space for a student structure which we will get back from
     // some of the functions we will be writing such as get_student(),
     // and print_student().
     student_t student = {0};
 
-    // This function must have at least one arg, and the arg must start
-    // with a dash
-    if ((argc < 2) || (*argv[1] != '-'))
-    {
-        usage(argv[0]);
-        exit(1);
-    }
-
-    // The option is the first character after the dash for example
-    //-h -a -c -d -f -p -x -z
     opt = (char)*(argv[1] + 1); // get the option flag
 
-    // handle the help flag and then exit normally
-    if (opt == 'h')
+    // long options that operate on an open database
+    if (opt == '-')
     {
+        if (strcmp(argv[1], "--upgrade") == 0 && argc == 2)
+        {
+            *fd = upgrade_db(*fd);
+            return *fd < 0 ? EXIT_FAIL_DB : EXIT_OK;
+        }
         usage(argv[0]);
-        exit(EXIT_OK);
-    }
-
-    // now lets open the file and continue if there is no error
-    // note we are not truncating the file using the second
-    // parameter
-    fd = open_db(DB_FILE, false);
-    if (fd < 0) {
-        exit(EXIT_FAIL_DB);
+        return EXIT_FAIL_ARGS;
     }
 
     // set rc to the return code of the operation to ensure the program
@@ -414,25 +918,60 @@ int main(int argc, char *argv[])
         id = atoi(argv[2]);
         gpa = atoi(argv[5]);
 
-        exit_code = validate_range(id, gpa);
+        exit_code = validate_range(*fd, id, gpa);
         if (exit_code == EXIT_FAIL_ARGS)
         {
             printf(M_ERR_STD_RNG);
             break;
         }
 
-        rc = add_student(fd, id, argv[3], argv[4], gpa);
+        rc = add_student(*fd, id, argv[3], argv[4], gpa);
         if (rc < 0)
             exit_code = EXIT_FAIL_DB;
 
         break;
 
+    case 'A':
+        //   arv[0] arv[1]      arv[2]    arv[3]  arv[4]
+        // prog_name     -A  first_name last_name     gpa
+        //------------------------------------------------
+        // example:  prog_name -A John Doe 341
+        if (argc != 5)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = add_auto_student(*fd, argv[2], argv[3], atoi(argv[4]));
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'b':
+        //   arv[0] arv[1]  arv[2]
+        // prog_name     -b    file
+        //-------------------------
+        // example:  prog_name -b students.csv
+        //           prog_name -b - < students.csv
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = bulk_load(*fd, argv[2]);
+        if (rc != 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'c':
         //    arv[0] arv[1]
         // prog_name     -c
         //-----------------
         // example:  prog_name -c
-        rc = count_db_records(fd);
+        rc = count_db_records(*fd);
         if (rc < 0)
             exit_code = EXIT_FAIL_DB;
         break;
@@ -449,25 +988,31 @@ int main(int argc, char *argv[])
             break;
         }
         id = atoi(argv[2]);
-        rc = del_student(fd, id);
+        rc = del_student(*fd, id);
         if (rc < 0)
             exit_code = EXIT_FAIL_DB;
 
         break;
 
     case 'f':
-        //    arv[0] arv[1]  arv[2]
-        // prog_name     -f      id
-        //-------------------------
-        // example:  prog_name -f 100
-        if (argc != 3)
+        //    arv[0] arv[1]  arv[2]   arv[3..]
+        // prog_name     -f      id   more ids
+        //----------------------------------
+        // example:  prog_name -f 100 101 250
+        if (argc < 3)
         {
             usage(argv[0]);
             exit_code = EXIT_FAIL_ARGS;
             break;
         }
+        if (argc > 3) {
+            rc = find_students(*fd, argc - 2, &argv[2]);
+            if (rc != 0)
+                exit_code = EXIT_FAIL_DB;
+            break;
+        }
         id = atoi(argv[2]);
-        rc = get_student(fd, id, &student);
+        rc = get_student(*fd, id, &student);
 
         switch (rc)
         {
@@ -485,16 +1030,155 @@ int main(int argc, char *argv[])
         }
         break;
 
+    case 'g':
+        //    arv[0] arv[1]  arv[2..]
+        // prog_name     -g  percentiles
+        //-----------------------------
+        // example:  prog_name -g
+        //           prog_name -g 90 99
+        rc = gpa_stats_db(*fd, argc - 2, &argv[2]);
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'n':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -n    name
+        //-------------------------
+        // example:  prog_name -n doe
+        //           prog_name -n doe,john
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = find_by_name(*fd, argv[2]);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'r':
+        //    arv[0] arv[1]  arv[2]  arv[3]
+        // prog_name     -r      lo      hi
+        //---------------------------------
+        // example:  prog_name -r 300 350
+        if (argc != 4)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        lo = atoi(argv[2]);
+        hi = atoi(argv[3]);
+        if (lo < MIN_STD_GPA || hi > MAX_STD_GPA || lo > hi)
+        {
+            printf(M_ERR_GPA_RNG, MIN_STD_GPA, MAX_STD_GPA);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = find_by_gpa(*fd, lo, hi);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'p':
         //    arv[0] arv[1]
         // prog_name     -p
         //-----------------
         // example:  prog_name -p
-        rc = print_db(fd);
+        rc = print_db(*fd);
         if (rc < 0)
             exit_code = EXIT_FAIL_DB;
         break;
 
+    case 'q':
+        //    arv[0] arv[1]     arv[2]
+        // prog_name     -q  predicate
+        //----------------------------
+        // example:  prog_name -q "gpa>=350 && lname==doe"
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = query_db(*fd, argv[2]);
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 't':
+        //   arv[0] arv[1]  arv[2]
+        // prog_name     -t  script
+        //-------------------------
+        // example:  prog_name -t enroll.txt
+        //           prog_name -t - < enroll.txt
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = run_transaction(fd, argv[0], argv[2]);
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'u':
+        //   arv[0] arv[1]  arv[2]     arv[3..]
+        // prog_name     -u      id  field=value
+        //---------------------------------------
+        // example:  prog_name -u 100 gpa=351 lname=smith
+        if (argc < 4)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        id = atoi(argv[2]);
+        rc = update_student(*fd, id, argc - 3, &argv[3]);
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'U':
+        //   arv[0] arv[1]  arv[2]
+        // prog_name     -U    file
+        //-------------------------
+        // example:  prog_name -U updates.txt
+        //           prog_name -U - < updates.txt
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = bulk_update(*fd, argv[2]);
+        if (rc != 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'V':
+        //    arv[0] arv[1]
+        // prog_name     -V
+        //-----------------
+        // example:  prog_name -V
+        rc = scrub_db(*fd);
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc != 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'x':
         //    arv[0] arv[1]
         // prog_name     -x
@@ -503,8 +1187,8 @@ int main(int argc, char *argv[])
 
         // remember compress_db returns a fd of the compressed database.
         // we close it after this switch statement
-        fd = compress_db(fd);
-        if (fd < 0)
+        *fd = compress_db(*fd);
+        if (*fd < 0)
             exit_code = EXIT_FAIL_DB;
         break;
 
@@ -513,11 +1197,8 @@ int main(int argc, char *argv[])
         // prog_name     -x
         //-----------------
         // example:  prog_name -x
-        // HINT:  close the db file, we already have fd
-        //       and reopen db indicating truncate=true
-        close(fd);
-        fd = open_db(DB_FILE, true);
-        if (fd < 0)
+        // see zero_db()
+        if (zero_db(fd) != NO_ERROR)
         {
             exit_code = EXIT_FAIL_DB;
             break;
@@ -530,8 +1211,110 @@ int main(int argc, char *argv[])
         exit_code = EXIT_FAIL_ARGS;
     }
 
+    return exit_code;
+}
+
+// Welcome to main()
+int main(int argc, char *argv[])
+{
+    char opt;      // user selected option
+    int fd;        // file descriptor of database files
+    int exit_code; // exit code to shell
+    char *server;  // socket of a running sdbsc server, if any
+    char *stats;   // SDB_STATS setting
+
+    // -S in front of any other option turns on statistics for it, the
+    // rest of the command line is handled as if it was not there
+    stats = getenv(SDB_ENV_STATS);
+    if (argc > 2 && strcmp(argv[1], "-S") == 0)
+    {
+        stats_start(argv[2]);
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    else if (argc > 1 && stats != NULL && strcmp(stats, "on") == 0)
+    {
+        stats_start(argv[1]);
+    }
+
+    // This function must have at least one arg, and the arg must start
+    // with a dash
+    if ((argc < 2) || (*argv[1] != '-'))
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    // The option is the first character after the dash for example
+    //-h -a -c -d -f -p -x -z
+    opt = (char)*(argv[1] + 1); // get the option flag
+
+    // handle the help flag and then exit normally
+    if (opt == 'h')
+    {
+        usage(argv[0]);
+        exit(EXIT_OK);
+    }
+
+    // long options, --serve keeps the database open and answers requests
+    // over a unix domain socket until it is asked to stop
+    if (strcmp(argv[1], "--serve") == 0)
+    {
+        if (argc > 3)
+        {
+            usage(argv[0]);
+            exit(EXIT_FAIL_ARGS);
+        }
+        exit(start_db_server(argc == 3 ? argv[2] : DB_SOCK_FILE));
+    }
+
+    // --follow keeps the database in this directory a replica of the one
+    // whose change stream it names, --once stops when it has caught up
+    if (strcmp(argv[1], "--follow") == 0)
+    {
+        if (argc < 3 || argc > 4 || (argc == 4 && strcmp(argv[3], "--once") != 0))
+        {
+            usage(argv[0]);
+            exit(EXIT_FAIL_ARGS);
+        }
+        fd = open_db(DB_FILE, false);
+        if (fd < 0)
+            exit(EXIT_FAIL_DB);
+        exit_code = follow_changes(&fd, argv[2], argc == 4);
+        if (fd >= 0)
+            close_db(fd);
+        exit(exit_code);
+    }
+
+    // when SDB_SERVER names the socket of a running server the command is
+    // forwarded to it instead of opening the database in this process
+    server = getenv(SDB_ENV_SERVER);
+    if (server != NULL && *server != '\0')
+    {
+        exit(exec_remote_command(server, argc, argv));
+    }
+
+    // now lets open the file and continue if there is no error
+    // note we are not truncating the file using the second
+    // parameter
+    fd = open_db(DB_FILE, false);
+    if (fd < 0) {
+        exit(EXIT_FAIL_DB);
+    }
+
+    exit_code = run_command(&fd, argc, argv);
+
+    // with the write-ahead log enabled the changes are only durable once
+    // they are committed, report it if that fails
+    if (fd >= 0 && db_commit(fd) != NO_ERROR)
+    {
+        printf(M_ERR_DB_WRITE);
+        exit_code = EXIT_FAIL_DB;
+    }
+
     // dont forget to close the file before exiting, and setting the
     // proper exit code - see the header file for expected values
-    close(fd);
+    close_db(fd);
     exit(exit_code);
 }
@@ -1,19 +1,388 @@
 #ifndef __SDB_H__
+    #define __SDB_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #include "db.h" //get student record type
 
 //prototypes for functions go below for this assignment
 int open_db(char *dbFile, bool should_truncate);
+int close_db(int fd);
 int add_student(int fd, int id, char *fname, char *lname, int gpa);
+int add_auto_student(int fd, char *fname, char *lname, int gpa);
 int get_student(int fd, int id, student_t *s);
+int get_students(int fd, const int *ids, int n, student_t *recs);
 int del_student(int fd, int id);
+int update_student(int fd, int id, int n, char *assigns[]);
 int compress_db(int fd);
+int zero_db(int *fd);
+int scrub_db(int fd);
 void print_student(student_t *s);
-int validate_range(int id, int gpa);
+int validate_range(int fd, int id, int gpa);
 int count_db_records(int fd);
 int print_db(int fd);
+void init_student(student_t *s, int id, char *fname, char *lname, int gpa);
+int bulk_load(int fd, char *path);
+int bulk_update(int fd, char *path);
+int parse_update(char *assign, student_t *patch, unsigned *fields);
+void patch_student(student_t *s, const student_t *patch, unsigned fields);
+size_t update_span(const student_t *old, const student_t *s, size_t *start);
+int run_command(int *fd, int argc, char *argv[]);
+int run_transaction(int *fd, char *exename, char *path);
 void usage(char *);
 
+//fields an update (-u and -U) may assign, id is what names the student
+#define UPD_FNAME   0x1
+#define UPD_LNAME   0x2
+#define UPD_GPA     0x4
+
+//storage engines, selected with the SDB_ENGINE environment variable
+//  DB_ENGINE_IO     lseek() + read()/write() for every record (default)
+//  DB_ENGINE_MMAP   SDB_ENGINE=mmap, records are accessed directly in a
+//                   MAP_SHARED region that grows with pwrite() + mremap()
+//  DB_ENGINE_URING  SDB_ENGINE=uring, single records use plain I/O while
+//                   batches and scans keep DB_URING_DEPTH transfers in
+//                   flight through an io_uring (falls back to io when the
+//                   kernel has none)
+#define DB_ENGINE_IO    0
+#define DB_ENGINE_MMAP  1
+#define DB_ENGINE_URING 2
+#define DB_URING_DEPTH  64
+
+//when the mmap engine flushes dirty pages, selected with SDB_SYNC
+//  DB_SYNC_CLOSE    msync(MS_SYNC) the whole region in close_db() (default)
+//  DB_SYNC_NONE     SDB_SYNC=none, leave it to normal kernel writeback
+//  DB_SYNC_WRITE    SDB_SYNC=write, msync(MS_SYNC) after every record write
+#define DB_SYNC_CLOSE   0
+#define DB_SYNC_NONE    1
+#define DB_SYNC_WRITE   2
+
+#define SDB_ENV_ENGINE  "SDB_ENGINE"
+#define SDB_ENV_SYNC    "SDB_SYNC"
+#define SDB_ENV_FORMAT  "SDB_FORMAT"    //v1, packed or hashed creates new files with a header
+#define SDB_ENV_WAL     "SDB_WAL"       //on logs every change before applying it
+#define SDB_ENV_SIMD    "SDB_SIMD"      //off keeps -q and crc32c() on the scalar code
+#define SDB_ENV_THREADS "SDB_THREADS"   //threads used by full file scans
+#define SDB_ENV_STATS   "SDB_STATS"     //on reports statistics like -S
+#define SDB_ENV_SNAPSHOT "SDB_SNAPSHOT" //off makes scans hold the file lock throughout
+#define SDB_ENV_ID_RANGE "SDB_ID_RANGE" //lo-hi, the ids -A hands out
+#define SDB_ENV_CRC     "SDB_CRC"       //on creates files with record checksums
+#define SDB_ENV_CHANGES "SDB_CHANGES"   //on starts the change stream
+
+#define DB_MAX_HANDLES  8
+#define DB_SCAN_BLOCK   (1024*64)   //bytes read per call when scanning
+#define DB_SCAN_MAX_THREADS 64
+#define DB_SCAN_MIN_PART    (1024*256)  //smallest share of the file worth a thread
+#define DB_SNAP_MIN     (1024*1024) //data bytes that make a scan snapshot the file
+
+//secondary indexes, see sdb_index.c
+#define DB_IDX_NAME         0       //last name (and first name) index
+#define DB_IDX_GPA          1       //one bucket per gpa value
+#define DB_IDX_COUNT        2
+#define NAME_IDX_BUCKETS    1024    //~100 entries per bucket at 100000 students
+#define GPA_IDX_BUCKETS     (MAX_STD_GPA - MIN_STD_GPA + 1)
+
+//write-ahead log, see sdb_wal.c
+#define WAL_CHECKPOINT_BYTES    (1024*1024) //checkpoint once the log is this big
+#define WAL_IDLE_MS             500         //server checkpoints after this much idle time
+
+//log state of one open database.  Changes are collected in buf as log
+//entries until wal_commit() writes them out with a single fdatasync().
+typedef struct db_wal {
+    int      fd;        //log file, -1 when the log is not in use
+    char    *buf;       //pending entries, each wal_entry_t + padded payload
+    size_t   len;
+    size_t   cap;
+    size_t   last;      //offset in buf of the newest pending entry
+    off_t    size;      //bytes of entries in the log file at the last commit
+    bool     txn;       //a transaction is open, see wal_txn_begin()
+    bool     temp;      //the log is only on for that transaction
+    size_t   txn_len;   //len and last when the transaction began
+    size_t   txn_last;
+} db_wal_t;
+
+//change stream, see sdb_changes.c
+#define CHG_READ_ENTRIES    1024        //entries --follow reads at a time, to start with
+#define CHG_POLL_MS         100         //--follow looks for new changes this often
+#define CHG_REBASE_BYTES    (64*1024*1024)  //a longer stream is started over when the db is opened
+
+//change stream state of one open database.  The entries of the current
+//command are collected in buf until db_commit() adds them to the stream.
+typedef struct db_chg {
+    int          fd;        //student.db.chg, -1 when there is none
+    chg_entry_t *buf;
+    int          len;
+    int          cap;
+    int          txn_len;   //len when the transaction began
+    bool         lost;      //a change could not be queued, the commit fails
+    bool         begun;     //the command is counted in chg_header_t.begun
+} db_chg_t;
+
+//io_uring state, private to sdb_uring.c
+typedef struct db_ring db_ring_t;
+
+//one transfer of a db_io_batch().  buff/len describe the data, a write
+//may give iov/iovcnt instead.  res is set to the bytes transferred or -1.
+typedef struct db_io {
+    bool    write;
+    off_t   offset;
+    void   *buff;
+    size_t  len;
+    const struct iovec *iov;
+    int     iovcnt;
+    ssize_t res;
+} db_io_t;
+
+//per descriptor engine state, see sdb_engine.c
+typedef struct db_handle {
+    bool    in_use;
+    int     fd;
+    int     engine;     //DB_ENGINE_*
+    int     sync_mode;  //DB_SYNC_*
+    char   *map;        //base of the shared mapping (DB_ENGINE_MMAP)
+    size_t  map_len;    //number of bytes currently mapped
+    db_ring_t *ring;    //batch submission ring (DB_ENGINE_URING)
+    int     format;     //DB_FORMAT_* found by db_detect_format()
+    off_t   data_off;   //file offset of record slot 0
+    off_t   bitmap_off; //file offset of the occupancy bitmap or packed
+                        //directory (0 if none)
+    uint32_t flags;     //DB_FLAG_* of the header
+    int     idx_fd[DB_IDX_COUNT];       //open secondary indexes, -1 if not
+    int     col_fd;     //open column file, -1 if not
+    db_wal_t wal;
+    db_chg_t chg;
+    short   file_lock;  //F_RDLCK/F_WRLCK while the whole file is locked
+    uint64_t ino;       //identity of the file fd was opened on, see
+    uint64_t birth;     //db_identity(), 0 while it is being attached
+} db_handle_t;
+
+//callback used by db_scan(), receives n consecutive record slots
+typedef int (*db_scan_fn)(student_t *recs, int n, void *arg);
+
+//engine prototypes for sdb_engine.c
+int db_attach(int fd);
+int db_follow(int fd);
+db_handle_t *db_handle(int fd);
+ssize_t db_read_at(int fd, off_t offset, void *buff, size_t len);
+ssize_t db_write_at(int fd, off_t offset, const void *buff, size_t len);
+ssize_t db_writev_at(int fd, off_t offset, const struct iovec *iov, int iovcnt);
+ssize_t db_apply_at(int fd, off_t offset, const struct iovec *iov, int iovcnt);
+int db_sync(db_handle_t *h);
+void db_identity(int fd, uint64_t *ino, uint64_t *birth);
+bool db_file_gone(int fd);
+int db_lock(int fd, short type, off_t start, off_t len);
+int db_lock_file(int fd, short type);
+int db_lock_slots(int fd, int first, int last);
+int db_commit(int fd);
+int db_scan(int fd, db_scan_fn fn, void *arg);
+int db_scan_threads(void);
+int db_scan_parallel(int fd, db_scan_fn fn, void *args, size_t arg_size, int parts);
+int db_io_batch(int fd, db_io_t *ios, int n);
+
+//counters kept by sdb_stats.c for -S and SDB_STATS
+#define STAT_READS          0   //read system calls on the database file
+#define STAT_WRITES         1   //write system calls on the database file
+#define STAT_SEEKS          2   //lseek() calls, SEEK_DATA/SEEK_HOLE while scanning
+#define STAT_RING_IOS       3   //transfers handed to an io_uring instead
+#define STAT_BYTES_READ     4
+#define STAT_BYTES_WRITTEN  5
+#define STAT_IO_NS          6   //time spent in those reads and writes
+#define STAT_SCANNED        7   //record slots handed to scan callbacks
+#define STAT_MATCHED        8   //records a command reported or counted
+#define STAT_COUNT          9
+
+//statistics prototypes for sdb_stats.c
+void stats_start(const char *op);
+bool stats_enabled(void);
+uint64_t stats_now(void);
+void stats_add(int counter, uint64_t n);
+void stats_io(int counter, uint64_t start, ssize_t bytes);
+void stats_latency(uint64_t start);
+
+//io_uring prototypes for sdb_uring.c
+db_ring_t *uring_open(unsigned depth);
+void uring_close(db_ring_t *ring);
+int uring_queue(db_ring_t *ring, int fd, const db_io_t *io, uint64_t tag);
+int uring_wait(db_ring_t *ring, uint64_t *tag, ssize_t *res);
+int uring_batch(db_ring_t *ring, int fd, db_io_t *ios, int n);
+
+//format prototypes for sdb_format.c
+int db_format_from_env(void);
+void db_init_header(db_header_t *hdr, int format);
+int db_detect_format(db_handle_t *h);
+int db_create_format(int fd, int format, uint32_t flags);
+int db_format(int fd);
+uint32_t db_flags_from_env(void);
+uint32_t db_flags(int fd);
+uint32_t record_crc(const student_t *s);
+void db_seal(int fd, student_t *s);
+bool db_record_ok(int fd, const student_t *s);
+off_t db_slot_offset(int fd, int id);
+ssize_t db_read_record(int fd, off_t offset, student_t *s);
+ssize_t db_write_record(int fd, off_t offset, const student_t *s);
+int db_record_batch(int fd, db_io_t *ios, int n);
+off_t db_slot_alloc(int fd, int first, int n);
+int db_slot_reserve(int fd, int n);
+int db_slot_used(int fd, int id);
+int db_mark_slots(int fd, const int *ids, int n, bool used);
+int db_header_count(int fd);
+int db_max_id(int fd);
+int db_free_id(int fd, int lo, int hi);
+int rebuild_db(int fd);
+int upgrade_db(int fd);
+
+//packed format prototypes for sdb_packed.c
+int packed_locate(int fd, int id, off_t *offset);
+off_t packed_alloc(int fd, int first, int n);
+int packed_free(int fd, const int *ids, int n);
+int packed_scan(int fd, int src, int first, int last, db_scan_fn fn, void *arg);
+int pack_db(int fd);
+
+//hashed format prototypes for sdb_hash.c
+int hash_locate(int fd, int id, off_t *offset);
+off_t hash_alloc(int fd, int id);
+int hash_grow(int fd, int count);
+
+//dictionary format prototypes for sdb_dict.c
+ssize_t dict_read(int fd, off_t offset, student_t *s);
+ssize_t dict_write(int fd, off_t offset, const student_t *s);
+int dict_scan(int fd, int src, int first, int last, db_scan_fn fn, void *arg);
+int dict_pack(int fd);
+
+//write-ahead log prototypes for sdb_wal.c
+uint32_t crc32c(uint32_t crc, const void *buff, size_t len);
+int wal_attach(db_handle_t *h);
+void wal_detach(db_handle_t *h);
+ssize_t wal_log(db_handle_t *h, off_t offset, const struct iovec *iov, int iovcnt);
+ssize_t wal_overlay(db_handle_t *h, off_t offset, void *buff, size_t len, ssize_t got);
+int wal_commit(int fd);
+int wal_checkpoint(int fd);
+int wal_reset(int fd);
+off_t wal_size(int fd);
+int wal_txn_begin(int fd);
+int wal_txn_end(int fd, bool commit);
+
+//an index entry together with the bucket it belongs in
+typedef struct idx_item {
+    uint32_t    bucket;
+    idx_entry_t entry;
+} idx_item_t;
+
+//callback used by idx_lookup(), receives every entry of a bucket
+typedef int (*idx_visit_fn)(idx_entry_t *e, void *arg);
+
+//change stream prototypes for sdb_changes.c
+int chg_open(db_handle_t *h);
+void chg_close(db_handle_t *h);
+int chg_start(int fd);
+void chg_begin(int fd);
+void chg_put(int fd, student_t **recs, int n);
+void chg_del(int fd, student_t *s);
+void chg_zero(int fd);
+void chg_compress(int fd);
+int chg_flush(int fd, bool keep);
+int follow_changes(int *fd, char *path, bool once);
+
+//index prototypes for sdb_index.c
+int idx_init(int ifd, const idx_header_t *owner);
+int idx_open(char *path, const idx_header_t *owner, bool create, bool *fresh);
+int idx_insert(int ifd, idx_item_t *items, int n);
+int idx_remove(int ifd, idx_item_t *item);
+int idx_lookup(int ifd, uint32_t bucket, idx_visit_fn fn, void *arg);
+uint32_t name_hash(const char *name, size_t max);
+int index_open(int fd, int which, bool build);
+void index_close(db_handle_t *h);
+void index_add(int fd, student_t **recs, int n);
+void index_del(int fd, student_t *s);
+void index_rebuild(int fd);
+void index_discard(int fd);
+int find_by_name(int fd, char *spec);
+int find_by_gpa(int fd, int lo, int hi);
+
+//column file prototypes for sdb_column.c
+int col_open(int fd, bool build);
+void col_close(db_handle_t *h);
+void col_add(int fd, student_t **recs, int n);
+void col_del(int fd, student_t *s);
+void col_rebuild(int fd);
+void col_discard(int fd);
+int col_count(int fd);
+int col_read(int cfd, int column, int first, int n, int32_t *buff);
+int col_aggregate(int fd, uint32_t *count, col_agg_t *agg);
+void col_agg_add(col_agg_t *agg, int gpa, bool add);
+void col_agg_bounds(col_agg_t *agg);
+
+//gpa statistics prototypes for sdb_agg.c
+int gpa_stats_db(int fd, int n, char *pcts[]);
+
+//filtered scan prototypes for sdb_query.c
+int query_db(int fd, char *text);
+
+//client/server protocol.  Every request is an sdb_req_hdr_t followed by
+//len bytes holding argc NUL terminated strings (the command line minus
+//argv[0]).  The server answers with an sdb_rsp_hdr_t followed by len bytes
+//of output text.  A connection may carry any number of requests.
+#define SDB_PROTO_MAGIC     0x5344      //"SD"
+#define SDB_REQ_MAX_ARGS    16
+#define SDB_REQ_MAX_LEN     4096
+#define SDB_RSP_BUFF_SZ     (1024*64)
+#define SDB_SVR_BACKLOG     64
+#define SDB_SVR_TMP_SUFFIX  ".new"      //socket name until it listens
+#define SDB_SVR_MAX_CLIENTS 64
+#define SDB_SVR_SEND_MS     5000        //a client that takes no response for this long is dropped
+#define SDB_STOP_CMD        "--stop"
+#define SDB_ENV_SERVER      "SDB_SERVER"
+
+typedef struct sdb_req_hdr {
+    uint16_t magic;
+    uint8_t  argc;
+    uint8_t  flags;     //reserved, must be 0
+    uint32_t len;
+} sdb_req_hdr_t;
+
+typedef struct sdb_rsp_hdr {
+    int32_t  exit_code;
+    uint32_t len;
+} sdb_rsp_hdr_t;
+
+//what the server is still receiving from a client and still has to send
+//it.  Client sockets are non-blocking, a request runs once all of it is
+//here and its response goes out as the socket takes it.
+typedef struct sdb_conn {
+    size_t        got;      //bytes of hdr, then of args, received so far
+    sdb_req_hdr_t hdr;
+    char          args[SDB_REQ_MAX_LEN + 1];
+    char         *out;      //responses queued for the client
+    size_t        out_len;  //bytes in out
+    size_t        out_sent; //bytes of out already sent
+    uint64_t      out_since;//stats_now() when out last made progress
+    bool          done;     //drop the client once out is sent
+} sdb_conn_t;
+
+//a response the server holds back until the group commit of its poll round
+typedef struct sdb_rsp {
+    int           sock;     //client the response goes to
+    bool          keep;     //false to close the connection once sent
+    bool          logged;   //the request queued changes in the write-ahead log
+    sdb_rsp_hdr_t hdr;
+    char         *text;
+} sdb_rsp_t;
+
+//server prototypes for sdb_server.c
+int start_db_server(char *sock_path);
+int boot_db_server(char *sock_path);
+int process_db_requests(int svr_socket, int *fd);
+int exec_db_request(int cli_socket, sdb_conn_t *conn, int *fd, int out_fd, int saved_fd, sdb_rsp_t *rsp);
+int recv_all(int sock, void *buff, size_t len);
+int send_all(int sock, const void *buff, size_t len);
+
+//client prototypes for sdb_cli.c
+int connect_db_server(char *sock_path);
+int exec_remote_command(char *sock_path, int argc, char *argv[]);
+
 //error codes to be returned from individual functions
 // NO_ERROR is returned if there are no errors
 // ERR_DB_FILE is returned if there is are any issues with the database file itself
@@ -26,6 +395,13 @@ void usage(char *);
 #define NOT_IMPLEMENTED_YET 0
 
 
+//sdbsc server specific error codes
+#define ERR_SDB_COMM    -50     //Used for client/server communication errors
+#define STOP_SERVER_SC  200     //returned from exec_db_request() when a
+                                //client asked the server to stop
+#define REQ_PENDING_SC  201     //returned from exec_db_request() while the
+                                //rest of a request has not arrived yet
+
 //error codes to be returned to the shell
 // EXIT_OK          program executed without error
 // EXIT_FAIL_DB     a database operation failed
@@ -43,16 +419,54 @@ void usage(char *);
 #define M_ERR_DB_READ     "Error reading DB file, exiting!\n"
 #define M_ERR_DB_WRITE    "Error writing DB file, exiting!\n"
 #define M_ERR_DB_ADD_DUP  "Cant add student with ID=%d, already exists in db.\n"
+#define M_ERR_NO_FREE_ID  "Cant add student, every ID from %d to %d is taken.\n"
+#define M_ERR_DB_CORRUPT  "Student %d failed its checksum, the record is corrupt!\n"
+#define M_ERR_DB_NO_CRC   "Database has no record checksums, create it with SDB_CRC=on.\n"
+#define M_DB_SCRUBBED     "Scrub complete: %d record(s) checked, %d corrupt.\n"
 #define M_ERR_STD_PRINT   "Cant print student. Student is NULL or ID is zero\n"
 
 #define M_STD_ADDED       "Student %d added to database.\n"
 #define M_STD_DEL_MSG     "Student %d was deleted from database.\n"
+#define M_STD_UPDATED     "Student %d updated.\n"
+#define M_ERR_UPDATE      "Cant update %s, expected fname=, lname= or gpa=\n"
 #define M_STD_NOT_FND_MSG "Student %d was not found in database.\n"
+#define M_STD_NAME_NOT_FND "No student named %s was found in database.\n"
+#define M_STD_GPA_NOT_FND "No student with a gpa from %d to %d was found in database.\n"
+#define M_ERR_GPA_RNG     "GPA range must satisfy %d <= lo <= hi <= %d!\n"
+#define M_ERR_GPA_PCT     "Percentile must be a whole number from 0 to 100, not %s\n"
+#define M_GPA_STATS       "GPA of %d student(s): mean %.2f, median %.2f, min %.2f, max %.2f\n"
+#define M_GPA_PERCENTILE  "GPA percentile %d: %.2f\n"
+#define M_STD_QUERY_NOT_FND "No student matching %s was found in database.\n"
+#define M_ERR_QUERY       "Cant parse query at: %s\n"
 #define M_DB_COMPRESSED_OK "Database successfully compressed!\n"
 #define M_DB_ZERO_OK      "All database records removed!\n"
 #define M_DB_EMPTY        "Database contains no student records.\n"
 #define M_DB_RECORD_CNT   "Database contains %d student record(s).\n"
 #define M_NOT_IMPL        "The requested operation is not implemented yet!\n"
+#define M_DB_HASHED_KEEP  "Hashed databases are not compressed, they grow one bucket at a time.\n"
+#define M_ERR_DB_FORMAT   "Unsupported database format version %d, exiting!\n"
+#define M_DB_UPGRADED     "Database upgraded to format version %d.\n"
+#define M_DB_FORMAT_CURRENT "Database already uses format version %d.\n"
+#define M_ERR_BULK_OPEN   "Cant open bulk load file %s\n"
+#define M_ERR_BULK_ROW    "Line %d: "
+#define M_ERR_BULK_PARSE  "expected id,first_name,last_name,gpa\n"
+#define M_BULK_LOADED     "Bulk load complete: %d student(s) added, %d rejected.\n"
+#define M_ERR_BULK_UPDATE "expected id field=value...\n"
+#define M_BULK_UPDATED    "Bulk update complete: %d student(s) updated, %d rejected.\n"
+#define M_ERR_TXN_OP      "only -a, -d and -u commands can run in a transaction\n"
+#define M_TXN_COMMITTED   "Transaction committed: %d operation(s).\n"
+#define M_TXN_ROLLED_BACK "Transaction rolled back at line %d, nothing was changed.\n"
+#define M_ERR_CHG_OPEN    "Cant open change stream %s\n"
+#define M_ERR_CHG_STREAM  "%s is not a change stream, exiting!\n"
+#define M_CHG_APPLIED     "Replica applied %d change(s) from the stream.\n"
+#define M_CHG_LOST        "%s is missing changes, it starts over when the primary db is next opened\n"
+#define M_ERR_SVR_SOCKET  "Error creating server socket %s, exiting!\n"
+#define M_ERR_SVR_CONNECT "Cant connect to sdbsc server at %s\n"
+#define M_ERR_SVR_COMM    "Error communicating with sdbsc server at %s\n"
+#define M_ERR_SVR_STDIN   "Bulk input from stdin is not supported through the server\n"
+#define M_SVR_STARTED     "sdbsc server listening on %s\n"
+#define M_SVR_STOPPING    "sdbsc server stopping\n"
+#define M_SVR_STOPPED     "sdbsc server stopped\n"
 
 //useful format strings for print students
 //For example to print the header in the required output:
@@ -0,0 +1,133 @@
+#!/usr/bin/env bash
+
+# Multi-process write stress test for sdbsc.
+#
+#   usage: ./stress.sh [ops_per_writer] [max_writers]
+#
+# For 1, 2, 4, ... max_writers concurrent processes, every writer adds
+# ops_per_writer students with ids interleaved with the other writers (so
+# neighbouring ids, and their bitmap bytes, belong to different processes)
+# and then deletes every fourth one of them.  Afterwards the database must
+# hold exactly the surviving ids.  A second round has all writers race to
+# add the same ids, exactly one add per id may succeed.  In the last one
+# the writers add while -x keeps rewriting the file, every add that was
+# acknowledged must be in it afterwards.  Everything runs in a scratch
+# directory so an existing student.db is left alone.
+#
+# SDB_ENGINE, SDB_FORMAT and SDB_WAL are passed through, e.g.
+#   SDB_FORMAT=v1 SDB_WAL=on ./stress.sh 500 8
+
+OPS=${1:-200}
+MAX_WRITERS=${2:-8}
+SDBSC=$(realpath ./sdbsc)
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+now() {
+    date +%s.%N
+}
+
+writer() {
+    local w=$1 writers=$2
+    local k id
+
+    for ((k = 0; k < OPS; k++)); do
+        id=$((k * writers + w + 1))
+        $SDBSC -a $id first$id last$w $((id % 501)) > /dev/null || fail "add $id"
+    done
+    for ((k = 0; k < OPS; k += 4)); do
+        id=$((k * writers + w + 1))
+        $SDBSC -d $id > /dev/null || fail "delete $id"
+    done
+}
+
+racer() {
+    local k
+
+    for ((k = 1; k <= OPS; k++)); do
+        $SDBSC -a $k racer$1 racer 300 > /dev/null
+    done
+    return 0
+}
+
+acked_writer() {
+    local w=$1 writers=$2
+    local k id
+
+    for ((k = 0; k < OPS; k++)); do
+        id=$((k * writers + w + 1))
+        $SDBSC -a $id first$id last$w $((id % 501)) > /dev/null && echo $id
+    done
+    return 0
+}
+
+compactor() {
+    while [ ! -e "$WORK/writers_done" ]; do
+        $SDBSC -x > /dev/null || fail "compress"
+    done
+}
+
+expected_ids() {
+    local writers=$1
+    local w k
+
+    for ((w = 0; w < writers; w++)); do
+        for ((k = 0; k < OPS; k++)); do
+            ((k % 4 == 0)) || echo $((k * writers + w + 1))
+        done
+    done | sort -n
+}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || fail "no scratch directory"
+
+printf "%-8s %10s %10s %12s\n" "writers" "ops" "seconds" "ops/sec"
+
+for ((writers = 1; writers <= MAX_WRITERS; writers *= 2)); do
+    $SDBSC -z > /dev/null || fail "zero database"
+
+    start=$(now)
+    for ((w = 0; w < writers; w++)); do
+        writer $w $writers &
+    done
+    wait
+    end=$(now)
+
+    ops=$((writers * (OPS + (OPS + 3) / 4)))
+    awk -v w=$writers -v o=$ops -v s=$start -v e=$end \
+        'BEGIN { printf "%-8d %10d %10.2f %12.0f\n", w, o, e - s, o / (e - s) }'
+
+    got=$($SDBSC -p | awk 'NR > 1 { print $1 }' | sort -n)
+    [ "$got" = "$(expected_ids $writers)" ] || fail "$writers writers: wrong set of records"
+
+    want=$((writers * (OPS - (OPS + 3) / 4)))
+    $SDBSC -c | grep -q "contains $want student" || fail "$writers writers: count is not $want"
+done
+
+$SDBSC -z > /dev/null || fail "zero database"
+for ((w = 0; w < MAX_WRITERS; w++)); do
+    racer $w &
+done
+wait
+$SDBSC -c | grep -q "contains $OPS student" || fail "duplicate adds were not rejected"
+
+$SDBSC -z > /dev/null || fail "zero database"
+compactor &
+compactor_pid=$!
+writer_pids=()
+for ((w = 0; w < MAX_WRITERS; w++)); do
+    acked_writer $w $MAX_WRITERS > "$WORK/acked.$w" &
+    writer_pids+=($!)
+done
+wait "${writer_pids[@]}"
+touch "$WORK/writers_done"
+wait $compactor_pid
+
+got=$($SDBSC -p | awk 'NR > 1 { print $1 }' | sort -n)
+[ "$got" = "$(sort -n "$WORK"/acked.*)" ] || fail "acknowledged adds were lost to -x"
+
+echo "PASS"
@@ -192,4 +192,915 @@ setup_file() {
         echo "Failed Output:  $output"
         return 1
     }
-}
\ No newline at end of file
+}
+
+@test "mmap engine grows the file the same way as the I/O engine" {
+    ./sdbsc -z
+    run env SDB_ENGINE=mmap ./sdbsc -a 99999 big dude 205
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student 99999 added to database." ]
+
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "6400000" ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+}
+
+@test "mmap engine and I/O engine see each others records" {
+    run env SDB_ENGINE=mmap SDB_SYNC=write ./sdbsc -a 3 jane doe 390
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -f 3
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "3 jane doe 3.90" ]
+
+    run env SDB_ENGINE=mmap ./sdbsc -c
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database contains 2 student record(s)." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run env SDB_ENGINE=mmap ./sdbsc -d 99999
+    [ "$status" -eq 0 ]
+    run ./sdbsc -f 99999
+    [ "$status" -eq 1 ]
+}
+
+@test "Bulk load students from stdin" {
+    ./sdbsc -z
+    run ./sdbsc -b - <<EOF2
+1,john,doe,345
+# comments and blank lines are skipped
+
+3 jane doe 390
+63,jim,doe,285
+EOF2
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Bulk load complete: 3 student(s) added, 0 rejected." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 3 student record(s)." ]
+}
+
+@test "Bulk load reports bad rows and keeps going" {
+    run ./sdbsc -b - <<EOF2
+64,janet,doe,310
+3,dup,student,300
+65,bad,gpa,600
+not a student
+64,janet,again,310
+EOF2
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Line 2: Cant add student with ID=3, already exists in db." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+    [ "${lines[1]}" = "Line 3: Cant add student, either ID or GPA out of allowable range!" ]
+    [ "${lines[2]}" = "Line 4: expected id,first_name,last_name,gpa" ]
+    [ "${lines[3]}" = "Line 5: Cant add student with ID=64, already exists in db." ]
+    [ "${lines[4]}" = "Bulk load complete: 1 student(s) added, 4 rejected." ]
+
+    run ./sdbsc -f 64
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "64 janet doe 3.10" ]
+}
+
+@test "Server mode runs commands sent by the thin client" {
+    ./sdbsc -z
+    ./sdbsc --serve .test_sdbsc.sock > /dev/null 2>&1 &
+    for i in $(seq 1 50); do
+        [ -S .test_sdbsc.sock ] && break
+        sleep 0.1
+    done
+
+    run env SDB_SERVER=.test_sdbsc.sock ./sdbsc -a 3 jane doe 390
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student 3 added to database." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run env SDB_SERVER=.test_sdbsc.sock ./sdbsc -a 3 dup student 300
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Cant add student with ID=3, already exists in db." ]
+
+    run env SDB_SERVER=.test_sdbsc.sock ./sdbsc -f 3
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "3 jane doe 3.90" ]
+
+    run env SDB_SERVER=.test_sdbsc.sock ./sdbsc --stop
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "sdbsc server stopping" ]
+
+    # the server wrote through to the same database file
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1 student record(s)." ]
+}
+
+@test "Thin client reports a missing server" {
+    run env SDB_SERVER=.no_such_sdbsc.sock ./sdbsc -c
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Cant connect to sdbsc server at .no_such_sdbsc.sock" ]
+}
+
+@test "Scans skip the holes in a sparse database" {
+    ./sdbsc -z
+    ./sdbsc -a 2 first student 100
+    ./sdbsc -a 50000 middle student 200
+    ./sdbsc -a 100000 last student 300
+
+    # only a few blocks are allocated, the rest of the file is holes
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "6400064" ]
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 3 student record(s)." ]
+
+    run ./sdbsc -p
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    expected_output="ID FIRST_NAME LAST_NAME GPA 2 first student 1.00 50000 middle student 2.00 100000 last student 3.00"
+    [ "$normalized_output" = "$expected_output" ] || {
+        echo "Failed Output: $normalized_output"
+        echo "Expected Output: $expected_output"
+        return 1
+    }
+}
+
+@test "Upgrade a headerless database to format version 1" {
+    ./sdbsc -z
+    ./sdbsc -a 1 john doe 345
+    ./sdbsc -a 99999 big dude 205
+    ./sdbsc -a 63 jim doe 285
+    ./sdbsc -d 63
+
+    run ./sdbsc --upgrade
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database upgraded to format version 1." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc --upgrade
+    [ "${lines[0]}" = "Database already uses format version 1." ]
+
+    # header + bitmap take the first 20480 bytes
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "6420480" ]
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 2 student record(s)." ]
+
+    run ./sdbsc -f 99999
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "99999 big dude 2.05" ]
+}
+
+@test "Format version 1 keeps the header count and bitmap current" {
+    run ./sdbsc -a 1 dup student 300
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Cant add student with ID=1, already exists in db." ]
+
+    ./sdbsc -a 2 jane doe 390
+    ./sdbsc -d 1
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 2 student record(s)." ]
+
+    # zeroing the database keeps the header
+    ./sdbsc -z
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains no student records." ]
+    run ./sdbsc --upgrade
+    [ "${lines[0]}" = "Database already uses format version 1." ]
+
+    run ./sdbsc -b - <<EOF2
+5,a,b,100
+6,c,d,200
+5,e,f,300
+EOF2
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 2 student record(s)." ]
+    ./sdbsc -z
+    rm -f student.db
+}
+
+@test "Find students by last name" {
+    ./sdbsc -z
+    ./sdbsc -a 3 john doe 310
+    ./sdbsc -a 1 jane doe 390
+    ./sdbsc -a 2 jim smith 250
+
+    run ./sdbsc -n doe
+    [ "$status" -eq 0 ]
+    [ "${#lines[@]}" -eq 3 ]
+    [ "${lines[0]}" = "ID     FIRST_NAME               LAST_NAME                        GPA" ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "1 jane doe 3.90" ]
+    normalized_output=$(echo -n "${lines[2]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "3 john doe 3.10" ]
+
+    run ./sdbsc -n doe,john
+    [ "${#lines[@]}" -eq 2 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "3 john doe 3.10" ]
+
+    # the index follows deletes once it exists
+    ./sdbsc -d 1
+    run ./sdbsc -n doe
+    [ "${#lines[@]}" -eq 2 ]
+
+    run ./sdbsc -n nobody
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "No student named nobody was found in database." ]
+
+    ./sdbsc -z
+    run ./sdbsc -n doe
+    [ "$status" -eq 1 ]
+}
+
+@test "Find students in a gpa range" {
+    ./sdbsc -z
+    ./sdbsc -a 1 jane doe 310
+    ./sdbsc -a 2 john doe 300
+    ./sdbsc -a 3 jim smith 350
+    ./sdbsc -a 4 jill jones 351
+    ./sdbsc -a 5 joe brown 300
+
+    run ./sdbsc -r 300 350
+    [ "$status" -eq 0 ]
+    [ "${#lines[@]}" -eq 5 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "2 john doe 3.00" ]
+    normalized_output=$(echo -n "${lines[2]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "5 joe brown 3.00" ]
+    normalized_output=$(echo -n "${lines[4]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "3 jim smith 3.50" ]
+
+    # the index follows adds and deletes once it exists
+    ./sdbsc -d 5
+    ./sdbsc -a 6 jack white 349
+    run ./sdbsc -r 300 350
+    [ "${#lines[@]}" -eq 5 ]
+    normalized_output=$(echo -n "${lines[3]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "6 jack white 3.49" ]
+
+    run ./sdbsc -r 0 100
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "No student with a gpa from 0 to 100 was found in database." ]
+
+    run ./sdbsc -r 400 300
+    [ "$status" -eq 2 ]
+    [ "${lines[0]}" = "GPA range must satisfy 0 <= lo <= hi <= 500!" ]
+    ./sdbsc -z
+}
+
+@test "Write-ahead log repairs a record damaged after commit" {
+    ./sdbsc -z
+    SDB_WAL=on ./sdbsc -a 7 jane doe 390
+
+    # simulate a torn in place write, the committed log still has the record
+    dd if=/dev/zero of=student.db bs=64 seek=7 count=1 conv=notrunc 2>/dev/null
+    # and a restart, clearing the boot id makes the log get replayed
+    dd if=/dev/zero of=student.db.wal bs=1 seek=48 count=40 conv=notrunc 2>/dev/null
+    # a crash in the middle of an append leaves a damaged tail, it is ignored
+    printf 'garbage' >> student.db.wal
+
+    run env SDB_WAL=off ./sdbsc -f 7
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "7 jane doe 3.90" ]
+
+    # opening without the log replays it and then empties it down to its
+    # 88 byte header
+    [ "$(stat -c %s student.db.wal)" -eq 88 ]
+    ./sdbsc -z
+}
+
+@test "Concurrent writers do not lose each others records" {
+    ./sdbsc -z
+
+    for w in 0 1 2 3; do
+        (for k in $(seq 0 24); do ./sdbsc -a $((k * 4 + w + 1)) first last 300 > /dev/null; done) &
+    done
+    wait
+
+    run ./sdbsc -c
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database contains 100 student record(s)." ]
+
+    ./sdbsc -z
+}
+
+@test "Compressed database keeps direct lookups by id" {
+    ./sdbsc -z
+    ./sdbsc -a 1 john doe 345
+    ./sdbsc -a 3 jane doe 390
+    ./sdbsc -a 63 jim doe 285
+    ./sdbsc -a 99999 big dude 205
+    ./sdbsc -d 3
+
+    run ./sdbsc -x
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database successfully compressed!" ]
+
+    # header and top level directory, 3 records and 2 directory leaves
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "10432" ]
+
+    run ./sdbsc -f 63
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "63 jim doe 2.85" ]
+
+    run ./sdbsc -f 3
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Student 3 was not found in database." ]
+
+    # adds and deletes keep working on the packed file
+    ./sdbsc -a 2 jill doe 300
+    ./sdbsc -d 1
+    run ./sdbsc -a 99999 dup student 100
+    [ "$status" -eq 1 ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 3 student record(s)." ]
+
+    run ./sdbsc -p
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    expected_output="ID FIRST_NAME LAST_NAME GPA 2 jill doe 3.00 63 jim doe 2.85 99999 big dude 2.05"
+    [ "$normalized_output" = "$expected_output" ] || {
+        echo "Failed Output: $normalized_output"
+        echo "Expected Output: $expected_output"
+        return 1
+    }
+
+    # emptying it goes back to the layout new files get
+    ./sdbsc -z
+    ./sdbsc -a 99999 big dude 205
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "6400000" ]
+    ./sdbsc -z
+}
+
+@test "Query mode filters records during the scan" {
+    ./sdbsc -z
+    ./sdbsc -a 1 jane doe 390
+    ./sdbsc -a 2 john doe 310
+    ./sdbsc -a 3 jim smith 380
+    ./sdbsc -a 4 jill doe 350
+
+    run ./sdbsc -q "gpa>=350 && lname==doe"
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    expected_output="ID FIRST_NAME LAST_NAME GPA 1 jane doe 3.90 4 jill doe 3.50"
+    [ "$normalized_output" = "$expected_output" ] || {
+        echo "Failed Output: $normalized_output"
+        echo "Expected Output: $expected_output"
+        return 1
+    }
+
+    # the scalar kernel gives the same answer
+    run env SDB_SIMD=off ./sdbsc -q "gpa>=350 && lname==doe"
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "$expected_output" ]
+
+    run ./sdbsc -q "id!=1 && fname==jim"
+    [ "${#lines[@]}" -eq 2 ]
+
+    run ./sdbsc -q "gpa>400"
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "No student matching gpa>400 was found in database." ]
+
+    run ./sdbsc -q "gpa=>400"
+    [ "$status" -eq 2 ]
+    ./sdbsc -z
+}
+
+@test "Column file keeps filters and counts in sync" {
+    ./sdbsc -z
+    ./sdbsc -a 1 jane doe 390
+    ./sdbsc -a 2 john doe 310
+    ./sdbsc -a 70000 jim smith 380
+
+    # the first query builds the column file
+    run ./sdbsc -q "gpa>=300"
+    [ "${#lines[@]}" -eq 4 ]
+    [ -f student.col ]
+
+    # later writes go to the column file as well
+    ./sdbsc -a 5 jill doe 350
+    ./sdbsc -d 2
+    run ./sdbsc -q "lname==doe && gpa>300"
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    expected_output="ID FIRST_NAME LAST_NAME GPA 1 jane doe 3.90 5 jill doe 3.50"
+    [ "$normalized_output" = "$expected_output" ] || {
+        echo "Failed Output: $normalized_output"
+        echo "Expected Output: $expected_output"
+        return 1
+    }
+
+    run ./sdbsc -q "id>=60000"
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "70000 jim smith 3.80" ]
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 3 student record(s)." ]
+
+    # a new database is never answered from the old column file
+    rm student.db
+    ./sdbsc -a 9 new one 300
+    run ./sdbsc -q "gpa>=300"
+    [ "${#lines[@]}" -eq 2 ]
+    ./sdbsc -z
+}
+
+@test "Parallel scans print, count and compress like a single thread" {
+    ./sdbsc -z
+    rm -f student.col
+    seq 1 37 40000 | awk '{ print $1, "f" $1, "l" $1 % 13, $1 % 401 }' | ./sdbsc -b -
+
+    run env SDB_THREADS=1 ./sdbsc -p
+    serial="$output"
+    run env SDB_THREADS=8 ./sdbsc -p
+    [ "$status" -eq 0 ]
+    [ "$output" = "$serial" ]
+    [ "${#lines[@]}" -eq 1083 ]
+
+    run env SDB_THREADS=8 ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1082 student record(s)." ]
+
+    run env SDB_THREADS=8 ./sdbsc -x
+    [ "$status" -eq 0 ]
+    run env SDB_THREADS=8 ./sdbsc -p
+    [ "$output" = "$serial" ]
+    ./sdbsc -z
+}
+
+@test "Find many ids in one batch with the uring engine" {
+    ./sdbsc -z
+    seq 1 3 600 | awk '{ print $1, "f" $1, "l" $1, $1 % 401 }' | SDB_ENGINE=uring ./sdbsc -b -
+
+    run env SDB_ENGINE=uring ./sdbsc -f 4 2 598 1
+    [ "$status" -eq 1 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    expected_output="ID FIRST NAME LAST NAME GPA 4 f4 l4 0.04 Student 2 was not found in database. 598 f598 l598 1.97 1 f1 l1 0.01"
+    [ "$normalized_output" = "$expected_output" ] || {
+        echo "Failed Output: $normalized_output"
+        echo "Expected Output: $expected_output"
+        return 1
+    }
+
+    # scans read ahead through the ring and see the same records
+    run env SDB_ENGINE=uring ./sdbsc -p
+    uring="$output"
+    run ./sdbsc -p
+    [ "$output" = "$uring" ]
+    [ "${#lines[@]}" -eq 201 ]
+    ./sdbsc -z
+}
+
+@test "Statistics are reported as JSON on stderr" {
+    ./sdbsc -z
+    seq 1 2000 | awk '{ print $1 ",f" $1 ",l" $1 ",300" }' > stats_load.csv
+
+    ./sdbsc -S -b stats_load.csv 2> stats.json > /dev/null
+    grep -q '"op":"-b"' stats.json
+    grep -q '"latency_us":{"count":1,' stats.json
+
+    # -S leaves the output of the command alone
+    run ./sdbsc -S -c
+    [ "${lines[0]}" = "Database contains 2000 student record(s)." ]
+    SDB_STATS=on ./sdbsc -f 7 2> stats.json > /dev/null
+    grep -q '"records_matched":1' stats.json
+    ./sdbsc -S -d 7 2> stats.json > /dev/null
+    grep -q '"records_matched":0' stats.json
+    grep -Eq '"(bytes_written|write_calls)":[1-9]' stats.json
+
+    rm -f stats.json stats_load.csv
+    ./sdbsc -z
+}
+
+@test "Scans read a consistent snapshot while bulk loads run" {
+    rm -f student.*
+    files=$(ls -a | wc -l)
+    # over DB_SNAP_MIN of data, so scans read a snapshot
+    seq 1 20000 | awk '{ print $1 ",f" $1 ",l" $1 ",300" }' | ./sdbsc -b -
+
+    (for k in $(seq 0 19); do
+        seq $((20001 + k * 100)) $((20100 + k * 100)) | awk '{ print $1 ",f" $1 ",l" $1 ",300" }' |
+            ./sdbsc -b - > /dev/null
+    done) &
+    # every print sees whole batches only
+    for i in $(seq 1 10); do
+        n=$(./sdbsc -p | tail -n +2 | wc -l)
+        [ $((n % 100)) -eq 0 ] || { wait; echo "print saw $n records"; return 1; }
+    done
+    wait
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 22000 student record(s)." ]
+    # snapshots have no name and leave nothing behind
+    [ "$(ls -a | grep -vc '^student\.')" -eq "$files" ]
+    rm -f student.*
+}
+
+@test "Hashed format stores ids past MAX_STD_ID" {
+    rm -f student.db
+    export SDB_FORMAT=hashed
+    run ./sdbsc -a 2000000000 big id 350
+    [ "$status" -eq 0 ]
+    run ./sdbsc -a 100001 next id 300
+    [ "$status" -eq 0 ]
+
+    # enough students to split buckets and chain overflow pages
+    seq 7 7919 30000000 | awk '{ print $1 ",f" $1 ",l" $1 "," $1 % 401 }' > hashed_load.csv
+    ./sdbsc -b hashed_load.csv
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 3791 student record(s)." ]
+
+    run ./sdbsc -f 2000000000 29997179 7
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    expected_output="ID FIRST NAME LAST NAME GPA 2000000000 big id 3.50 29997179 f29997179 l29997179 3.74 7 f7 l7 0.07"
+    [ "$normalized_output" = "$expected_output" ] || {
+        echo "Failed Output: $normalized_output"
+        echo "Expected Output: $expected_output"
+        return 1
+    }
+
+    run ./sdbsc -d 100001
+    [ "$status" -eq 0 ]
+    run ./sdbsc -f 100001
+    [ "$status" -eq 1 ]
+
+    # every student is in the scan once, in hash order
+    run bash -c "./sdbsc -p | tail -n +2 | awk '{ print \$1 }' | sort -n | tr '\n' ' '"
+    [ "$output" = "$( (cut -d, -f1 hashed_load.csv; echo 2000000000) | sort -n | tr '\n' ' ')" ]
+
+    # no slot per possible id, the file stays small
+    [ "$(stat -c %s student.db)" -lt 1048576 ]
+
+    rm -f hashed_load.csv
+    unset SDB_FORMAT
+    rm -f student.db
+}
+
+@test "Update students in place one at a time and in batches" {
+    ./sdbsc -z
+    ./sdbsc -a 1 john doe 300
+    ./sdbsc -a 2 jane doe 310
+    ./sdbsc -a 3 jim roe 320
+    ./sdbsc -r 300 400 > /dev/null
+
+    run ./sdbsc -u 1 gpa=351 lname=smith
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student 1 updated." ]
+    run ./sdbsc -u 4 gpa=351
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Student 4 was not found in database." ]
+    run ./sdbsc -u 1 age=20
+    [ "$status" -eq 2 ]
+
+    # repeated ids apply in input order, bad lines are reported
+    run ./sdbsc -U - <<EOF2
+3 gpa=100
+2 fname=janet
+9 gpa=200
+2 gpa=120
+2 bogus
+3 gpa=101,lname=rowe
+EOF2
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Line 3: Student 9 was not found in database." ]
+    [ "${lines[1]}" = "Line 5: expected id field=value..." ]
+    [ "${lines[2]}" = "Bulk update complete: 2 student(s) updated, 2 rejected." ]
+
+    run ./sdbsc -p
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    expected_output="ID FIRST_NAME LAST_NAME GPA 1 john smith 3.51 2 janet doe 1.20 3 jim rowe 1.01"
+    [ "$normalized_output" = "$expected_output" ] || {
+        echo "Failed Output: $normalized_output"
+        echo "Expected Output: $expected_output"
+        return 1
+    }
+
+    # the gpa index follows the updates
+    run ./sdbsc -r 101 120
+    [ "${#lines[@]}" -eq 3 ]
+    run ./sdbsc -r 300 320
+    [ "${lines[0]}" = "No student with a gpa from 300 to 320 was found in database." ]
+}
+
+@test "Transactions apply a script of changes all or nothing" {
+    ./sdbsc -z
+    ./sdbsc -a 1 john doe 300
+    ./sdbsc -r 300 400 > /dev/null
+
+    # the last line fails, so the first three never happened
+    run ./sdbsc -t - <<EOF2
+-a 2 jane doe 310
+-u 1 gpa=100
+-d 1
+-a 2 jim roe 320
+EOF2
+    [ "$status" -eq 1 ]
+    [ "${lines[3]}" = "Cant add student with ID=2, already exists in db." ]
+    [ "${lines[4]}" = "Transaction rolled back at line 4, nothing was changed." ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1 student record(s)." ]
+    run ./sdbsc -r 300 400
+    [ "${#lines[@]}" -eq 2 ]
+    # the log the transaction turned on is left empty
+    [ "$(stat -c %s student.db.wal)" -eq 88 ] || [ "$SDB_WAL" = "on" ]
+
+    # commands other than -a, -d and -u are refused before anything runs
+    run ./sdbsc -t - <<EOF2
+-a 2 jane doe 310
+-p
+EOF2
+    [ "$status" -eq 2 ]
+    [ "${lines[0]}" = "Line 2: only -a, -d and -u commands can run in a transaction" ]
+
+    run ./sdbsc -t - <<EOF2
+-a 2 jane doe 310
+# comments and blank lines are skipped
+
+-u 1 gpa=100
+EOF2
+    [ "$status" -eq 0 ]
+    [ "${lines[2]}" = "Transaction committed: 2 operation(s)." ]
+    run ./sdbsc -p
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    expected_output="ID FIRST_NAME LAST_NAME GPA 1 john doe 1.00 2 jane doe 3.10"
+    [ "$normalized_output" = "$expected_output" ] || {
+        echo "Failed Output: $normalized_output"
+        echo "Expected Output: $expected_output"
+        return 1
+    }
+    run ./sdbsc -r 100 100
+    [ "${#lines[@]}" -eq 2 ]
+}
+
+@test "Automatic ids fill the lowest free id" {
+    ./sdbsc -z
+    ./sdbsc -a 1 john doe 300
+    ./sdbsc -a 2 jane doe 310
+    ./sdbsc -a 4 jim roe 320
+
+    run ./sdbsc -A amy poe 330
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student 3 added to database." ]
+    run ./sdbsc -A bob poe 340
+    [ "${lines[0]}" = "Student 5 added to database." ]
+
+    # SDB_ID_RANGE keeps the new ids inside a block
+    SDB_ID_RANGE=100-102 ./sdbsc -A cal poe 350
+    run env SDB_ID_RANGE=100-102 ./sdbsc -A dee poe 360
+    [ "${lines[0]}" = "Student 101 added to database." ]
+    SDB_ID_RANGE=100-102 ./sdbsc -A eve poe 370
+    run env SDB_ID_RANGE=100-102 ./sdbsc -A fay poe 380
+    [ "$status" -eq 2 ]
+    [ "${lines[0]}" = "Cant add student, every ID from 100 to 102 is taken." ]
+
+    run env SDB_ID_RANGE=102-100 ./sdbsc -A fay poe 380
+    [ "$status" -eq 2 ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 8 student record(s)." ]
+}
+
+@test "Checksummed records catch corruption on reads and scrubs" {
+    rm -f student.db
+    export SDB_FORMAT=v1 SDB_CRC=on
+    seq 1 300 | awk '{ print $1 ",f" $1 ",l" $1 "," $1 % 401 }' | ./sdbsc -b -
+    ./sdbsc -u 5 gpa=123 lname=averyveryveryverylonglastname
+    run ./sdbsc -V
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Scrub complete: 300 record(s) checked, 0 corrupt." ]
+
+    # last names give up 4 bytes to the checksum
+    run ./sdbsc -f 5
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "5 f5 averyveryveryverylonglastna 1.23" ]
+
+    # flip a bit in the gpa of student 7 and one in a name of student 250
+    printf '\001' | dd of=student.db bs=1 seek=$((20480 + 7 * 64 + 60)) conv=notrunc 2>/dev/null
+    printf 'X' | dd of=student.db bs=1 seek=$((20480 + 250 * 64 + 5)) conv=notrunc 2>/dev/null
+    run ./sdbsc -f 7
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Student 7 failed its checksum, the record is corrupt!" ]
+    run ./sdbsc -f 6
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -V
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Student 7 failed its checksum, the record is corrupt!" ]
+    [ "${lines[1]}" = "Student 250 failed its checksum, the record is corrupt!" ]
+    [ "${lines[2]}" = "Scrub complete: 300 record(s) checked, 2 corrupt." ]
+    run env SDB_SIMD=off ./sdbsc -V
+    [ "${lines[2]}" = "Scrub complete: 300 record(s) checked, 2 corrupt." ]
+
+    # records keep their checksums when -x moves them
+    ./sdbsc -x
+    run ./sdbsc -V
+    [ "$status" -eq 1 ]
+    [ "${lines[2]}" = "Scrub complete: 300 record(s) checked, 2 corrupt." ]
+
+    unset SDB_FORMAT SDB_CRC
+    rm -f student.db
+    ./sdbsc -a 1 john doe 300
+    run ./sdbsc -V
+    [ "$status" -eq 2 ]
+    [ "${lines[0]}" = "Database has no record checksums, create it with SDB_CRC=on." ]
+    rm -f student.db
+}
+
+@test "Dictionary format stores each distinct name once" {
+    rm -f student.db
+    seq 1 20000 | awk '{ print $1 ",first" $1 % 50 ",last" $1 % 100 "," $1 % 401 }' > dict_rows.csv
+    SDB_FORMAT=v1 ./sdbsc -b dict_rows.csv
+    v1_blocks=$(stat -c %b student.db)
+    SDB_FORMAT=v1 ./sdbsc -p > dict_v1.out
+    rm -f student.db
+
+    export SDB_FORMAT=dict
+    run ./sdbsc -b dict_rows.csv
+    [ "${lines[0]}" = "Bulk load complete: 20000 student(s) added, 0 rejected." ]
+    [ $(stat -c %b student.db) -lt $((v1_blocks / 2)) ]
+    ./sdbsc -p | cmp - dict_v1.out
+
+    ./sdbsc -u 1234 lname=brandnewname gpa=111
+    ./sdbsc -d 1235
+    ./sdbsc -a 1235 first35 last35 32
+    run ./sdbsc -f 1234
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "1234 first34 brandnewname 1.11" ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 20000 student record(s)." ]
+
+    # -x keeps the format and drops names nobody uses
+    ./sdbsc -u 1234 lname=last34 gpa=31
+    ./sdbsc -x
+    ./sdbsc -p | cmp - dict_v1.out
+    ! grep -q brandnewname student.db
+
+    unset SDB_FORMAT
+    rm -f student.db dict_rows.csv dict_v1.out
+}
+
+@test "Followers replay the change stream into a replica" {
+    rm -rf student.db student.db.chg chg_replica
+    mkdir chg_replica
+    ./sdbsc -a 1 john doe 300
+    SDB_CHANGES=on ./sdbsc -a 2 jane roe 310
+    seq 10 2000 | awk '{ print $1 ",f" $1 ",l" $1 % 97 "," $1 % 401 }' | ./sdbsc -b -
+    ./sdbsc -u 1 gpa=222
+    ./sdbsc -d 2
+    printf -- '-a 3 bob poe 333\n-d 9999\n' | ./sdbsc -t - || true
+
+    # the first group holds the students the database had already
+    cd chg_replica
+    run ../sdbsc --follow ../student.db.chg --once
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Replica applied 1997 change(s) from the stream." ]
+    ../sdbsc -p | sort > replica.out
+    run ../sdbsc --follow ../student.db.chg --once
+    [ "${lines[0]}" = "Replica applied 0 change(s) from the stream." ]
+    cd ..
+    ./sdbsc -p | sort | cmp - chg_replica/replica.out
+
+    ./sdbsc -z
+    ./sdbsc -a 7 amy lee 390
+    ./sdbsc -x
+    (cd chg_replica && exec ../sdbsc --follow ../student.db.chg > follow.log 2>&1) &
+    ./sdbsc -a 8 ben lee 380
+    for i in $(seq 1 50); do
+        (cd chg_replica && ../sdbsc -c | grep -q " 2 student") && break
+        sleep 0.1
+    done
+    kill -TERM $!
+    wait $!
+    [ "$(tail -1 chg_replica/follow.log)" = "Replica applied 4 change(s) from the stream." ]
+    ./sdbsc -p | sort | cmp - <(cd chg_replica && ../sdbsc -p | sort)
+
+    run ./sdbsc --follow student.db --once
+    [ "$status" -eq 2 ]
+    [ "${lines[0]}" = "student.db is not a change stream, exiting!" ]
+    rm -rf student.db student.db.chg chg_replica
+}
+
+@test "Followers start over when the change stream lacks a change" {
+    rm -rf student.db student.db.chg chg_replica
+    mkdir chg_replica
+    SDB_CHANGES=on ./sdbsc -a 1 john doe 300
+    ./sdbsc -a 2 jane roe 310
+
+    # a writer that was counted in but died before its changes got in
+    printf '\001' | dd of=student.db.chg bs=1 seek=15 conv=notrunc 2>/dev/null
+    cd chg_replica
+    run ../sdbsc --follow ../student.db.chg --once
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "../student.db.chg is missing changes, it starts over when the primary db is next opened" ]
+    [ "${lines[1]}" = "Replica applied 3 change(s) from the stream." ]
+    cd ..
+
+    # the next process to open the primary starts a new stream, and the
+    # follower replays it from its first group
+    ./sdbsc -a 3 bob poe 333
+    cd chg_replica
+    run ../sdbsc --follow ../student.db.chg --once
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Replica applied 4 change(s) from the stream." ]
+    cd ..
+    ./sdbsc -p | sort | cmp - <(cd chg_replica && ../sdbsc -p | sort)
+    rm -rf student.db student.db.chg chg_replica
+}
+
+@test "GPA statistics follow every change without a scan" {
+    rm -f student.db student.col
+    seq 1 100 | awk '{ print $1 ",f" $1 ",l" $1 "," $1 * 4 }' | ./sdbsc -b -
+
+    # the first -g builds the column file and its aggregates
+    run ./sdbsc -g 0 90 100
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "GPA of 100 student(s): mean 2.02, median 2.00, min 0.04, max 4.00" ]
+    [ "${lines[1]}" = "GPA percentile 0: 0.04" ]
+    [ "${lines[2]}" = "GPA percentile 90: 3.60" ]
+    [ "${lines[3]}" = "GPA percentile 100: 4.00" ]
+
+    # deleting the top student moves the max, updating the lowest one
+    # moves both bounds
+    ./sdbsc -d 100
+    run ./sdbsc -g
+    [ "${lines[0]}" = "GPA of 99 student(s): mean 2.00, median 2.00, min 0.04, max 3.96" ]
+    ./sdbsc -u 1 gpa=499
+    run ./sdbsc -g 0
+    [ "${lines[0]}" = "GPA of 99 student(s): mean 2.05, median 2.04, min 0.08, max 4.99" ]
+    [ "${lines[1]}" = "GPA percentile 0: 0.08" ]
+
+    run ./sdbsc -g 101
+    [ "$status" -eq 2 ]
+    [ "${lines[0]}" = "Percentile must be a whole number from 0 to 100, not 101" ]
+
+    ./sdbsc -z
+    run ./sdbsc -g
+    [ "${lines[0]}" = "Database contains no student records." ]
+    rm -f student.db student.col
+}
+
+@test "Server keeps serving while a client sends half a request" {
+    ./sdbsc -z
+    ./sdbsc --serve .test_sdbsc.sock > /dev/null 2>&1 &
+    for i in $(seq 1 50); do
+        [ -S .test_sdbsc.sock ] && break
+        sleep 0.1
+    done
+
+    # three bytes of a request header, then nothing
+    perl -MIO::Socket::UNIX -e '
+        my $s = IO::Socket::UNIX->new(Peer => ".test_sdbsc.sock") or exit 1;
+        print $s "SD\001"; $s->flush; sleep 30' > /dev/null 2>&1 &
+    stalled=$!
+    sleep 0.2
+
+    run timeout 5 env SDB_SERVER=.test_sdbsc.sock ./sdbsc -a 4 jill doe 350
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student 4 added to database." ]
+
+    kill $stalled
+    run env SDB_SERVER=.test_sdbsc.sock ./sdbsc --stop
+    [ "$status" -eq 0 ]
+    ./sdbsc -z
+}
+
+@test "Server keeps serving while a client reads its response slowly" {
+    ./sdbsc -z
+    seq 1 10000 | awk '{ print $1, "first" $1, "last" $1, $1 % 401 }' | ./sdbsc -b - > /dev/null
+    ./sdbsc --serve .test_sdbsc.sock > /dev/null 2>&1 &
+    for i in $(seq 1 50); do
+        [ -S .test_sdbsc.sock ] && break
+        sleep 0.1
+    done
+
+    # asks for the whole database (more than the socket holds), then
+    # takes one byte of it every second
+    perl -MIO::Socket::UNIX -e '
+        my $s = IO::Socket::UNIX->new(Peer => ".test_sdbsc.sock") or exit 1;
+        print $s pack("SCCL", 0x5344, 1, 0, 3) . "-p\0"; $s->flush;
+        for (1 .. 30) { sleep 1; sysread($s, my $b, 1) }' > /dev/null 2>&1 &
+    stalled=$!
+    sleep 0.5
+
+    run timeout 3 env SDB_SERVER=.test_sdbsc.sock ./sdbsc -a 10001 jill doe 350
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student 10001 added to database." ]
+
+    kill $stalled
+    run env SDB_SERVER=.test_sdbsc.sock ./sdbsc --stop
+    [ "$status" -eq 0 ]
+    ./sdbsc -z
+}